@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,6 +18,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/syscall.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -53,6 +55,12 @@
     } \
   } while(0)
 
+/* The stream is carried over up to MAX_PATHS connections at once, one per
+ * usable interface. */
+#define MAX_PATHS 4
+
+static int max_paths = MAX_PATHS;
+
 static int muxloop(int sserv, int demux, struct addrinfo* caddrinfo,
                    int sctl, int keepalive);
 
@@ -121,6 +129,10 @@ int main(int argc, char** argv) {
     } else if(!strcmp("--keepalive", *argv) && argc > 1) {
       keepalive = atoi(*++argv);
       argc--;
+    } else if(!strcmp("--paths", *argv) && argc > 1) {
+      max_paths = atoi(*++argv);
+      max_paths = max_paths < 1 ? 1 : max_paths;
+      argc--;
     }
   }
 
@@ -147,6 +159,8 @@ int main(int argc, char** argv) {
     printf("  --demux     : Demultiplex mode (rather than multiplex)\n");
     printf("  --keepalive milliseconds : Send control messages to keep "
                   "connection alive and estimate RTT\n");
+    printf("  --paths count : Most interfaces to carry the connection over "
+                  "at once (default %d)\n", MAX_PATHS);
     // TODO: Add max client switch
     // TODO: Need to provide keys?
     return 0;
@@ -324,6 +338,26 @@ int main(int argc, char** argv) {
 #define MAX_CLIENTS (1 << 16)
 #define ACK_THRESHOLD (1 << 8)
 
+/* Paths carry the stream in segments of at most SEGSIZE bytes. */
+#define SEGSIZE (16 << 10)
+
+/* Estimates used for a path before TCP has measured it. */
+#define PATH_DEFAULT_RTT 100*1000 // In us
+#define PATH_DEFAULT_RATE (1 << 20) // In bytes per second
+
+/* Unacknowledged data is resent over the other paths when no ack has come
+ * back for PATH_STALL plus a few round trips. */
+#define PATH_STALL 200 // In ms
+#define PATH_TICK 100 // In ms
+
+/* How long unacknowledged data may sit on a path before the kernel gives up
+ * on the connection. */
+#define PATH_USER_TIMEOUT 5000 // In ms
+
+#ifndef TCP_USER_TIMEOUT
+#define TCP_USER_TIMEOUT 18
+#endif
+
 struct mux_context;
 
 typedef struct client_data {
@@ -354,19 +388,65 @@ typedef struct message {
   char buf[VPACKETSIZE];
 } message;
 
-typedef struct mux_context {
+/* Sent when a path connects.  The mux side sends all of it, the demux side
+ * answers with just pos. */
+typedef struct path_hello {
+  char key[KEYSZ];
+  int id; /* Path slot, so a reconnect replaces the old connection. */
+  int pos; /* Stream position received so far. */
+} path_hello;
+
+/* Each segment on a path carries the stream bytes starting at off. */
+typedef struct segment {
+  unsigned int off;
+  int sz;
+} segment;
+
+typedef struct mux_path {
   int is_client; /* Must be at the beginning of the struct.  Must be 0. */
   int is_connecting;
   int is_burned;
   int handshake_st;
+  struct mux_context* context;
+
+  int id;
+  int fd;
+  int timerfd;
+  char ifname[IFNAMSIZ]; /* Interface bound to, empty if unbound. */
+  struct in_addr local;
+
+  /* Scheduling estimates, see update_path(). */
+  int rtt; /* In us. */
+  int rate; /* In bytes per second. */
+
+  /* Write state information. */
+  int wblocked;
+  int wflush; /* Wrote since the last forced flush. */
+  unsigned int woff;
+  int wpos;
+  int wsz;
+  segment wseg;
+  unsigned int sent_end; /* Position after the last byte sent on this path. */
+
+  /* Read state information. */
+  path_hello hello;
+  int rpos;
+  segment rseg;
+  char rbuf[SEGSIZE];
+
+  struct mux_path* next_path;
+} mux_path;
+
+typedef struct mux_context {
+  int is_burned;
+  int is_keyed; /* Demux side: the key of this context is known. */
   int last_activity;
 
   int demux;
   int epollfd;
-  int timerfd;
   struct addrinfo* caddrinfo;
 
-  int mainfd;
+  mux_path* paths;
   client_data* write_head;
   client_data* write_tail;
   client_data* karma_head;
@@ -382,23 +462,28 @@ typedef struct mux_context {
   int client_write_bytes;
   int client_read_bytes;
 
-  /* Stream information. */
+  /* Stream information.  Positions count bytes since the stream started and
+   * wrap at 2^32; the circular buffer holds the last GLOBAL_KARMA of them. */
   int stream_karma; /* Amount of un-ack'ed bytes left to send. */
-  int stream_pos; /* Position in circular buffer of last written byte. */
-  int stream_debt; /* Amount of stream that needs to be resent. */
+  unsigned int stream_pos; /* Position after the last byte queued. */
+  unsigned int stream_sent; /* Position after the last byte sent on a path. */
+  unsigned int rtx_pos; /* Range of the stream to send again. */
+  unsigned int rtx_end;
+  int ack_time; /* When the stream was last acked or idle. */
   char stream[GLOBAL_KARMA];
 
-  /* Reverse stream information. */
-  int rstream_pos; /* Position in logical circular buffer of last read byte. */
+  /* Reverse stream information.  Segments may arrive out of order over
+   * different paths; rmap marks the bytes of rstream that have arrived ahead
+   * of rstream_pos. */
+  unsigned int rstream_pos; /* Position after the last in-order byte. */
   int rstream_karma; /* Amount of bytes to ack. */
+  char rstream[GLOBAL_KARMA];
+  unsigned char rmap[GLOBAL_KARMA / 8];
 
   /* Write state information. */
-  int wpos;
-  int wsz;
   message wout;
 
   /* Read state information. */
-  int read_bytes;
   int rpos;
   message rin;
 
@@ -414,10 +499,23 @@ typedef struct mux_context {
 static mux_context* context_list;
 
 static int mainw(mux_context* mc);
-static int mainr(mux_context* mc);
 static int clientw(client_data* cd);
 static int clientr(client_data* cd);
 
+static int seq_before(unsigned int a, unsigned int b) {
+  return (int)(a - b) < 0;
+}
+
+/* Position after the last byte the peer has acknowledged. */
+static unsigned int stream_acked(mux_context* mc) {
+  return mc->stream_pos - (GLOBAL_KARMA - 1 - mc->stream_karma);
+}
+
+static int path_ready(mux_path* p) {
+  return !p->is_burned && p->fd != -1 && !p->is_connecting &&
+         p->handshake_st == sizeof(path_hello);
+}
+
 static int initiate_client_connect(client_data* cd) {
   VLOG("Starting client connection");
 
@@ -563,16 +661,43 @@ mux_context* make_context(int demux, int epollfd, struct addrinfo* caddrinfo) {
     mc->next_context->prev_context = mc;
     mc->prev_context->next_context = mc;
   }
-  mc->last_activity = get_time();
+  mc->last_activity = mc->ack_time = get_time();
   mc->demux = demux;
   mc->epollfd = epollfd;
   mc->caddrinfo = caddrinfo;
-  mc->timerfd = mc->mainfd = -1;
   mc->stream_karma = GLOBAL_KARMA - 1;
   allocate_client(mc, 0); /* Create the dummy control client. */
   return mc;
 }
 
+static mux_path* make_path(mux_context* mc, const char* ifname,
+                           struct in_addr local) {
+  mux_path* p = calloc(1, sizeof(mux_path));
+  if(!p) {
+    fprintf(stderr, "Could not allocate path\n");
+    return NULL;
+  }
+
+  /* Take the lowest slot not in use. */
+  mux_path* q;
+  for(p->id = 0; ; p->id++) {
+    for(q = mc->paths; q && (q->is_burned || q->id != p->id);
+        q = q->next_path);
+    if(!q) break;
+  }
+
+  p->context = mc;
+  p->fd = p->timerfd = -1;
+  strncpy(p->ifname, ifname, sizeof(p->ifname) - 1);
+  p->local = local;
+  p->rtt = PATH_DEFAULT_RTT;
+  p->rate = PATH_DEFAULT_RATE;
+  p->sent_end = mc->stream_sent;
+  p->next_path = mc->paths;
+  mc->paths = p;
+  return p;
+}
+
 static void free_client(client_data* cd) {
   if(cd->s != -1) {
     if(epoll_ctl(cd->context->epollfd, EPOLL_CTL_DEL, cd->s, NULL)) {
@@ -584,6 +709,12 @@ static void free_client(client_data* cd) {
   free(cd);
 }
 
+static void free_path(mux_path* p) {
+  if(p->fd != -1) close(p->fd);
+  if(p->timerfd != -1) close(p->timerfd);
+  free(p);
+}
+
 static void free_context(mux_context* mc) {
   int i;
   for(i = 0; i < mc->client_table_size; i++) {
@@ -592,12 +723,10 @@ static void free_context(mux_context* mc) {
       free_client(cd);
     }
   }
-  if(mc->mainfd != -1) {
-    if(epoll_ctl(mc->epollfd, EPOLL_CTL_DEL, mc->mainfd, NULL)) {
-      perror("epoll_ctl 4");
-    }
-    close(mc->mainfd);
-    mc->mainfd = -1;
+  while(mc->paths) {
+    mux_path* p = mc->paths;
+    mc->paths = p->next_path;
+    free_path(p);
   }
   free(mc->client_table);
   free(mc);
@@ -620,7 +749,7 @@ static void write_cbuf(char* cdata, int opos, int* csz, int cmxsz,
     int amt = cmxsz - cpos;
     amt = wsz < amt ? wsz : amt;
     memcpy(cdata + cpos, wdata, amt);
-    
+
     wdata += amt;
     wsz -= amt;
     *csz += amt;
@@ -628,14 +757,23 @@ static void write_cbuf(char* cdata, int opos, int* csz, int cmxsz,
   }
 }
 
-static int write_mux_header(mux_context* mc) {
+static int write_path_hello(mux_path* p) {
   /* Write out the initial connecting header.  Because this operation
    * corresponds to a new connection we expect that we can write it out fully
    * without blocking. */
-  int bpos = htonl(mc->rstream_pos);
-  if((!mc->demux &&
-       write(mc->mainfd, mc->key, sizeof(mc->key)) != sizeof(mc->key)) ||
-      write(mc->mainfd, &bpos, sizeof(int)) != sizeof(int)) {
+  mux_context* mc = p->context;
+  path_hello hello;
+  memcpy(hello.key, mc->key, KEYSZ);
+  hello.id = htonl(p->id);
+  hello.pos = htonl(mc->rstream_pos);
+
+  const char* buf = (const char*)&hello;
+  size_t count = sizeof(hello);
+  if(mc->demux) {
+    buf += offsetof(path_hello, pos);
+    count -= offsetof(path_hello, pos);
+  }
+  if(write(p->fd, buf, count) != (ssize_t)count) {
     fprintf(stderr, "Writting initial header unexpectedly failed\n");
     return 1;
   }
@@ -685,31 +823,54 @@ static int make_timerfd(int seconds, int nseconds,
   return fd;
 }
 
-static int initiate_main_connect(mux_context* mc) {
+static int initiate_path_connect(mux_path* p) {
+  mux_context* mc = p->context;
   int epollfd = mc->epollfd;
 
-  if(mc->mainfd != -1) close(mc->mainfd);
-  mc->mainfd = socket(AF_INET, SOCK_STREAM, 0);
-  SETOPT(mc->mainfd, TCP_CORK, 1);
-  mc->is_connecting = 1;
-  mc->handshake_st = KEYSZ;
-
-  if(setnonblocking(mc->mainfd)) return 1;
+  if(p->fd != -1) close(p->fd);
+  p->fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(p->fd == -1) {
+    perror("socket");
+    return 1;
+  }
+  SETOPT(p->fd, TCP_CORK, 1);
+  SETOPT(p->fd, TCP_USER_TIMEOUT, PATH_USER_TIMEOUT);
+  p->is_connecting = 1;
+  p->handshake_st = offsetof(path_hello, pos);
+  p->rpos = p->wsz = p->wblocked = 0;
+
+  if(setnonblocking(p->fd)) return 1;
+
+  if(*p->ifname) {
+    /* Pin the connection to its interface.  Binding to the device needs
+     * privileges; the source address alone is enough with plain routing. */
+    if(setsockopt(p->fd, SOL_SOCKET, SO_BINDTODEVICE, p->ifname,
+                  strlen(p->ifname) + 1) && errno != EPERM) {
+      perror("setsockopt");
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr = p->local;
+    if(bind(p->fd, (struct sockaddr*)&addr, sizeof(addr))) {
+      perror("bind");
+    }
+  }
 
   struct epoll_event ev;
   memset(&ev, 0, sizeof(ev));
   ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
-  ev.data.ptr = mc;
+  ev.data.ptr = p;
 
   int res;
-  while((res = connect(mc->mainfd, mc->caddrinfo->ai_addr,
+  while((res = connect(p->fd, mc->caddrinfo->ai_addr,
                        mc->caddrinfo->ai_addrlen))) {
     if(errno == EINPROGRESS) {
       break;
-    } else if(errno == ENETUNREACH) {
-      mc->timerfd = make_timerfd(8, 0, 0, 0);
-      if(mc->timerfd == -1) return 1;
-      if(epoll_ctl(epollfd, EPOLL_CTL_ADD, mc->timerfd, &ev)) {
+    } else if(errno == ENETUNREACH || errno == EADDRNOTAVAIL) {
+      p->timerfd = make_timerfd(8, 0, 0, 0);
+      if(p->timerfd == -1) return 1;
+      if(epoll_ctl(epollfd, EPOLL_CTL_ADD, p->timerfd, &ev)) {
         perror("epoll_ctl 5.5");
         return 1;
       }
@@ -722,26 +883,57 @@ static int initiate_main_connect(mux_context* mc) {
   if(res == 0) {
     /* Uncommon case (does it ever happen?).  Connection finished
      * immediately. */
-    mc->is_connecting = 0;
-    write_mux_header(mc);
+    p->is_connecting = 0;
+    write_path_hello(p);
   }
 
-  if(epoll_ctl(epollfd, EPOLL_CTL_ADD, mc->mainfd, &ev)) {
+  if(epoll_ctl(epollfd, EPOLL_CTL_ADD, p->fd, &ev)) {
     perror("epoll_ctl 5");
     return 1;
   }
   return 0;
 }
 
-static ssize_t write_mainfd(mux_context* mc, const void* buf, size_t count) {
-  VVLOG("Writing data to mainfd");
-  ssize_t amt = write(mc->mainfd, buf, count);
-  if(amt < 0) {
-    return amt;
+/* Whatever was in flight when a path went away may never arrive.  Send
+ * everything not yet acknowledged again; the peer drops what it already
+ * has. */
+static void resend_unacked(mux_context* mc) {
+  mc->rtx_pos = stream_acked(mc);
+  mc->rtx_end = mc->stream_sent;
+}
+
+static int close_path(mux_path* p) {
+  VLOG("Disconnecting path");
+  mux_context* mc = p->context;
+  if(path_ready(p)) {
+    resend_unacked(mc);
+  }
+  if(p->fd != -1) {
+    epoll_ctl(mc->epollfd, EPOLL_CTL_DEL, p->fd, NULL);
+    close(p->fd);
+    p->fd = -1;
+  }
+  if(p->timerfd != -1) {
+    close(p->timerfd);
+    p->timerfd = -1;
   }
-  mc->stream_karma -= amt;
-  write_cbuf(mc->stream, 0, &mc->stream_pos, GLOBAL_KARMA, buf, amt, 1);
-  return amt;
+  p->handshake_st = 0;
+  p->rpos = p->wsz = p->wblocked = 0;
+
+  /* The mux side reconnects over the same interface, the demux side waits
+   * for the peer to do so. */
+  if(mc->demux || p->is_burned) {
+    p->is_burned = 1;
+    return 0;
+  }
+  return initiate_path_connect(p);
+}
+
+static void append_stream(mux_context* mc, const void* buf, int count) {
+  int pos = mc->stream_pos & (GLOBAL_KARMA - 1);
+  write_cbuf(mc->stream, 0, &pos, GLOBAL_KARMA, buf, count, 1);
+  mc->stream_pos += count;
+  mc->stream_karma -= count;
 }
 
 static int read_ack(mux_context* mc) {
@@ -749,11 +941,15 @@ static int read_ack(mux_context* mc) {
 
   int* data = (int*)mc->rin.buf;
   int* edata = (int*)(mc->rin.buf + mc->rin.sz);
-  mc->stream_karma += ntohl(*data++);
+  int acked = ntohl(*data++);
+  mc->stream_karma += acked;
   if(mc->stream_karma < 0 || mc->stream_karma > GLOBAL_KARMA) {
     fprintf(stderr, "Bad global karma acknowledgment\n");
     return 1;
   }
+  if(acked > 0) {
+    mc->ack_time = get_time();
+  }
   for(; data + 2 <= edata; ) {
     int id = ntohl(*data++);
     int karma = ntohl(*data++);
@@ -810,7 +1006,7 @@ static void write_ack(mux_context* mc) {
     cd->rkarma = 0;
     mc->karma_head = cd->karma_next;
     cd->karma_next = NULL;
-    
+
     if(cd->is_rdead) {
       /* If the client was marked as disconnected burn the client. */
       mc->client_table[cd->id] = NULL;
@@ -823,106 +1019,35 @@ static void write_ack(mux_context* mc) {
   mc->wout.sz = (char*)data - mc->wout.buf;
 }
 
-static int disconnect_main(mux_context* mc) {
-  VLOG("Disconnecting main");
-  if(mc->mainfd != -1) {
-    if(epoll_ctl(mc->epollfd, EPOLL_CTL_DEL, mc->mainfd, NULL)) {
-      perror("epoll_ctl 6");
-      return 1;
-    }
-    close(mc->mainfd);
-    mc->mainfd = -1;
-  }
-  return mc->demux ? 0 : initiate_main_connect(mc);
-}
-
-static int mainr(mux_context* mc) {
+/* Handles count bytes of the stream that just became contiguous starting at
+ * pos. */
+static int deliver(mux_context* mc, unsigned int pos, int count) {
   int hdr = sizeof(message) - VPACKETSIZE;
-  while(!mc->is_burned && mc->mainfd != -1 && !mc->is_connecting) {
-    void* buf;
-    size_t count;
-    int rsz = -1;
-
-    if(mc->handshake_st < KEYSZ) {
-      buf = mc->key + mc->handshake_st;
-      count = KEYSZ - mc->handshake_st;
-    } else if(mc->handshake_st < KEYSZ + (int)sizeof(int)) {
-      buf = ((char*)&mc->stream_debt) + mc->handshake_st - KEYSZ;
-      count = sizeof(int) + KEYSZ - mc->handshake_st;
-    } else {
-      rsz = hdr;
-      if(rsz <= mc->rpos) {
-        rsz += ntohl(mc->rin.sz);
-        if(ntohl(mc->rin.sz) == 0 || ntohl(mc->rin.sz) > VPACKETSIZE) {
-          fprintf(stderr, "Unexpected virtual packet size %d\n",
-ntohl(mc->rin.sz));
-          return 1;
-        }
-      }
-      buf = ((char*)&mc->rin) + mc->rpos;
-      count = rsz - mc->rpos;
-    }
 
-    ssize_t amt = read(mc->mainfd, buf, count);
-    if(amt == 0 || (amt == -1 && errno != EAGAIN)) {
-      return disconnect_main(mc);
-    } else if(amt == -1) {
-      return 0;
-    }
-
-    if(rsz == -1) {
-      mc->handshake_st += amt;
-      if(mc->handshake_st == KEYSZ) {
-        /* Key transfer has finished.  Switch into existing context if it
-         * exists. */
-        mux_context* ctx = context_list;
-        do {
-          if(ctx->handshake_st == KEYSZ + sizeof(int) &&
-             !memcmp(mc->key, ctx->key, KEYSZ)) {
-            VLOG("Key matchup");
-            if(ctx->mainfd != -1) {
-              int res = disconnect_main(ctx);
-              if(res) return 1;
-            }
+  /* Check if we have new data to acknowledge. */
+  mc->rstream_karma += count;
+  if(mc->rstream_karma >= ACK_THRESHOLD) {
+    push_writer(mc, mc->client_table[0], 0);
+  }
 
-            ctx->handshake_st = mc->handshake_st;
-            ctx->mainfd = mc->mainfd;
-            mc->mainfd = -1;
-            mc->is_burned = 1;
-            mc = ctx;
-
-            struct epoll_event ev;
-            memset(&ev, 0, sizeof(ev));
-            ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
-            ev.data.ptr = mc;
-            if(epoll_ctl(mc->epollfd, EPOLL_CTL_MOD, mc->mainfd, &ev)) {
-              perror("epoll_ctl 7");
-              return 1;
-            }
-            break;
-          }
-          ctx = ctx->next_context;
-        } while(ctx != context_list);
-        write_mux_header(mc);
-      } else if(mc->handshake_st == KEYSZ + sizeof(int)) {
-        mc->stream_debt = mc->stream_pos - ntohl(mc->stream_debt);
-        mc->stream_debt += mc->stream_debt < 0 ? GLOBAL_KARMA : 0;
-        mainw(mc); /* Give us a chance to write our debts now. */
+  while(count > 0) {
+    int rsz = hdr;
+    if(rsz <= mc->rpos) {
+      rsz += ntohl(mc->rin.sz);
+      if(ntohl(mc->rin.sz) == 0 || ntohl(mc->rin.sz) > VPACKETSIZE) {
+        fprintf(stderr, "Unexpected virtual packet size %d\n",
+ntohl(mc->rin.sz));
+        return 1;
       }
-      continue;
     }
 
-    mc->rstream_pos += amt;
-    if(mc->rstream_pos >= GLOBAL_KARMA) {
-      mc->rstream_pos -= GLOBAL_KARMA;
-    }
-
-    /* Check if we have new data to acknowledge. */
-    mc->rstream_karma += amt;
-    mc->rstream_pos -= mc->rstream_pos >= GLOBAL_KARMA ? GLOBAL_KARMA : 0;
-    if(mc->rstream_karma >= ACK_THRESHOLD) {
-      push_writer(mc, mc->client_table[0], 0);
-    }
+    int idx = pos & (GLOBAL_KARMA - 1);
+    int amt = rsz - mc->rpos;
+    amt = count < amt ? count : amt;
+    amt = GLOBAL_KARMA - idx < amt ? GLOBAL_KARMA - idx : amt;
+    memcpy(((char*)&mc->rin) + mc->rpos, mc->rstream + idx, amt);
+    pos += amt;
+    count -= amt;
 
     mc->rpos += amt;
     if(rsz > hdr && mc->rpos == rsz) {
@@ -950,127 +1075,488 @@ ntohl(mc->rin.sz));
         int res = clientw(cd);
         if(res) return res;
       }
+      mc->rin.id = mc->rin.sz = 0;
     }
   }
   return 0;
 }
 
-static int mainw(mux_context* mc) {
-  if(mc->is_burned || mc->mainfd == -1 || mc->is_connecting) return 0;
-
-  /* Make sure we're not still doing a handshake. */
-  if(mc->handshake_st < KEYSZ + (int)sizeof(int)) return 0;
-
-  while(mc->write_head || mc->stream_debt > 0) {
-    while(mc->stream_debt > 0) {
-      VLOG("Absolving stream debt");
-      int pos = mc->stream_pos - mc->stream_debt;
-      int sz = mc->stream_debt;
-      if(pos < 0) {
-        pos += GLOBAL_KARMA;
-        sz -= mc->stream_pos;
+/* Places a segment received on any path into the stream and hands on
+ * whatever became contiguous. */
+static int receive_segment(mux_context* mc, unsigned int off,
+                           const char* data, int sz) {
+  int skip = (int)(mc->rstream_pos - off);
+  if(skip >= sz) {
+    /* Seen all of it already.  The sender resent it because it was missing an
+     * ack so send one now even if below the threshold. */
+    push_writer(mc, mc->client_table[0], 1);
+    return 0;
+  }
+  if(skip > 0) {
+    off += skip;
+    data += skip;
+    sz -= skip;
+  }
+  if(off - mc->rstream_pos + sz > GLOBAL_KARMA) {
+    fprintf(stderr, "Segment outside of the stream window\n");
+    return 1;
+  }
+
+  int i;
+  for(i = 0; i < sz; i++) {
+    int idx = (off + i) & (GLOBAL_KARMA - 1);
+    mc->rstream[idx] = data[i];
+    mc->rmap[idx >> 3] |= 1 << (idx & 7);
+  }
+
+  unsigned int pos = mc->rstream_pos;
+  for(;;) {
+    int idx = mc->rstream_pos & (GLOBAL_KARMA - 1);
+    if(!(mc->rmap[idx >> 3] & 1 << (idx & 7))) break;
+    mc->rmap[idx >> 3] &= ~(1 << (idx & 7));
+    mc->rstream_pos++;
+  }
+  return deliver(mc, pos, mc->rstream_pos - pos);
+}
+
+/* Demux side.  The key of a new path has arrived; join the context it
+ * belongs to. */
+static int match_path(mux_path* p) {
+  mux_context* mc = p->context;
+  mux_context* ctx = context_list;
+  do {
+    if(ctx != mc && ctx->is_keyed && !ctx->is_burned &&
+       !memcmp(p->hello.key, ctx->key, KEYSZ)) {
+      VLOG("Key matchup");
+      mux_path** pp;
+      for(pp = &mc->paths; *pp != p; pp = &(*pp)->next_path);
+      *pp = p->next_path;
+      p->next_path = ctx->paths;
+      ctx->paths = p;
+      p->context = ctx;
+      mc->is_burned = 1;
+      break;
+    }
+    ctx = ctx->next_context;
+  } while(ctx != context_list);
+  if(p->context == mc) {
+    memcpy(mc->key, p->hello.key, KEYSZ);
+    mc->is_keyed = 1;
+  }
+
+  /* A path that reconnects replaces its old connection, which is gone even if
+   * we haven't noticed yet. */
+  p->id = ntohl(p->hello.id);
+  mux_path* q;
+  for(q = p->context->paths; q; q = q->next_path) {
+    if(q != p && q->id == p->id && !q->is_burned) {
+      close_path(q);
+    }
+  }
+  return write_path_hello(p);
+}
+
+static void path_established(mux_path* p) {
+  mux_context* mc = p->context;
+  mux_path* q;
+  for(q = mc->paths; q && (q == p || !path_ready(q)); q = q->next_path);
+  if(q == NULL) {
+    /* Nothing else was carrying the stream.  Pick up from where the peer says
+     * it got to. */
+    unsigned int pos = ntohl(p->hello.pos);
+    if(!seq_before(pos, stream_acked(mc)) &&
+       !seq_before(mc->stream_sent, pos)) {
+      mc->rtx_pos = pos;
+      mc->rtx_end = mc->stream_sent;
+    }
+  }
+}
+
+static int pathr(mux_path* p) {
+  int hdr = sizeof(segment);
+  while(!p->is_burned && p->fd != -1 && !p->is_connecting) {
+    void* buf;
+    size_t count;
+    int handshake = p->handshake_st < (int)sizeof(path_hello);
+
+    if(handshake) {
+      int end = p->handshake_st < (int)offsetof(path_hello, pos) ?
+          (int)offsetof(path_hello, pos) : (int)sizeof(path_hello);
+      buf = ((char*)&p->hello) + p->handshake_st;
+      count = end - p->handshake_st;
+    } else if(p->rpos < hdr) {
+      buf = ((char*)&p->rseg) + p->rpos;
+      count = hdr - p->rpos;
+    } else {
+      buf = p->rbuf + p->rpos - hdr;
+      count = hdr + ntohl(p->rseg.sz) - p->rpos;
+    }
+
+    ssize_t amt = read(p->fd, buf, count);
+    if(amt == 0 || (amt == -1 && errno != EAGAIN)) {
+      return close_path(p);
+    } else if(amt == -1) {
+      return 0;
+    }
+
+    if(handshake) {
+      p->handshake_st += amt;
+      if(p->handshake_st == offsetof(path_hello, pos)) {
+        if(match_path(p)) return 1;
+      } else if(p->handshake_st == sizeof(path_hello)) {
+        path_established(p);
       }
-      ssize_t amt = write(mc->mainfd, mc->stream + pos, sz);
-      if(amt == 0 || (amt == -1 && errno != EAGAIN)) {
-        return disconnect_main(mc);
-      } else if(amt == -1) {
-        return 0;
+      continue;
+    }
+
+    p->rpos += amt;
+    if(p->rpos == hdr) {
+      int sz = ntohl(p->rseg.sz);
+      if(sz <= 0 || sz > SEGSIZE) {
+        fprintf(stderr, "Unexpected segment size %d\n", sz);
+        return 1;
       }
-      mc->stream_debt -= amt;
+    } else if(p->rpos == hdr + (int)ntohl(p->rseg.sz)) {
+      p->rpos = 0;
+      int res = receive_segment(p->context, ntohl(p->rseg.off), p->rbuf,
+                                ntohl(p->rseg.sz));
+      if(res) return res;
     }
+  }
+  return 0;
+}
 
-    while(mc->wout.id == 0) {
-      VLOG("Grabbing data to write");
+/* Refresh the round trip time and send rate of a path from what TCP has
+ * measured.  The rate is a congestion window per round trip. */
+static void update_path(mux_path* p) {
+  struct tcp_info info;
+  socklen_t tcp_info_length = sizeof(info);
+  if(getsockopt(p->fd, SOL_TCP, TCP_INFO, &info, &tcp_info_length) ||
+     info.tcpi_rtt == 0) {
+    return;
+  }
+  p->rtt = info.tcpi_rtt;
+  long long rate = (long long)info.tcpi_snd_cwnd * info.tcpi_snd_mss *
+                   1000000 / info.tcpi_rtt;
+  p->rate = rate > 0 && rate < 0x7FFFFFFF ? (int)rate : PATH_DEFAULT_RATE;
+}
 
-      client_data* cd = mc->write_head;
-      if(cd == NULL) {
-        /* Nobody has anything to write. */
-        return 0;
-      }
-      mc->write_head = mc->write_head->next;
-      cd->next = NULL;
+/* Pick the idle path expected to deliver another segment first: half a
+ * round trip plus the time to drain what is already queued on it. */
+static mux_path* pick_path(mux_context* mc) {
+  mux_path* best = NULL;
+  long long best_cost = 0;
+  mux_path* p;
+  for(p = mc->paths; p; p = p->next_path) {
+    if(!path_ready(p) || p->wblocked || p->wsz) continue;
+    update_path(p);
+
+    int queued = 0;
+    if(ioctl(p->fd, TIOCOUTQ, &queued)) queued = 0;
+    long long cost = p->rtt / 2 +
+                     (long long)(queued + SEGSIZE) * 1000000 / p->rate;
+    if(best == NULL || cost < best_cost) {
+      best = p;
+      best_cost = cost;
+    }
+  }
+  return best;
+}
 
-      int buffer_empty = 0;
-      mc->wout.sz = 0;
+/* Hand the next stretch of the stream to p, resends first.  Returns 0 if
+ * there is nothing to send. */
+static int next_segment(mux_context* mc, mux_path* p) {
+  unsigned int acked = stream_acked(mc);
+  if(seq_before(mc->rtx_pos, acked)) mc->rtx_pos = acked;
 
-      /* Grab as much data as we can up to the capacity of our vpacket. */
-      if(cd->id != 0 && (cd->is_burned || cd->s == -1)) {
-        /* This client is dead... just move past. */
-        buffer_empty = 1;
-      } else if(cd->id == 0) {
-        write_ack(mc);
-      } else {
-        mc->wout.sz = 0;
-        mc->wout.id = cd->id;
-        int mxsz = VPACKETSIZE < cd->wkarma ? VPACKETSIZE : cd->wkarma;
-        while(mc->wout.sz < mxsz) {
-          ssize_t amt = read(cd->s, mc->wout.buf + mc->wout.sz,
-                             mxsz - mc->wout.sz);
-          if(amt <= 0) {
-            buffer_empty = 1;
-            if(mc->wout.sz == 0 &&
-               (amt == 0 || (amt == -1 && errno != EAGAIN))) {
-              int res = disconnect_client(cd, 1);
-              if(res) return res;
-            }
-            break;
+  unsigned int off;
+  int sz;
+  if(seq_before(mc->rtx_pos, mc->rtx_end)) {
+    off = mc->rtx_pos;
+    sz = mc->rtx_end - off;
+    sz = sz < SEGSIZE ? sz : SEGSIZE;
+    mc->rtx_pos += sz;
+  } else if(seq_before(mc->stream_sent, mc->stream_pos)) {
+    if(acked == mc->stream_sent) {
+      /* The stall timer runs from the first unacknowledged byte. */
+      mc->ack_time = get_time();
+    }
+    off = mc->stream_sent;
+    sz = mc->stream_pos - off;
+    sz = sz < SEGSIZE ? sz : SEGSIZE;
+    mc->stream_sent += sz;
+  } else {
+    return 0;
+  }
+
+  if(seq_before(p->sent_end, off + sz)) p->sent_end = off + sz;
+  p->wseg.off = htonl(off);
+  p->wseg.sz = htonl(sz);
+  p->woff = off;
+  p->wpos = 0;
+  p->wsz = sizeof(segment) + sz;
+  return 1;
+}
+
+/* Write out as much of the segment under way on p as it takes. */
+static int pathw(mux_path* p) {
+  mux_context* mc = p->context;
+  int hdr = sizeof(segment);
+  while(p->wpos < p->wsz) {
+    struct iovec iov[3];
+    int n = 0;
+    if(p->wpos < hdr) {
+      iov[n].iov_base = ((char*)&p->wseg) + p->wpos;
+      iov[n++].iov_len = hdr - p->wpos;
+    }
+    int done = p->wpos < hdr ? 0 : p->wpos - hdr;
+    int left = p->wsz - hdr - done;
+    int idx = (p->woff + done) & (GLOBAL_KARMA - 1);
+    int amt = GLOBAL_KARMA - idx < left ? GLOBAL_KARMA - idx : left;
+    iov[n].iov_base = mc->stream + idx;
+    iov[n++].iov_len = amt;
+    if(amt < left) {
+      iov[n].iov_base = mc->stream;
+      iov[n++].iov_len = left - amt;
+    }
+
+    VVLOG("Writing data to path");
+    ssize_t wamt = writev(p->fd, iov, n);
+    if(wamt == 0 || (wamt == -1 && errno != EAGAIN)) {
+      return close_path(p);
+    } else if(wamt == -1) {
+      p->wblocked = 1;
+      return 0;
+    }
+    p->wpos += wamt;
+    p->wflush = 1;
+  }
+  p->wsz = 0;
+  return 0;
+}
+
+/* Move data waiting in the clients into the stream while there is karma for a
+ * full packet. */
+static int fill_stream(mux_context* mc) {
+  int hdr = sizeof(message) - VPACKETSIZE;
+  while(mc->write_head && mc->stream_karma >= (int)sizeof(message)) {
+    VLOG("Grabbing data to write");
+
+    client_data* cd = mc->write_head;
+    mc->write_head = mc->write_head->next;
+    cd->next = NULL;
+
+    int buffer_empty = 0;
+    mc->wout.sz = 0;
+
+    /* Grab as much data as we can up to the capacity of our vpacket. */
+    if(cd->id != 0 && (cd->is_burned || cd->s == -1)) {
+      /* This client is dead... just move past. */
+      buffer_empty = 1;
+    } else if(cd->id == 0) {
+      write_ack(mc);
+    } else {
+      mc->wout.sz = 0;
+      mc->wout.id = cd->id;
+      int mxsz = VPACKETSIZE < cd->wkarma ? VPACKETSIZE : cd->wkarma;
+      while(mc->wout.sz < mxsz) {
+        ssize_t amt = read(cd->s, mc->wout.buf + mc->wout.sz,
+                           mxsz - mc->wout.sz);
+        if(amt <= 0) {
+          buffer_empty = 1;
+          if(mc->wout.sz == 0 &&
+             (amt == 0 || (amt == -1 && errno != EAGAIN))) {
+            int res = disconnect_client(cd, 1);
+            if(res) return res;
           }
-          mc->wout.sz += amt;
+          break;
         }
-        cd->wkarma -= mc->wout.sz;
-        mc->client_write_bytes += mc->wout.sz;
+        mc->wout.sz += amt;
       }
+      cd->wkarma -= mc->wout.sz;
+      mc->client_write_bytes += mc->wout.sz;
+    }
 
-      /* If there is more data to send and we have karma left put back on the
-       * queue.  Never requeue the control 'client'. */
-      if((!buffer_empty && cd->wkarma > 0 && cd->id > 0) ||
-          (cd->id == 0 && mc->karma_head)) {
-        assert(mc->wout.sz != 0);
-        if(mc->write_head) {
-          mc->write_tail->next = cd;
-          mc->write_tail = cd;
-        } else {
-          mc->write_head = mc->write_tail = cd;
-        }
+    /* If there is more data to send and we have karma left put back on the
+     * queue.  Never requeue the control 'client'. */
+    if((!buffer_empty && cd->wkarma > 0 && cd->id > 0) ||
+        (cd->id == 0 && mc->karma_head)) {
+      assert(mc->wout.sz != 0);
+      if(mc->write_head) {
+        mc->write_tail->next = cd;
+        mc->write_tail = cd;
       } else {
-        cd->in_write_queue = 0;
+        mc->write_head = mc->write_tail = cd;
       }
+    } else {
+      cd->in_write_queue = 0;
+    }
 
-      if(mc->wout.sz == 0) {
-        mc->wout.id = 0;
-        continue;
-      }
-      mc->wpos = 0;
-      mc->wsz = sizeof(message) - VPACKETSIZE + mc->wout.sz;
-      mc->wout.id = htonl(mc->wout.id);
-      mc->wout.sz = htonl(mc->wout.sz);
+    if(mc->wout.sz == 0) {
+      continue;
     }
+    int wsz = hdr + mc->wout.sz;
+    mc->wout.id = htonl(mc->wout.id);
+    mc->wout.sz = htonl(mc->wout.sz);
+    append_stream(mc, &mc->wout, wsz);
+  }
+  mc->wout.id = 0;
+  return 0;
+}
 
-    /* Dump out as much data as we can.  If the write buffer fills up just back
-     * out. */
-    while(mc->wpos < mc->wsz) {
-      int numb = mc->stream_karma;
-      if(numb == 0) {
-        /* No global karma left. */
-        return 0;
-      }
-      numb = mc->wsz - mc->wpos < numb ? mc->wsz - mc->wpos : numb;
-      ssize_t amt = write_mainfd(mc, ((char*)&mc->wout) + mc->wpos, numb);
-      if(amt == 0 || (amt == -1 && errno != EAGAIN)) {
-        return disconnect_main(mc);
-      } else if(amt == -1) {
-        return 0;
+static int mainw(mux_context* mc) {
+  if(mc->is_burned) return 0;
+
+  int res = fill_stream(mc);
+  if(res) return res;
+
+  int progress = 1;
+  while(progress) {
+    progress = 0;
+
+    /* A segment has to be finished on the path it was started on. */
+    mux_path* p;
+    for(p = mc->paths; p; p = p->next_path) {
+      if(path_ready(p) && !p->wblocked && p->wsz) {
+        if((res = pathw(p))) return res;
       }
-      mc->wpos += amt;
     }
-    mc->wout.id = 0;
+
+    p = pick_path(mc);
+    if(p && next_segment(mc, p)) {
+      if((res = pathw(p))) return res;
+      progress = 1;
+    }
   }
 
   /* We flushed all the data we had to write.  Force out any partial packets
    * now. */
-  SETOPT(mc->mainfd, TCP_NODELAY, 1);
-  SETOPT(mc->mainfd, TCP_NODELAY, 0);
+  mux_path* p;
+  for(p = mc->paths; p; p = p->next_path) {
+    if(path_ready(p) && p->wflush && !p->wsz) {
+      SETOPT(p->fd, TCP_NODELAY, 1);
+      SETOPT(p->fd, TCP_NODELAY, 0);
+      p->wflush = 0;
+    }
+  }
+  return 0;
+}
+
+/* Resend unacknowledged data over the other paths if acks have stopped
+ * coming back.  A path can die without an error for a long time; this keeps
+ * the stream moving on the ones that still work.  With a single path left
+ * that is only worth it if some of the data went out on a path that is gone.
+ * Returns the ms until the next check is due, or -1 if there is nothing to
+ * watch. */
+static int check_stall(mux_context* mc, int time_now) {
+  unsigned int acked = stream_acked(mc);
+  int ready = 0;
+  int lost = 0;
+  int rtt = RTT_INFINITE;
+  mux_path* p;
+  for(p = mc->paths; p; p = p->next_path) {
+    if(path_ready(p)) {
+      ready++;
+      rtt = p->rtt < rtt ? p->rtt : rtt;
+    } else if(seq_before(acked, p->sent_end)) {
+      lost = 1;
+    }
+  }
+  if(acked == mc->stream_sent) {
+    mc->ack_time = time_now;
+    return -1;
+  }
+  if(ready == 0 || (ready == 1 && !lost)) return -1;
+
+  int stall = PATH_STALL + 4 * rtt / 1000;
+  if(time_now - mc->ack_time < stall) {
+    return stall - (time_now - mc->ack_time);
+  }
+  VLOG("Path stalled, resending");
+  mc->ack_time = time_now;
+  resend_unacked(mc);
+  mainw(mc);
+  return stall;
+}
+
+/* Mux side.  Keep one path per usable interface.  Paths whose interface or
+ * address went away are dropped; the rest are left alone so traffic keeps
+ * flowing over them while the others change. */
+static int scan_paths(mux_context* mc) {
+  struct ifreq reqs[32];
+  struct ifconf ifc;
+  int nreqs = 0;
+
+  /* A loopback peer is only reachable unbound. */
+  struct sockaddr_in* caddr = (struct sockaddr_in*)mc->caddrinfo->ai_addr;
+  int loopback = (ntohl(caddr->sin_addr.s_addr) >> 24) == 127;
+
+  int s = socket(AF_INET, SOCK_DGRAM, 0);
+  if(s == -1) {
+    perror("socket");
+    return 1;
+  }
+  ifc.ifc_len = sizeof(reqs);
+  ifc.ifc_req = reqs;
+  if(!loopback && ioctl(s, SIOCGIFCONF, &ifc) == 0) {
+    int i;
+    for(i = 0; i < (int)(ifc.ifc_len / sizeof(struct ifreq)); i++) {
+      struct ifreq freq = reqs[i];
+      if(ioctl(s, SIOCGIFFLAGS, &freq) || !(freq.ifr_flags & IFF_UP) ||
+         !(freq.ifr_flags & IFF_RUNNING) || (freq.ifr_flags & IFF_LOOPBACK)) {
+        continue;
+      }
+      reqs[nreqs++] = reqs[i];
+    }
+  }
+  close(s);
+
+  int i, live = 0;
+  mux_path* p;
+  for(p = mc->paths; p; p = p->next_path) {
+    if(p->is_burned) continue;
+    for(i = 0; i < nreqs; i++) {
+      struct sockaddr_in* addr = (struct sockaddr_in*)&reqs[i].ifr_addr;
+      if(!strcmp(p->ifname, reqs[i].ifr_name) &&
+         p->local.s_addr == addr->sin_addr.s_addr) {
+        break;
+      }
+    }
+    if(i == nreqs && (*p->ifname || nreqs > 0)) {
+      printf("Dropping path over %s\n", *p->ifname ? p->ifname : "default");
+      /* Burning the path first keeps close_path() from reconnecting it, so
+       * what was in flight on it has to be queued again here. */
+      if(path_ready(p)) resend_unacked(mc);
+      p->is_burned = 1;
+      close_path(p);
+    } else {
+      live++;
+    }
+  }
+
+  for(i = 0; i < nreqs && live < max_paths; i++) {
+    struct sockaddr_in* addr = (struct sockaddr_in*)&reqs[i].ifr_addr;
+    for(p = mc->paths; p; p = p->next_path) {
+      if(!p->is_burned && !strcmp(p->ifname, reqs[i].ifr_name) &&
+         p->local.s_addr == addr->sin_addr.s_addr) {
+        break;
+      }
+    }
+    if(p) continue;
 
+    printf("Adding path over %s\n", reqs[i].ifr_name);
+    p = make_path(mc, reqs[i].ifr_name, addr->sin_addr);
+    if(!p || initiate_path_connect(p)) return 1;
+    live++;
+  }
+
+  if(live == 0) {
+    /* No interface to bind to.  Let the routing table decide. */
+    struct in_addr any;
+    any.s_addr = htonl(INADDR_ANY);
+    p = make_path(mc, "", any);
+    if(!p || initiate_path_connect(p)) return 1;
+  }
   return 0;
 }
 
@@ -1150,7 +1636,7 @@ static int muxloop(int sserv, int demux, struct addrinfo* caddrinfo,
     mux_context* mc = mmc = make_context(demux, epollfd, caddrinfo);
     if(!mc) return 1;
     if(generate_key(mc)) return 1;
-    if(initiate_main_connect(mc)) return 1;
+    if(scan_paths(mc)) return 1;
 
     struct sockaddr_nl addr;
     snl = socket(PF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
@@ -1195,15 +1681,19 @@ static int muxloop(int sserv, int demux, struct addrinfo* caddrinfo,
     }
   }
 
+  int timeout = MUX_TIMEOUT;
   while(1) {
-    int nfds = epoll_wait(epollfd, events, MAX_EVENTS, MUX_TIMEOUT);
+    int nfds = epoll_wait(epollfd, events, MAX_EVENTS, timeout);
     if(nfds == -1) {
       if(errno == EINTR) {
         /* This is for testing purposes only. */
         printf("Dropping main connections\n");
         mux_context* mc = context_list;
         if(mc) do {
-          disconnect_main(mc);
+          mux_path* p;
+          for(p = mc->paths; p; p = p->next_path) {
+            if(!p->is_burned) close_path(p);
+          }
           mc = mc->next_context;
         } while(mc != context_list);
         continue;
@@ -1227,14 +1717,26 @@ static int muxloop(int sserv, int demux, struct addrinfo* caddrinfo,
           return 1;
         }
 
+        /* Report the quickest path. */
+        mux_path* best = NULL;
+        mux_path* p;
+        if(context_list) {
+          for(p = context_list->paths; p; p = p->next_path) {
+            if(path_ready(p) && (best == NULL || p->rtt < best->rtt)) {
+              best = p;
+            }
+          }
+        }
+
         uint32_t rtt = htonl(RTT_INFINITE);
         uint32_t rttvar = htonl(RTT_INFINITE);
-        uint32_t cwb = htonl(context_list->client_write_bytes);
-        uint32_t crb = htonl(context_list->client_read_bytes);
+        uint32_t cwb = htonl(context_list ?
+                             context_list->client_write_bytes : 0);
+        uint32_t crb = htonl(context_list ?
+                             context_list->client_read_bytes : 0);
         struct tcp_info info;
         socklen_t tcp_info_length = sizeof(info);
-        if(!context_list->is_connecting &&
-           0 == getsockopt(context_list->mainfd, SOL_TCP, TCP_INFO,
+        if(best && 0 == getsockopt(best->fd, SOL_TCP, TCP_INFO,
            &info, &tcp_info_length)) {
           rtt = htonl(info.tcpi_rtt);
           rttvar = htonl(info.tcpi_rttvar);
@@ -1243,7 +1745,7 @@ static int muxloop(int sserv, int demux, struct addrinfo* caddrinfo,
         write(cs, &rttvar, sizeof(rttvar));
         write(cs, &cwb, sizeof(cwb));
         write(cs, &crb, sizeof(crb));
-        
+
         char buf[128];
         write(cs, buf, sprintf(buf, "\n%u\n%u\n%u\n%u\n", ntohl(rtt), ntohl(rttvar),
                                ntohl(cwb), ntohl(crb)));
@@ -1266,14 +1768,11 @@ static int muxloop(int sserv, int demux, struct addrinfo* caddrinfo,
           }
         }
         if(new_addr) {
-          /* Network interfaces have changed.  Let's try connecting again
-           * to make sure we have the best interface. */
+          /* Network interfaces have changed.  Bring the paths in line with
+           * the interfaces we have now. */
           printf("Detected interface change\n");
-          mux_context* mc = context_list;
-          if(mc) do {
-            disconnect_main(mc);
-            mc = mc->next_context;
-          } while(mc != context_list);
+          if(scan_paths(mmc)) return 1;
+          mainw(mmc);
         }
       } else if(ei->data.ptr == &kafd) {
         uint64_t exprtimes;
@@ -1305,9 +1804,17 @@ static int muxloop(int sserv, int demux, struct addrinfo* caddrinfo,
           if(!mc) {
             goto bail_accept;
           }
-          mc->mainfd = cs;
+          struct in_addr any;
+          any.s_addr = htonl(INADDR_ANY);
+          mux_path* p = make_path(mc, "", any);
+          if(!p) {
+            mc->is_burned = 1;
+            goto bail_accept;
+          }
+          p->fd = cs;
           SETOPT(cs, TCP_CORK, 1);
-          ev.data.ptr = mc;
+          SETOPT(cs, TCP_USER_TIMEOUT, PATH_USER_TIMEOUT);
+          ev.data.ptr = p;
         } else {
           VLOG("Got new connection.  Creating client...");
           mmc->last_activity = time_now;
@@ -1319,7 +1826,7 @@ static int muxloop(int sserv, int demux, struct addrinfo* caddrinfo,
           ev.data.ptr = cd;
           set_rkarma(cd, CLIENT_KARMA, 0);
         }
-          
+
         ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
         if(epoll_ctl(epollfd, EPOLL_CTL_ADD, cs, &ev)) {
           perror("epoll_ctl 11");
@@ -1359,30 +1866,37 @@ bail_accept:
           cd->context->is_burned = 1;
         }
       } else {
-        /* It's the main file descriptor. */
-        mux_context* mc = (mux_context*)ei->data.ptr;
-        if(mc->is_connecting) {
-          if(mc->timerfd == -1 && socket_connected(mc->mainfd)) {
-            mc->is_connecting = 0;
-            write_mux_header(mc);
+        /* It's a path. */
+        mux_path* p = (mux_path*)ei->data.ptr;
+        if(p->is_burned) continue;
+        if(p->is_connecting) {
+          if(p->timerfd == -1 && socket_connected(p->fd)) {
+            p->is_connecting = 0;
+            write_path_hello(p);
           } else {
-            if(mc->timerfd != -1) close(mc->timerfd);
-            mc->timerfd = -1;
+            if(p->timerfd != -1) close(p->timerfd);
+            p->timerfd = -1;
 
-            int res = initiate_main_connect(mc);
+            int res = initiate_path_connect(p);
             if(res) return 1;
             continue;
           }
         }
-        mc->last_activity = time_now;
+        p->context->last_activity = time_now;
+        if(ei->events & EPOLLOUT) {
+          p->wblocked = 0;
+        }
 
         int res = 0;
         if(ei->events & EPOLLIN) {
-          VLOG("Main ready to read");
-          res = mainr(mc);
+          VLOG("Path ready to read");
+          res = pathr(p);
         }
-        if(!res) if(ei->events & EPOLLOUT) {
-          VLOG("Main ready to write");
+
+        /* Reading may have moved the path into another context. */
+        mux_context* mc = p->context;
+        if(!res) {
+          VLOG("Path ready to write");
           res = mainw(mc);
         }
         if(res) {
@@ -1392,7 +1906,8 @@ bail_accept:
       }
     }
 
-    /* Free any clients or contexts on the burn list. */
+    /* Free any clients, paths or contexts on the burn list. */
+    timeout = MUX_TIMEOUT;
     mux_context* mc = context_list;
     if(mc) do {
       client_data* cd = mc->burn_list;
@@ -1404,6 +1919,17 @@ bail_accept:
       }
       mc->burn_list = NULL;
 
+      mux_path** pp = &mc->paths;
+      while(*pp) {
+        mux_path* p = *pp;
+        if(p->is_burned) {
+          *pp = p->next_path;
+          free_path(p);
+        } else {
+          pp = &p->next_path;
+        }
+      }
+
       mux_context* nmc = mc->next_context;
       if((mc->is_burned || time_now - mc->last_activity > MUX_TIMEOUT) &&
           mc != mmc) {
@@ -1412,6 +1938,11 @@ bail_accept:
         mc->next_context->prev_context = mc->prev_context;
         mc->prev_context->next_context = mc->next_context;
         free_context(mc);
+      } else {
+        int wait = check_stall(mc, time_now);
+        if(wait >= 0 && wait < timeout) {
+          timeout = wait < PATH_TICK ? PATH_TICK : wait;
+        }
       }
       mc = nmc;
     } while(context_list && mc != context_list);
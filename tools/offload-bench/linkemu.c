@@ -0,0 +1,397 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <time.h>
+#include <unistd.h>
+
+/* linkemu forwards tcp connections while imposing the delay, bandwidth and
+ * loss of an emulated link, so two processes on one host can talk as if they
+ * were on separate devices.  Every chunk read from one side is held until the
+ * link would have delivered it: it waits for the link to be free, takes
+ * len / bandwidth to serialize and then half the RTT to propagate.  A lost
+ * chunk is held for an extra retransmission timeout, and so is everything
+ * behind it, as tcp would. */
+
+#define CHUNK_SIZE 16384
+#define MAX_PAIRS 64
+
+/* Stop reading from a side while this much of its data is in flight. */
+#define MAX_QUEUED (1 << 20)
+
+typedef long long usec_t;
+
+typedef struct chunk {
+  struct chunk* next;
+  usec_t release;
+  int len;
+  int off;
+  char data[CHUNK_SIZE];
+} chunk;
+
+typedef struct direction {
+  int src;
+  int dst;
+  chunk* head;
+  chunk* tail;
+  int queued;
+  int eof;
+  int shut;
+
+  /* When the emulated link finishes serializing what was queued so far and
+   * when the last chunk is delivered. */
+  usec_t link_free;
+  usec_t last_release;
+} direction;
+
+typedef struct pair {
+  int used;
+  direction dir[2];
+} pair;
+
+static usec_t rtt_us = 0;
+static long long bandwidth = 0; /* bits per second, 0 for unlimited */
+static double loss = 0.0;
+static usec_t rto_us = 200000;
+
+static pair pairs[MAX_PAIRS];
+
+static usec_t now_us() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (usec_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int setnonblocking(int s) {
+  int flags = fcntl(s, F_GETFL, 0);
+  if(flags == -1 || fcntl(s, F_SETFL, flags | O_NONBLOCK) == -1) {
+    perror("fcntl");
+    return 1;
+  }
+  return 0;
+}
+
+static void enqueue(direction* d, chunk* c) {
+  usec_t now = now_us();
+  usec_t start = d->link_free > now ? d->link_free : now;
+  usec_t ser = bandwidth ? (usec_t)c->len * 8 * 1000000 / bandwidth : 0;
+  d->link_free = start + ser;
+  c->release = d->link_free + rtt_us / 2;
+  if(loss > 0 && rand() < loss * RAND_MAX) {
+    c->release += rto_us;
+  }
+  /* Nothing overtakes a chunk that is still held. */
+  if(c->release < d->last_release) {
+    c->release = d->last_release;
+  }
+  d->last_release = c->release;
+
+  c->next = NULL;
+  c->off = 0;
+  if(d->tail) {
+    d->tail->next = c;
+  } else {
+    d->head = c;
+  }
+  d->tail = c;
+  d->queued += c->len;
+}
+
+static void close_pair(pair* p) {
+  int i;
+  for(i = 0; i < 2; i++) {
+    chunk* c = p->dir[i].head;
+    while(c) {
+      chunk* n = c->next;
+      free(c);
+      c = n;
+    }
+  }
+  close(p->dir[0].src);
+  close(p->dir[0].dst);
+  p->used = 0;
+}
+
+/* Read what is available on d's source.  Returns -1 if the pair broke. */
+static int pump_in(direction* d) {
+  chunk* c = (chunk*)malloc(sizeof(chunk));
+  int res = read(d->src, c->data, CHUNK_SIZE);
+  if(res > 0) {
+    c->len = res;
+    enqueue(d, c);
+    return 0;
+  }
+  free(c);
+  if(res == 0) {
+    d->eof = 1;
+    return 0;
+  }
+  return errno == EAGAIN || errno == EINTR ? 0 : -1;
+}
+
+/* Deliver the chunks that are due.  Returns -1 if the pair broke. */
+static int pump_out(direction* d, usec_t now) {
+  while(d->head && d->head->release <= now) {
+    chunk* c = d->head;
+    int res = write(d->dst, c->data + c->off, c->len - c->off);
+    if(res < 0) {
+      return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    }
+    c->off += res;
+    d->queued -= res;
+    if(c->off < c->len) {
+      return 0;
+    }
+    d->head = c->next;
+    if(!d->head) d->tail = NULL;
+    free(c);
+  }
+  if(d->eof && !d->head && !d->shut) {
+    shutdown(d->dst, SHUT_WR);
+    d->shut = 1;
+  }
+  return 0;
+}
+
+static int connect_to(struct addrinfo* caddr) {
+  struct addrinfo* rp;
+  for(rp = caddr; rp; rp = rp->ai_next) {
+    int s = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+    if(s == -1) continue;
+    if(!connect(s, rp->ai_addr, rp->ai_addrlen)) {
+      return s;
+    }
+    close(s);
+  }
+  return -1;
+}
+
+static void add_pair(int a, int b) {
+  int i;
+  for(i = 0; i < MAX_PAIRS; i++) {
+    if(!pairs[i].used) break;
+  }
+  if(i == MAX_PAIRS) {
+    fprintf(stderr, "linkemu: too many connections\n");
+    close(a);
+    close(b);
+    return;
+  }
+  int one = 1;
+  setsockopt(a, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  setsockopt(b, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  setnonblocking(a);
+  setnonblocking(b);
+
+  pair* p = &pairs[i];
+  memset(p, 0, sizeof(*p));
+  p->used = 1;
+  p->dir[0].src = p->dir[1].dst = a;
+  p->dir[0].dst = p->dir[1].src = b;
+}
+
+static void usage() {
+  printf(
+"linkemu forwards tcp connections through an emulated network link.\n\n");
+  printf("linkemu [options] [bind_addr:]bind_port connect_addr:connect_port\n\n");
+  printf("  [options]\n");
+  printf("  --rtt milliseconds   : Round trip time added to the link\n");
+  printf("  --bw kbit/s          : Bandwidth in each direction\n");
+  printf("  --loss percent       : Chance a chunk is lost and retransmitted\n");
+  printf("  --rto milliseconds   : Retransmission delay of a lost chunk "
+         "(default 200 or twice the RTT)\n");
+  printf("  --seed n             : Seed for the loss generator\n");
+}
+
+int main(int argc, char** argv) {
+  signal(SIGPIPE, SIG_IGN);
+  int seed = time(NULL);
+  int rto_set = 0;
+
+  for(++argv, --argc; argc > 0 && (*argv)[0] == '-'; ++argv, --argc) {
+    if(argc < 2) {
+      usage();
+      return 1;
+    }
+    if(!strcmp("--rtt", *argv)) {
+      rtt_us = (usec_t)(atof(argv[1]) * 1000);
+    } else if(!strcmp("--bw", *argv)) {
+      bandwidth = (long long)(atof(argv[1]) * 1000);
+    } else if(!strcmp("--loss", *argv)) {
+      loss = atof(argv[1]) / 100;
+    } else if(!strcmp("--rto", *argv)) {
+      rto_us = (usec_t)(atof(argv[1]) * 1000);
+      rto_set = 1;
+    } else if(!strcmp("--seed", *argv)) {
+      seed = atoi(argv[1]);
+    } else {
+      usage();
+      return 1;
+    }
+    ++argv, --argc;
+  }
+  if(argc != 2) {
+    usage();
+    return argc == 0 ? 0 : 1;
+  }
+  if(!rto_set && 2 * rtt_us > rto_us) {
+    rto_us = 2 * rtt_us;
+  }
+  srand(seed);
+
+  char* str;
+  char* baddr = NULL;
+  char* bport = argv[0];
+  char* caddr = NULL;
+  char* cport = argv[1];
+  for(str = argv[0]; *str; ++str) {
+    if(*str == ':') {
+      *str = 0;
+      baddr = argv[0];
+      bport = str + 1;
+    }
+  }
+  for(str = argv[1]; *str; ++str) {
+    if(*str == ':') {
+      *str = 0;
+      caddr = argv[1];
+      cport = str + 1;
+    }
+  }
+
+  struct addrinfo hints;
+  struct addrinfo* baddrinfo;
+  struct addrinfo* caddrinfo;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  if(getaddrinfo(baddr ? baddr : "127.0.0.1", bport, &hints, &baddrinfo)) {
+    fprintf(stderr, "linkemu: cannot resolve bind address\n");
+    return 1;
+  }
+  hints.ai_flags = 0;
+  if(getaddrinfo(caddr ? caddr : "127.0.0.1", cport, &hints, &caddrinfo)) {
+    fprintf(stderr, "linkemu: cannot resolve connect address\n");
+    return 1;
+  }
+
+  int sserv = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  if(sserv == -1 ||
+     setsockopt(sserv, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+     bind(sserv, baddrinfo->ai_addr, baddrinfo->ai_addrlen) ||
+     listen(sserv, 5)) {
+    perror("linkemu");
+    return 1;
+  }
+  freeaddrinfo(baddrinfo);
+  printf("linkemu: rtt %lld us, bandwidth %lld bit/s, loss %.2f%%\n",
+         rtt_us, bandwidth, loss * 100);
+  fflush(stdout);
+
+  struct pollfd fds[1 + MAX_PAIRS * 2];
+  direction* fdir[1 + MAX_PAIRS * 2];
+  for(;;) {
+    usec_t now = now_us();
+    usec_t next = -1;
+    int n = 0;
+    int i, j;
+
+    fds[n].fd = sserv;
+    fds[n].events = POLLIN;
+    fdir[n++] = NULL;
+    for(i = 0; i < MAX_PAIRS; i++) {
+      if(!pairs[i].used) continue;
+      for(j = 0; j < 2; j++) {
+        direction* d = &pairs[i].dir[j];
+        short events = 0;
+        if(!d->eof && d->queued < MAX_QUEUED) {
+          events |= POLLIN;
+        }
+        if(d->head) {
+          if(d->head->release <= now) {
+            events |= POLLOUT;
+          } else if(next == -1 || d->head->release < next) {
+            next = d->head->release;
+          }
+        }
+        /* Watch the source for input and the destination for room. */
+        if(events & POLLIN) {
+          fds[n].fd = d->src;
+          fds[n].events = POLLIN;
+          fdir[n++] = d;
+        }
+        if(events & POLLOUT) {
+          fds[n].fd = d->dst;
+          fds[n].events = POLLOUT;
+          fdir[n++] = d;
+        }
+      }
+    }
+
+    int timeout = next == -1 ? -1 : (int)((next - now + 999) / 1000);
+    if(poll(fds, n, timeout) < 0 && errno != EINTR) {
+      perror("poll");
+      return 1;
+    }
+
+    if(fds[0].revents & POLLIN) {
+      int s = accept(sserv, NULL, NULL);
+      if(s != -1) {
+        int c = connect_to(caddrinfo);
+        if(c == -1) {
+          perror("linkemu: connect");
+          close(s);
+        } else {
+          add_pair(s, c);
+        }
+      }
+    }
+
+    for(i = 1; i < n; i++) {
+      direction* d = fdir[i];
+      if((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) &&
+         fds[i].fd == d->src && !d->eof) {
+        if(pump_in(d)) d->eof = 1;
+      }
+    }
+
+    now = now_us();
+    for(i = 0; i < MAX_PAIRS; i++) {
+      pair* p = &pairs[i];
+      if(!p->used) continue;
+      if(pump_out(&p->dir[0], now) || pump_out(&p->dir[1], now) ||
+         (p->dir[0].shut && p->dir[1].shut)) {
+        close_pair(p);
+      }
+    }
+  }
+  return 0;
+}
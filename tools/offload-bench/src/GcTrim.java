@@ -0,0 +1,50 @@
+// Copyright 2014 The Android Open Source Project
+
+/**
+ * Stresses the distributed track trim: offloaded code builds lists of objects
+ * that become tracked, most of which are dropped again, and the collector is
+ * run between rounds.  size is the objects built per round.
+ */
+public class GcTrim extends Workload {
+    public int defaultSize() { return 20000; }
+    public int defaultRounds() { return 10; }
+
+    static class Node {
+        Node next;
+        long value;
+    }
+
+    static Node keep;
+
+    public long run(int size, int rounds) {
+        long check = 0;
+        for (int r = 0; r < rounds; r++) {
+            Node list = build(r, size);
+            /* Keep one in sixteen nodes alive. */
+            for (Node n = list; n != null; n = n.next) {
+                if ((n.value & 15) == 0) {
+                    Node k = new Node();
+                    k.value = n.value;
+                    k.next = keep;
+                    keep = k;
+                }
+                check += n.value;
+            }
+            list = null;
+            System.gc();
+        }
+        return check;
+    }
+
+    static Node build(long seed, int size) {
+        long x = spin(seed, 1000000);
+        Node head = null;
+        for (int i = 0; i < size; i++) {
+            Node n = new Node();
+            n.value = x + i;
+            n.next = head;
+            head = n;
+        }
+        return head;
+    }
+}
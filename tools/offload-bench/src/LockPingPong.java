@@ -0,0 +1,43 @@
+// Copyright 2014 The Android Open Source Project
+
+/**
+ * Stresses lock ownership transfers: a worker that migrates and the main
+ * thread, which stays local, take turns holding a shared lock.  size is the
+ * work done while holding it.
+ */
+public class LockPingPong extends Workload {
+    public int defaultSize() { return 1000; }
+    public int defaultRounds() { return 2000; }
+
+    static final Object lock = new Object();
+    static long shared;
+
+    public long run(final int size, final int rounds) {
+        Thread worker = new Thread() {
+            public void run() {
+                work(size, rounds);
+            }
+        };
+        worker.start();
+        for (int r = 0; r < rounds; r++) {
+            synchronized (lock) {
+                shared += spin(r, size);
+            }
+        }
+        try {
+            worker.join();
+        } catch (InterruptedException ie) {
+            ie.printStackTrace();
+        }
+        return shared;
+    }
+
+    static void work(int size, int rounds) {
+        long x = spin(1, 2000000);
+        for (int r = 0; r < rounds; r++) {
+            synchronized (lock) {
+                shared ^= spin(x + r, size);
+            }
+        }
+    }
+}
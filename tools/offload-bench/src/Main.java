@@ -0,0 +1,43 @@
+// Copyright 2014 The Android Open Source Project
+
+/**
+ * Offload benchmark workloads.  Each workload is a small program that leans
+ * on one part of the offload engine; run-bench runs them between a client and
+ * a server VM and collects the engine's own timings.
+ *
+ * Usage: Main workload [size] [rounds]
+ */
+public class Main {
+    public static void main(String[] args) {
+        if (args.length < 1) {
+            System.out.println("usage: Main sync|locks|volatile|migrate|gc"
+                    + " [size] [rounds]");
+            return;
+        }
+        int size = args.length > 1 ? Integer.parseInt(args[1]) : 0;
+        int rounds = args.length > 2 ? Integer.parseInt(args[2]) : 0;
+
+        Workload w;
+        if (args[0].equals("sync")) {
+            w = new SyncSize();
+        } else if (args[0].equals("locks")) {
+            w = new LockPingPong();
+        } else if (args[0].equals("volatile")) {
+            w = new VolatileTraffic();
+        } else if (args[0].equals("migrate")) {
+            w = new MigrationRate();
+        } else if (args[0].equals("gc")) {
+            w = new GcTrim();
+        } else {
+            System.out.println("unknown workload " + args[0]);
+            return;
+        }
+
+        long start = System.nanoTime();
+        long check = w.run(size > 0 ? size : w.defaultSize(),
+                rounds > 0 ? rounds : w.defaultRounds());
+        long elapsed = (System.nanoTime() - start) / 1000;
+        System.out.println("bench " + args[0] + " " + elapsed + " us"
+                + " (check " + check + ")");
+    }
+}
@@ -0,0 +1,24 @@
+// Copyright 2014 The Android Open Source Project
+
+/**
+ * Stresses migration frequency: many calls of a method that is just heavy
+ * enough to be worth offloading, with a little local work between them.
+ * size is the work per call in thousands of steps.
+ */
+public class MigrationRate extends Workload {
+    public int defaultSize() { return 500; }
+    public int defaultRounds() { return 200; }
+
+    public long run(int size, int rounds) {
+        long check = 0;
+        for (int r = 0; r < rounds; r++) {
+            check += heavy(r, size * 1000);
+            check ^= spin(check, 1000);
+        }
+        return check;
+    }
+
+    static long heavy(long seed, int iters) {
+        return spin(seed, iters);
+    }
+}
@@ -0,0 +1,35 @@
+// Copyright 2014 The Android Open Source Project
+
+/**
+ * Stresses the size of syncs: every round a heavy method rewrites a slice of
+ * a large heap so the migration there and back has to carry it.  size is the
+ * heap in KiB.
+ */
+public class SyncSize extends Workload {
+    public int defaultSize() { return 1024; }
+    public int defaultRounds() { return 20; }
+
+    static int[][] heap;
+
+    public long run(int size, int rounds) {
+        heap = new int[size][256];
+        long check = 0;
+        for (int r = 0; r < rounds; r++) {
+            check += compute(r, size);
+        }
+        return check;
+    }
+
+    static long compute(int round, int size) {
+        long x = spin(round, 2000000);
+        /* Touch a quarter of the heap, a different quarter each round. */
+        int from = (round % 4) * size / 4;
+        for (int i = from; i < from + size / 4; i++) {
+            int[] row = heap[i];
+            for (int j = 0; j < row.length; j++) {
+                row[j] += (int) x + j;
+            }
+        }
+        return x + heap[from][0];
+    }
+}
@@ -0,0 +1,51 @@
+// Copyright 2014 The Android Open Source Project
+
+/**
+ * Stresses volatile ownership: a migrated worker and the local main thread
+ * hand a token back and forth through a volatile field, and each also bumps
+ * a counter in another field group.  size is the work done per turn.
+ */
+public class VolatileTraffic extends Workload {
+    public int defaultSize() { return 100; }
+    public int defaultRounds() { return 1000; }
+
+    static volatile int turn;
+    static volatile long counter;
+
+    public long run(final int size, final int rounds) {
+        turn = 0;
+        Thread worker = new Thread() {
+            public void run() {
+                work(size, rounds);
+            }
+        };
+        worker.start();
+        long check = 0;
+        for (int r = 0; r < rounds; r++) {
+            while (turn != 0) {
+                /* spin on the flag */
+            }
+            check += spin(r, size);
+            counter++;
+            turn = 1;
+        }
+        try {
+            worker.join();
+        } catch (InterruptedException ie) {
+            ie.printStackTrace();
+        }
+        return check + counter;
+    }
+
+    static void work(int size, int rounds) {
+        long x = spin(2, 2000000);
+        for (int r = 0; r < rounds; r++) {
+            while (turn != 1) {
+                /* spin on the flag */
+            }
+            x += spin(x, size);
+            turn = 0;
+        }
+        counter += x & 0xFF;
+    }
+}
@@ -0,0 +1,22 @@
+// Copyright 2014 The Android Open Source Project
+
+/**
+ * A benchmark workload.  run returns a value derived from the work done so
+ * that it can't be optimized away and so that runs can be checked against
+ * each other.
+ */
+public abstract class Workload {
+    public abstract int defaultSize();
+    public abstract int defaultRounds();
+    public abstract long run(int size, int rounds);
+
+    /** CPU bound work for roughly iters steps, worth migrating. */
+    static long spin(long seed, int iters) {
+        long x = seed;
+        for (int i = 0; i < iters; i++) {
+            x = x * 6364136223846793005L + 1442695040888963407L;
+            x ^= x >>> 29;
+        }
+        return x;
+    }
+}
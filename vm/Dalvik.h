@@ -104,6 +104,11 @@
 #include "offload/MethodParser.h"
 #include "offload/UnoptDexLoader.h"
 #include "offload/GlobalAnalysis.h"
+#include "offload/AnalysisImage.h"
+#include "offload/AnalysisCache.h"
+#include "offload/Scheduler.h"
+#include "offload/MethodSlot.h"
+#include "offload/Telemetry.h"
 #endif
 #include "Globals.h"
 #include "reflect/Reflect.h"
@@ -115,6 +120,7 @@
 #ifdef WITH_OFFLOAD
 #include "offload/CommInlines.h"
 #include "offload/SchedulerInlines.h"
+#include "offload/TelemetryInlines.h"
 #endif
 #if defined(WITH_TRACER)
 #include "tracer/DexLoader.h"
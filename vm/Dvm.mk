@@ -183,7 +183,9 @@ LOCAL_SRC_FILES := \
 	reflect/Reflect.cpp \
 	test/AtomicTest.cpp.arm \
 	test/TestHash.cpp \
-	test/TestIndirectRefTable.cpp
+	test/TestIndirectRefTable.cpp \
+	test/TestArrayTrack.cpp \
+	test/TestCodec.cpp
 
 # TODO: this is the wrong test, but what's the right one?
 ifeq ($(dvm_arch),arm)
@@ -342,7 +344,13 @@ ifeq ($(dvm_offload),true)
       offload/CustomizedClass.cpp \
       offload/MethodParser.cpp \
       offload/UnoptDexLoader.cpp \
-      offload/GlobalAnalysis.cpp
+      offload/GlobalAnalysis.cpp \
+      offload/AnalysisImage.cpp \
+      offload/AnalysisCache.cpp \
+      offload/MethodSlot.cpp \
+      offload/Codec.cpp \
+      offload/Scheduler.cpp \
+      offload/Telemetry.cpp
 endif
 
 ifeq ($(dvm_tracer),true)
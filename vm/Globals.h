@@ -752,6 +752,9 @@ struct DvmGlobals {
     u4 offNetRTT;
     u4 offNetRTTVar;
 
+    /* Measured link bandwidth in bytes per second, 0 if not known yet. */
+    u4 offNetBandwidth;
+
     int offNetPipe[2];
     
     // Modified by Yong map which stores the method access information
@@ -760,12 +763,15 @@ struct DvmGlobals {
     std::map<char*, u4, charscomp>* methodClzOffsetMap;
     // Add method execution time cache
     std::map<const Method*, u4>* methodExePointMap;
-    // Add method execution times count
-    std::map<char*, u4, charscomp>* methodExeCountMap;
 
     // offload/Comm.h
     u4 nextId;
     u4 idMask;
+    /* Free local slots found by the last track trim, handed out in blocks
+     * starting at offFreeIdPos.  offIdEpoch changes at every trim. */
+    Vector offFreeIds;
+    u4 offFreeIdPos;
+    u4 offIdEpoch;
     UnlockedInfoTable objTables[2];
     pthread_mutex_t offCommLock;
     pthread_cond_t offPullCond;
@@ -778,6 +784,30 @@ struct DvmGlobals {
     FifoBuffer      offProxyFifoAll;
 
     Vector offStatusUpdate;
+
+    /* Copy dirty state in the pause and serialize it after the resume. */
+    bool offSyncSnapshot;
+    struct SyncSnapshot* offActiveSnapshot;
+    u4 offSyncPauseTime;
+
+    /* log2 of the bytes covered by one dirty bit of a primitive array, or 0
+     * to track primitive arrays per element. */
+    u4 offArrayChunkShift;
+
+    /* Send field values relative to the last value sent, see Comm.cpp. */
+    bool offSyncDelta;
+
+    /* Interpreted frames sent when a thread migrates without a stop frame,
+     * or 0 for the whole stack.  See offload/Stack.cpp. */
+    u4 offMigrateFrames;
+
+    /* Most bytes of arrays and strings a migration sends before they are
+     * used, on top of what the access analysis selects. */
+    u4 offPrefetchMax;
+
+    /* Tenant the client's sessions are accounted to on the server, from
+     * OFF_TENANT.  0 leaves it to the client's address. */
+    u4 offTenant;
     
     /* flag to indicate that if concurrent gc should be disabled */
     bool            conGcDisabled;
@@ -797,6 +827,8 @@ struct DvmGlobals {
     Vector          dexList;
     Vector          dexPushList;
     bool            dexPushing;
+    Vector          dexCacheIndex;
+    bool            dexCacheScanned;
 
     // offload/Sync.h
     pthread_mutex_t offVolatileLock;
@@ -818,6 +850,19 @@ struct DvmGlobals {
     // offload/SchedulerInlines.h
     u4              offSyncTime;
     u4              offSyncTimeSamples;
+
+    // offload/Scheduler.h
+    float           offSchedSpeedup;
+    bool            offSchedVerbose;
+    pthread_mutex_t offSchedLock;
+    std::vector<const Method*>* offSchedMethods;
+    u4              offSchedOutcomes;
+    s8              offSchedErrorSum;
+    u8              offSchedAbsErrorSum;
+
+    // offload/Telemetry.h
+    pthread_mutex_t offTelemetryLock;
+    OffTelemetry*   offTelemetryList;
 #endif
 
 #ifdef WITH_TRACER
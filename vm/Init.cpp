@@ -1417,6 +1417,10 @@ std::string dvmStartup(int argc, const char* const argv[],
         ALOGE("dvmTestHash FAILED");
     if (false /*noisy!*/ && !dvmTestIndirectRefTable())
         ALOGE("dvmTestIndirectRefTable FAILED");
+    if (false /*noisy!*/ && !dvmTestArrayTrackSpeed())
+        ALOGE("dvmTestArrayTrackSpeed FAILED");
+    if (!dvmTestCodec())
+        ALOGE("dvmTestCodec FAILED");
 #endif
 
     if (dvmCheckException(dvmThreadSelf())) {
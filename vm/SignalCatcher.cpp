@@ -169,6 +169,11 @@ static void handleSigQuit()
     dvmCompilerDumpStats();
 #endif
 
+#if defined(WITH_OFFLOAD)
+    offSchedulerDumpStats();
+    offTelemetryDump();
+#endif
+
     if (false) dvmDumpTrackedAllocations(true);
 
     dvmResumeAllThreads(SUSPEND_FOR_STACK_DUMP);
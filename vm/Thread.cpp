@@ -906,11 +906,22 @@ static Thread* allocThread(int interpStackSize)
     pthread_mutex_init(&thread->offBufferLock, NULL);
     pthread_cond_init(&thread->offBufferCond, NULL);
     thread->offCorkLevel = 0;
+    thread->offSendDeficit = 0;
+    thread->offSendPending = 0;
+    thread->offSendQueued = false;
+    thread->offSchedMethod = NULL;
     thread->offProtection = 0;
+    thread->offIdEpoch = 0;
+    thread->offIdNext = thread->offIdEnd = 0;
+    thread->offFreeIds = NULL;
+    thread->offFreeIdCount = 0;
+    thread->offTelemetry = NULL;
 
 //    offSchedulerUnsafePoint(thread);
 
     memset(thread->offLockList, 0, sizeof(thread->offLockList));
+    memset(thread->offLockWanted, 0, sizeof(thread->offLockWanted));
+    thread->offLockWantedPos = 0;
 #endif
 
     return thread;
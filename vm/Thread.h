@@ -338,6 +338,9 @@ struct Thread {
 //    u8               offUnsafeTime;  //todel  /* Indicates last time execution had to be local.  Only used for client. */
 
     Object*          offLockList[16];  /* Recently locked object ids. */
+    Object*          offLockWanted[8]; /* Objects the remote side of this
+                                        * thread recently asked to lock. */
+    u4               offLockWantedPos;
 
     /* Used for communication between parallel threads. */
     FifoBuffer       offWriteBuffer;
@@ -346,7 +349,29 @@ struct Thread {
     pthread_cond_t   offBufferCond;
     u4               offCorkLevel;
 
+    /* Send scheduling state owned by the control thread, see buildBatch. */
+    s4               offSendDeficit;
+    u4               offSendPending;
+    bool             offSendQueued;
+
+    /* Migration last requested by the scheduler, see offSchedulerDecide. */
+    const Method*    offSchedMethod;
+    u4               offSchedDepth;
+    u4               offSchedCounter;
+    u8               offSchedStart;
+    u8               offSchedPredicted;
+
     u4               offProtection;
+
+    /* Block of object ids reserved by this thread, see nextObjectIndex. */
+    u4               offIdEpoch;
+    u4               offIdNext;
+    u4               offIdEnd;
+    AuxValue*        offFreeIds;
+    u4               offFreeIdCount;
+
+    /* Counters and histograms, see offload/Telemetry.h. */
+    struct OffTelemetry* offTelemetry;
 #endif
 
 #ifdef OFFLOAD_DEBUG
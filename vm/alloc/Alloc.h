@@ -159,6 +159,12 @@ size_t dvmCountAssignableInstancesOfClass(const ClassObject *clazz);
  */
 void dvmClearGrowthLimit(void);
 
+/*
+ * Limits the heap to headroom bytes more than it takes from the system
+ * now.
+ */
+void dvmSetGrowthLimit(size_t headroom);
+
 /*
  * Returns true if the address is aligned appropriately for a heap object.
  * Does not require the caller to hold the heap lock, and does not take the
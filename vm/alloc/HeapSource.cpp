@@ -1105,6 +1105,29 @@ void dvmClearGrowthLimit()
     dvmUnlockHeap();
 }
 
+/*
+ * Sets the growth limit to headroom bytes over the current footprint,
+ * which is read under the heap lock, keeping it within the maximum heap
+ * size.
+ */
+void dvmSetGrowthLimit(size_t headroom)
+{
+    HS_BOILERPLATE();
+    dvmLockHeap();
+    dvmWaitForConcurrentGcToComplete();
+    size_t footprint = oldHeapOverhead(gHs, true);
+    size_t limit = footprint + headroom;
+    if (limit < footprint || limit > gHs->maximumSize) {
+        limit = gHs->maximumSize;
+    }
+    gHs->growthLimit = limit;
+    size_t overhead = oldHeapOverhead(gHs, false);
+    gHs->heaps[0].maximumSize = limit - overhead;
+    gHs->heaps[0].limit = gHs->heaps[0].base + gHs->heaps[0].maximumSize;
+    setIdealFootprint(gHs->idealSize);
+    dvmUnlockHeap();
+}
+
 /*
  * Return the real bytes used by old heaps plus the soft usage of the
  * current heap.  When a soft limit is in effect, this is effectively
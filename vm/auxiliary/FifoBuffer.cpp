@@ -2,48 +2,117 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 
-#define BUFFERSIZE (1 << 14) // 16Kb
+/* Most chunks a thread keeps for reuse, 64Kb.  A buffer reuses its own
+ * drained chunks through fb->spare, and syncs stream out a frame at a time,
+ * so a thread rarely needs more than a couple of chunks at once; the pool only
+ * has to carry them from one short lived buffer to the next.  Chunks go to the
+ * pool of the thread that destroys the buffer, so a thread that only consumes
+ * also holds no more than this. */
+#define FIFO_POOL_CHUNKS 4
 
-FifoBuffer auxFifoCreate() {
-  FifoBuffer fb;
-  fb.pos_head = fb.pos_tail = 0;
-  fb.buffers = auxQueueCreate();
-  fb.freeBufs = auxVectorCreate(0);
-  return fb;
+typedef struct ChunkPool {
+  FifoChunk* free;
+  u4 count;
+} ChunkPool;
+
+static pthread_key_t chunkPoolKey;
+static pthread_once_t chunkPoolOnce = PTHREAD_ONCE_INIT;
+
+static void freeChunkPool(void* arg) {
+  ChunkPool* pool = (ChunkPool*)arg;
+  while(pool->free != NULL) {
+    FifoChunk* chunk = pool->free;
+    pool->free = chunk->next;
+    free(chunk);
+  }
+  free(pool);
 }
 
-void auxFifoDestroy(FifoBuffer* fb) {
-  while(!auxQueueEmpty(&fb->buffers)) {
-    free(auxQueuePop(&fb->buffers).v);
+static void initChunkPool() {
+  pthread_key_create(&chunkPoolKey, freeChunkPool);
+}
+
+static ChunkPool* currentChunkPool() {
+  pthread_once(&chunkPoolOnce, initChunkPool);
+  ChunkPool* pool = (ChunkPool*)pthread_getspecific(chunkPoolKey);
+  if(pool == NULL) {
+    pool = (ChunkPool*)calloc(1, sizeof(ChunkPool));
+    assert(pool && "chunk pool malloc failed");
+    pthread_setspecific(chunkPoolKey, pool);
   }
-  u4 i;
-  for(i = 0; i < auxVectorSize(&fb->freeBufs); i++) {
-    free(auxVectorGet(&fb->freeBufs, i).v);
+  return pool;
+}
+
+static FifoChunk* allocChunk(FifoBuffer* fb) {
+  FifoChunk* chunk = fb->spare;
+  if(chunk != NULL) {
+    fb->spare = chunk->next;
+  } else {
+    ChunkPool* pool = currentChunkPool();
+    chunk = pool->free;
+    if(chunk != NULL) {
+      pool->free = chunk->next;
+      pool->count--;
+    } else {
+      chunk = (FifoChunk*)malloc(sizeof(FifoChunk));
+      assert(chunk && "fifo chunk malloc failed");
+    }
   }
-  auxQueueDestroy(&fb->buffers);
-  auxVectorDestroy(&fb->freeBufs);
+  chunk->next = NULL;
+  chunk->end = 0;
+  return chunk;
 }
 
-bool auxFifoEmpty(FifoBuffer* fb) {
-  return auxQueueEmpty(&fb->buffers);
+/* Hand a list of chunks back to the calling thread's pool. */
+static void releaseChunks(FifoChunk* chunk) {
+  if(chunk == NULL) return;
+  ChunkPool* pool = currentChunkPool();
+  while(chunk != NULL) {
+    FifoChunk* next = chunk->next;
+    if(pool->count < FIFO_POOL_CHUNKS) {
+      chunk->next = pool->free;
+      pool->free = chunk;
+      pool->count++;
+    } else {
+      free(chunk);
+    }
+    chunk = next;
+  }
 }
 
-u4 auxFifoSize(FifoBuffer* fb) {
-  if(auxQueueEmpty(&fb->buffers)) return 0;
-  return BUFFERSIZE * (auxQueueSize(&fb->buffers) - 1) +
-         (fb->pos_tail ? fb->pos_tail : BUFFERSIZE) - fb->pos_head;
+static FifoChunk* appendChunk(FifoBuffer* fb) {
+  FifoChunk* chunk = allocChunk(fb);
+  if(fb->tail != NULL) {
+    fb->tail->next = chunk;
+  } else {
+    fb->head = chunk;
+    fb->pos_head = 0;
+  }
+  fb->tail = chunk;
+  return chunk;
+}
+
+FifoBuffer auxFifoCreate() {
+  FifoBuffer fb;
+  memset(&fb, 0, sizeof(fb));
+  return fb;
+}
+
+void auxFifoDestroy(FifoBuffer* fb) {
+  releaseChunks(fb->head);
+  releaseChunks(fb->spare);
+  memset(fb, 0, sizeof(*fb));
 }
 
 u4 auxFifoGetBufferSize(FifoBuffer* fb) {
-  u4 bsz = auxQueueSize(&fb->buffers);
-  if(bsz == 0) return 0;
-  if(bsz == 1 && fb->pos_tail != 0) return fb->pos_tail - fb->pos_head;
-  return BUFFERSIZE - fb->pos_head;
+  if(fb->head == NULL) return 0;
+  return fb->head->end - fb->pos_head;
 }
 
 char* auxFifoGetBuffer(FifoBuffer* fb) {
-  return ((char*)auxQueuePeek(&fb->buffers).v) + fb->pos_head;
+  return fb->head->data + fb->pos_head;
 }
 
 void auxFifoReadBuffer(FifoBuffer* fb, char* buf, u4 bytes) {
@@ -59,33 +128,72 @@ void auxFifoReadBuffer(FifoBuffer* fb, char* buf, u4 bytes) {
 }
 
 void auxFifoPopBytes(FifoBuffer* fb, u4 bytes) {
-  if(fb->pos_head + bytes == BUFFERSIZE) {
-    auxVectorPush(&fb->freeBufs, auxQueuePop(&fb->buffers));
+  FifoChunk* head = fb->head;
+  fb->pos_head += bytes;
+  fb->size -= bytes;
+  if(fb->pos_head == head->end) {
+    fb->head = head->next;
+    if(fb->head == NULL) {
+      fb->tail = NULL;
+    }
     fb->pos_head = 0;
-  } else {
-    fb->pos_head += bytes;
-    if(fb->pos_head == fb->pos_tail && auxQueueSize(&fb->buffers) == 1) {
-      auxVectorPush(&fb->freeBufs, auxQueuePop(&fb->buffers));
-      fb->pos_head = fb->pos_tail = 0;
+    head->next = fb->spare;
+    fb->spare = head;
+  }
+}
+
+void auxFifoDiscard(FifoBuffer* fb, u4 bytes) {
+  while(bytes > 0) {
+    u4 rbytes = auxFifoGetBufferSize(fb);
+    assert(rbytes != 0 && "tried to discard too much from buffer");
+    if(rbytes > bytes) rbytes = bytes;
+    auxFifoPopBytes(fb, rbytes);
+    bytes -= rbytes;
+  }
+}
+
+u4 auxFifoGather(FifoBuffer* fb, u4 skip, u4 bytes, struct iovec* iov,
+                 u4* iovcnt) {
+  u4 used = 0;
+  u4 total = 0;
+  FifoChunk* chunk;
+  for(chunk = fb->head; chunk && used < *iovcnt && total < bytes;
+      chunk = chunk->next) {
+    u4 start = chunk == fb->head ? fb->pos_head : 0;
+    u4 end = chunk->end;
+    if(skip >= end - start) {
+      skip -= end - start;
+      continue;
     }
+    start += skip;
+    skip = 0;
+    u4 amt = end - start < bytes - total ? end - start : bytes - total;
+    iov[used].iov_base = chunk->data + start;
+    iov[used].iov_len = amt;
+    used++;
+    total += amt;
   }
+  *iovcnt = used;
+  return total;
+}
+
+char* auxFifoReserveSlow(FifoBuffer* fb, u4 bytes) {
+  assert(bytes <= FIFO_CHUNK_SIZE && "reservation larger than a chunk");
+  /* Whatever is left of the tail stays unused. */
+  return appendChunk(fb)->data;
 }
 
-void auxFifoPushData(FifoBuffer* fb, char* buf, u4 bytes) {
+void auxFifoPushDataSlow(FifoBuffer* fb, const char* buf, u4 bytes) {
   while(bytes > 0) {
-    u4 amt = fb->pos_tail + bytes < BUFFERSIZE ? bytes :
-                                                 BUFFERSIZE - fb->pos_tail;
-    if(fb->pos_tail == 0) {
-      /* Need to push on a new buffer. */
-      if(!auxVectorEmpty(&fb->freeBufs)) {
-        auxQueuePush(&fb->buffers, auxVectorPop(&fb->freeBufs));
-      } else {
-        auxQueuePushV(&fb->buffers, malloc(BUFFERSIZE));
-      }
+    FifoChunk* tail = fb->tail;
+    if(tail == NULL || tail->end == FIFO_CHUNK_SIZE) {
+      tail = appendChunk(fb);
     }
-    memcpy(((char*)auxQueuePeekBack(&fb->buffers).v) + fb->pos_tail,
-           buf, amt);
-    fb->pos_tail = (fb->pos_tail + amt) & (BUFFERSIZE - 1);
+    u4 amt = FIFO_CHUNK_SIZE - tail->end;
+    if(amt > bytes) amt = bytes;
+    memcpy(tail->data + tail->end, buf, amt);
+    tail->end += amt;
+    fb->size += amt;
     bytes -= amt;
     buf += amt;
   }
@@ -2,23 +2,44 @@
 #define AUXILIARY_FIFOBUFFER_H
 
 #include "Common.h"
-#include "auxiliary/Queue.h"
-#include "auxiliary/Vector.h"
+#include "Inlines.h"
+
+#include <string.h>
+#include <sys/uio.h>
+
+#define FIFO_CHUNK_SIZE (1 << 14) // 16Kb
+
+/* Data lives in a list of fixed size chunks.  Chunks come from a per thread
+ * pool and go back to it when the buffer is destroyed, so buffers that are
+ * created and destroyed around every message cost no malloc once the pool is
+ * warm.  A chunk may end short of FIFO_CHUNK_SIZE when a reservation did not
+ * fit in what was left of it. */
+typedef struct FifoChunk {
+  struct FifoChunk* next;
+  u4 end;
+  char data[FIFO_CHUNK_SIZE];
+} FifoChunk;
 
 typedef struct FifoBuffer {
+  u4 size;
   u4 pos_head;
-  u4 pos_tail;
-  Queue buffers;
-  Vector freeBufs;
+  FifoChunk* head;
+  FifoChunk* tail;
+  /* Chunks emptied by reads, reused before going to the pool. */
+  FifoChunk* spare;
 } FifoBuffer;
 
 FifoBuffer auxFifoCreate();
 
 void auxFifoDestroy(FifoBuffer* fb);
 
-bool auxFifoEmpty(FifoBuffer* fb);
+INLINE bool auxFifoEmpty(FifoBuffer* fb) {
+  return fb->size == 0;
+}
 
-u4 auxFifoSize(FifoBuffer* fb);
+INLINE u4 auxFifoSize(FifoBuffer* fb) {
+  return fb->size;
+}
 
 u4 auxFifoGetBufferSize(FifoBuffer* fb);
 
@@ -28,6 +49,45 @@ void auxFifoReadBuffer(FifoBuffer* fb, char* buf, u4 bytes);
 
 void auxFifoPopBytes(FifoBuffer* fb, u4 bytes);
 
-void auxFifoPushData(FifoBuffer* fb, char* buf, u4 bytes);
+/* Pop bytes that may span several buffers. */
+void auxFifoDiscard(FifoBuffer* fb, u4 bytes);
+
+/* Describe up to bytes of the data following the first skip bytes with at
+ * most *iovcnt iovecs, without copying.  *iovcnt is set to the number used and
+ * the number of bytes described is returned.  The iovecs stay valid until the
+ * data is popped. */
+u4 auxFifoGather(FifoBuffer* fb, u4 skip, u4 bytes, struct iovec* iov,
+                 u4* iovcnt);
+
+char* auxFifoReserveSlow(FifoBuffer* fb, u4 bytes);
+
+void auxFifoPushDataSlow(FifoBuffer* fb, const char* buf, u4 bytes);
+
+/* Get room for bytes (at most FIFO_CHUNK_SIZE) contiguous bytes at the end of
+ * the buffer to serialize into.  Nothing is added until auxFifoCommit, which
+ * may add less than was reserved. */
+INLINE char* auxFifoReserve(FifoBuffer* fb, u4 bytes) {
+  FifoChunk* tail = fb->tail;
+  if(tail != NULL && FIFO_CHUNK_SIZE - tail->end >= bytes) {
+    return tail->data + tail->end;
+  }
+  return auxFifoReserveSlow(fb, bytes);
+}
+
+INLINE void auxFifoCommit(FifoBuffer* fb, u4 bytes) {
+  fb->tail->end += bytes;
+  fb->size += bytes;
+}
+
+INLINE void auxFifoPushData(FifoBuffer* fb, const char* buf, u4 bytes) {
+  FifoChunk* tail = fb->tail;
+  if(tail != NULL && FIFO_CHUNK_SIZE - tail->end >= bytes) {
+    memcpy(tail->data + tail->end, buf, bytes);
+    tail->end += bytes;
+    fb->size += bytes;
+  } else {
+    auxFifoPushDataSlow(fb, buf, bytes);
+  }
+}
 
 #endif // AUXILIARY_FIFOBUFFER_H
@@ -161,119 +161,6 @@ static inline s8 getLongFromArray(const u4* ptr, int idx)
 #endif
 }
 
-u8 acctime = -1U;
-u8 acttime = -1U;
-u8 pcaltime = -1U;
-u8 timetime = -1U;
-u8 dijtime = -1U;
-u8 transtime = -1U;
-u8 chesstime = -1U;
-u8 truntime = -1U;
-u8 mruntime = -1U;
-u8 psoltime = -1U;
-u8 pinittime = -1U;
-void offSchedulerSafePoint(Thread* self, const Method* method) {
-    // sudoku
-     if(!strcmp(method->clazz->descriptor, "Lcom/genina/ads/AdView$MyLocalThread;") && !strcmp(method->name, "run") && method->idx == 1289) {
-        truntime = dvmGetRelativeTimeUsec();
-     } else if(!strcmp(method->clazz->descriptor, "Lcom/icenta/sudoku/ui/MobileSudoku$42;") && !strcmp(method->name, "run") && method->idx == 2996) {
-        mruntime = dvmGetRelativeTimeUsec();
-     } else if(!strcmp(method->clazz->descriptor, "Lcom/icenta/sudoku/Puzzle;") && !strcmp(method->name, "solve") && method->idx == 2811) {
-        psoltime = dvmGetRelativeTimeUsec();
-     } else if(!strcmp(method->clazz->descriptor, "Lcom/icenta/sudoku/Puzzle;") && !strcmp(method->name, "<init>") && method->idx == 2784) {
-        pinittime = dvmGetRelativeTimeUsec();
-     }
-     
-     // chess
-     else if (!strcmp(method->clazz->descriptor, "Lcom/google/android/chess/b;") && !strcmp(method->name, "h") && method->idx == 286) {
-        chesstime = dvmGetRelativeTimeUsec();
-     }
-     
-     // poker odds
-     else if(!strcmp(method->clazz->descriptor, "Lcom/leslie/cjpokeroddscalculator/CJPokerOddsCalculator$3;") && !strcmp(method->name, "access$0") && method->idx == 61) {
-        acctime = dvmGetRelativeTimeUsec();
-     } else if(!strcmp(method->clazz->descriptor, "Lcom/leslie/cjpokeroddscalculator/CJPokerOddsCalculator$3;") && !strcmp(method->name, "poker_calculation") && method->idx == 73) {
-        pcaltime = dvmGetRelativeTimeUsec();
-     }
-     
-     // ru metro
-     else if(!strcmp(method->clazz->descriptor, "Lcom/mechsoft/ru/metro/MainActivity$20;") && !strcmp(method->name, "run") && method->idx == 440) {
-        acttime = dvmGetRelativeTimeUsec();
-     } else if(!strcmp(method->clazz->descriptor, "Lcom/mechsoft/ru/graph/Graph;") && !strcmp(method->name, "TheShortestPathByTime") && method->idx == 313) {
-        timetime = dvmGetRelativeTimeUsec();
-     } else if(!strcmp(method->clazz->descriptor, "Lcom/mechsoft/ru/graph/Graph;") && !strcmp(method->name, "Dijkstra") && method->idx == 312) {
-        dijtime = dvmGetRelativeTimeUsec();
-     } else if(!strcmp(method->clazz->descriptor, "Lcom/mechsoft/ru/graph/Graph;") && !strcmp(method->name, "TheShortestPathByTransfer") && method->idx == 314) {
-        transtime = dvmGetRelativeTimeUsec();
-     }
-  if(gDvm.offDisabled) return;
-  //if(++self->offTimeCounter & 0x3FF) return;
-  if(!method->clazz->pDvmDex->classLoader) return;
-  if(!gDvm.isServer && self->offProtection == 0 && !self->offFlagMigration &&
-     offWellConnected()) {
-     // offload test
-      if(!strcmp(method->clazz->descriptor, "Ledu/utk/offloadtest/MainActivity;") && !strcmp(method->name, "matrixTest")) {
-         self->offFlagMigration = true;
-      }
-
-     // space bubble
-     if(!strcmp(method->clazz->descriptor, "Lcom/google/ads/util/AdUtil;") && !strcmp(method->name, "a") && method->idx == 1156) {
-        self->offFlagMigration = true;
-     }
-     
-     // sudoku
-     if(!strcmp(method->clazz->descriptor, "Lcom/genina/ads/AdView$MyLocalThread;") && !strcmp(method->name, "run") && method->idx == 1289) {
-        self->offFlagMigration = true;
-        truntime = dvmGetRelativeTimeUsec();
-     } else if(!strcmp(method->clazz->descriptor, "Lcom/icenta/sudoku/ui/MobileSudoku$42;") && !strcmp(method->name, "run") && method->idx == 2996) {
-        self->offFlagMigration = true;
-        mruntime = dvmGetRelativeTimeUsec();
-     } else if(!strcmp(method->clazz->descriptor, "Lcom/icenta/sudoku/Puzzle;") && !strcmp(method->name, "solve") && method->idx == 2811) {
-        self->offFlagMigration = true;
-        psoltime = dvmGetRelativeTimeUsec();
-     } else if(!strcmp(method->clazz->descriptor, "Lcom/icenta/sudoku/Puzzle;") && !strcmp(method->name, "<init>") && method->idx == 2784) {
-        self->offFlagMigration = true;
-        pinittime = dvmGetRelativeTimeUsec();
-     }
-     
-     // chess
-     if(!strcmp(method->clazz->descriptor, "Lcom/google/android/chess/b;") && !strcmp(method->name, "h") && method->idx == 286) {
-        self->offFlagMigration = true;
-        chesstime = dvmGetRelativeTimeUsec();
-     }/* else if(!strcmp(method->clazz->descriptor, "Lcom/leagem/chesslive/gamelogic/c;") && !strcmp(method->name, "run") && method->idx == 7213) {
-        self->offFlagMigration = true;
-     }*/
-     
-     // mobialia chess
-     if(!strcmp(method->clazz->descriptor, "Lcom/alonsoruibal/chess/search/SearchEngine;") && !strcmp(method->name, "run") && method->idx == 918) {
-        self->offFlagMigration = true;
-        chesstime = dvmGetRelativeTimeUsec();
-     }
-     
-     // poker odds
-     if(!strcmp(method->clazz->descriptor, "Lcom/leslie/cjpokeroddscalculator/CJPokerOddsCalculator$3;") && !strcmp(method->name, "access$0") && method->idx == 61) {
-        self->offFlagMigration = true;
-        acctime = dvmGetRelativeTimeUsec();
-     } else if(!strcmp(method->clazz->descriptor, "Lcom/leslie/cjpokeroddscalculator/CJPokerOddsCalculator$3;") && !strcmp(method->name, "poker_calculation") && method->idx == 73) {
-        self->offFlagMigration = true;
-        pcaltime = dvmGetRelativeTimeUsec();
-     }
-     
-     // ru metro
-     if(!strcmp(method->clazz->descriptor, "Lcom/mechsoft/ru/graph/Graph;") && !strcmp(method->name, "TheShortestPathByTime") && method->idx == 313) {
-        self->offFlagMigration = true;
-        timetime = dvmGetRelativeTimeUsec();
-     } else if(!strcmp(method->clazz->descriptor, "Lcom/mechsoft/ru/graph/Graph;") && !strcmp(method->name, "Dijkstra") && method->idx == 312) {
-        self->offFlagMigration = true;
-        dijtime = dvmGetRelativeTimeUsec();
-     } else if(!strcmp(method->clazz->descriptor, "Lcom/mechsoft/ru/graph/Graph;") && !strcmp(method->name, "TheShortestPathByTransfer") && method->idx == 314) {
-        self->offFlagMigration = true;
-        transtime = dvmGetRelativeTimeUsec();
-     }
-  }
-}
-
-
 /* store a long into an array of u4 */
 static inline void putLongToArray(u4* ptr, int idx, s8 val)
 {
@@ -3782,87 +3669,26 @@ GOTO_TARGET(returnFromMethod)
         
 #if defined(WITH_OFFLOAD)
         u8 end = dvmGetRelativeTimeUsec();
-        /*if(!gDvm.offDisabled && curMethod->clazz->pDvmDex->classLoader) {
-            // cjpoker
-            if(!strcmp(curMethod->clazz->descriptor, "Lcom/leslie/cjpokeroddscalculator/CJPokerOddsCalculator$3;") && !strcmp(curMethod->name, "access$0") && curMethod->idx == 61) {
-                if(acctime != -1U) {
-                    ALOGE("Lcom/leslie/cjpokeroddscalculator/CJPokerOddsCalculator$3; access$0 exetime: %llu", end - acctime);
-                }
-             } else if(!strcmp(curMethod->clazz->descriptor, "Lcom/leslie/cjpokeroddscalculator/CJPokerOddsCalculator$3;") && !strcmp(curMethod->name, "poker_calculation") && curMethod->idx == 73) {
-                if(pcaltime != -1U) {
-                    ALOGE("Lcom/leslie/cjpokeroddscalculator/CJPokerOddsCalculator$3; poker_calculation exetime: %llu", end - pcaltime);
-                }
-             }
-             
-             // metro
-             else if(!strcmp(curMethod->clazz->descriptor, "Lcom/mechsoft/ru/metro/MainActivity$20;") && !strcmp(curMethod->name, "run") && curMethod->idx == 440) {
-                if(acttime != -1U) {
-                    ALOGE("Lcom/mechsoft/ru/metro/MainActivity$20; run exetime: %llu", end - acttime);
-                }
-             } else if(!strcmp(curMethod->clazz->descriptor, "Lcom/mechsoft/ru/graph/Graph;") && !strcmp(curMethod->name, "TheShortestPathByTime") && curMethod->idx == 313) {
-                if(timetime != -1U) {
-                    ALOGE("Lcom/mechsoft/ru/graph/Graph; TheShortestPathByTime exetime: %llu", end - timetime);
-                }
-             } else if(!strcmp(curMethod->clazz->descriptor, "Lcom/mechsoft/ru/graph/Graph;") && !strcmp(curMethod->name, "Dijkstra") && curMethod->idx == 312) {
-                if(dijtime != -1U) {
-                    ALOGE("Lcom/mechsoft/ru/graph/Graph; Dijkstra exetime: %llu", end - dijtime);
-                }
-             } else if(!strcmp(curMethod->clazz->descriptor, "Lcom/mechsoft/ru/graph/Graph;") && !strcmp(curMethod->name, "TheShortestPathByTransfer") && curMethod->idx == 314) {
-                if(transtime != -1U) {
-                    ALOGE("Lcom/mechsoft/ru/graph/Graph; TheShortestPathByTransfer exetime: %llu", end - transtime);
-                }
-             }
-             
-             // chess
-             else if(!strcmp(curMethod->clazz->descriptor, "Lcom/google/android/chess/b;") && !strcmp(curMethod->name, "h") && curMethod->idx == 286) {
-                if(chesstime != -1U) {
-                    ALOGE("Lcom/google/android/chess/b; h exetime: %llu", end - chesstime);
-                }
-             }
-             
-             // sudoku
-             else if(!strcmp(curMethod->clazz->descriptor, "Lcom/genina/ads/AdView$MyLocalThread;") && !strcmp(curMethod->name, "run") && curMethod->idx == 1289) {
-                if(truntime != -1U) {
-                    ALOGE("Lcom/genina/ads/AdView$MyLocalThread; run exetime: %llu", end - truntime);
-                }
-             } else if(!strcmp(curMethod->clazz->descriptor, "Lcom/icenta/sudoku/ui/MobileSudoku$42;") && !strcmp(curMethod->name, "run") && curMethod->idx == 2996) {
-                if(mruntime != -1U) {
-                    ALOGE("Lcom/icenta/sudoku/ui/MobileSudoku$42; run exetime: %llu", end - mruntime);
-                }
-             } else if(!strcmp(curMethod->clazz->descriptor, "Lcom/icenta/sudoku/Puzzle;") && !strcmp(curMethod->name, "solve") && curMethod->idx == 2811) {
-                if(psoltime != -1U) {
-                    ALOGE("Lcom/icenta/sudoku/Puzzle; solve exetime: %llu", end - psoltime);
-                }
-             } else if(!strcmp(curMethod->clazz->descriptor, "Lcom/icenta/sudoku/Puzzle;") && !strcmp(curMethod->name, "<init>") && curMethod->idx == 2784) {
-                if(pinittime != -1U) {
-                    ALOGE("Lcom/icenta/sudoku/Puzzle; <init> exetime: %llu", end - pinittime);
-                }
-             }
-         }*/
         if(!gDvm.offDisabled && end > saveArea->startTime && curMethod->clazz->pDvmDex->classLoader) {
             u4 exepoint = 0;
             if(gDvm.methodExePointMap->find(curMethod) != gDvm.methodExePointMap->end()) {
                 exepoint = (*gDvm.methodExePointMap)[curMethod];
             }
-  std::stringstream converter;
-  converter << exepoint;
-  char* pointStr = strdup(converter.str().c_str());
-  converter.str("");
-  converter.clear();
-            char key[strlen(curMethod->clazz->descriptor) + strlen(curMethod->name) + strlen(pointStr) + 1];
-            strcpy(key, curMethod->clazz->descriptor);
-            strcat(key, curMethod->name);
-            strcat(key, pointStr);
-            if(gDvm.methodExeCountMap->find(key) == gDvm.methodExeCountMap->end()) {
-                (*gDvm.methodExeCountMap)[strdup(key)] = 0;
+            std::map<u4, u4>& exeCounts = offGetMethodSlot(curMethod)->exeCounts;
+            std::map<u4, u4>::iterator count = exeCounts.find(exepoint);
+            if(count == exeCounts.end()) {
+                exeCounts[exepoint] = 0;
             } else {
-                if((*gDvm.methodExeCountMap)[key] <= 8) {
+                if(count->second <= 8) {
                 // write out the result
                     ALOGE("write out method execution: %s %s %d, point: %d, time: %llu", curMethod->clazz->descriptor, curMethod->name, curMethod->idx, exepoint, end - saveArea->startTime);
-                    (*gDvm.methodExeCountMap)[key] += 1;
+                    count->second += 1;
                 }
             }
         }
+        if(!gDvm.isServer) {
+            offSchedulerMethodExit(self, curMethod, fp, saveArea->startTime, end);
+        }
 #endif
 
 #ifdef EASY_GDB
@@ -4338,22 +4164,15 @@ GOTO_TARGET(invokeMethod, bool methodCallRange, const Method* _methodToCall,
                         exepoint = (*gDvm.methodExePointMap)[curMethod];
                     }
                     // write out the result
-  std::stringstream converter;
-  converter << exepoint;
-  char* pointStr = strdup(converter.str().c_str());
-  converter.str("");
-  converter.clear();
-            char key[strlen(tempArea->method->clazz->descriptor) + strlen(tempArea->method->name) + strlen(pointStr) + 1];
-            strcpy(key, tempArea->method->clazz->descriptor);
-            strcat(key, tempArea->method->name);
-            strcat(key, pointStr);
-            if(gDvm.methodExeCountMap->find(key) == gDvm.methodExeCountMap->end()) {
-                (*gDvm.methodExeCountMap)[strdup(key)] = 0;
+            std::map<u4, u4>& exeCounts = offGetMethodSlot(tempArea->method)->exeCounts;
+            std::map<u4, u4>::iterator count = exeCounts.find(exepoint);
+            if(count == exeCounts.end()) {
+                exeCounts[exepoint] = 0;
             } else {
-                if((*gDvm.methodExeCountMap)[key] <= 8) {
+                if(count->second <= 8) {
                 // write out the result
                     ALOGE("write out method execution: %s %s %d, point: %d, time: %llu", tempArea->method->clazz->descriptor, tempArea->method->name, tempArea->method->idx, exepoint, end - tempArea->startTime);
-                    (*gDvm.methodExeCountMap)[key] += 1;
+                    count->second += 1;
                 }
             }
                 }
@@ -89,7 +89,7 @@
             FINISH(0);                                                      \
         }                                                                   \
     } while(0)
-#define SCHEDULER_SAFE_POINT() offSchedulerSafePoint(self)
+#define SCHEDULER_SAFE_POINT() offSchedulerSafePoint(self, curMethod)
 #define CHECK_STACK_INTEGRITY_DO(x) do {                                    \
         u4 breakFrames = self->breakFrames;                                 \
         u4 migrationCounter = self->migrationCounter;                       \
@@ -57,6 +57,9 @@ static void Dalvik_dalvik_system_VMDebug_getVmFeatureList(const u4* args, JValue
     features.push_back("method-trace-profiling-streaming");
     features.push_back("hprof-heap-dump");
     features.push_back("hprof-heap-dump-streaming");
+#ifdef WITH_OFFLOAD
+    features.push_back("offload-telemetry");
+#endif
 
     ArrayObject* result = dvmCreateStringArray(features);
     dvmReleaseTrackedAlloc((Object*) result, dvmThreadSelf());
@@ -749,6 +752,95 @@ static void Dalvik_dalvik_system_VMDebug_countInstancesOfClass(const u4* args,
     }
 }
 
+#ifdef WITH_OFFLOAD
+/*
+ * static void getOffloadCounters(long[] counters)
+ *
+ * Copy the offload engine's event counters, summed over all threads, into
+ * the array.  See offload/Telemetry.h for their order.
+ */
+static void Dalvik_dalvik_system_VMDebug_getOffloadCounters(const u4* args,
+    JValue* pResult)
+{
+    ArrayObject* countArray = (ArrayObject*) args[0];
+
+    if (countArray != NULL) {
+        u8 counters[OFF_STAT_COUNT];
+        u4 length = countArray->length;
+        if (length > OFF_STAT_COUNT) {
+            length = OFF_STAT_COUNT;
+        }
+
+        offTelemetryReadCounters(counters);
+        memcpy(countArray->contents, counters, length * sizeof(u8));
+        offTrackArrayWrite(countArray, 0, length);
+    }
+
+    RETURN_VOID();
+}
+
+/*
+ * static void getOffloadHistogram(int which, long[] summary)
+ *
+ * Summarize one of the offload engine's latency or size histograms as
+ * { count, sum, max, p50, p90, p99, p99.9 }.
+ */
+static void Dalvik_dalvik_system_VMDebug_getOffloadHistogram(const u4* args,
+    JValue* pResult)
+{
+    u4 which = args[0];
+    ArrayObject* summaryArray = (ArrayObject*) args[1];
+
+    if (which >= OFF_HIST_COUNT) {
+        dvmThrowIllegalArgumentException("unknown offload histogram");
+        RETURN_VOID();
+    }
+    if (summaryArray != NULL) {
+        OffHistogramSummary summary;
+        u8 values[7];
+        u4 length = summaryArray->length;
+        if (length > (u4) NELEM(values)) {
+            length = (u4) NELEM(values);
+        }
+
+        offTelemetryReadHistogram((OffHistogram) which, &summary);
+        values[0] = summary.count;
+        values[1] = summary.sum;
+        values[2] = summary.max;
+        values[3] = summary.p50;
+        values[4] = summary.p90;
+        values[5] = summary.p99;
+        values[6] = summary.p999;
+        memcpy(summaryArray->contents, values, length * sizeof(u8));
+        offTrackArrayWrite(summaryArray, 0, length);
+    }
+
+    RETURN_VOID();
+}
+
+/*
+ * static void resetOffloadTelemetry()
+ */
+static void Dalvik_dalvik_system_VMDebug_resetOffloadTelemetry(const u4* args,
+    JValue* pResult)
+{
+    offTelemetryReset();
+    RETURN_VOID();
+}
+
+/*
+ * static void dumpOffloadTelemetry()
+ *
+ * Write the offload counters and histograms to the log, as SIGQUIT does.
+ */
+static void Dalvik_dalvik_system_VMDebug_dumpOffloadTelemetry(const u4* args,
+    JValue* pResult)
+{
+    offTelemetryDump();
+    RETURN_VOID();
+}
+#endif
+
 const DalvikNativeMethod dvm_dalvik_system_VMDebug[] = {
     { "getVmFeatureList",           "()[Ljava/lang/String;",
         Dalvik_dalvik_system_VMDebug_getVmFeatureList },
@@ -804,5 +896,15 @@ const DalvikNativeMethod dvm_dalvik_system_VMDebug[] = {
         Dalvik_dalvik_system_VMDebug_infopoint },
     { "countInstancesOfClass",     "(Ljava/lang/Class;Z)J",
         Dalvik_dalvik_system_VMDebug_countInstancesOfClass },
+#ifdef WITH_OFFLOAD
+    { "getOffloadCounters",        "([J)V",
+        Dalvik_dalvik_system_VMDebug_getOffloadCounters },
+    { "getOffloadHistogram",       "(I[J)V",
+        Dalvik_dalvik_system_VMDebug_getOffloadHistogram },
+    { "resetOffloadTelemetry",     "()V",
+        Dalvik_dalvik_system_VMDebug_resetOffloadTelemetry },
+    { "dumpOffloadTelemetry",      "()V",
+        Dalvik_dalvik_system_VMDebug_dumpOffloadTelemetry },
+#endif
     { NULL, NULL, NULL },
 };
@@ -0,0 +1,443 @@
+#include "Dalvik.h"
+#include "libdex/DexCatch.h"
+#include "libdex/InstrUtils.h"
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <algorithm>
+#include <fstream>
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME        0x100000001b3ULL
+
+static u8 hashBytes(u8 hash, const void* data, size_t len) {
+  const u1* bytes = (const u1*)data;
+  for(size_t i = 0; i < len; i++) {
+    hash = (hash ^ bytes[i]) * FNV_PRIME;
+  }
+  return hash;
+}
+
+static u8 hashString(u8 hash, const char* str) {
+  return hashBytes(hash, str, strlen(str) + 1);
+}
+
+static u8 hashWord(u8 hash, u8 value) {
+  return hashBytes(hash, &value, sizeof(value));
+}
+
+/* Hash what the index of an instruction names rather than the index. */
+static u8 hashReference(u8 hash, const DexFile* pDexFile,
+                        InstructionIndexType indexType, u4 idx) {
+  switch(indexType) {
+    case kIndexStringRef:
+      return hashString(hash, dexStringById(pDexFile, idx));
+    case kIndexTypeRef:
+      return hashString(hash, dexStringByTypeIdx(pDexFile, idx));
+    case kIndexFieldRef: {
+      const DexFieldId* pFieldId = dexGetFieldId(pDexFile, idx);
+      hash = hashString(hash, dexStringByTypeIdx(pDexFile, pFieldId->classIdx));
+      hash = hashString(hash, dexStringById(pDexFile, pFieldId->nameIdx));
+      return hashString(hash, dexStringByTypeIdx(pDexFile, pFieldId->typeIdx));
+    }
+    case kIndexMethodRef: {
+      const DexMethodId* pMethodId = dexGetMethodId(pDexFile, idx);
+      char* desc = dexCopyDescriptorFromMethodId(pDexFile, pMethodId);
+      hash = hashString(hash, dexStringByTypeIdx(pDexFile, pMethodId->classIdx));
+      hash = hashString(hash, dexStringById(pDexFile, pMethodId->nameIdx));
+      hash = hashString(hash, desc);
+      free(desc);
+      return hash;
+    }
+    default:
+      return hashWord(hash, idx);
+  }
+}
+
+static bool isReference(InstructionIndexType indexType) {
+  return indexType == kIndexStringRef || indexType == kIndexTypeRef ||
+         indexType == kIndexFieldRef || indexType == kIndexMethodRef;
+}
+
+u8 offMethodCodeHash(const Method* method) {
+  u8 hash = FNV_OFFSET_BASIS;
+  char* desc = dexProtoCopyMethodDescriptor(&method->prototype);
+  hash = hashString(hash, method->clazz->descriptor);
+  hash = hashString(hash, method->name);
+  hash = hashString(hash, desc);
+  free(desc);
+  hash = hashWord(hash, method->accessFlags);
+  if(method->insns == NULL) {
+    return hash;
+  }
+
+  const DexFile* pDexFile = method->clazz->pDvmDex->pDexFile;
+  const DexCode* pCode = dvmGetMethodCode(method);
+  hash = hashWord(hash, pCode->registersSize);
+  hash = hashWord(hash, pCode->insSize);
+  u4 insnsSize = pCode->insnsSize;
+  for(u4 offset = 0; offset < insnsSize; ) {
+    const u2* insns = pCode->insns + offset;
+    u4 width = dexGetWidthFromInstruction(insns);
+    if(width == 0 || offset + width > insnsSize) {
+      break;
+    }
+    offset += width;
+    DecodedInstruction dec;
+    dexDecodeInstruction(insns, &dec);
+    if(dec.opcode == OP_NOP) {
+      /* Padding and switch or array payloads. */
+      hash = hashBytes(hash, insns, width * sizeof(u2));
+      continue;
+    }
+    hash = hashWord(hash, dec.opcode);
+    InstructionIndexType indexType = dexGetIndexTypeFromOpcode(dec.opcode);
+    if(isReference(indexType)) {
+      InstructionFormat format = dexGetFormatFromOpcode(dec.opcode);
+      u4* index = format == kFmt22c ? &dec.vC : &dec.vB;
+      hash = hashReference(hash, pDexFile, indexType, *index);
+      *index = 0;
+    }
+    hash = hashWord(hash, dec.vA);
+    hash = hashWord(hash, dec.vB);
+    hash = hashWord(hash, dec.vB_wide);
+    hash = hashWord(hash, dec.vC);
+    for(u4 i = 0; i < 5; i++) {
+      hash = hashWord(hash, dec.arg[i]);
+    }
+  }
+
+  const DexTry* pTries = pCode->triesSize != 0 ? dexGetTries(pCode) : NULL;
+  for(u4 i = 0; i < pCode->triesSize; i++) {
+    hash = hashWord(hash, pTries[i].startAddr);
+    hash = hashWord(hash, pTries[i].insnCount);
+    DexCatchIterator iterator;
+    dexCatchIteratorInit(&iterator, pCode, pTries[i].handlerOff);
+    DexCatchHandler* handler;
+    while((handler = dexCatchIteratorNext(&iterator)) != NULL) {
+      hash = hashString(hash, handler->typeIdx == kDexNoIndex ? "" :
+                        dexStringByTypeIdx(pDexFile, handler->typeIdx));
+      hash = hashWord(hash, handler->address);
+    }
+  }
+  return hash;
+}
+
+struct TarjanFrame {
+  int node;
+  unsigned int next;
+};
+
+/* Tarjan's algorithm, iteratively so deep call chains don't exhaust the
+ * stack. */
+int offFindCallCycles(std::vector<std::vector<int> >* edges,
+                      std::vector<int>* sccOf) {
+  int count = edges->size();
+  std::vector<int> index(count, -1);
+  std::vector<int> low(count, 0);
+  std::vector<bool> onStack(count, false);
+  std::vector<int> stack;
+  std::vector<TarjanFrame> work;
+  int nextIndex = 0;
+  int sccCount = 0;
+  sccOf->assign(count, -1);
+  for(int root = 0; root < count; root++) {
+    if(index[root] != -1) continue;
+    TarjanFrame rootFrame = {root, 0};
+    index[root] = low[root] = nextIndex++;
+    stack.push_back(root);
+    onStack[root] = true;
+    work.push_back(rootFrame);
+    while(!work.empty()) {
+      int v = work.back().node;
+      if(work.back().next < edges->at(v).size()) {
+        int w = edges->at(v)[work.back().next++];
+        if(index[w] == -1) {
+          TarjanFrame frame = {w, 0};
+          index[w] = low[w] = nextIndex++;
+          stack.push_back(w);
+          onStack[w] = true;
+          work.push_back(frame);
+        } else if(onStack[w] && index[w] < low[v]) {
+          low[v] = index[w];
+        }
+        continue;
+      }
+      if(low[v] == index[v]) {
+        int w;
+        do {
+          w = stack.back();
+          stack.pop_back();
+          onStack[w] = false;
+          (*sccOf)[w] = sccCount;
+        } while(w != v);
+        sccCount++;
+      }
+      work.pop_back();
+      if(!work.empty() && low[v] < low[work.back().node]) {
+        low[work.back().node] = low[v];
+      }
+    }
+  }
+  return sccCount;
+}
+
+void offMethodDeepHashes(std::vector<Method*>* methods,
+    OffCalleeCollector collect, std::map<Method*, u8>* hashes) {
+  std::vector<Method*> nodes;
+  std::map<Method*, int> nodeOf;
+  for(size_t i = 0; i < methods->size(); i++) {
+    if(nodeOf.insert(std::make_pair(methods->at(i), (int)nodes.size())).second) {
+      nodes.push_back(methods->at(i));
+    }
+  }
+  /* Callees outside of methods join the graph as they are found. */
+  std::vector<std::vector<int> > edges;
+  for(size_t i = 0; i < nodes.size(); i++) {
+    std::vector<Method*> callees;
+    collect(nodes[i], &callees);
+    std::vector<int> out;
+    for(size_t j = 0; j < callees.size(); j++) {
+      if(callees[j] == NULL) continue;
+      std::pair<std::map<Method*, int>::iterator, bool> added =
+          nodeOf.insert(std::make_pair(callees[j], (int)nodes.size()));
+      if(added.second) {
+        nodes.push_back(callees[j]);
+      }
+      out.push_back(added.first->second);
+    }
+    edges.push_back(out);
+  }
+
+  std::vector<int> sccOf;
+  int sccCount = offFindCallCycles(&edges, &sccOf);
+  std::vector<std::vector<int> > members(sccCount);
+  for(size_t i = 0; i < nodes.size(); i++) {
+    members[sccOf[i]].push_back(i);
+  }
+  /* Components come callees first, so the hashes of everything a component
+   * calls are known by the time it is reached.  Sorting makes the hash
+   * independent of the order methods and invocations were found in. */
+  std::vector<u8> sccHash(sccCount);
+  for(int scc = 0; scc < sccCount; scc++) {
+    std::vector<u8> own;
+    std::vector<u8> reached;
+    for(size_t i = 0; i < members[scc].size(); i++) {
+      int node = members[scc][i];
+      own.push_back(offMethodCodeHash(nodes[node]));
+      for(size_t j = 0; j < edges[node].size(); j++) {
+        int callee = sccOf[edges[node][j]];
+        if(callee != scc) {
+          reached.push_back(sccHash[callee]);
+        }
+      }
+    }
+    std::sort(own.begin(), own.end());
+    std::sort(reached.begin(), reached.end());
+    reached.erase(std::unique(reached.begin(), reached.end()), reached.end());
+    u8 hash = FNV_OFFSET_BASIS;
+    for(size_t i = 0; i < own.size(); i++) {
+      hash = hashWord(hash, own[i]);
+    }
+    hash = hashWord(hash, reached.size());
+    for(size_t i = 0; i < reached.size(); i++) {
+      hash = hashWord(hash, reached[i]);
+    }
+    sccHash[scc] = hash;
+  }
+  for(size_t i = 0; i < nodes.size(); i++) {
+    (*hashes)[nodes[i]] = sccHash[sccOf[i]];
+  }
+}
+
+void offCollectDexMethods(std::vector<DvmDex*>* dexes,
+                          std::vector<Method*>* methods) {
+  for(size_t idx = 0; idx < dexes->size(); idx++) {
+    DvmDex* pDvmDex = dexes->at(idx);
+    for(u4 i = 0; i < pDvmDex->pHeader->classDefsSize; i++) {
+      const DexClassDef* pClassDef = dexGetClassDef(pDvmDex->pDexFile, i);
+      const char* className =
+          dexStringByTypeIdx(pDvmDex->pDexFile, pClassDef->classIdx);
+      if(className[0] != '\0' && className[1] == '\0') continue;
+      ClassObject* clazz = dvmLookupClass(className, NULL, false);
+      if(clazz == NULL || clazz->pDvmDex != pDvmDex) continue;
+      for(int j = 0; j < clazz->virtualMethodCount; j++) {
+        methods->push_back(&clazz->virtualMethods[j]);
+      }
+      for(int j = 0; j < clazz->directMethodCount; j++) {
+        methods->push_back(&clazz->directMethods[j]);
+      }
+    }
+  }
+}
+
+struct CacheEntry {
+  std::string data;
+  bool used;
+};
+
+struct CacheShard {
+  char name[kSHA1DigestOutputLen];
+  /* Seeded from the shard of another version of the dex. */
+  bool inherited;
+  bool dirty;
+  std::map<std::string, CacheEntry> entries;
+};
+
+static std::string cacheDir;
+static std::map<DvmDex*, CacheShard*> cacheShards;
+/* Dex location to the name of the last shard seen there. */
+static std::map<std::string, std::string> cacheLocations;
+static bool locationsDirty;
+static u4 cacheHits;
+static u4 cacheMisses;
+
+/* Entries are a line of deep hash and method, the data lines and an empty
+ * line. */
+static std::string entryKey(const Method* method, u8 deepHash) {
+  char hashStr[17];
+  char* desc = dexProtoCopyMethodDescriptor(&method->prototype);
+  snprintf(hashStr, sizeof(hashStr), "%016llx", deepHash);
+  std::string key = std::string(hashStr) + " " + method->clazz->descriptor +
+      " " + method->name + " " + desc;
+  free(desc);
+  return key;
+}
+
+static void loadShard(CacheShard* shard, const char* name) {
+  std::ifstream in((cacheDir + "/" + name).c_str());
+  std::string key;
+  while(std::getline(in, key) && !key.empty()) {
+    CacheEntry entry;
+    entry.used = false;
+    std::string line;
+    while(std::getline(in, line) && !line.empty()) {
+      entry.data += line;
+      entry.data += '\n';
+    }
+    shard->entries[key] = entry;
+  }
+}
+
+static bool writeShard(CacheShard* shard) {
+  std::string path = cacheDir + "/" + shard->name;
+  std::string tmpPath = path + ".tmp";
+  std::ofstream out(tmpPath.c_str(), std::ios::out | std::ios::trunc);
+  for(std::map<std::string, CacheEntry>::iterator it = shard->entries.begin();
+      it != shard->entries.end(); ++it) {
+    /* What an older version of the dex left and this one did not use is
+     * stale. */
+    if(shard->inherited && !it->second.used) continue;
+    out << it->first << std::endl << it->second.data << std::endl;
+  }
+  out.close();
+  if(out.fail() || rename(tmpPath.c_str(), path.c_str()) != 0) {
+    ALOGE("Failed to write analysis cache shard %s", path.c_str());
+    unlink(tmpPath.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool offAnalysisCacheOpen(const char* dir) {
+  if(mkdir(dir, 0700) != 0 && errno != EEXIST) {
+    ALOGE("Failed to create analysis cache %s: %s", dir, strerror(errno));
+    return false;
+  }
+  cacheDir = dir;
+  locationsDirty = false;
+  cacheHits = cacheMisses = 0;
+  std::ifstream in((cacheDir + "/locations").c_str());
+  std::string line;
+  while(std::getline(in, line)) {
+    size_t space = line.find(' ');
+    if(space == std::string::npos) continue;
+    cacheLocations[line.substr(space + 1)] = line.substr(0, space);
+  }
+  return true;
+}
+
+void offAnalysisCacheAddDex(DvmDex* pDvmDex, const char* location) {
+  if(cacheDir.empty() || cacheShards.count(pDvmDex) != 0) return;
+  CacheShard* shard = new CacheShard();
+  const u1* signature = pDvmDex->pHeader->signature;
+  for(int i = 0; i < kSHA1DigestLen; i++) {
+    sprintf(shard->name + i * 2, "%02x", signature[i]);
+  }
+  shard->inherited = false;
+  shard->dirty = false;
+
+  struct stat st;
+  if(stat((cacheDir + "/" + shard->name).c_str(), &st) == 0) {
+    loadShard(shard, shard->name);
+  } else {
+    std::map<std::string, std::string>::iterator last =
+        cacheLocations.find(location);
+    if(last != cacheLocations.end()) {
+      loadShard(shard, last->second.c_str());
+      shard->inherited = true;
+      shard->dirty = true;
+    }
+  }
+  std::string& lastName = cacheLocations[location];
+  if(lastName != shard->name) {
+    lastName = shard->name;
+    locationsDirty = true;
+  }
+  cacheShards[pDvmDex] = shard;
+}
+
+bool offAnalysisCacheLookup(const Method* method, u8 deepHash,
+                            std::string* data) {
+  std::map<DvmDex*, CacheShard*>::iterator shard =
+      cacheShards.find(method->clazz->pDvmDex);
+  if(shard == cacheShards.end()) return false;
+  std::map<std::string, CacheEntry>::iterator it =
+      shard->second->entries.find(entryKey(method, deepHash));
+  if(it == shard->second->entries.end()) {
+    cacheMisses++;
+    return false;
+  }
+  cacheHits++;
+  it->second.used = true;
+  *data = it->second.data;
+  return true;
+}
+
+void offAnalysisCacheStore(const Method* method, u8 deepHash,
+                           const std::string& data) {
+  std::map<DvmDex*, CacheShard*>::iterator shard =
+      cacheShards.find(method->clazz->pDvmDex);
+  if(shard == cacheShards.end()) return;
+  CacheEntry& entry = shard->second->entries[entryKey(method, deepHash)];
+  entry.data = data;
+  entry.used = true;
+  shard->second->dirty = true;
+}
+
+void offAnalysisCacheClose() {
+  for(std::map<DvmDex*, CacheShard*>::iterator it = cacheShards.begin();
+      it != cacheShards.end(); ++it) {
+    if(it->second->dirty) {
+      writeShard(it->second);
+    }
+    delete it->second;
+  }
+  cacheShards.clear();
+  if(locationsDirty) {
+    std::ofstream out((cacheDir + "/locations").c_str(),
+                      std::ios::out | std::ios::trunc);
+    for(std::map<std::string, std::string>::iterator it =
+        cacheLocations.begin(); it != cacheLocations.end(); ++it) {
+      out << it->second << " " << it->first << std::endl;
+    }
+  }
+  cacheLocations.clear();
+  if(!cacheDir.empty()) {
+    ALOGI("Analysis cache: %u results reused, %u computed", cacheHits,
+          cacheMisses);
+  }
+  cacheDir.clear();
+}
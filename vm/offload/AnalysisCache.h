@@ -0,0 +1,64 @@
+#ifndef OFFLOAD_ANALYSIS_CACHE_H
+#define OFFLOAD_ANALYSIS_CACHE_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+struct Method;
+struct DvmDex;
+
+/* Support for reusing analysis results across runs.
+ *
+ * A method's code hash covers its bytecode and try blocks with every string,
+ * type, field and method index replaced by what it names, so it does not
+ * change when an unrelated edit renumbers the dex.  Its deep hash combines the
+ * code hashes of its call graph component with the deep hashes of every
+ * component it may call, so a result stored under a deep hash is still valid
+ * exactly when neither the method nor anything it reaches has changed.
+ *
+ * Results are kept in one shard per dex file, named after the SHA-1 signature
+ * in the dex header, under a directory shared by all apps.  A dex that has
+ * not changed finds its shard as it is, which is how the boot class path is
+ * analysed once for every app.  A dex that has changed starts from the shard
+ * of the last version seen at the same location and drops whatever it does
+ * not use. */
+
+/* Callees an analysis follows from method. */
+typedef void (*OffCalleeCollector)(Method* method, std::vector<Method*>* callees);
+
+u8 offMethodCodeHash(const Method* method);
+
+/* Deep hashes of methods and of everything they may call, as reported by
+ * collect. */
+void offMethodDeepHashes(std::vector<Method*>* methods,
+    OffCalleeCollector collect, std::map<Method*, u8>* hashes);
+
+/* Group the graph given by the adjacency lists in edges into strongly
+ * connected components.  A component is numbered after every component it
+ * has an edge into, so numbering order is a bottom-up order of a call graph.
+ * Returns the component count. */
+int offFindCallCycles(std::vector<std::vector<int> >* edges,
+                      std::vector<int>* sccOf);
+
+/* All methods of the classes defined by dexes that have been loaded. */
+void offCollectDexMethods(std::vector<DvmDex*>* dexes,
+                          std::vector<Method*>* methods);
+
+/* Use the shards under dir, creating it if needed. */
+bool offAnalysisCacheOpen(const char* dir);
+
+/* Load the shard of a dex file found at location. */
+void offAnalysisCacheAddDex(DvmDex* pDvmDex, const char* location);
+
+/* Find the result stored for method under deepHash. */
+bool offAnalysisCacheLookup(const Method* method, u8 deepHash,
+                            std::string* data);
+
+void offAnalysisCacheStore(const Method* method, u8 deepHash,
+                           const std::string& data);
+
+/* Write back the shards that changed and forget them all. */
+void offAnalysisCacheClose();
+
+#endif // OFFLOAD_ANALYSIS_CACHE_H
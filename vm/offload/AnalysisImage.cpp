@@ -0,0 +1,371 @@
+#include "Dalvik.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static u1* imageBase;
+static size_t imageSize;
+static const AnalysisImageHeader* imageHeader;
+static const AnalysisImageEntry* imageIndex;
+
+/* Argument trees decoded so far, indexed like imageIndex.  Entries whose
+ * method has no argument information stay NULL and are decoded again on every
+ * lookup, which is cheap since all that takes is a look at argsOff. */
+static MethodAccResult** decoded;
+static pthread_mutex_t decodeLock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline const u4* imageWords(u4 off) {
+  return (const u4*)(imageBase + off);
+}
+
+static inline const char* imageString(u4 off) {
+  return (const char*)(imageBase + off);
+}
+
+static void statSource(const char* path, AnalysisImageSource* source) {
+  struct stat st;
+  memset(source, 0, sizeof(*source));
+  if(stat(path, &st) == 0) {
+    source->size = st.st_size;
+    source->mtime = st.st_mtime;
+  }
+}
+
+bool offAnalysisImageOpen(const char* path,
+                          const char* const sources[ANALYSIS_IMAGE_SOURCES]) {
+  assert(imageBase == NULL);
+  int fd = open(path, O_RDONLY);
+  if(fd == -1) {
+    return false;
+  }
+  struct stat st;
+  if(fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(AnalysisImageHeader)) {
+    close(fd);
+    return false;
+  }
+  void* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(base == MAP_FAILED) {
+    ALOGE("Failed to map analysis image %s: %s", path, strerror(errno));
+    return false;
+  }
+
+  const AnalysisImageHeader* header = (const AnalysisImageHeader*)base;
+  if(header->magic != ANALYSIS_IMAGE_MAGIC ||
+     header->version != ANALYSIS_IMAGE_VERSION ||
+     header->fileSize != (u4)st.st_size ||
+     header->indexOff + (u8)header->methodCount * sizeof(AnalysisImageEntry) >
+         (u8)st.st_size) {
+    ALOGI("Ignoring stale analysis image %s", path);
+    munmap(base, st.st_size);
+    return false;
+  }
+  for(int i = 0; i < ANALYSIS_IMAGE_SOURCES; i++) {
+    AnalysisImageSource source;
+    statSource(sources[i], &source);
+    if(memcmp(&source, &header->sources[i], sizeof(source)) != 0) {
+      ALOGI("Ignoring analysis image %s, %s changed since it was built", path,
+            sources[i]);
+      munmap(base, st.st_size);
+      return false;
+    }
+  }
+
+  imageBase = (u1*)base;
+  imageSize = st.st_size;
+  imageHeader = header;
+  imageIndex = (const AnalysisImageEntry*)(imageBase + header->indexOff);
+  decoded = (MethodAccResult**)calloc(header->methodCount,
+                                      sizeof(MethodAccResult*));
+  ALOGI("Mapped analysis image %s, %u methods, %u bytes", path,
+        header->methodCount, header->fileSize);
+  return true;
+}
+
+static void freeDecodedNode(ObjectAccResult* node) {
+  for(u4 i = 0; i < node->fieldSet.size(); i++) {
+    if(node->fieldSet[i] != NULL) {
+      freeDecodedNode(node->fieldSet[i]);
+    }
+  }
+  delete node;
+}
+
+void offAnalysisImageClose() {
+  if(imageBase == NULL) {
+    return;
+  }
+  for(u4 i = 0; i < imageHeader->methodCount; i++) {
+    MethodAccResult* result = decoded[i];
+    if(result != NULL) {
+      for(u4 j = 0; j < result->args->size(); j++) {
+        freeDecodedNode(result->args->at(j));
+      }
+      delete result->args;
+      delete result;
+    }
+  }
+  free(decoded);
+  munmap(imageBase, imageSize);
+  decoded = NULL;
+  imageBase = NULL;
+  imageSize = 0;
+  imageHeader = NULL;
+  imageIndex = NULL;
+}
+
+bool offAnalysisImageLoaded() {
+  return imageBase != NULL;
+}
+
+/* Binary search of the sorted index.  Returns the entry index or -1. */
+static int findEntry(const char* key) {
+  int lo = 0;
+  int hi = (int)imageHeader->methodCount - 1;
+  while(lo <= hi) {
+    int mid = (lo + hi) >> 1;
+    int cmp = strcmp(imageString(imageIndex[mid].keyOff), key);
+    if(cmp == 0) {
+      return mid;
+    } else if(cmp < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return -1;
+}
+
+static ObjectAccResult* decodeNode(u4 off) {
+  const u4* node = imageWords(off);
+  ObjectAccResult* result = new ObjectAccResult();
+  result->allFlag = (node[0] & 0x1) != 0;
+  u4 fieldCount = node[1];
+  result->migrate = node[2];
+  u4 hsz = fieldCount > 32 ? (fieldCount - 1) >> 5 : 0;
+  /* The high words are only ever read so they can stay in the mapping. */
+  result->highbits = hsz ? (u4*)(node + 3) : NULL;
+  const u4* children = node + 3 + hsz;
+  result->fieldSet.resize(fieldCount);
+  for(u4 i = 0; i < fieldCount; i++) {
+    result->fieldSet[i] = children[i] ? decodeNode(children[i]) : NULL;
+  }
+  return result;
+}
+
+MethodAccResult* offAnalysisLookupMethod(const char* key) {
+  int ind = findEntry(key);
+  if(ind < 0 || imageIndex[ind].argsOff == 0) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&decodeLock);
+  MethodAccResult* result = decoded[ind];
+  if(result == NULL) {
+    const u4* args = imageWords(imageIndex[ind].argsOff);
+    result = new MethodAccResult();
+    result->args = new std::vector<ObjectAccResult*>();
+    result->args->reserve(args[0]);
+    for(u4 i = 0; i < args[0]; i++) {
+      result->args->push_back(decodeNode(args[1 + i]));
+    }
+    decoded[ind] = result;
+  }
+  pthread_mutex_unlock(&decodeLock);
+  return result;
+}
+
+bool offAnalysisLookupClasses(const char* key, AnalysisClassIter* iter) {
+  int ind = findEntry(key);
+  if(ind < 0 || imageIndex[ind].classesOff == 0) {
+    return false;
+  }
+  const u4* classes = imageWords(imageIndex[ind].classesOff);
+  iter->left = classes[0];
+  iter->pos = classes + 1;
+  return true;
+}
+
+bool offAnalysisNextClass(AnalysisClassIter* iter, const char** descriptor,
+                          u4* fieldCount, const u4** words) {
+  if(iter->left == 0) {
+    return false;
+  }
+  const u4* pos = iter->pos;
+  *descriptor = imageString(pos[0]);
+  *fieldCount = pos[1];
+  *words = pos + 2;
+  iter->pos = pos + 2 + ((pos[1] - 1) >> 5) + 1;
+  iter->left--;
+  return true;
+}
+
+/* Image writer.  Everything is appended to a u4 vector so that offsets are
+ * just four times the vector position. */
+namespace {
+
+struct ImageEntry {
+  MethodAccResult* result;
+  bool hasClasses;
+  u4 classOffset;
+};
+
+class ImageWriter {
+public:
+  std::vector<u4> out;
+
+  u4 offset() const {
+    return out.size() << 2;
+  }
+
+  u4 addString(const char* str) {
+    u4 off = offset();
+    size_t len = strlen(str) + 1;
+    size_t pos = out.size();
+    out.resize(pos + ((len + 3) >> 2), 0);
+    memcpy(&out[pos], str, len);
+    return off;
+  }
+
+  /* Children are written before their parent so the parent can refer to
+   * them by offset. */
+  u4 addNode(ObjectAccResult* node) {
+    u4 fieldCount = node->fieldSet.size();
+    std::vector<u4> children(fieldCount, 0);
+    for(u4 i = 0; i < fieldCount; i++) {
+      if(node->fieldSet[i] != NULL) {
+        children[i] = addNode(node->fieldSet[i]);
+      }
+    }
+    u4 off = offset();
+    u4 hsz = fieldCount > 32 ? (fieldCount - 1) >> 5 : 0;
+    out.push_back(node->allFlag ? 0x1 : 0);
+    out.push_back(fieldCount);
+    out.push_back(node->migrate);
+    for(u4 i = 0; i < hsz; i++) {
+      out.push_back(node->highbits != NULL ? node->highbits[i] : 0);
+    }
+    out.insert(out.end(), children.begin(), children.end());
+    return off;
+  }
+
+  u4 addArgs(std::vector<ObjectAccResult*>* args) {
+    std::vector<u4> nodes;
+    for(u4 i = 0; i < args->size(); i++) {
+      nodes.push_back(addNode(args->at(i)));
+    }
+    u4 off = offset();
+    out.push_back(nodes.size());
+    out.insert(out.end(), nodes.begin(), nodes.end());
+    return off;
+  }
+
+  /* Copy one method's records out of static.txt. */
+  u4 addClasses(std::ifstream* staticfile, u4 fileOffset) {
+    std::vector<u4> records;
+    std::string line;
+    u4 count = 0;
+    staticfile->clear();
+    staticfile->seekg(fileOffset);
+    std::getline(*staticfile, line);
+    while(std::getline(*staticfile, line) && !line.empty()) {
+      u4 descOff = addString(line.c_str());
+      std::getline(*staticfile, line);
+      std::istringstream in(line);
+      u4 size = 0;
+      in >> size;
+      if(size == 0) {
+        continue;
+      }
+      records.push_back(descOff);
+      records.push_back(size);
+      for(u4 i = 0; i < ((size - 1) >> 5) + 1; i++) {
+        u4 word = 0;
+        in >> word;
+        records.push_back(word);
+      }
+      count++;
+    }
+    u4 off = offset();
+    out.push_back(count);
+    out.insert(out.end(), records.begin(), records.end());
+    return off;
+  }
+};
+
+} // namespace
+
+bool offAnalysisImageBuild(const char* path,
+    const char* const sources[ANALYSIS_IMAGE_SOURCES],
+    std::map<char*, MethodAccResult*, charscomp>* methodAccMap,
+    std::map<char*, u4, charscomp>* offsetMap, std::ifstream* staticfile) {
+  std::map<const char*, ImageEntry, charscomp> entries;
+  for(std::map<char*, MethodAccResult*, charscomp>::iterator it =
+      methodAccMap->begin(); it != methodAccMap->end(); ++it) {
+    ImageEntry& entry = entries[it->first];
+    entry.result = it->second;
+  }
+  bool haveStatic = staticfile->is_open();
+  for(std::map<char*, u4, charscomp>::iterator it = offsetMap->begin();
+      haveStatic && it != offsetMap->end(); ++it) {
+    ImageEntry& entry = entries[it->first];
+    entry.hasClasses = true;
+    entry.classOffset = it->second;
+  }
+
+  ImageWriter writer;
+  u4 headerWords = (sizeof(AnalysisImageHeader) + 3) >> 2;
+  u4 indexWords = entries.size() * (sizeof(AnalysisImageEntry) >> 2);
+  writer.out.resize(headerWords + indexWords, 0);
+
+  u4 ind = 0;
+  for(std::map<const char*, ImageEntry, charscomp>::iterator it =
+      entries.begin(); it != entries.end(); ++it, ++ind) {
+    AnalysisImageEntry ientry;
+    ientry.keyOff = writer.addString(it->first);
+    ientry.argsOff = it->second.result != NULL && it->second.result->args ?
+        writer.addArgs(it->second.result->args) : 0;
+    ientry.classesOff = it->second.hasClasses ?
+        writer.addClasses(staticfile, it->second.classOffset) : 0;
+    memcpy(&writer.out[headerWords + ind * (sizeof(ientry) >> 2)], &ientry,
+           sizeof(ientry));
+  }
+  staticfile->clear();
+
+  AnalysisImageHeader header;
+  header.magic = ANALYSIS_IMAGE_MAGIC;
+  header.version = ANALYSIS_IMAGE_VERSION;
+  header.fileSize = writer.offset();
+  header.methodCount = entries.size();
+  header.indexOff = headerWords << 2;
+  for(int i = 0; i < ANALYSIS_IMAGE_SOURCES; i++) {
+    statSource(sources[i], &header.sources[i]);
+  }
+  memcpy(&writer.out[0], &header, sizeof(header));
+
+  /* Write to a temporary name first so a concurrent open never sees a
+   * partial image. */
+  std::string tmpPath = std::string(path) + ".tmp";
+  FILE* fp = fopen(tmpPath.c_str(), "wb");
+  if(fp == NULL) {
+    ALOGE("Failed to create analysis image %s: %s", tmpPath.c_str(),
+          strerror(errno));
+    return false;
+  }
+  size_t written = fwrite(&writer.out[0], 4, writer.out.size(), fp);
+  bool ok = fclose(fp) == 0 && written == writer.out.size();
+  if(!ok || rename(tmpPath.c_str(), path) != 0) {
+    ALOGE("Failed to write analysis image %s", path);
+    unlink(tmpPath.c_str());
+    return false;
+  }
+  ALOGI("Wrote analysis image %s, %u methods, %u bytes", path,
+        header.methodCount, header.fileSize);
+  return true;
+}
@@ -0,0 +1,93 @@
+#ifndef OFFLOAD_ANALYSIS_IMAGE_H
+#define OFFLOAD_ANALYSIS_IMAGE_H
+
+#include <map>
+#include <fstream>
+
+struct charscomp;
+struct MethodAccResult;
+
+/* Binary container for the results of the static access analysis.  It holds
+ * what used to be spread over parse.txt, offset.txt and static.txt:
+ *
+ *   header     AnalysisImageHeader
+ *   index      methodCount AnalysisImageEntry records sorted by key
+ *   data       keys, argument trees and class access records
+ *
+ * All values are u4 in host byte order at 4 byte aligned offsets from the start
+ * of the file.  An offset of 0 means "not present".
+ *
+ * An argument list is a count followed by that many node offsets.  A node is
+ * flags (bit 0: all fields), fieldCount, migrate, the high migrate words when
+ * fieldCount > 32, then fieldCount child node offsets.
+ *
+ * A class access list is a count followed by records of descriptor offset,
+ * field count and ((fieldCount - 1) >> 5) + 1 access words. */
+#define ANALYSIS_IMAGE_MAGIC   0x4941464FU /* "OFAI" */
+#define ANALYSIS_IMAGE_VERSION 2
+
+/* The image is built from parse.txt, offset.txt and static.txt, in that
+ * order, and is only used while all three are as they were when it was
+ * built. */
+#define ANALYSIS_IMAGE_SOURCES 3
+
+/* Identity of a source file.  All zero if the file did not exist. */
+typedef struct AnalysisImageSource {
+  u4 size;
+  u4 mtime;
+} AnalysisImageSource;
+
+typedef struct AnalysisImageHeader {
+  u4 magic;
+  u4 version;
+  u4 fileSize;
+  u4 methodCount;
+  u4 indexOff;
+  AnalysisImageSource sources[ANALYSIS_IMAGE_SOURCES];
+} AnalysisImageHeader;
+
+typedef struct AnalysisImageEntry {
+  u4 keyOff;
+  u4 argsOff;
+  u4 classesOff;
+} AnalysisImageEntry;
+
+/* Iterator over the class access records of one method. */
+typedef struct AnalysisClassIter {
+  const u4* pos;
+  u4 left;
+} AnalysisClassIter;
+
+/* Map the image at path read-only.  Returns false if it is missing, was
+ * written by a different version or any of the source files changed since it
+ * was built.  Must not be called again while an image is mapped. */
+bool offAnalysisImageOpen(const char* path,
+                          const char* const sources[ANALYSIS_IMAGE_SOURCES]);
+
+void offAnalysisImageClose();
+
+/* True if an image is currently mapped. */
+bool offAnalysisImageLoaded();
+
+/* Write an image built from the results of the text format, which were read
+ * from sources. */
+bool offAnalysisImageBuild(const char* path,
+    const char* const sources[ANALYSIS_IMAGE_SOURCES],
+    std::map<char*, MethodAccResult*, charscomp>* methodAccMap,
+    std::map<char*, u4, charscomp>* offsetMap, std::ifstream* staticfile);
+
+/* Find the argument access results of the method with the given key.  The
+ * result trees are built from the image the first time a key is looked up and
+ * cached after that. */
+MethodAccResult* offAnalysisLookupMethod(const char* key);
+
+/* Start iterating over the class access records of the method with the given
+ * key.  Returns false if the method has none. */
+bool offAnalysisLookupClasses(const char* key, AnalysisClassIter* iter);
+
+/* Get the next class access record.  The access words stay valid while the
+ * image is mapped. */
+bool offAnalysisNextClass(AnalysisClassIter* iter, const char** descriptor,
+                          u4* fieldCount, const u4** words);
+
+#endif // OFFLOAD_ANALYSIS_IMAGE_H
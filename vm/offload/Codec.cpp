@@ -0,0 +1,317 @@
+#include "Dalvik.h"
+#include "offload/Codec.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define Z_LEVEL Z_DEFAULT_COMPRESSION
+
+/* One message in this many is sent with another codec so that every codec's
+ * cost and ratio keep getting measured. */
+#define CODEC_EXPLORE_INTERVAL 64
+
+/* The other end pays to decode what we encode.  Decoding is cheaper than
+ * encoding for both codecs; charge a quarter on top of the measured cost. */
+#define CODEC_DECODE_FACTOR 1.25f
+
+/* Minimum batch size that gives a useful bandwidth sample. */
+#define CODEC_MIN_SAMPLE (32 << 10)
+
+int offCodecConfigured() {
+  const char* env = getenv("OFF_CODEC");
+  if(env == NULL || !strcmp(env, "auto")) return -1;
+  if(!strcmp(env, "none")) return OFF_CODEC_NONE;
+  if(!strcmp(env, "zlib")) return OFF_CODEC_ZLIB;
+  if(!strcmp(env, "lz")) return OFF_CODEC_LZ;
+  ALOGW("Unknown OFF_CODEC %s, choosing adaptively", env);
+  return -1;
+}
+
+void offCodecLinkInit(OffCodecLink* link, u4 allowed) {
+  memset(&link->wstrm, 0, sizeof(link->wstrm));
+  memset(&link->rstrm, 0, sizeof(link->rstrm));
+  deflateInit(&link->wstrm, Z_LEVEL);
+  inflateInit(&link->rstrm);
+  link->allowed = allowed | 1U << OFF_CODEC_NONE;
+  link->forced = offCodecConfigured();
+  link->messages = link->explore = 0;
+
+  /* Rough starting points until there are measurements. */
+  link->nsPerByte[OFF_CODEC_NONE] = 0.0f;
+  link->ratio[OFF_CODEC_NONE] = 1.0f;
+  link->nsPerByte[OFF_CODEC_ZLIB] = 25.0f;
+  link->ratio[OFF_CODEC_ZLIB] = 0.35f;
+  link->nsPerByte[OFF_CODEC_LZ] = 3.0f;
+  link->ratio[OFF_CODEC_LZ] = 0.55f;
+}
+
+void offCodecLinkDestroy(OffCodecLink* link) {
+  deflateEnd(&link->wstrm);
+  inflateEnd(&link->rstrm);
+}
+
+/* Time it takes a byte to get across the link. */
+static float wireNsPerByte() {
+  u4 bw = gDvm.offNetBandwidth;
+  if(bw != 0) {
+    return 1e9f / bw;
+  }
+  /* No samples yet; guess from the RTT whether this is a LAN. */
+  return gDvm.offNetRTT < 5000 ? 20.0f : 1000.0f;
+}
+
+int offCodecChoose(OffCodecLink* link) {
+  link->messages++;
+  if(link->forced >= 0) {
+    return link->allowed & 1U << link->forced ? link->forced : OFF_CODEC_NONE;
+  }
+
+  if(link->messages % CODEC_EXPLORE_INTERVAL == 0) {
+    for(int i = 1; i <= OFF_CODEC_COUNT; i++) {
+      int codec = (link->explore + i) % OFF_CODEC_COUNT;
+      if(link->allowed & 1U << codec) {
+        link->explore = codec;
+        return codec;
+      }
+    }
+  }
+
+  float wire = wireNsPerByte();
+  int best = OFF_CODEC_NONE;
+  float bestCost = wire;
+  for(int codec = 0; codec < OFF_CODEC_COUNT; codec++) {
+    if(!(link->allowed & 1U << codec)) continue;
+    float cost = link->nsPerByte[codec] * CODEC_DECODE_FACTOR +
+                 link->ratio[codec] * wire;
+    if(cost < bestCost) {
+      best = codec;
+      bestCost = cost;
+    }
+  }
+  return best;
+}
+
+u4 offCodecBound(u4 n) {
+  /* The LZ bound is the larger of the two. */
+  return n + n / 255 + 16;
+}
+
+void offCodecNoteTransfer(u4 bytes, u8 usec) {
+  if(bytes < CODEC_MIN_SAMPLE || usec == 0) return;
+  u8 sample = (u8)bytes * 1000000 / usec;
+  if(sample > 0xFFFFFFFFULL) sample = 0xFFFFFFFFULL;
+  if(gDvm.offNetBandwidth == 0) {
+    gDvm.offNetBandwidth = (u4)sample;
+  } else {
+    gDvm.offNetBandwidth = (u4)((7 * (u8)gDvm.offNetBandwidth + sample) / 8);
+  }
+}
+
+/* LZ is a byte oriented LZ77 codec in the LZ4 block format: greedy matching
+ * through a hash of the next four bytes, no entropy coding.  It costs a small
+ * fraction of deflate and still removes most of the redundancy in sync
+ * payloads (ids, zeroed fields, repeated class references). */
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MF_LIMIT 12
+#define LZ_HASH_BITS 13
+
+static inline u4 lzRead32(const u1* p) {
+  u4 v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline u4 lzHash(u4 seq) {
+  return (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static u1* lzWriteLength(u1* op, u4 len) {
+  while(len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (u1)len;
+  return op;
+}
+
+static u1* lzWriteSequence(u1* op, const u1* lit, u4 litLen, u4 offset,
+                           u4 matchLen) {
+  u1* token = op++;
+  *token = (u1)((litLen < 15 ? litLen : 15) << 4);
+  if(litLen >= 15) op = lzWriteLength(op, litLen - 15);
+  memcpy(op, lit, litLen);
+  op += litLen;
+  if(matchLen == 0) {
+    return op;
+  }
+  *op++ = (u1)offset;
+  *op++ = (u1)(offset >> 8);
+  matchLen -= LZ_MIN_MATCH;
+  *token |= (u1)(matchLen < 15 ? matchLen : 15);
+  if(matchLen >= 15) op = lzWriteLength(op, matchLen - 15);
+  return op;
+}
+
+static u4 lzCompress(OffCodecLink* link, const u1* src, u4 n, u1* dst) {
+  u2* table = link->hashTable;
+  memset(table, 0, sizeof(link->hashTable));
+  const u1* ip = src;
+  const u1* anchor = src;
+  const u1* end = src + n;
+  u1* op = dst;
+
+  if(n > LZ_MF_LIMIT) {
+    const u1* mflimit = end - LZ_MF_LIMIT;
+    const u1* matchlimit = end - LZ_LAST_LITERALS;
+    while(ip < mflimit) {
+      u4 seq = lzRead32(ip);
+      u4 h = lzHash(seq);
+      const u1* ref = src + table[h];
+      table[h] = (u2)(ip - src);
+      if(ref >= ip || lzRead32(ref) != seq) {
+        ip++;
+        continue;
+      }
+      while(ip > anchor && ref > src && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+      const u1* mp = ip + LZ_MIN_MATCH;
+      const u1* mr = ref + LZ_MIN_MATCH;
+      while(mp < matchlimit && *mp == *mr) {
+        mp++;
+        mr++;
+      }
+      op = lzWriteSequence(op, anchor, ip - anchor, ip - ref, mp - ip);
+      ip = anchor = mp;
+    }
+  }
+  op = lzWriteSequence(op, anchor, end - anchor, 0, 0);
+  return op - dst;
+}
+
+static int lzReadLength(const u1** ip, const u1* iend, u4* len) {
+  u1 b;
+  do {
+    if(*ip >= iend) return -1;
+    b = *(*ip)++;
+    *len += b;
+  } while(b == 255);
+  return 0;
+}
+
+static int lzDecompress(const u1* in, u4 sz, u1* out, u4 cap) {
+  const u1* ip = in;
+  const u1* iend = in + sz;
+  u1* op = out;
+  u1* oend = out + cap;
+  while(ip < iend) {
+    u1 token = *ip++;
+    u4 litLen = token >> 4;
+    if(litLen == 15 && lzReadLength(&ip, iend, &litLen)) return -1;
+    if((u4)(iend - ip) < litLen || (u4)(oend - op) < litLen) return -1;
+    memcpy(op, ip, litLen);
+    ip += litLen;
+    op += litLen;
+    if(ip == iend) break;
+
+    if(iend - ip < 2) return -1;
+    u4 offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    u4 matchLen = token & 15;
+    if(matchLen == 15 && lzReadLength(&ip, iend, &matchLen)) return -1;
+    matchLen += LZ_MIN_MATCH;
+    if(offset == 0 || (u4)(op - out) < offset ||
+       (u4)(oend - op) < matchLen) {
+      return -1;
+    }
+    /* The match may overlap the bytes it produces. */
+    const u1* ref = op - offset;
+    while(matchLen--) {
+      *op++ = *ref++;
+    }
+  }
+  return op - out;
+}
+
+u4 offCodecCompress(OffCodecLink* link, int codec, const struct iovec* iov,
+                    u4 cnt, char* out, u4 cap) {
+  u8 start = dvmGetRelativeTimeNsec();
+  u4 in = 0;
+  u4 size = 0;
+  switch(codec) {
+    case OFF_CODEC_ZLIB: {
+      z_stream* strm = &link->wstrm;
+      strm->next_out = (unsigned char*)out;
+      strm->avail_out = cap;
+      for(u4 i = 0; i < cnt; i++) {
+        strm->next_in = (unsigned char*)iov[i].iov_base;
+        strm->avail_in = iov[i].iov_len;
+        deflate(strm, i + 1 == cnt ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+        if(strm->avail_in != 0 || strm->avail_out == 0) {
+          ALOGE("Compressed message does not fit in %u bytes", cap);
+          dvmAbort();
+        }
+        in += iov[i].iov_len;
+      }
+      size = cap - strm->avail_out;
+      break;
+    }
+    case OFF_CODEC_LZ: {
+      const u1* src = (const u1*)iov[0].iov_base;
+      in = iov[0].iov_len;
+      if(cnt > 1) {
+        /* Matching needs the message in one piece. */
+        in = 0;
+        for(u4 i = 0; i < cnt; i++) {
+          memcpy(link->scratch + in, iov[i].iov_base, iov[i].iov_len);
+          in += iov[i].iov_len;
+        }
+        src = link->scratch;
+      }
+      assert(in <= OFF_CODEC_MAX_INPUT && offCodecBound(in) <= cap);
+      size = lzCompress(link, src, in, (u1*)out);
+      break;
+    }
+    default: {
+      for(u4 i = 0; i < cnt; i++) {
+        memcpy(out + in, iov[i].iov_base, iov[i].iov_len);
+        in += iov[i].iov_len;
+      }
+      return in;
+    }
+  }
+
+  if(in != 0) {
+    float ns = (float)(dvmGetRelativeTimeNsec() - start) / in;
+    link->nsPerByte[codec] += (ns - link->nsPerByte[codec]) / 8;
+    link->ratio[codec] += ((float)size / in - link->ratio[codec]) / 8;
+  }
+  return size;
+}
+
+int offCodecDecompress(OffCodecLink* link, int codec, const char* in, u4 sz,
+                       char* out, u4 cap) {
+  switch(codec) {
+    case OFF_CODEC_NONE:
+      if(sz > cap) return -1;
+      memcpy(out, in, sz);
+      return sz;
+    case OFF_CODEC_ZLIB: {
+      z_stream* strm = &link->rstrm;
+      strm->next_in = (unsigned char*)in;
+      strm->avail_in = sz;
+      strm->next_out = (unsigned char*)out;
+      strm->avail_out = cap;
+      int res = inflate(strm, Z_SYNC_FLUSH);
+      if((res != Z_OK && res != Z_BUF_ERROR) || strm->avail_in != 0) {
+        return -1;
+      }
+      return cap - strm->avail_out;
+    }
+    case OFF_CODEC_LZ:
+      return lzDecompress((const u1*)in, sz, (u1*)out, cap);
+  }
+  return -1;
+}
@@ -0,0 +1,79 @@
+#ifndef OFFLOAD_CODEC_H
+#define OFFLOAD_CODEC_H
+
+#include <sys/uio.h>
+
+#include "zlib.h"
+
+/* Compression codecs for the offload link.  Every message carries the id of
+ * the codec it was compressed with in the top byte of its size field so the
+ * sender can switch codecs at any message boundary. */
+#define OFF_CODEC_NONE  0
+#define OFF_CODEC_ZLIB  1
+#define OFF_CODEC_LZ    2
+#define OFF_CODEC_COUNT 3
+
+/* Mask of the codecs this build can decode. */
+#define OFF_CODEC_ALL ((1U << OFF_CODEC_COUNT) - 1)
+
+#define OFF_CODEC_SHIFT 24
+#define OFF_CODEC_SIZE_MASK ((1U << OFF_CODEC_SHIFT) - 1)
+
+/* Largest message the codecs accept. */
+#define OFF_CODEC_MAX_INPUT (1 << 16)
+
+/* Per link codec state.  The zlib streams carry their dictionary from one
+ * zlib message to the next so both ends must see the same messages in the
+ * same order, which the link guarantees. */
+typedef struct OffCodecLink {
+  z_stream wstrm;
+  z_stream rstrm;
+
+  /* Codecs both ends can decode. */
+  u4 allowed;
+
+  /* Codec set with OFF_CODEC, or -1 to choose adaptively. */
+  int forced;
+
+  /* Measured compression cost in ns per input byte and output/input ratio. */
+  float nsPerByte[OFF_CODEC_COUNT];
+  float ratio[OFF_CODEC_COUNT];
+
+  /* Messages compressed so far, used to pace exploration. */
+  u4 messages;
+  u4 explore;
+
+  /* Scratch for codecs that need contiguous input. */
+  u1 scratch[OFF_CODEC_MAX_INPUT];
+  u2 hashTable[1 << 13];
+} OffCodecLink;
+
+/* Codec this end is configured to send with, from OFF_CODEC ("none", "zlib",
+ * "lz" or "auto").  Returns -1 for adaptive. */
+int offCodecConfigured();
+
+void offCodecLinkInit(OffCodecLink* link, u4 allowed);
+
+void offCodecLinkDestroy(OffCodecLink* link);
+
+/* Pick the codec for the next message from the measured link bandwidth and
+ * RTT and the measured cost and ratio of each codec. */
+int offCodecChoose(OffCodecLink* link);
+
+/* Worst case compressed size of n bytes with any codec. */
+u4 offCodecBound(u4 n);
+
+/* Compress the data described by iov into out, which must have room for
+ * offCodecBound bytes.  Returns the compressed size. */
+u4 offCodecCompress(OffCodecLink* link, int codec, const struct iovec* iov,
+                    u4 cnt, char* out, u4 cap);
+
+/* Decompress a message.  Returns the decompressed size or -1 if the data is
+ * corrupt or does not fit in cap bytes. */
+int offCodecDecompress(OffCodecLink* link, int codec, const char* in, u4 sz,
+                       char* out, u4 cap);
+
+/* Feed a bandwidth sample: bytes took usec to leave the socket. */
+void offCodecNoteTransfer(u4 bytes, u8 usec);
+
+#endif // OFFLOAD_CODEC_H
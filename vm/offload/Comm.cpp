@@ -2,29 +2,11 @@
 #include "alloc/HeapInternal.h"
 #include <sstream> 
 
-#include <sys/time.h>
-
-#define TIMER_BEGIN()                                                       \
-  u8             _end_time_us_;                                             \
-  struct timeval _start_time_;                                              \
-  struct timeval _end_time_;                                                \
-  gettimeofday(&_start_time_, NULL)
-
-#define TIMER_END(threadId, name, bytes, fields)                                      \
-  gettimeofday(&_end_time_, NULL);                                          \
-  _end_time_us_ = (_end_time_.tv_sec - _start_time_.tv_sec) * 1000000 +     \
-                     (_end_time_.tv_usec - _start_time_.tv_usec);           \
-  ALOGI("THREAD %d TIMER %s %lld.%06lld [%d bytes, %d fields]", threadId, name,                 \
-        _end_time_us_ / 1000000, _end_time_us_ % 1000000,                   \
-        (bytes), (fields))
-
-#define TIMER_RESET() \
-  gettimeofday(&_start_time_, NULL)
-
 #define READWRITEFUNC(type, size, ntoh, hton)                                 \
   static void write##size(FifoBuffer* fb, type v) {                           \
     v = hton(v);                                                              \
-    auxFifoPushData(fb, (char*)&v, sizeof(v));                                \
+    memcpy(auxFifoReserve(fb, sizeof(v)), &v, sizeof(v));                    \
+    auxFifoCommit(fb, sizeof(v));                                             \
   }                                                                           \
   static type read##size(FifoBuffer* fb) {                                    \
     type v;                                                                   \
@@ -40,9 +22,39 @@ READWRITEFUNC(u8, U8, ntohll, htonll);
 static std::stringstream converter;
 extern std::ifstream staticfile;
 
+/* A copy of the dirty state of one object taken while the VM is suspended.
+ * The payload holds the raw values of the dirty fields so that the object can
+ * be serialized after the mutators have been resumed. */
+typedef struct SyncRecord {
+  Object* obj;
+
+  /* Copies of the dirty bitmaps at the time of the capture. */
+  u4 dirty;
+  u4* bits;
+
+  /* Static field values, instance data, or the array contents starting at
+   * byte offset lo. */
+  char* data;
+  u4 lo;
+} SyncRecord;
+
+typedef struct SyncSnapshot {
+  Vector records;
+} SyncSnapshot;
+
+/* Link bandwidth to assume for the prefetch budget before it is measured. */
+#define PREFETCH_DEFAULT_BANDWIDTH (1 << 20)
+
+/* Wire cost of an object beyond its contents. */
+#define PREFETCH_OBJECT_BYTES 16
+
+/* Bytes left for arrays and strings sent whole by the current push. */
+static u4 prefetchBudget;
+
 static bool isObjectDirty(ObjectInfo* info);
 static bool isFieldDirty(ObjectInfo* info, u4 fieldIndex);
 static void writeValue(FifoBuffer* fb, char type, JValue* val);
+static u4 emitObject(FifoBuffer* fb, Object* obj, u4 dirty, const u4* bits);
   
 static bool isClassObject(Object* obj) {
   return obj->clazz == gDvm.classJavaLangClass;
@@ -63,34 +75,165 @@ Object* offIdToObject(u4 objId) {
   return info ? info->obj : NULL;
 }
 
+/* Number of dirty bits of obj in a sync, at the chunk shift in force. */
 static u4 getMaxFieldIndex(Object* obj) {
   if(isClassObject(obj)) {
     return ((ClassObject*)obj)->sfieldCount;
   } else if(*obj->clazz->descriptor == '[') {
-    return ((ArrayObject*)obj)->length;
+    ArrayObject* aobj = (ArrayObject*)obj;
+    return offIsChunkedArray(aobj) ?
+        offArrayChunkCount(aobj, gDvm.offArrayChunkShift) : aobj->length;
   } else {
     return (obj->clazz->objectSize - sizeof(Object)) >> 2;
   }
 }
 
+/* Number of dirty bits in info->bits, which may predate the chunk shift in
+ * force. */
+static u4 getTrackedFieldCount(ObjectInfo* info) {
+  Object* obj = info->obj;
+  if(!isClassObject(obj) && *obj->clazz->descriptor == '[') {
+    ArrayObject* aobj = (ArrayObject*)obj;
+    return info->chunkShift != 0 ?
+        offArrayChunkCount(aobj, info->chunkShift) : aobj->length;
+  }
+  return getMaxFieldIndex(obj);
+}
+
+/* Fix the chunk shift of a newly tracked object's dirty bits. */
+static void setChunkShift(ObjectInfo* info, Object* obj) {
+  info->chunkShift = !isClassObject(obj) && *obj->clazz->descriptor == '[' &&
+      offIsChunkedArray((ArrayObject*)obj) ? gDvm.offArrayChunkShift : 0;
+}
+
+/* True if info's dirty bits were sized for another chunk shift than the one
+ * in force, so they can't go over the wire as they are. */
+static bool isRechunked(ObjectInfo* info) {
+  Object* obj = info->obj;
+  if(isClassObject(obj) || *obj->clazz->descriptor != '[') return false;
+  ArrayObject* aobj = (ArrayObject*)obj;
+  return info->chunkShift !=
+      (offIsChunkedArray(aobj) ? gDvm.offArrayChunkShift : 0);
+}
+
 static bool addTrackedObjectIdLocked(Object* obj, u4 objId) {
   obj->objId = objId;
   u4 bid = GET_ID_NUM(objId);
   u4 ind = STRIP_ID_MASK(objId);
 
   /* Put the object into the table. */
-  ObjectInfo* info = offTableLockedGet(&gDvm.objTables[bid], ind);
+  ObjectInfo* info = offTableAcquire(&gDvm.objTables[bid], ind);
   if(info->obj && info->obj != obj) return false;
 
   assert(!info->obj);
+  setChunkShift(info, obj);
   u4 maxFields = getMaxFieldIndex(obj);
 
   info->obj = obj;
   info->dirty = 0;
   info->bits = maxFields > 32 ? (u4*)calloc((maxFields - 1) >> 5, 4)
                               : (u4*)NULL;
+  info->sendShadow = info->recvShadow = NULL;
   info->isQueued = false;
-  info->isVolatileOwner = info->isLockOwner = bid == GET_ID_NUM(gDvm.idMask);
+  info->isLockOwner = bid == GET_ID_NUM(gDvm.idMask);
+  info->volatileOwned = info->isLockOwner ? OFF_VOLATILE_ALL : 0;
+  info->lockFlips = 0;
+  info->lockSince = 0;
+  return true;
+}
+
+/* Reserve the next local object index.  Each thread takes indexes in blocks of
+ * OFF_ID_BLOCK so the common case touches no shared state.  Blocks come from
+ * the free slots found by the last track trim first and from indexes that
+ * have never been used after that. */
+static u4 nextObjectIndex() {
+  Thread* self = dvmThreadSelf();
+  if(self == NULL) {
+    return (u4)android_atomic_inc((volatile int32_t*)&gDvm.nextId);
+  }
+
+  /* A trim invalidates every block handed out before it. */
+  if(self->offIdEpoch != gDvm.offIdEpoch) {
+    self->offIdEpoch = gDvm.offIdEpoch;
+    self->offFreeIds = NULL;
+    self->offFreeIdCount = 0;
+    self->offIdNext = self->offIdEnd = 0;
+  }
+
+  if(self->offFreeIdCount > 0) {
+    return self->offFreeIds[--self->offFreeIdCount].i;
+  }
+  if(self->offIdNext == self->offIdEnd) {
+    u4 nfree = auxVectorSize(&gDvm.offFreeIds);
+    u4 pos = nfree <= gDvm.offFreeIdPos ? nfree :
+        (u4)android_atomic_add(OFF_ID_BLOCK,
+                               (volatile int32_t*)&gDvm.offFreeIdPos);
+    if(pos < nfree) {
+      self->offFreeIds = auxVectorArray(&gDvm.offFreeIds) + pos;
+      self->offFreeIdCount = nfree - pos < OFF_ID_BLOCK ? nfree - pos :
+                                                          OFF_ID_BLOCK;
+      return self->offFreeIds[--self->offFreeIdCount].i;
+    }
+    self->offIdNext = (u4)android_atomic_add(OFF_ID_BLOCK,
+                                            (volatile int32_t*)&gDvm.nextId);
+    self->offIdEnd = self->offIdNext + OFF_ID_BLOCK;
+  }
+  return self->offIdNext++;
+}
+
+/* Hand back the index just returned by nextObjectIndex so that the next call
+ * returns it again.  Without a thread the index stays unused until the next
+ * track trim finds its slot free. */
+static void releaseObjectIndex(u4 index) {
+  Thread* self = dvmThreadSelf();
+  if(self == NULL || self->offIdEpoch != gDvm.offIdEpoch) {
+    return;
+  }
+  if(self->offFreeIds != NULL &&
+     self->offFreeIds[self->offFreeIdCount].i == index) {
+    self->offFreeIdCount++;
+  } else if(self->offIdNext == index + 1) {
+    self->offIdNext--;
+  }
+}
+
+/* Give obj a fresh local identifier and mark all of its fields dirty.  This
+ * does not take offCommLock.  Returns false if another thread assigned obj an
+ * identifier first. */
+static bool assignObjectId(Object* obj) {
+  u4 bid = GET_ID_NUM(gDvm.idMask);
+  u4 objId;
+  ObjectInfo* info;
+  do {
+    objId = ADD_ID_MASK(nextObjectIndex());
+    info = offTableAcquire(&gDvm.objTables[bid], STRIP_ID_MASK(objId));
+  } while(android_atomic_release_cas(0, (int32_t)obj,
+                                     (volatile int32_t*)&info->obj) != 0);
+
+  setChunkShift(info, obj);
+  u4 maxFields = getMaxFieldIndex(obj);
+  memset(&info->dirty, 0xFF, sizeof(info->dirty));
+  info->bits = NULL;
+  if(maxFields > 32) {
+    info->bits = (u4*)malloc(((maxFields - 1) >> 5) << 2);
+    memset(info->bits, 0xFF, ((maxFields - 1) >> 5) << 2);
+  }
+  info->sendShadow = info->recvShadow = NULL;
+  info->isQueued = false;
+  info->isLockOwner = true;
+  info->volatileOwned = OFF_VOLATILE_ALL;
+  info->lockFlips = 0;
+  info->lockSince = 0;
+
+  /* Publishing the id makes the info structure visible to everyone else. */
+  if(android_atomic_release_cas((int32_t)COMM_INVALID_ID, (int32_t)objId,
+                                (volatile int32_t*)&obj->objId) != 0) {
+    free(info->bits);
+    info->bits = NULL;
+    android_atomic_release_store(0, (volatile int32_t*)&info->obj);
+    releaseObjectIndex(STRIP_ID_MASK(objId));
+    return false;
+  }
   return true;
 }
 
@@ -111,20 +254,11 @@ void offAddTrackedObject(Object* obj) {
   } else if(obj->objId == COMM_INVALID_ID) {
     /* Otherwise we do the normal process of allocating an object identifier and
      * setting up a data structure for it. */
-    pthread_mutex_lock(&gDvm.offCommLock);
-    while(!addTrackedObjectIdLocked(obj, ADD_ID_MASK(gDvm.nextId++)));
-
-    u4 maxField = getMaxFieldIndex(obj);
-    ObjectInfo* info = offIdObjectInfo(obj->objId);
-    memset(&info->dirty, 0xFF, sizeof(info->dirty));
-    if(maxField > 32) {
-      memset(info->bits, 0xFF, ((maxField - 1) >> 5) << 2);
-    }
-
-    if(gDvm.isServer) {
+    if(assignObjectId(obj) && gDvm.isServer) {
+      pthread_mutex_lock(&gDvm.offCommLock);
       offAddToWriteQueueLocked(obj);
+      pthread_mutex_unlock(&gDvm.offCommLock);
     }
-    pthread_mutex_unlock(&gDvm.offCommLock);
   }
 }
 
@@ -132,17 +266,7 @@ void offAddVectorIntoTrack(std::vector<Object*>* objVec, FifoBuffer* fb) {
   for(unsigned int i = 0; i < objVec->size(); i++) {
     Object* obj = objVec->at(i);
     if(obj->objId == COMM_INVALID_ID) {
-      pthread_mutex_lock(&gDvm.offCommLock);
-      while(!addTrackedObjectIdLocked(obj, ADD_ID_MASK(gDvm.nextId++)));
-
-      u4 maxField = getMaxFieldIndex(obj);
-      ObjectInfo* info = offIdObjectInfo(obj->objId);
-      memset(&info->dirty, 0xFF, sizeof(info->dirty));
-      if(maxField > 32) {
-        memset(info->bits, 0xFF, ((maxField - 1) >> 5) << 2);
-      }
-
-      pthread_mutex_unlock(&gDvm.offCommLock);
+      assignObjectId(obj);
     }
     ObjectInfo* info = offIdObjectInfo(obj->objId);
     // it has been marked as migrate all before, do not need to handle it again
@@ -156,35 +280,16 @@ void offAddVectorIntoTrack(std::vector<Object*>* objVec, FifoBuffer* fb) {
       pthread_mutex_unlock(&gDvm.offCommLock);
     }
     bool isDirty = isObjectDirty(info);
-    u4 maxIndex;
     if(isDirty) {
-      // write object info
-      /* Write the object definition. */
-      JValue valobj; valobj.l = obj;
-      writeValue(fb, 'L', &valobj);  
-          
-      /* Write the dirty bits. */
-      maxIndex = getMaxFieldIndex(obj);
-      writeU4(fb, info->dirty);
-      //ALOGE("offloading send: object id: %d, dirty: %u", obj->objId, info->dirty);
-      if(maxIndex > 32) {
-        u4 bsz = (maxIndex - 1) >> 5;
-        for(u4 j = 0; j < bsz; j++) {
-          writeU4(fb, info->bits[j]);
-          //ALOGE("offloading send: object id: %d, dirty bits j: %d, value: %u", obj->objId, j, info->bits[j]);
-        }
-      }
+      emitObject(fb, obj, info->dirty, info->bits);
     }
     if(isClassObject(obj)) {
-      /* To sync class objects we just write out all of its globals. */
+      /* Follow all of the globals of the class. */
       ClassObject* clazz = (ClassObject*)obj;
 
       StaticField* fld = clazz->sfields;
       StaticField* efld = fld + clazz->sfieldCount;
       for(; fld != efld; ++fld) {
-        if(isFieldDirty(info, fld - clazz->sfields)) {
-          writeValue(fb, *fld->signature, (JValue*)&fld->value);
-        }
         if(*fld->signature != '[' && *fld->signature != 'L') {
           continue;
         }
@@ -197,15 +302,11 @@ void offAddVectorIntoTrack(std::vector<Object*>* objVec, FifoBuffer* fb) {
     } else {
       ClassObject* clazz = obj->clazz;
       if(*clazz->descriptor != '[') {
-        /* For normal class objects we write out all the instance fields. */
+        /* For normal class objects we follow all the instance fields. */
         for(; clazz; clazz = clazz->super) {
           InstField* fld = clazz->ifields;
           InstField* efld = fld + clazz->ifieldCount;
           for(; fld != efld; ++fld) {
-            if(isFieldDirty(info, (fld->byteOffset - sizeof(Object)) >> 2)) {
-              writeValue(fb, *fld->signature,
-                       (JValue*)(((char*)obj) + fld->byteOffset));
-            }
             if(*fld->signature != '[' && *fld->signature != 'L') {
               continue;
             }
@@ -217,20 +318,13 @@ void offAddVectorIntoTrack(std::vector<Object*>* objVec, FifoBuffer* fb) {
           }
         }
       } else {
-        /* For array objects we send the whole array contents for now. */
+        /* For arrays of references we follow the whole array contents. */
         ArrayObject* aobj = (ArrayObject*)obj;
-        char* contents = (char*)aobj->contents;
+        Object** contents = (Object**)(void*)aobj->contents;
         char type = aobj->clazz->descriptor[1];
-        u4 typeWidth = auxTypeWidth(type);
-        for(u4 j = 0; j < aobj->length; j++, contents += typeWidth) {
-          if(isFieldDirty(info, j)) {
-            writeValue(fb, aobj->clazz->descriptor[1], (JValue*)contents);
-          }
-          if(type != '[' && type != 'L') {
-            continue;
-          }
-          JValue* val = (JValue*) contents;
-          Object* fldObj = (Object*) val->l;
+        for(u4 j = 0; (type == '[' || type == 'L') && j < aobj->length;
+            j++) {
+          Object* fldObj = contents[j];
           if(fldObj != NULL) {
             objVec->push_back(fldObj);
           }
@@ -239,7 +333,7 @@ void offAddVectorIntoTrack(std::vector<Object*>* objVec, FifoBuffer* fb) {
     }
     if(isDirty) {
         info->dirty = 0;
-        u4 maxIndex = getMaxFieldIndex(obj);
+        u4 maxIndex = getTrackedFieldCount(info);
         if(maxIndex > 32) {
           u4 bsz = (maxIndex - 1) >> 5;
           for(u4 j = 0; j < bsz; j++) {
@@ -250,6 +344,70 @@ void offAddVectorIntoTrack(std::vector<Object*>* objVec, FifoBuffer* fb) {
     }
 }
 
+/* Returns the dirty mask of info restricted to the fields selected by the
+ * static access analysis in objAccInfo.  The high bits are written into
+ * hbits which must have room for all of the object's high words. */
+static u4 maskDirtyBits(ObjectInfo* info, ObjectAccResult* objAccInfo,
+                        u4 bsz, std::vector<u4>* hbits) {
+  u4 asz = objAccInfo->fieldSet.empty() ? 0 :
+      (objAccInfo->fieldSet.size() - 1) >> 5;
+  hbits->assign(bsz, 0);
+  for(u4 j = 0; j < bsz && j < asz; j++) {
+    (*hbits)[j] = info->bits[j] & objAccInfo->highbits[j];
+  }
+  return info->dirty & objAccInfo->migrate;
+}
+
+/* The prefetch budget of a push is what the link carries in one round trip.
+ * Sending that much more costs no more than the single pull that would fault
+ * in something left out. */
+static void prefetchBegin() {
+  u8 bw = gDvm.offNetBandwidth ? gDvm.offNetBandwidth :
+                                 PREFETCH_DEFAULT_BANDWIDTH;
+  u8 bytes = bw * gDvm.offNetRTT / 1000000;
+  prefetchBudget = bytes < gDvm.offPrefetchMax ? (u4)bytes :
+                                                 gDvm.offPrefetchMax;
+}
+
+/* Returns true if the walk of the current push would write out obj, which
+ * it does for objects new to the other end or changed since last sent. */
+static bool prefetchPending(Object* obj) {
+  if(obj->objId == COMM_INVALID_ID) return true;
+  ObjectInfo* info = offIdObjectInfo(obj->objId);
+  return !info->isQueued && isObjectDirty(info);
+}
+
+/* Returns true if obj, reached through the access analysis, is an array or
+ * string that fits in what is left of the prefetch budget.  Those are sent
+ * whole rather than left to be pulled over once the method touches them.
+ * Only the parts that are actually written are charged to the budget, so a
+ * string whose contents the other end already has costs nothing. */
+static bool prefetchWhole(Object* obj, ObjectInfo* info) {
+  if(isClassObject(obj)) return false;
+
+  u4 bytes = 0;
+  if(*obj->clazz->descriptor == '[') {
+    if(!isObjectDirty(info)) return false;
+    ArrayObject* aobj = (ArrayObject*)obj;
+    bytes = aobj->length * auxTypeWidth(aobj->clazz->descriptor[1]) +
+            PREFETCH_OBJECT_BYTES;
+  } else if(obj->clazz == gDvm.classJavaLangString) {
+    if(isObjectDirty(info)) {
+      bytes += obj->clazz->objectSize + PREFETCH_OBJECT_BYTES;
+    }
+    ArrayObject* value =
+        (ArrayObject*)dvmGetFieldObject(obj, STRING_FIELDOFF_VALUE);
+    if(value != NULL && prefetchPending((Object*)value)) {
+      bytes += value->length * 2 + PREFETCH_OBJECT_BYTES;
+    }
+  } else {
+    return false;
+  }
+  if(bytes > prefetchBudget) return false;
+  prefetchBudget -= bytes;
+  return true;
+}
+
 void offAddObjectIntoTrack(Object* objToAdd, ObjectAccResult* objAccInfoToAdd, FifoBuffer* fb) {
   if(objToAdd == NULL) {
     return;
@@ -258,7 +416,17 @@ void offAddObjectIntoTrack(Object* objToAdd, ObjectAccResult* objAccInfoToAdd, F
   objVec.push_back(objToAdd);
   ObjectAccResult flagAllObj;
   flagAllObj.allFlag = true;
+  /* Marks arrays and strings sent whole by the prefetch.  The elements of a
+   * prefetched array get no fields of their own but may be prefetched in
+   * turn. */
+  ObjectAccResult prefetchObj;
+  prefetchObj.allFlag = true;
+  ObjectAccResult elementObj;
+  elementObj.allFlag = false;
+  elementObj.migrate = 0;
+  elementObj.highbits = NULL;
   std::vector<ObjectAccResult*> objAccVec;
+  std::vector<u4> hbits;
   if(objAccInfoToAdd != NULL) {
     objAccVec.push_back(objAccInfoToAdd);
   } else {
@@ -268,51 +436,34 @@ void offAddObjectIntoTrack(Object* objToAdd, ObjectAccResult* objAccInfoToAdd, F
     Object* obj = objVec[i];
     ObjectAccResult* objAccInfo = objAccVec[i];
     if(obj->objId == COMM_INVALID_ID) {
-      pthread_mutex_lock(&gDvm.offCommLock);
-      while(!addTrackedObjectIdLocked(obj, ADD_ID_MASK(gDvm.nextId++)));
-
-      u4 maxField = getMaxFieldIndex(obj);
-      ObjectInfo* info = offIdObjectInfo(obj->objId);
-      memset(&info->dirty, 0xFF, sizeof(info->dirty));
-      if(maxField > 32) {
-        memset(info->bits, 0xFF, ((maxField - 1) >> 5) << 2);
-      }
-
-      pthread_mutex_unlock(&gDvm.offCommLock);
+      assignObjectId(obj);
     }
     ObjectInfo* info = offIdObjectInfo(obj->objId);
     // it has been marked as migrate all before, do not need to handle it again
     if(info->isQueued) {
       continue;
     }
+    if(!objAccInfo->allFlag && prefetchWhole(obj, info)) {
+      objAccInfo = &prefetchObj;
+    }
     if(!objAccInfo->allFlag) { // this indicates we don't need to migrate all the information
       bool isDirty = isObjectDirty(info);
-      u4 maxIndex = 0;
+      u4 maxIndex = getTrackedFieldCount(info);
+      u4 bsz = maxIndex > 32 ? (maxIndex - 1) >> 5 : 0;
+      bool isArray = !isClassObject(obj) && *obj->clazz->descriptor == '[';
       if(isDirty) {
-        // write object info
-        /* Write the object definition. */
-        JValue valobj; valobj.l = obj;
-        writeValue(fb, 'L', &valobj);  
-          
-        /* Write the dirty bits. */
-        maxIndex = getMaxFieldIndex(obj);
-        writeU4(fb, info->dirty & objAccInfo->migrate);
-        //ALOGE("offloading send: object id: %d, dirty: %u", obj->objId, info->dirty & info->migrate);
-        if(maxIndex > 32) {
-          u4 bsz = (maxIndex - 1) >> 5;
-          u4 asz = (objAccInfo->fieldSet.size() - 1) >> 5;
-          for(u4 j = 0; j < bsz; j++) {
-            if(j < asz) {
-              writeU4(fb, info->bits[j] & objAccInfo->highbits[j]);
-            } else {
-              writeU4(fb, 0);
-            }
-            //ALOGE("offloading send: object id: %d, dirty bits j: %d, value: %u", obj->objId, j, info->bits[j] & info->highbits[j]);
-          }
+        /* For array, the static analysis will only treat it as migrate all or
+         * not migrate so nothing of a partial array goes over. */
+        if(isArray) {
+          hbits.assign(bsz, 0);
+          emitObject(fb, obj, 0, bsz ? &hbits[0] : NULL);
+        } else {
+          u4 dirty = maskDirtyBits(info, objAccInfo, bsz, &hbits);
+          emitObject(fb, obj, dirty, bsz ? &hbits[0] : NULL);
         }
       }
       if(isClassObject(obj)) {
-        /* To sync class objects we just write out all of its globals. */
+        /* Follow the globals selected by the analysis. */
         ClassObject* clazz = (ClassObject*)obj;
         
         StaticField* fld = clazz->sfields;
@@ -321,9 +472,6 @@ void offAddObjectIntoTrack(Object* objToAdd, ObjectAccResult* objAccInfoToAdd, F
           if(objAccInfo->fieldSet[offset] == NULL) {
             continue;
           }
-          if(isFieldDirty(info, fld - clazz->sfields)) {
-            writeValue(fb, *fld->signature, (JValue*)&fld->value);
-          }
           if(*fld->signature != '[' && *fld->signature != 'L') {
             continue;
           }
@@ -334,70 +482,37 @@ void offAddObjectIntoTrack(Object* objToAdd, ObjectAccResult* objAccInfoToAdd, F
             objAccVec.push_back(objAccInfo->fieldSet[offset]);
           }
         }
-      } else {
+      } else if(!isArray) {
+        /* For normal class objects we follow the selected instance fields. */
         ClassObject* clazz = obj->clazz;
-        if(*clazz->descriptor != '[') {
-          /* For normal class objects we write out all the instance fields. */
-          for(; clazz; clazz = clazz->super) {
-            InstField* fld = clazz->ifields;
-            InstField* efld = fld + clazz->ifieldCount;
-            for(; fld != efld; ++fld) {
-              unsigned int offset = (fld->byteOffset - sizeof(Object)) >> 2;
-              if(objAccInfo->fieldSet.size() <= offset || objAccInfo->fieldSet[offset] == NULL) {
-                continue;
-              }
-              if(isFieldDirty(info, (fld->byteOffset - sizeof(Object)) >> 2)) {
-                writeValue(fb, *fld->signature,
-                         (JValue*)(((char*)obj) + fld->byteOffset));
-              }
-              if(*fld->signature != '[' && *fld->signature != 'L') {
-                continue;
-              }
-              JValue* val = (JValue*) ((char*)obj + fld->byteOffset);
-              Object* fldObj = (Object*) val->l;
-              if(fldObj != NULL) {
-                objVec.push_back(fldObj);
-                objAccVec.push_back(objAccInfo->fieldSet[offset]);
-              }
-            }
-          }
-        } else {
-          // For array, the static analysis will only treat it as migrate all or not migrate
-          if(!objAccInfo->allFlag) {
-            continue;
-          }
-          /* For array objects we send the whole array contents for now. */
-          ArrayObject* aobj = (ArrayObject*)obj;
-          char* contents = (char*)aobj->contents;
-          char type = aobj->clazz->descriptor[1];
-          u4 typeWidth = auxTypeWidth(type);
-          for(u4 j = 0; j < aobj->length; j++, contents += typeWidth) {
-            if(isFieldDirty(info, j)) {
-              writeValue(fb, aobj->clazz->descriptor[1], (JValue*)contents);
+        for(; clazz; clazz = clazz->super) {
+          InstField* fld = clazz->ifields;
+          InstField* efld = fld + clazz->ifieldCount;
+          for(; fld != efld; ++fld) {
+            unsigned int offset = (fld->byteOffset - sizeof(Object)) >> 2;
+            if(objAccInfo->fieldSet.size() <= offset || objAccInfo->fieldSet[offset] == NULL) {
+              continue;
             }
-            if(type != '[' && type != 'L') {
+            if(*fld->signature != '[' && *fld->signature != 'L') {
               continue;
             }
-            JValue* val = (JValue*) contents;
+            JValue* val = (JValue*) ((char*)obj + fld->byteOffset);
             Object* fldObj = (Object*) val->l;
             if(fldObj != NULL) {
               objVec.push_back(fldObj);
-              objAccVec.push_back(&flagAllObj);
+              objAccVec.push_back(objAccInfo->fieldSet[offset]);
             }
           }
         }
+      } else {
+        continue;
       }
       if(isDirty) {
+        u4 asz = objAccInfo->fieldSet.empty() ? 0 :
+            (objAccInfo->fieldSet.size() - 1) >> 5;
         info->dirty = info->dirty & ~objAccInfo->migrate;
-        if(maxIndex > 32) {
-          u4 maxIndex = getMaxFieldIndex(obj);
-          u4 bsz = (maxIndex - 1) >> 5;
-          u4 asz = (objAccInfo->fieldSet.size() - 1) >> 5;
-          for(u4 j = 0; j < bsz; j++) {
-            if(j < asz) {
-              info->bits[j] = info->bits[j] & ~objAccInfo->highbits[j];
-            }
-          }
+        for(u4 j = 0; j < bsz && j < asz; j++) {
+          info->bits[j] = info->bits[j] & ~objAccInfo->highbits[j];
         }
       }
     } else {
@@ -408,35 +523,17 @@ void offAddObjectIntoTrack(Object* objToAdd, ObjectAccResult* objAccInfoToAdd, F
         pthread_mutex_unlock(&gDvm.offCommLock);
       }
       bool isDirty = isObjectDirty(info);
-      u4 maxIndex = 0;
+      u4 maxIndex = getTrackedFieldCount(info);
       if(isDirty) {
-        // write object info
-        /* Write the object definition. */
-        JValue valobj; valobj.l = obj;
-        writeValue(fb, 'L', &valobj);  
-          
-        /* Write the dirty bits. */
-        maxIndex = getMaxFieldIndex(obj);
-        writeU4(fb, info->dirty);
-        //ALOGE("offloading send: object id: %d, dirty: %u", obj->objId, info->dirty);
-        if(maxIndex > 32) {
-          u4 bsz = (maxIndex - 1) >> 5;
-          for(u4 j = 0; j < bsz; j++) {
-            writeU4(fb, info->bits[j]);
-            //ALOGE("offloading send: object id: %d, dirty bits j: %d, value: %u", obj->objId, j, info->bits[j]);
-          }
-        }
+        emitObject(fb, obj, info->dirty, info->bits);
       }
       if(isClassObject(obj)) {
-        /* To sync class objects we just write out all of its globals. */
+        /* Follow all of the globals of the class. */
         ClassObject* clazz = (ClassObject*)obj;
 
         StaticField* fld = clazz->sfields;
         StaticField* efld = fld + clazz->sfieldCount;
         for(; fld != efld; ++fld) {
-          if(isFieldDirty(info, fld - clazz->sfields)) {
-            writeValue(fb, *fld->signature, (JValue*)&fld->value);
-          }
           if(*fld->signature != '[' && *fld->signature != 'L') {
             continue;
           }
@@ -450,15 +547,11 @@ void offAddObjectIntoTrack(Object* objToAdd, ObjectAccResult* objAccInfoToAdd, F
       } else {
         ClassObject* clazz = obj->clazz;
         if(*clazz->descriptor != '[') {
-          /* For normal class objects we write out all the instance fields. */
+          /* For normal class objects we follow all the instance fields. */
           for(; clazz; clazz = clazz->super) {
             InstField* fld = clazz->ifields;
             InstField* efld = fld + clazz->ifieldCount;
             for(; fld != efld; ++fld) {
-              if(isFieldDirty(info, (fld->byteOffset - sizeof(Object)) >> 2)) {
-                writeValue(fb, *fld->signature,
-                         (JValue*)(((char*)obj) + fld->byteOffset));
-              }
               if(*fld->signature != '[' && *fld->signature != 'L') {
                 continue;
               }
@@ -471,23 +564,17 @@ void offAddObjectIntoTrack(Object* objToAdd, ObjectAccResult* objAccInfoToAdd, F
             }
           }
         } else {
-          /* For array objects we send the whole array contents for now. */
+          /* For arrays of references we follow the whole array contents. */
           ArrayObject* aobj = (ArrayObject*)obj;
-          char* contents = (char*)aobj->contents;
+          Object** contents = (Object**)(void*)aobj->contents;
           char type = aobj->clazz->descriptor[1];
-          u4 typeWidth = auxTypeWidth(type);
-          for(u4 j = 0; j < aobj->length; j++, contents += typeWidth) {
-            if(isFieldDirty(info, j)) {
-              writeValue(fb, aobj->clazz->descriptor[1], (JValue*)contents);
-            }
-            if(type != '[' && type != 'L') {
-              continue;
-            }
-            JValue* val = (JValue*) contents;
-            Object* fldObj = (Object*) val->l;
+          for(u4 j = 0; (type == '[' || type == 'L') && j < aobj->length;
+              j++) {
+            Object* fldObj = contents[j];
             if(fldObj != NULL) {
               objVec.push_back(fldObj);
-              objAccVec.push_back(&flagAllObj);
+              objAccVec.push_back(objAccInfo == &prefetchObj ? &elementObj :
+                                                               &flagAllObj);
             }
           }
         }
@@ -521,15 +608,85 @@ void pushAllClazzInfo(FifoBuffer* fb) {
   //ALOGE("sync scan class time with scan loaded classes is: %llu", endtime-starttime);
 }
 
-void pushClazzInfo(const Method* method, char* key, FifoBuffer* fb) {
-  if(gDvm.methodClzOffsetMap->find(key) == gDvm.methodClzOffsetMap->end()) {
-   // ALOGE("sync scan class cannot find the specified key, the key is: %s", key);
+/* Push the static fields of descriptor that the analysis marked in words,
+ * size being the number of fields the analysis saw. */
+static void pushClassAccess(const Method* method, int byteOffset,
+                            const char* descriptor, u4 size, const u4* words,
+                            std::vector<Object*>* objVec, FifoBuffer* fb) {
+  Object* classLoader = method->clazz->classLoader;
+  ClassObject* clazz;
+  do {
+    clazz = dvmLookupClass(descriptor, classLoader, false);
+    if(classLoader == NULL) {
+      break;
+    }
+    JValue* val = (JValue*) ((char*)classLoader + byteOffset);
+    classLoader = (Object*) val->l;
+  } while(clazz == NULL);
+  if(clazz == NULL || size == 0) {
+    return;
+  }
+
+  u4 sz = ((size - 1) >> 5) + 1;
+  u4 maxFields = clazz->sfieldCount;
+  u4 fsz = maxFields > 32 ? (maxFields - 1) >> 5 : 0;
+  u4 migrate = 0;
+  u4* highbits = maxFields > 32 ? (u4*)calloc(fsz, 4) : (u4*)NULL;
+  for(u4 i = 0; i < sz; i++) {
+    u4 accInfo = words[i];
+    if(i == 0) {
+      migrate = accInfo;
+    } else if(i - 1 < fsz) {
+      highbits[i - 1] = accInfo;
+    }
+    for(int j = 0; j < 31; j++) {
+      if(((accInfo >> j) & 0x1) != 0) {
+        StaticField* fld = clazz->sfields + (i * 32 + j);
+        if(*fld->signature == '[' || *fld->signature == 'L') {
+          JValue* val = &fld->value;
+          Object* fldObj = (Object*) val->l;
+          if(fldObj != NULL) {
+            objVec->push_back(fldObj);
+          }
+        }
+      }
+    }
+  }
+  if(!clazz->offInfo.isQueued) {
+    pthread_mutex_lock(&gDvm.offCommLock);
+    clazz->offInfo.isQueued = true;
+    offAddToWriteQueueLocked(clazz);
+    pthread_mutex_unlock(&gDvm.offCommLock);
+  }
+  bool isDirty = isObjectDirty(&clazz->offInfo);
+  if(isDirty) {
+    std::vector<u4> hbits;
+    if(maxFields > 32) {
+      for(u4 j = 0; j < fsz; j++) {
+        hbits.push_back(clazz->offInfo.bits[j] & highbits[j]);
+      }
+    }
+    emitObject(fb, clazz, clazz->offInfo.dirty & migrate,
+               hbits.empty() ? NULL : &hbits[0]);
+
+    clazz->offInfo.dirty = clazz->offInfo.dirty & ~migrate;
+    if(maxFields > 32) {
+      for(u4 j = 0; j < fsz; j++) {
+        clazz->offInfo.bits[j] = clazz->offInfo.bits[j] & ~highbits[j];
+      }
+    }
+  }
+  if(highbits != NULL) {
+    free(highbits);
+  }
+}
+
+void pushClazzInfo(const Method* method, FifoBuffer* fb) {
+  MethodSlot* slot = offGetMethodSlot(method);
+  if(!slot->hasClasses) {
     pushAllClazzInfo(fb);
     return;
   }
-  //u8 starttime = dvmGetRelativeTimeUsec();
-  //u4 classCount = 0;
-  //u4 actualCount = 0;
   ClassObject* classLoaderClazz = dvmFindSystemClass("Ljava/lang/ClassLoader;");
   InstField* fld,* efld;
   int byteOffset = 0;
@@ -540,207 +697,577 @@ void pushClazzInfo(const Method* method, char* key, FifoBuffer* fb) {
       break;
     }
   }
-  //u4 timeusedforfile = 0;
-  //u4 timeusedforparse = 0;
-  //u4 timeusedforadd = 0;
-  //u8 fstart = dvmGetRelativeTimeUsec();
-  staticfile.seekg((*gDvm.methodClzOffsetMap)[key]);
-  std::string line;
-  // read the method name info
-  std::getline(staticfile, line);
-  //u8 fend = dvmGetRelativeTimeUsec();
- // timeusedforfile+= fend-fstart;
   std::vector<Object*>* objVec = new std::vector<Object*>();
-  while(true) {
-    //classCount++;
- // u8 fstart = dvmGetRelativeTimeUsec();
-    std::getline(staticfile, line);
- // u8 fend = dvmGetRelativeTimeUsec();
-  //timeusedforfile+= fend-fstart;
-    if(line.compare("") == 0) {
-      break;
+  if(offAnalysisImageLoaded()) {
+    /* The records are read straight out of the mapped image. */
+    const char* descriptor;
+    u4 size;
+    const u4* words;
+    AnalysisClassIter iter = slot->classes;
+    while(offAnalysisNextClass(&iter, &descriptor, &size, &words)) {
+      pushClassAccess(method, byteOffset, descriptor, size, words, objVec, fb);
     }
-    Object* classLoader = method->clazz->classLoader;
-    ClassObject* clazz;
-    do {
-      clazz = dvmLookupClass(line.c_str(), classLoader, false);
-      if(classLoader == NULL) {
+  } else {
+    staticfile.seekg(slot->classOffset);
+    std::string line;
+    // read the method name info
+    std::getline(staticfile, line);
+    std::vector<u4> words;
+    while(true) {
+      std::getline(staticfile, line);
+      if(line.compare("") == 0) {
         break;
       }
-      JValue* val = (JValue*) ((char*)classLoader + byteOffset);
-      classLoader = (Object*) val->l;
-    } while(clazz == NULL);
-  //fstart = dvmGetRelativeTimeUsec();
-    std::getline(staticfile, line);
-  //fend = dvmGetRelativeTimeUsec();
-  //timeusedforfile+= fend-fstart;
- // u8 pstart = dvmGetRelativeTimeUsec();
-    if(clazz != NULL) {
-    //  actualCount++;
+      std::string descriptor = line;
+      std::getline(staticfile, line);
       converter.str(line);
-      u4 size;
+      u4 size = 0;
       converter >> size;
-      //ALOGE("size is %d, size != 0 is %d, clazz is: %s", size, size!=0, clazz->descriptor);
-      u4 sz = ((size - 1) >> 5) + 1;
-      u4 maxFields = clazz->sfieldCount;
-      u4 fsz = (maxFields - 1) >> 5;
-      u4 migrate;
-      u4* highbits = maxFields > 32 ? (u4*)calloc(fsz, 4) : (u4*)NULL;
-      for(u4 i = 0; i < sz; i++) {
-        u4 accInfo;
+      words.clear();
+      for(u4 i = 0; size != 0 && i < ((size - 1) >> 5) + 1; i++) {
+        u4 accInfo = 0;
         converter >> accInfo;
-        if(i == 0) {
-          migrate = accInfo;
-        } else {
-          highbits[i - 1] = accInfo;
-        }
-        for(int j = 0; j < 31; j++) {
-          if(((accInfo >> j) & 0x1) != 0) {
-            StaticField* fld = clazz->sfields + (i * 32 + j);
-            if(*fld->signature == '[' || *fld->signature == 'L') {
-              JValue* val = &fld->value;
-              Object* fldObj = (Object*) val->l;
-              if(fldObj != NULL) {
-                //offAddObjectIntoTrack(fldObj, NULL);
-                objVec->push_back(fldObj);
-              }
-            }
-          }
-        }
+        words.push_back(accInfo);
       }
       converter.str("");
       converter.clear();
-      if(!clazz->offInfo.isQueued) {
-        pthread_mutex_lock(&gDvm.offCommLock);
-        clazz->offInfo.isQueued = true;
-        offAddToWriteQueueLocked(clazz);
-        pthread_mutex_unlock(&gDvm.offCommLock);
+      pushClassAccess(method, byteOffset, descriptor.c_str(), size,
+                      words.empty() ? NULL : &words[0], objVec, fb);
+    }
+  }
+  offAddVectorIntoTrack(objVec, fb);
+  delete(objVec);
+}
+
+static bool isObjectDirty(ObjectInfo* info) {
+  if(info->dirty != 0) {
+    return true;
+  }
+  u4 maxFields = getTrackedFieldCount(info);
+  if(maxFields > 32) {
+    u4 fsz = (maxFields - 1) >> 5;
+    for(u4 i = 0; i < fsz; i++) {
+      if(*(info->bits + i) != 0) {
+        return true;
       }
-      bool isDirty = isObjectDirty(&clazz->offInfo);
-      if(isDirty) {
-        // write object info
-        /* Write the object definition. */
-        JValue valobj; valobj.l = clazz;
-        writeValue(fb, 'L', &valobj);  
-          
-        /* Write the dirty bits. */
-        writeU4(fb, clazz->offInfo.dirty & migrate);
-        //ALOGE("offloading send: object id: %d, dirty: %u", clazz->objId, clazz->offInfo.dirty & migrate);
-        if(maxFields > 32) {
-          for(u4 j = 0; j < fsz; j++) {
-            writeU4(fb, clazz->offInfo.bits[j] & highbits[j]);
-            //ALOGE("offloading send: object id: %d, dirty bits j: %d, value: %u", clazz->objId, j, clazz->offInfo.bits[j] & highbits[j]);
-          }
+    }
+  }
+  return false;
+}
+
+static bool isFieldDirtyRaw(u4 dirty, const u4* bits, u4 fieldIndex) {
+  if(fieldIndex < 32) {
+    return (dirty & 1U << fieldIndex) != 0;
+  }
+  return (bits[(fieldIndex - 32) >> 5] & (1U << (fieldIndex & 0x1F))) != 0;
+}
+
+static bool isFieldDirty(ObjectInfo* info, u4 fieldIndex) {
+  return isFieldDirtyRaw(info->dirty, info->bits, fieldIndex);
+}
+
+/* Only allowed in sync operations.  Clear a dirty bit.  Intended to be used in
+ * syncPull when the other endpoint overwrites something. */
+static void clearDirty(ObjectInfo* info, u4 fieldIndex) {
+  if(fieldIndex < 32) {
+    info->dirty &= ~(1U << fieldIndex);
+  } else {
+    info->bits[(fieldIndex - 32) >> 5] &= ~(1U << (fieldIndex & 0x1F));
+  }
+}
+
+static void writeValue(FifoBuffer* fb, char type, JValue* val) {
+  switch(type) {
+    case 'Z': writeU1(fb, val->z); break;
+    case 'B': writeU1(fb, val->b); break;
+    case 'C': writeU2(fb, val->c); break;
+    case 'S': writeU2(fb, val->s); break;
+    case 'F': case 'I': writeU4(fb, val->i); break;
+    case 'D': case 'J': writeU8(fb, val->j); break;
+    case '[': case 'L': {
+      Object* obj = (Object*)val->l;
+      if(obj != NULL) {
+        u4 objId = auxObjectToId(obj);
+        if(objId == COMM_INVALID_ID) {
+          offAddTrackedObject(obj);
+          objId = auxObjectToId(obj);
         }
+        assert(objId != COMM_INVALID_ID);
+
+        writeU4(fb, auxObjectToId((Object*)obj->clazz));
+        writeU4(fb, objId);
+        /*if(isClassObject(obj)) {        
+            ALOGE("write object clazz id: %d, descriptor: %s", auxObjectToId((Object*)obj->clazz), obj->clazz->descriptor);
+            ALOGE("write object instance id: %d, descriptor: %s", objId, ((ClassObject*)obj)->descriptor);
+        }*/
+        if(*obj->clazz->descriptor == '[') {
+          ArrayObject* aobj = (ArrayObject*)obj;
+          writeU4(fb, aobj->length);
+          //ALOGE("write array instance length: %d", aobj->length);
+        }
+      } else {
+        writeU4(fb, COMM_INVALID_ID);
       }
+    } break;
+    default: assert(0 && "unexpected type");
+  }
+}
 
-      StaticField* fld = clazz->sfields;
-      StaticField* efld = fld + clazz->sfieldCount;
+/* A dirty field of a class or instance object in wire order. */
+typedef struct FieldRef {
+  u4 index;
+  char type;
+  JValue* val;
+} FieldRef;
+
+/* Collect the fields of a class or instance object selected by dirty and bits
+ * in the order they go on the wire.  If data is non-NULL the values point into
+ * a snapshot taken by captureObject. */
+static void collectFields(Object* obj, u4 dirty, const u4* bits,
+                          const char* data, std::vector<FieldRef>* out) {
+  out->clear();
+  if(isClassObject(obj)) {
+    ClassObject* clazz = (ClassObject*)obj;
+    JValue* vals = (JValue*)(void*)data;
+    for(u4 j = 0; j < (u4)clazz->sfieldCount; j++) {
+      if(isFieldDirtyRaw(dirty, bits, j)) {
+        StaticField* fld = clazz->sfields + j;
+        FieldRef ref = { j, *fld->signature,
+                         vals ? &vals[j] : (JValue*)&fld->value };
+        out->push_back(ref);
+      }
+    }
+  } else {
+    char* base = data ? (char*)data - sizeof(Object) : (char*)obj;
+    for(ClassObject* clazz = obj->clazz; clazz; clazz = clazz->super) {
+      InstField* fld = clazz->ifields;
+      InstField* efld = fld + clazz->ifieldCount;
       for(; fld != efld; ++fld) {
-        u4 offset = fld - clazz->sfields;
-        if(isFieldDirty(&clazz->offInfo, offset)) {
-          if((offset < 32 && (((migrate >> offset) & 0x1) != 0))
-            || (offset >= 32 && ((highbits[(offset - 32) >> 5] & (1U << (offset & 0x1F))) != 0))) {
-            writeValue(fb, *fld->signature, (JValue*)&fld->value);
-          }
+        u4 fieldIndex = (fld->byteOffset - sizeof(Object)) >> 2;
+        if(isFieldDirtyRaw(dirty, bits, fieldIndex)) {
+          FieldRef ref = { fieldIndex, *fld->signature,
+                           (JValue*)(base + fld->byteOffset) };
+          out->push_back(ref);
         }
       }
-      if(isDirty) {
-        clazz->offInfo.dirty = clazz->offInfo.dirty & ~migrate;
-        if(maxFields > 32) {
-          for(u4 j = 0; j < fsz; j++) {
-            clazz->offInfo.bits[j] = clazz->offInfo.bits[j] & ~highbits[j];
-          }
+    }
+  }
+}
+
+/* Delta encoding.  When gDvm.offSyncDelta is set the values of class and
+ * instance fields are sent relative to the last value sent for the same field,
+ * which both ends remember in ObjectInfo::sendShadow and recvShadow.  The
+ * values of an object go out as runs, each introduced by a varint of
+ * (count << 1 | unchanged).  An unchanged run carries no data.  In a literal
+ * run integral values are zigzag varints of the difference and floating point
+ * values are the XOR with the previous value with zero bytes stripped.
+ * References are always sent as literals. */
+static void writeVarint(FifoBuffer* fb, u8 v) {
+  u1* buf = (u1*)auxFifoReserve(fb, 10);
+  u4 n = 0;
+  while(v >= 0x80) {
+    buf[n++] = (u1)(v | 0x80);
+    v >>= 7;
+  }
+  buf[n++] = (u1)v;
+  auxFifoCommit(fb, n);
+}
+
+static u8 readVarint(FifoBuffer* fb) {
+  u8 v = 0;
+  for(u4 shift = 0; ; shift += 7) {
+    u1 b = readU1(fb);
+    v |= (u8)(b & 0x7F) << shift;
+    if(!(b & 0x80)) break;
+  }
+  return v;
+}
+
+static u8 zigzag(s8 v) {
+  return ((u8)v << 1) ^ (u8)(v >> 63);
+}
+
+static s8 unzigzag(u8 v) {
+  return (s8)(v >> 1) ^ -(s8)(v & 1);
+}
+
+static u8 valueBits(char type, const JValue* val) {
+  switch(type) {
+    case 'Z': return val->z;
+    case 'B': return (u1)val->b;
+    case 'C': return val->c;
+    case 'S': return (u2)val->s;
+    case 'F': case 'I': return (u4)val->i;
+    default: return val->j;
+  }
+}
+
+static void setValueBits(char type, JValue* val, u8 v) {
+  switch(type) {
+    case 'Z': val->z = (u1)v; break;
+    case 'B': val->i = (s1)v; break;
+    case 'C': val->c = (u2)v; break;
+    case 'S': val->i = (s2)v; break;
+    case 'F': case 'I': val->i = (s4)v; break;
+    default: val->j = (s8)v; break;
+  }
+}
+
+/* Encode cur relative to prev. */
+static void writeDelta(FifoBuffer* fb, char type, u8 prev, u8 cur) {
+  switch(type) {
+    case 'Z': case 'B': writeU1(fb, (u1)cur); break;
+    case 'C': case 'S': case 'I':
+      writeVarint(fb, zigzag((s4)((u4)cur - (u4)prev)));
+      break;
+    case 'J': writeVarint(fb, zigzag((s8)(cur - prev))); break;
+    case 'F': case 'D': {
+      u4 width = type == 'F' ? 4 : 8;
+      u8 x = cur ^ prev;
+      u4 lead = 0, trail = 0;
+      while(lead < width && !((x >> ((width - 1 - lead) << 3)) & 0xFF)) lead++;
+      while(lead + trail < width && !((x >> (trail << 3)) & 0xFF)) trail++;
+      writeU1(fb, (u1)(lead << 4 | trail));
+      for(u4 i = width - lead; i > trail; i--) {
+        writeU1(fb, (u1)(x >> ((i - 1) << 3)));
+      }
+    } break;
+  }
+}
+
+static u8 readDelta(FifoBuffer* fb, char type, u8 prev) {
+  switch(type) {
+    case 'Z': case 'B': return readU1(fb);
+    case 'C': case 'S': case 'I':
+      return (u4)((u4)prev + (u4)unzigzag(readVarint(fb)));
+    case 'J': return prev + (u8)unzigzag(readVarint(fb));
+    case 'F': case 'D': {
+      u4 width = type == 'F' ? 4 : 8;
+      u1 hdr = readU1(fb);
+      u4 lead = hdr >> 4, trail = hdr & 0xF;
+      u8 x = 0;
+      for(u4 i = width - lead; i > trail; i--) {
+        x |= (u8)readU1(fb) << ((i - 1) << 3);
+      }
+      return prev ^ x;
+    }
+  }
+  return 0;
+}
+
+static u8* getShadow(u8** shadow, Object* obj) {
+  if(*shadow == NULL) {
+    u4 maxIndex = getMaxFieldIndex(obj);
+    *shadow = (u8*)calloc(maxIndex ? maxIndex : 1, sizeof(u8));
+  }
+  return *shadow;
+}
+
+static bool isShadowed(const FieldRef* ref, const u8* shadow) {
+  return ref->type != 'L' && ref->type != '[' &&
+         valueBits(ref->type, ref->val) == shadow[ref->index];
+}
+
+/* Write the selected fields of obj using the delta encoding. */
+static void writeDeltaFields(FifoBuffer* fb, Object* obj,
+                             std::vector<FieldRef>* fields) {
+  ObjectInfo* info = offIdObjectInfo(auxObjectToId(obj));
+  u8* shadow = getShadow(&info->sendShadow, obj);
+  u4 n = fields->size();
+  for(u4 i = 0; i < n; ) {
+    bool same = isShadowed(&(*fields)[i], shadow);
+    u4 j = i + 1;
+    while(j < n && isShadowed(&(*fields)[j], shadow) == same) j++;
+    writeVarint(fb, (u8)(j - i) << 1 | (same ? 1 : 0));
+    for(; !same && i < j; i++) {
+      FieldRef* ref = &(*fields)[i];
+      if(ref->type == 'L' || ref->type == '[') {
+        writeValue(fb, ref->type, ref->val);
+      } else {
+        u8 cur = valueBits(ref->type, ref->val);
+        writeDelta(fb, ref->type, shadow[ref->index], cur);
+        shadow[ref->index] = cur;
+      }
+    }
+    i = j;
+  }
+}
+
+/* Finds the next run [*start, *end) of set bits at or after *pos among the
+ * first count bits of dirty and bits.  Returns false if there is none. */
+static bool nextDirtyRun(u4 dirty, const u4* bits, u4 count, u4* pos,
+                         u4* start, u4* end) {
+  u4 i = *pos;
+  while(i < count && !isFieldDirtyRaw(dirty, bits, i)) i++;
+  if(i == count) {
+    *pos = count;
+    return false;
+  }
+  *start = i;
+  while(i < count && isFieldDirtyRaw(dirty, bits, i)) i++;
+  *end = *pos = i;
+  return true;
+}
+
+/* Convert a range of chunks of a chunked array into the byte range of the
+ * contents that it covers. */
+static void chunkRunBytes(ArrayObject* aobj, u4* start, u4* end) {
+  u4 bytes = aobj->length * auxTypeWidth(aobj->clazz->descriptor[1]);
+  u8 last = (u8)*end << gDvm.offArrayChunkShift;
+  *start <<= gDvm.offArrayChunkShift;
+  *end = last < bytes ? (u4)last : bytes;
+}
+
+/* Write out the values of the fields selected by dirty and bits in field index
+ * order.  If data is non-NULL the values are taken from a snapshot captured by
+ * captureObject rather than from the live object.  Returns the number of
+ * values written. */
+static u4 writeObjectFields(FifoBuffer* fb, Object* obj, u4 dirty,
+                            const u4* bits, const char* data, u4 lo) {
+  u4 count = 0;
+  if(!isClassObject(obj) && *obj->clazz->descriptor == '[') {
+    ArrayObject* aobj = (ArrayObject*)obj;
+    char type = aobj->clazz->descriptor[1];
+    u4 typeWidth = auxTypeWidth(type);
+    const char* contents = data ? data - lo : (const char*)aobj->contents;
+    if(offIsChunkedArray(aobj)) {
+      /* Dirty chunks go over as raw runs of the array contents. */
+      u4 start, end;
+      u4 pos = 0;
+      u4 chunks = offArrayChunkCount(aobj, gDvm.offArrayChunkShift);
+      while(nextDirtyRun(dirty, bits, chunks, &pos, &start, &end)) {
+        chunkRunBytes(aobj, &start, &end);
+        auxFifoPushData(fb, contents + start, end - start);
+        count += (end - start) / typeWidth;
+      }
+    } else {
+      for(u4 j = 0; j < aobj->length; j++) {
+        if(isFieldDirtyRaw(dirty, bits, j)) {
+          writeValue(fb, type, (JValue*)(contents + j * typeWidth));
+          count++;
         }
       }
-      if(highbits != NULL) {
-        free(highbits);
+    }
+  } else {
+    std::vector<FieldRef> fields;
+    collectFields(obj, dirty, bits, data, &fields);
+    if(gDvm.offSyncDelta) {
+      writeDeltaFields(fb, obj, &fields);
+    } else {
+      for(u4 i = 0; i < fields.size(); i++) {
+        writeValue(fb, fields[i].type, fields[i].val);
       }
     }
-    //u8 pend = dvmGetRelativeTimeUsec();
-    //timeusedforparse+= pend-pstart;
+    count = fields.size();
   }
- // u8 astart = dvmGetRelativeTimeUsec();
-  offAddVectorIntoTrack(objVec, fb);
-  //u8 aend = dvmGetRelativeTimeUsec();
- // timeusedforadd += aend - astart;
-  delete(objVec);
-  //u8 endtime = dvmGetRelativeTimeUsec();
-  //ALOGE("sync scan class time with clazz info is: %llu, classCount: %d, actualCount: %d, timeusedforfile: %d, timeusedforparse: %d, timeusedforadd: %d", endtime-starttime, classCount, actualCount, timeusedforfile, timeusedforparse, timeusedforadd);
+  return count;
+}
+
+/* Write an object definition followed by the dirty mask and the values of the
+ * selected fields. */
+static u4 writeObject(FifoBuffer* fb, Object* obj, u4 dirty, const u4* bits,
+                      const char* data, u4 lo) {
+  JValue valobj; valobj.l = obj;
+  writeValue(fb, 'L', &valobj);
+
+  u4 maxIndex = getMaxFieldIndex(obj);
+  writeU4(fb, dirty);
+  if(maxIndex > 32) {
+    u4 bsz = (maxIndex - 1) >> 5;
+    for(u4 j = 0; j < bsz; j++) {
+      writeU4(fb, bits[j]);
+    }
+  }
+  return writeObjectFields(fb, obj, dirty, bits, data, lo);
+}
+
+/* Computes the range [*lo, *hi) of the first count indexes selected by dirty
+ * and bits. */
+static void dirtyRange(u4 dirty, const u4* bits, u4 count, u4* lo, u4* hi) {
+  u4 words = count > 32 ? ((count - 1) >> 5) + 1 : 1;
+  *lo = *hi = 0;
+  bool found = false;
+  for(u4 w = 0; w < words; w++) {
+    u4 word = w == 0 ? dirty : bits[w - 1];
+    if(word == 0) continue;
+    if(!found) {
+      *lo = (w << 5) + __builtin_ctz(word);
+      found = true;
+    }
+    *hi = (w << 5) + 32 - __builtin_clz(word);
+  }
+  if(*hi > count) *hi = count;
+}
+
+/* Make sure a referenced object has an identifier before the mutators are
+ * resumed.  Serializing the reference later must not change the tracking
+ * tables. */
+static void trackReference(Object* obj) {
+  if(obj != NULL && auxObjectToId(obj) == COMM_INVALID_ID) {
+    offAddTrackedObject(obj);
+  }
+}
+
+/* Copy the selected state of obj into the snapshot.  Must be called with all
+ * threads suspended. */
+static void captureObject(SyncSnapshot* snap, Object* obj, u4 dirty,
+                          const u4* bits) {
+  SyncRecord* rec = (SyncRecord*)malloc(sizeof(SyncRecord));
+  u4 maxIndex = getMaxFieldIndex(obj);
+  u4 bsz = maxIndex > 32 ? (maxIndex - 1) >> 5 : 0;
+
+  rec->obj = obj;
+  rec->dirty = dirty;
+  rec->bits = NULL;
+  rec->data = NULL;
+  rec->lo = 0;
+  if(bsz > 0) {
+    rec->bits = (u4*)malloc(bsz << 2);
+    memcpy(rec->bits, bits, bsz << 2);
+  }
+
+  if(isClassObject(obj)) {
+    ClassObject* clazz = (ClassObject*)obj;
+    JValue* vals = (JValue*)malloc((clazz->sfieldCount + 1) * sizeof(JValue));
+    for(u4 j = 0; j < (u4)clazz->sfieldCount; j++) {
+      StaticField* fld = clazz->sfields + j;
+      vals[j] = fld->value;
+      if((*fld->signature == '[' || *fld->signature == 'L') &&
+         isFieldDirtyRaw(dirty, bits, j)) {
+        trackReference((Object*)vals[j].l);
+      }
+    }
+    rec->data = (char*)vals;
+  } else if(*obj->clazz->descriptor == '[') {
+    /* Only the dirty span of the array is copied. */
+    ArrayObject* aobj = (ArrayObject*)obj;
+    char type = aobj->clazz->descriptor[1];
+    u4 typeWidth = auxTypeWidth(type);
+    u4 lo, hi;
+    dirtyRange(dirty, bits, maxIndex, &lo, &hi);
+    if(offIsChunkedArray(aobj)) {
+      chunkRunBytes(aobj, &lo, &hi);
+    } else {
+      lo *= typeWidth;
+      hi *= typeWidth;
+    }
+    rec->lo = lo;
+    rec->data = (char*)malloc(hi - lo + 1);
+    memcpy(rec->data, (char*)aobj->contents + lo, hi - lo);
+    if(type == '[' || type == 'L') {
+      Object** contents = (Object**)(void*)rec->data;
+      for(u4 j = lo / typeWidth; j < hi / typeWidth; j++) {
+        if(isFieldDirtyRaw(dirty, bits, j)) {
+          trackReference(contents[j - lo / typeWidth]);
+        }
+      }
+    }
+  } else {
+    u4 size = obj->clazz->objectSize - sizeof(Object);
+    rec->data = (char*)malloc(size + 1);
+    memcpy(rec->data, (char*)obj + sizeof(Object), size);
+    for(ClassObject* clazz = obj->clazz; clazz; clazz = clazz->super) {
+      InstField* fld = clazz->ifields;
+      InstField* efld = fld + clazz->ifieldCount;
+      for(; fld != efld; ++fld) {
+        if((*fld->signature == '[' || *fld->signature == 'L') &&
+           isFieldDirtyRaw(dirty, bits,
+                           (fld->byteOffset - sizeof(Object)) >> 2)) {
+          trackReference(*(Object**)(void*)(rec->data + fld->byteOffset -
+                                            sizeof(Object)));
+        }
+      }
+    }
+  }
+  auxVectorPushV(&snap->records, rec);
 }
 
-static bool isObjectDirty(ObjectInfo* info) {
-  if(info->dirty != 0) {
-    return true;
-  }
-  u4 maxFields = getMaxFieldIndex(info->obj);
-  if(maxFields > 32) {
-    u4 fsz = (maxFields - 1) >> 5;
-    for(u4 i = 0; i < fsz; i++) {
-      if(*(info->bits + i) != 0) {
-        return true;
+/* Either write the object out directly or, if a snapshot sync is in progress,
+ * capture it for serialization once the VM has been resumed. */
+static u4 emitObject(FifoBuffer* fb, Object* obj, u4 dirty, const u4* bits) {
+  /* An array whose bits predate the chunk shift in force goes over whole if
+   * any of it is dirty. */
+  std::vector<u4> whole;
+  if(!isClassObject(obj) && *obj->clazz->descriptor == '[') {
+    ObjectInfo* info = offIdObjectInfo(obj->objId);
+    if(info != NULL && isRechunked(info)) {
+      u4 count = getTrackedFieldCount(info);
+      u4 bsz = count > 32 ? (count - 1) >> 5 : 0;
+      for(u4 j = 0; dirty == 0 && j < bsz; j++) {
+        dirty = bits[j];
       }
+      dirty = dirty != 0 ? ~0U : 0;
+      count = getMaxFieldIndex(obj);
+      whole.assign(count > 32 ? (count - 1) >> 5 : 0, dirty);
+      bits = whole.empty() ? NULL : &whole[0];
     }
   }
-  return false;
+  if(gDvm.offActiveSnapshot != NULL) {
+    captureObject(gDvm.offActiveSnapshot, obj, dirty, bits);
+    return 0;
+  }
+  return writeObject(fb, obj, dirty, bits, NULL, 0);
 }
 
-static bool isFieldDirtyRaw(u4 dirty, u4* bits, u4 fieldIndex) {
-  if(fieldIndex < 32) {
-    return (dirty & 1U << fieldIndex) != 0;
+/* A sync payload goes out as a series of frames, each a u4 length followed by
+ * that many bytes, ended by an empty frame.  Full frames are handed to the
+ * control thread while the rest of the payload is still being serialized so
+ * compression and transfer overlap with serialization, and the serialized
+ * data never has to sit in memory in full. */
+typedef struct SyncStream {
+  Thread* self;
+  u4 sent;
+} SyncStream;
+
+/* Send the full frames buffered in fb, or everything if all is set. */
+static void streamFrames(SyncStream* stream, FifoBuffer* fb, bool all) {
+  for(;;) {
+    u4 frame = auxFifoSize(fb);
+    if(frame == 0 || (frame < OFF_SYNC_FRAME_SIZE && !all)) {
+      break;
+    }
+    if(frame > OFF_SYNC_FRAME_SIZE) {
+      frame = OFF_SYNC_FRAME_SIZE;
+    }
+    offWriteU4(stream->self, frame);
+    stream->sent += frame;
+    while(frame > 0) {
+      u4 bytes = auxFifoGetBufferSize(fb);
+      bytes = bytes < frame ? bytes : frame;
+      offSendMessage(stream->self, auxFifoGetBuffer(fb), bytes);
+      auxFifoPopBytes(fb, bytes);
+      frame -= bytes;
+    }
   }
-  return (bits[(fieldIndex - 32) >> 5] & (1U << (fieldIndex & 0x1F))) != 0;
 }
 
-static bool isFieldDirty(ObjectInfo* info, u4 fieldIndex) {
-  return isFieldDirtyRaw(info->dirty, info->bits, fieldIndex);
+static void streamEnd(SyncStream* stream) {
+  offWriteU4(stream->self, 0);
 }
 
-/* Only allowed in sync operations.  Clear a dirty bit.  Intended to be used in
- * syncPull when the other endpoint overwrites something. */
-static void clearDirty(ObjectInfo* info, u4 fieldIndex) {
-  if(fieldIndex < 32) {
-    info->dirty &= ~(1U << fieldIndex);
-  } else {
-    info->bits[(fieldIndex - 32) >> 5] &= ~(1U << (fieldIndex & 0x1F));
-  }
+static SyncSnapshot* snapshotCreate() {
+  SyncSnapshot* snap = (SyncSnapshot*)malloc(sizeof(SyncSnapshot));
+  snap->records = auxVectorCreate(0);
+  return snap;
 }
 
-static void writeValue(FifoBuffer* fb, char type, JValue* val) {
-  switch(type) {
-    case 'Z': writeU1(fb, val->z); break;
-    case 'B': writeU1(fb, val->b); break;
-    case 'C': writeU2(fb, val->c); break;
-    case 'S': writeU2(fb, val->s); break;
-    case 'F': case 'I': writeU4(fb, val->i); break;
-    case 'D': case 'J': writeU8(fb, val->j); break;
-    case '[': case 'L': {
-      Object* obj = (Object*)val->l;
-      if(obj != NULL) {
-        u4 objId = auxObjectToId(obj);
-        if(objId == COMM_INVALID_ID) {
-          offAddTrackedObject(obj);
-          objId = auxObjectToId(obj);
-        }
-        assert(objId != COMM_INVALID_ID);
-
-        writeU4(fb, auxObjectToId((Object*)obj->clazz));
-        writeU4(fb, objId);
-        /*if(isClassObject(obj)) {        
-            ALOGE("write object clazz id: %d, descriptor: %s", auxObjectToId((Object*)obj->clazz), obj->clazz->descriptor);
-            ALOGE("write object instance id: %d, descriptor: %s", objId, ((ClassObject*)obj)->descriptor);
-        }*/
-        if(*obj->clazz->descriptor == '[') {
-          ArrayObject* aobj = (ArrayObject*)obj;
-          writeU4(fb, aobj->length);
-          //ALOGE("write array instance length: %d", aobj->length);
-        }
-      } else {
-        writeU4(fb, COMM_INVALID_ID);
-      }
-    } break;
-    default: assert(0 && "unexpected type");
+/* Serialize all of the captured records into fb and release the snapshot.
+ * Returns the number of values written. */
+static u4 snapshotFlush(SyncSnapshot* snap, FifoBuffer* fb,
+                        SyncStream* stream) {
+  u4 count = 0;
+  for(u4 i = 0; i < auxVectorSize(&snap->records); i++) {
+    SyncRecord* rec = (SyncRecord*)auxVectorGet(&snap->records, i).v;
+    count += writeObject(fb, rec->obj, rec->dirty, rec->bits, rec->data,
+                         rec->lo);
+    free(rec->bits);
+    free(rec->data);
+    free(rec);
+    streamFrames(stream, fb, false);
   }
+  auxVectorDestroy(&snap->records);
+  free(snap);
+  return count;
 }
 
 static void readValue(Thread* self, FifoBuffer* fb, char type,
@@ -799,6 +1326,29 @@ static void readValue(Thread* self, FifoBuffer* fb, char type,
   }
 }
 
+/* Read the selected fields of obj written by writeDeltaFields. */
+static void readDeltaFields(Thread* self, FifoBuffer* fb, Object* obj,
+                            std::vector<FieldRef>* fields) {
+  ObjectInfo* info = offIdObjectInfo(obj->objId);
+  u8* shadow = getShadow(&info->recvShadow, obj);
+  u4 n = fields->size();
+  for(u4 i = 0; i < n; ) {
+    u8 hdr = readVarint(fb);
+    u4 end = i + (u4)(hdr >> 1);
+    for(; i < end && i < n; i++) {
+      FieldRef* ref = &(*fields)[i];
+      if(ref->type == 'L' || ref->type == '[') {
+        readValue(self, fb, ref->type, ref->val, true);
+      } else {
+        if(!(hdr & 1)) {
+          shadow[ref->index] = readDelta(fb, ref->type, shadow[ref->index]);
+        }
+        setValueBits(ref->type, ref->val, shadow[ref->index]);
+      }
+    }
+  }
+}
+
 void offRegisterProxy(ClassObject* clazz, char* str,
                       ClassObject** interfaces, u4 isz) {
   /* We only allow proxies to be created on the client so if we get here it's
@@ -847,12 +1397,55 @@ void expandProxies(FifoBuffer* fb) {
   }
 }
 
+/* Timestamps taken at the boundaries of the phases of a sync push. */
+enum {
+  SYNC_PHASE_START,
+  SYNC_PHASE_SUSPENDED,
+  SYNC_PHASE_RESUMED,
+  SYNC_PHASE_SERIALIZED,
+  SYNC_PHASE_SENT,
+  SYNC_PHASE_DONE,
+  SYNC_PHASE_COUNT
+};
+
+static void recordSyncPush(Thread* self, const u8* stamps, u4 bytes,
+                           u4 fields) {
+  u8 pause = stamps[SYNC_PHASE_RESUMED] - stamps[SYNC_PHASE_START];
+  u8 elapsed = stamps[SYNC_PHASE_DONE] - stamps[SYNC_PHASE_START];
+  ALOGV("THREAD %d SYNC PHASES suspend %llu capture %llu serialize %llu "
+        "send %llu wait %llu [pause %llu us, snapshot %d]", self->threadId,
+        stamps[SYNC_PHASE_SUSPENDED] - stamps[SYNC_PHASE_START],
+        stamps[SYNC_PHASE_RESUMED] - stamps[SYNC_PHASE_SUSPENDED],
+        stamps[SYNC_PHASE_SERIALIZED] - stamps[SYNC_PHASE_RESUMED],
+        stamps[SYNC_PHASE_SENT] - stamps[SYNC_PHASE_SERIALIZED],
+        stamps[SYNC_PHASE_DONE] - stamps[SYNC_PHASE_SENT],
+        pause, gDvm.offSyncSnapshot);
+  offTelemetryRecord(self, OFF_HIST_SYNC_PUSH_US, elapsed);
+  offTelemetryRecord(self, OFF_HIST_SYNC_PAUSE_US, pause);
+  offTelemetryRecord(self, OFF_HIST_SYNC_PUSH_BYTES, bytes);
+  offTelemetryCount(self, OFF_STAT_SYNC_FIELDS_SENT, fields);
+
+  if(gDvm.offSyncPauseTime == 0) {
+    gDvm.offSyncPauseTime = pause;
+  } else {
+    gDvm.offSyncPauseTime = (15 * gDvm.offSyncPauseTime + pause) / 16;
+  }
+  if(gDvm.offSyncTime == 0) {
+    gDvm.offSyncTime = elapsed / 50;
+  } else {
+    gDvm.offSyncTime = (15 * gDvm.offSyncTime + elapsed) / 16;
+  }
+  ++gDvm.offSyncTimeSamples;
+}
+
 void offSyncPushDoIfLocal(bool(*before_func)(void*), void* before_arg,
                      void(*after_func)(void*, FifoBuffer*), void* after_arg) {
   Thread* self = dvmThreadSelf();
 
-  TIMER_BEGIN();
+  u8 stamps[SYNC_PHASE_COUNT];
+  stamps[SYNC_PHASE_START] = dvmGetRelativeTimeUsec();
   dvmSuspendAllThreads(SUSPEND_FOR_GC);
+  stamps[SYNC_PHASE_SUSPENDED] = dvmGetRelativeTimeUsec();
 
   if(before_func && !before_func(before_arg)) {
     dvmResumeAllThreads(SUSPEND_FOR_GC);
@@ -874,6 +1467,7 @@ void offSyncPushDoIfLocal(bool(*before_func)(void*), void* before_arg,
 
   u4 i, j;
   FifoBuffer fb = auxFifoCreate();
+  SyncStream stream = { self, 0 };
 
   /* Send over new class status updates. */
   //ALOGI("gDvm.offStatusUpdate size is: %u", auxVectorSize(&gDvm.offStatusUpdate));
@@ -893,13 +1487,18 @@ void offSyncPushDoIfLocal(bool(*before_func)(void*), void* before_arg,
   JValue valobj; valobj.l = NULL;
   writeValue(&fb, 'L', &valobj);
 
+  /* In snapshot mode the objects reached from the stacks are only copied
+   * while the VM is suspended and are serialized after it resumes. */
+  u4 dirty_fields = 0;
+  SyncSnapshot* snap = gDvm.offSyncSnapshot ? snapshotCreate() : NULL;
+  gDvm.offActiveSnapshot = snap;
+
   //u8 starttime = dvmGetRelativeTimeUsec();
   /* Send over stack information. */
   FifoBuffer sfb = auxFifoCreate();
+  prefetchBegin();
   offPushAllStacks(&sfb, &fb);
-  /* Terminate the object list. */
-  valobj.l = NULL;
-  writeValue(&fb, 'L', &valobj);
+  streamFrames(&stream, &fb, false);
 
   /* Clear the dirty bits. */
   for(i = 0; i < auxVectorSize(&gDvm.offWriteQueue); i++) {
@@ -912,25 +1511,27 @@ void offSyncPushDoIfLocal(bool(*before_func)(void*), void* before_arg,
     //ALOGE("sync scan construct sending data time: %llu", endtime1 - starttime);
 
   if(after_func) after_func(after_arg, &sfb);
+  gDvm.offActiveSnapshot = NULL;
   dvmResumeAllThreads(SUSPEND_FOR_GC);
+  stamps[SYNC_PHASE_RESUMED] = dvmGetRelativeTimeUsec();
 
-  /* Actually send over the data.  We need to send the size of the data so that
-   * the other endpoint can buffer in the whole thing before suspending the vm.
-   */
-  u4 total_bytes = auxFifoSize(&fb) + auxFifoSize(&sfb);
-  offWriteU4(self, total_bytes);
-  while(!auxFifoEmpty(&fb)) {
-    u4 bytes = auxFifoGetBufferSize(&fb);
-    offSendMessage(self, auxFifoGetBuffer(&fb), bytes);
-    auxFifoPopBytes(&fb, bytes);
+  /* Serialize the objects captured while the VM was suspended. */
+  if(snap != NULL) {
+    dirty_fields += snapshotFlush(snap, &fb, &stream);
   }
+  /* Terminate the object list. */
+  valobj.l = NULL;
+  writeValue(&fb, 'L', &valobj);
+  stamps[SYNC_PHASE_SERIALIZED] = dvmGetRelativeTimeUsec();
+
+  /* Send what is left of the objects followed by the stacks. */
+  streamFrames(&stream, &fb, true);
   auxFifoDestroy(&fb);
-  while(!auxFifoEmpty(&sfb)) {
-    u4 bytes = auxFifoGetBufferSize(&sfb);
-    offSendMessage(self, auxFifoGetBuffer(&sfb), bytes);
-    auxFifoPopBytes(&sfb, bytes);
-  }
+  streamFrames(&stream, &sfb, true);
   auxFifoDestroy(&sfb);
+  streamEnd(&stream);
+  u4 total_bytes = stream.sent;
+  stamps[SYNC_PHASE_SENT] = dvmGetRelativeTimeUsec();
     //u8 endtime = dvmGetRelativeTimeUsec();
    // ALOGE("sync scan send data time: %llu", endtime - endtime1);
 
@@ -941,13 +1542,8 @@ void offSyncPushDoIfLocal(bool(*before_func)(void*), void* before_arg,
 
   /* Wait for the sync to complete. */
   offThreadWaitForResume(self);
-  TIMER_END(self->threadId, "syncPush", total_bytes, 0);
-  if(gDvm.offSyncTime == 0) {
-    gDvm.offSyncTime =  _end_time_us_ / 50;
-  } else {
-    gDvm.offSyncTime = (15 * gDvm.offSyncTime + _end_time_us_) / 16;
-  }
-  ++gDvm.offSyncTimeSamples;
+  stamps[SYNC_PHASE_DONE] = dvmGetRelativeTimeUsec();
+  recordSyncPush(self, stamps, total_bytes, dirty_fields);
 }
 
 void offSyncPush() {
@@ -962,8 +1558,10 @@ void offSyncPushDoIf(bool(*before_func)(void*), void* before_arg,
   }
   Thread* self = dvmThreadSelf();
 
-  TIMER_BEGIN();
+  u8 stamps[SYNC_PHASE_COUNT];
+  stamps[SYNC_PHASE_START] = dvmGetRelativeTimeUsec();
   dvmSuspendAllThreads(SUSPEND_FOR_GC);
+  stamps[SYNC_PHASE_SUSPENDED] = dvmGetRelativeTimeUsec();
 
   if(before_func && !before_func(before_arg)) {
     dvmResumeAllThreads(SUSPEND_FOR_GC);
@@ -985,6 +1583,7 @@ void offSyncPushDoIf(bool(*before_func)(void*), void* before_arg,
 
   u4 i, j;
   FifoBuffer fb = auxFifoCreate();
+  SyncStream stream = { self, 0 };
 
   //u8 starttime = dvmGetRelativeTimeUsec();
   /* Send over stack information. */
@@ -1010,6 +1609,8 @@ void offSyncPushDoIf(bool(*before_func)(void*), void* before_arg,
   writeValue(&fb, 'L', &valobj);
 
   u4 dirty_fields = 0;
+  SyncSnapshot* snap = gDvm.offSyncSnapshot ? snapshotCreate() : NULL;
+  gDvm.offActiveSnapshot = snap;
   //ALOGI("gDvm.offWriteQueue size is: %u", auxVectorSize(&gDvm.offWriteQueue));
   for(i = 0; i < auxVectorSize(&gDvm.offWriteQueue); i++) {
     Object* obj = auxVectorGet(&gDvm.offWriteQueue, i).l; assert(obj);
@@ -1018,74 +1619,9 @@ void offSyncPushDoIf(bool(*before_func)(void*), void* before_arg,
       continue;
     }
     //ALOGE("offloading send: object id: %d", obj->objId);
-
-    /* Write the object definition. */
-    JValue valobj; valobj.l = obj;
-    writeValue(&fb, 'L', &valobj);
-
-    /* Write the dirty bits. */
-    u4 maxIndex = getMaxFieldIndex(obj);
-      writeU4(&fb, info->dirty);
-      //ALOGE("offloading send: object id: %d, dirty: %u, in allFlag", obj->objId, info->dirty);
-    if(maxIndex > 32) {
-      u4 bsz = (maxIndex - 1) >> 5;
-      for(j = 0; j < bsz; j++) info->bits[j] = htonl(info->bits[j]);
-      auxFifoPushData(&fb, (char*)info->bits, bsz << 2);
-      for(j = 0; j < bsz; j++) {
-        info->bits[j] = ntohl(info->bits[j]);
-        //ALOGE("offloading send: object id: %d, dirty bits j: %d, value: %u", obj->objId, j, info->bits[j]);
-      }
-    }
-
-    if(isClassObject(obj)) {
-      /* To sync class objects we just write out all of its globals. */
-      ClassObject* clazz = (ClassObject*)obj;
-      //ALOGE("offloading send: class id: %d, descriptor: %s", obj->objId, clazz->descriptor);
-
-      StaticField* fld = clazz->sfields;
-      StaticField* efld = fld + clazz->sfieldCount;
-      for(; fld != efld; ++fld) {
-        if(isFieldDirty(info, fld - clazz->sfields)) {
-          writeValue(&fb, *fld->signature, (JValue*)&fld->value);
-          dirty_fields++;
-        }
-      }
-    } else {
-      ClassObject* clazz = obj->clazz;
-      if(*clazz->descriptor == '[') {
-        /* For array objects we send the whole array contents for now. */
-        ArrayObject* aobj = (ArrayObject*)obj;
-        char* contents = (char*)aobj->contents;
-        //ALOGE("offloading send: array id: %d, descriptor: %s", obj->objId, aobj->clazz->descriptor);
-
-        u4 typeWidth = auxTypeWidth(aobj->clazz->descriptor[1]);
-        for(j = 0; j < aobj->length; j++, contents += typeWidth) {
-          if(isFieldDirty(info, j)) {
-            writeValue(&fb, aobj->clazz->descriptor[1], (JValue*)contents);
-            dirty_fields++;
-          }
-        }
-      } else {
-        /* For normal class objects we write out all the instance fields. */
-        //ALOGE("offloading send: object instance id: %d, descriptor: %s", obj->objId, obj->clazz->descriptor);
-        for(; clazz; clazz = clazz->super) {
-          InstField* fld = clazz->ifields;
-          InstField* efld = fld + clazz->ifieldCount;
-          for(; fld != efld; ++fld) {
-            if(isFieldDirty(info,
-               (fld->byteOffset - sizeof(Object)) >> 2)) {
-              writeValue(&fb, *fld->signature,
-                         (JValue*)(((char*)obj) + fld->byteOffset));
-              dirty_fields++;
-            }
-          }
-        }
-      }
-    }
+    dirty_fields += emitObject(&fb, obj, info->dirty, info->bits);
+    streamFrames(&stream, &fb, false);
   }
-  /* Terminate the object list. */
-  valobj.l = NULL;
-  writeValue(&fb, 'L', &valobj);
 
   /* Clear the dirty bits. */
   for(i = 0; i < auxVectorSize(&gDvm.offWriteQueue); i++) {
@@ -1093,7 +1629,7 @@ void offSyncPushDoIf(bool(*before_func)(void*), void* before_arg,
     ObjectInfo* info = offIdObjectInfo(obj->objId);
     info->isQueued = false;
 
-    u4 maxIndex = getMaxFieldIndex(obj);
+    u4 maxIndex = getTrackedFieldCount(info);
     info->dirty = 0;
     if(maxIndex > 32) {
       memset(info->bits, 0, ((maxIndex - 1) >> 5) << 2);
@@ -1104,25 +1640,27 @@ void offSyncPushDoIf(bool(*before_func)(void*), void* before_arg,
     //ALOGE("sync construct sending data time: %llu", endtime1 - starttime);
 
   if(after_func) after_func(after_arg, &sfb);
+  gDvm.offActiveSnapshot = NULL;
   dvmResumeAllThreads(SUSPEND_FOR_GC);
+  stamps[SYNC_PHASE_RESUMED] = dvmGetRelativeTimeUsec();
 
-  /* Actually send over the data.  We need to send the size of the data so that
-   * the other endpoint can buffer in the whole thing before suspending the vm.
-   */
-  u4 total_bytes = auxFifoSize(&fb) + auxFifoSize(&sfb);
-  offWriteU4(self, total_bytes);
-  while(!auxFifoEmpty(&fb)) {
-    u4 bytes = auxFifoGetBufferSize(&fb);
-    offSendMessage(self, auxFifoGetBuffer(&fb), bytes);
-    auxFifoPopBytes(&fb, bytes);
+  /* Serialize the objects captured while the VM was suspended. */
+  if(snap != NULL) {
+    dirty_fields += snapshotFlush(snap, &fb, &stream);
   }
+  /* Terminate the object list. */
+  valobj.l = NULL;
+  writeValue(&fb, 'L', &valobj);
+  stamps[SYNC_PHASE_SERIALIZED] = dvmGetRelativeTimeUsec();
+
+  /* Send what is left of the objects followed by the stacks. */
+  streamFrames(&stream, &fb, true);
   auxFifoDestroy(&fb);
-  while(!auxFifoEmpty(&sfb)) {
-    u4 bytes = auxFifoGetBufferSize(&sfb);
-    offSendMessage(self, auxFifoGetBuffer(&sfb), bytes);
-    auxFifoPopBytes(&sfb, bytes);
-  }
+  streamFrames(&stream, &sfb, true);
   auxFifoDestroy(&sfb);
+  streamEnd(&stream);
+  u4 total_bytes = stream.sent;
+  stamps[SYNC_PHASE_SENT] = dvmGetRelativeTimeUsec();
     //u8 endtime = dvmGetRelativeTimeUsec();
     //ALOGE("sync send data time: %llu, total bytes: %d", endtime - starttime, total_bytes);
 
@@ -1133,13 +1671,8 @@ void offSyncPushDoIf(bool(*before_func)(void*), void* before_arg,
 
   /* Wait for the sync to complete. */
   offThreadWaitForResume(self);
-  TIMER_END(self->threadId, "syncPush", total_bytes, dirty_fields);
-  if(gDvm.offSyncTime == 0) {
-    gDvm.offSyncTime =  _end_time_us_ / 50;
-  } else {
-    gDvm.offSyncTime = (15 * gDvm.offSyncTime + _end_time_us_) / 16;
-  }
-  ++gDvm.offSyncTimeSamples;
+  stamps[SYNC_PHASE_DONE] = dvmGetRelativeTimeUsec();
+  recordSyncPush(self, stamps, total_bytes, dirty_fields);
 }
 
 bool offSyncPull() {
@@ -1151,8 +1684,6 @@ bool offSyncPullDo(void(*before_func)(void*), void* before_arg,
                    void(*after_func)(void*, FifoBuffer*), void* after_arg) {
   struct Thread* self = dvmThreadSelf();
 
-  TIMER_BEGIN();
-
   /* Grab revision header and wait for our turn.  Do this before we suspend the
    * threads so whoever should be pulling next will go ahead. */
   u4 rev = offReadU4(self);
@@ -1171,24 +1702,25 @@ bool offSyncPullDo(void(*before_func)(void*), void* before_arg,
     bytes -= rbytes;
   }
 
-  /* Read in all of the data we need. */
+  /* Read in all of the frames.  They are collected before anything is
+   * applied so a link failure part way through never leaves a half applied
+   * heap behind. */
   FifoBuffer fb = auxFifoCreate();
-  bytes = offReadU4(self);
-  if(!gDvm.offConnected) return false;
-  while(bytes > 0) {
-    char cbuf[1024];
-    u4 rbytes = bytes < sizeof(cbuf) ? bytes : sizeof(cbuf);
-    offReadBuffer(self, cbuf, rbytes);
-    auxFifoPushData(&fb, cbuf, rbytes);
-    bytes -= rbytes;
+  for(bytes = offReadU4(self); bytes != 0 && gDvm.offConnected;
+      bytes = offReadU4(self)) {
+    offReadFifo(self, &fb, bytes);
   }
+  if(!gDvm.offConnected) return false;
 
   u4 total_bytes = auxFifoSize(&fbproxy) + auxFifoSize(&fb);
-  TIMER_END(self->threadId, "syncPull [read]", total_bytes, 0);
 
   /* Load in any dex files.  Usually there is nothing to do here.  This should
    * happen prior to any thread suspension. */
-  offPullDexFiles(self);
+  if(!offPullDexFiles(self)) {
+    auxFifoDestroy(&fbproxy);
+    auxFifoDestroy(&fb);
+    return false;
+  }
 
   /* Wait for our turn to inflate. */
   if((int)(rev - gDvm.offRecvRevision) > 0) {
@@ -1221,7 +1753,7 @@ bool offSyncPullDo(void(*before_func)(void*), void* before_arg,
    */
   gDvm.conGcDisabled = true;
   dvmUnlockHeap();
-  TIMER_RESET();
+  u8 start = dvmGetRelativeTimeUsec();
   if(before_func) before_func(before_arg);
 
   expandProxies(&fbproxy);
@@ -1246,6 +1778,7 @@ bool offSyncPullDo(void(*before_func)(void*), void* before_arg,
   u4* bits = NULL;
   u4 bitsSz = 0;
   u4 dirtyCount = 0;
+  std::vector<FieldRef> fields;
   for(;;) {
     JValue valobj; readValue(self, &fb, 'L', &valobj, false);
     Object* obj = valobj.l;
@@ -1270,6 +1803,17 @@ bool offSyncPullDo(void(*before_func)(void*), void* before_arg,
       }
     }
     
+    if(gDvm.offSyncDelta &&
+       (isClassObject(obj) || *obj->clazz->descriptor != '[')) {
+      collectFields(obj, dirty, bits, NULL, &fields);
+      readDeltaFields(self, &fb, obj, &fields);
+      for(j = 0; j < fields.size(); j++) {
+        clearDirty(info, fields[j].index);
+      }
+      dirtyCount += fields.size();
+      continue;
+    }
+
     if(isClassObject(obj)) {
       ClassObject* clazz = (ClassObject*)obj;
       //ALOGE("offloading receive: class id: %d, descriptor: %s", obj->objId, clazz->descriptor);
@@ -1291,12 +1835,28 @@ bool offSyncPullDo(void(*before_func)(void*), void* before_arg,
         char* contents = (char*)aobj->contents;
         //ALOGE("offloading receive: array id: %d, descriptor: %s", obj->objId, aobj->clazz->descriptor);
 
+        /* Local bits sized for another chunk shift stay set; at worst
+         * the values received are sent back. */
+        bool rechunked = isRechunked(info);
         u4 typeWidth = auxTypeWidth(clazz->descriptor[1]);
+        if(offIsChunkedArray(aobj)) {
+          u4 start, end;
+          u4 pos = 0;
+          while(nextDirtyRun(dirty, bits, maxIndex, &pos, &start, &end)) {
+            for(j = start; j < end && !rechunked; j++) {
+              clearDirty(info, j);
+            }
+            chunkRunBytes(aobj, &start, &end);
+            auxFifoReadBuffer(&fb, contents + start, end - start);
+            dirtyCount += (end - start) / typeWidth;
+          }
+          continue;
+        }
         for(j = 0; j < aobj->length; j++, contents += typeWidth) {
           if(isFieldDirtyRaw(dirty, bits, j)) {
             readValue(self, &fb, clazz->descriptor[1],
                       (JValue*)contents, false);
-            clearDirty(info, j);
+            if(!rechunked) clearDirty(info, j);
             dirtyCount++;
           }
         }
@@ -1327,7 +1887,10 @@ bool offSyncPullDo(void(*before_func)(void*), void* before_arg,
   auxFifoDestroy(&fb);
 
   offWriteU1(self, OFF_ACTION_RESUME);
-  TIMER_END(self->threadId, "syncPull", total_bytes, dirtyCount);
+  offTelemetryRecord(self, OFF_HIST_SYNC_PULL_US,
+                     dvmGetRelativeTimeUsec() - start);
+  offTelemetryRecord(self, OFF_HIST_SYNC_PULL_BYTES, total_bytes);
+  offTelemetryCount(self, OFF_STAT_SYNC_FIELDS_RECEIVED, dirtyCount);
 
   pthread_mutex_lock(&gDvm.offCommLock);
   gDvm.offRecvRevision++;
@@ -1340,11 +1903,105 @@ bool offSyncPullDo(void(*before_func)(void*), void* before_arg,
   return true;
 }
 
+bool offSyncCaptureObject(ObjectInfo* info, FifoBuffer* fb) {
+  Object* obj = info->obj;
+
+  /* Only the server's write queue says exactly what changed since the last
+   * sync, and nothing besides obj may be pending. */
+  if(!gDvm.isServer ||
+     !auxFifoEmpty(&gDvm.offProxyFifo) ||
+     !auxVectorEmpty(&gDvm.offStatusUpdate) ||
+     !auxVectorEmpty(&gDvm.dexPushList)) {
+    return false;
+  }
+  u4 queued = auxVectorSize(&gDvm.offWriteQueue);
+  if(queued > 1 ||
+     (queued == 1 && auxVectorGet(&gDvm.offWriteQueue, 0).l != obj)) {
+    return false;
+  }
+  if(!isClassObject(obj) && *obj->clazz->descriptor == '[') {
+    return false;
+  }
+
+  /* References could name objects the other end hasn't seen yet. */
+  std::vector<FieldRef> fields;
+  collectFields(obj, info->dirty, info->bits, NULL, &fields);
+  for(u4 i = 0; i < fields.size(); i++) {
+    if(fields[i].type == 'L' || fields[i].type == '[') {
+      return false;
+    }
+  }
+
+  /* Values go out raw so the delta shadows of both ends stay in step. */
+  u4 maxIndex = getMaxFieldIndex(obj);
+  u4 bsz = maxIndex > 32 ? (maxIndex - 1) >> 5 : 0;
+  writeU4(fb, info->dirty);
+  for(u4 j = 0; j < bsz; j++) {
+    writeU4(fb, info->bits[j]);
+  }
+  for(u4 i = 0; i < fields.size(); i++) {
+    writeValue(fb, fields[i].type, fields[i].val);
+  }
+
+  info->dirty = 0;
+  if(bsz > 0) {
+    memset(info->bits, 0, bsz << 2);
+  }
+  if(queued == 1) {
+    info->isQueued = false;
+    auxVectorResize(&gDvm.offWriteQueue, 0);
+  }
+  return true;
+}
+
+bool offSyncPullObject(Thread* self, ObjectInfo* info, u4 rev,
+                       FifoBuffer* fb) {
+  /* Wait until every sync sent before the handoff has been applied. */
+  if((int)(rev - gDvm.offRecvRevision) > 0) {
+    ThreadStatus status = dvmChangeStatus(self, THREAD_WAIT);
+    pthread_mutex_lock(&gDvm.offCommLock);
+    while((int)(rev - gDvm.offRecvRevision) && gDvm.offConnected) {
+      pthread_cond_wait(&gDvm.offPullCond, &gDvm.offCommLock);
+    }
+    pthread_mutex_unlock(&gDvm.offCommLock);
+    dvmChangeStatus(self, status);
+  }
+  if(!gDvm.offConnected) return false;
+
+  /* Only primitive fields are written so there is no need to hold off the
+   * collector as offSyncPullDo does. */
+  dvmSuspendAllThreads(SUSPEND_FOR_GC);
+
+  Object* obj = info->obj;
+  u4 maxIndex = getMaxFieldIndex(obj);
+  u4 bsz = maxIndex > 32 ? (maxIndex - 1) >> 5 : 0;
+  u4 dirty = readU4(fb);
+  u4* bits = bsz > 0 ? (u4*)malloc(bsz << 2) : NULL;
+  for(u4 j = 0; j < bsz; j++) {
+    bits[j] = readU4(fb);
+  }
+  std::vector<FieldRef> fields;
+  collectFields(obj, dirty, bits, NULL, &fields);
+  for(u4 i = 0; i < fields.size(); i++) {
+    readValue(self, fb, fields[i].type, fields[i].val, true);
+    clearDirty(info, fields[i].index);
+  }
+  free(bits);
+  assert(auxFifoSize(fb) == 0);
+
+  pthread_mutex_lock(&gDvm.offCommLock);
+  gDvm.offRecvRevision++;
+  pthread_cond_broadcast(&gDvm.offPullCond);
+  pthread_mutex_unlock(&gDvm.offCommLock);
+  dvmResumeAllThreads(SUSPEND_FOR_GC);
+  return true;
+}
+
 /* We only need to do work when we're not making memory for a potential OOM. */
 void offGcMarkOffloadRefs(const GcSpec* spec, bool remark) {
   if(!spec->doPreserve) {
     Thread* self = dvmThreadSelf();
-ALOGI("STARTING TRIMGC ON %d", self->threadId);
+    ALOGV("STARTING TRIMGC ON %d", self->threadId);
     if(!self->offTrimSignaled) {
       offWriteU1(self, OFF_ACTION_TRIMGC);
     }
@@ -1372,64 +2029,149 @@ ALOGI("STARTING TRIMGC ON %d", self->threadId);
   dvmProcessMarkStack(ctx);
 }
 
+#define TRIM_TABLES (sizeof(gDvm.objTables) / sizeof(gDvm.objTables[0]))
+
+/* Append the tracked objects of table i that are marked but have not been
+ * reported yet to fb and note them in sent.  They go out as runs of
+ * consecutive ids, each a varint of the gap from the end of the previous run
+ * followed by a varint of its length, after a varint count of the runs.
+ * Returns the number of ids written. */
+static u4 writeTrimDelta(FifoBuffer* fb, u4 i, Vector* sent) {
+  UnlockedInfoTable* table = &gDvm.objTables[i];
+  u4 sz = offTableSize(table);
+  while(auxVectorSize(sent) < (sz + 31) >> 5) {
+    auxVectorPushI(sent, 0);
+  }
+
+  FifoBuffer runs = auxFifoCreate();
+  u4 nruns = 0, ids = 0;
+  u4 last = 0;
+  for(u4 j = 0; j < sz; ) {
+    u4 word = auxVectorGet(sent, j >> 5).i;
+    if(word == ~0U && (j & 0x1F) == 0) {
+      j += 32;
+      continue;
+    }
+    u4 start = j;
+    for(; j < sz; j++) {
+      if(auxVectorGet(sent, j >> 5).i & 1U << (j & 0x1F)) break;
+      ObjectInfo* info = offTableGet(table, j);
+      if(!info || !info->obj || !dvmIsMarked(info->obj)) break;
+      auxVectorSetI(sent, j >> 5, auxVectorGet(sent, j >> 5).i |
+                                  1U << (j & 0x1F));
+    }
+    if(j == start) {
+      j++;
+      continue;
+    }
+    writeVarint(&runs, start - last);
+    writeVarint(&runs, j - start);
+    last = j;
+    nruns++;
+    ids += j - start;
+  }
+  writeVarint(fb, nruns);
+  while(!auxFifoEmpty(&runs)) {
+    u4 bytes = auxFifoGetBufferSize(&runs);
+    auxFifoPushData(fb, auxFifoGetBuffer(&runs), bytes);
+    auxFifoPopBytes(&runs, bytes);
+  }
+  auxFifoDestroy(&runs);
+  return ids;
+}
+
+/* Read the ids written by writeTrimDelta for table i and mark the objects
+ * that aren't marked yet.  They are noted in sent too since there is no point
+ * in reporting them back.  Returns the number of ids read and sets *work if
+ * anything was marked. */
+static u4 readTrimDelta(FifoBuffer* fb, u4 i, Vector* sent, bool* work) {
+  GcMarkContext* ctx = &gDvm.gcHeap->markContext;
+  UnlockedInfoTable* table = &gDvm.objTables[i];
+  u4 sz = offTableSize(table);
+  u4 nruns = (u4)readVarint(fb);
+  u4 ids = 0;
+  u4 last = 0;
+  for(u4 r = 0; r < nruns; r++) {
+    u4 start = last + (u4)readVarint(fb);
+    u4 len = (u4)readVarint(fb);
+    last = start + len;
+    ids += len;
+    for(u4 j = start; j < last && j < sz; j++) {
+      auxVectorSetI(sent, j >> 5, auxVectorGet(sent, j >> 5).i |
+                                  1U << (j & 0x1F));
+      ObjectInfo* info = offTableGet(table, j);
+      if(info && info->obj && !dvmIsMarked(info->obj)) {
+        *work = true;
+        dvmMarkObjectOnStack(info->obj, ctx);
+      }
+    }
+  }
+  return ids;
+}
+
+/* Each endpoint marks from its own roots and the tracked objects are then
+ * exchanged until neither side marks anything new.  Every round carries only
+ * the ids marked since the last one, so the first round is the full summary
+ * of what each side's roots reach and later rounds are usually tiny.  Both
+ * ends send before they read so a round costs one trip across the link, and
+ * the exchange stops as soon as a round in which neither side had anything
+ * to report. */
 void offGcDoTrackTrim() {
-  u4 i, j, k;
+  u4 i, j;
   u4 iterations;
+  u4 bytesSent = 0;
   GcMarkContext* ctx = &gDvm.gcHeap->markContext;
   Thread* thctx = &gDvm.gcThreadContext;
+  u8 start = dvmGetRelativeTimeUsec();
+
+  Vector sent[TRIM_TABLES];
+  for(i = 0; i < TRIM_TABLES; ++i) {
+    sent[i] = auxVectorCreate(0);
+  }
 
   ctx->finger = (void *)ULONG_MAX;
   for(iterations = 1; ; iterations++) {
-    u4 bv;
     bool work = false;
-ALOGI("ITERATION A %d", iterations);
-
-    /* First send over all marked tracked objects in a bit vector. */
-    for(i = 0; i < sizeof(gDvm.objTables) / sizeof(gDvm.objTables[0]); ++i) {
-      u4 sz = offTableSize(&gDvm.objTables[i]);
-      offWriteU4(thctx, sz);
-      for(j = 0; j < sz; j += 32) {
-        u4 bv = 0;
-        for(k = 0; k < 32 && j + k < sz; k++) {
-          ObjectInfo* info = offTableGet(&gDvm.objTables[i], j + k);
-          if(info && info->obj && dvmIsMarked(info->obj)) {
-            bv |= 1U << k;
-          }
-        }
-        offWriteU4(thctx, bv);
-      }
+    u4 sentIds = 0, recvIds = 0;
+
+    FifoBuffer fb = auxFifoCreate();
+    for(i = 0; i < TRIM_TABLES; ++i) {
+      sentIds += writeTrimDelta(&fb, i, &sent[i]);
+    }
+    offWriteU4(thctx, auxFifoSize(&fb));
+    bytesSent += auxFifoSize(&fb);
+    while(!auxFifoEmpty(&fb)) {
+      u4 bytes = auxFifoGetBufferSize(&fb);
+      offSendMessage(thctx, auxFifoGetBuffer(&fb), bytes);
+      auxFifoPopBytes(&fb, bytes);
     }
 
-ALOGI("ITERATION B %d", iterations);
-    /* Now read in the marked tracked objects from the remoted endpoint and mark
-     * them. */
-    for(i = 0; i < sizeof(gDvm.objTables) / sizeof(gDvm.objTables[0]); ++i) {
-      u4 sz = offReadU4(thctx);
-      for(j = 0; j < sz; j += 32) {
-        bv = offReadU4(thctx);
-        for(k = 0; k < 32 && j + k < sz; k++) {
-          if(~bv & 1U << k) continue;
-
-          ObjectInfo* info = offTableGet(&gDvm.objTables[i], j + k);
-          if(info && info->obj && !dvmIsMarked(info->obj)) {
-            work = true;
-            dvmMarkObjectOnStack(info->obj, ctx);
-          }
-        }
-      }
+    offReadFifo(thctx, &fb, offReadU4(thctx));
+    if(!gDvm.offConnected) {
+      auxFifoDestroy(&fb);
+      break;
     }
+    for(i = 0; i < TRIM_TABLES; ++i) {
+      recvIds += readTrimDelta(&fb, i, &sent[i], &work);
+    }
+    auxFifoDestroy(&fb);
 
-ALOGI("ITERATION C %d %d", iterations, work);
-    offWriteU1(thctx, work);
-    work |= offReadU1(thctx);
-ALOGI("ITERATION D %d %d", iterations, work);
+    /* Both ends see the same two counts so they stop in the same round. */
+    if(sentIds == 0 && recvIds == 0) {
+      break;
+    }
     if(work) {
       dvmProcessMarkStack(ctx);
-    } else {
-      break;
     }
-ALOGI("ITERATION E %d", iterations);
   }
+  for(i = 0; i < TRIM_TABLES; ++i) {
+    auxVectorDestroy(&sent[i]);
+  }
+  if(!gDvm.offConnected) {
+    /* Without the remote marks we can't tell what is garbage. */
+    return;
+  }
+  u8 elapsed = dvmGetRelativeTimeUsec() - start;
 
   /* Ok now we can trim all of the objects that haven't been marked. */
   u4 trimmed = 0;
@@ -1444,6 +2186,9 @@ ALOGI("ITERATION E %d", iterations);
         info->obj = NULL;
         free(info->bits);
         info->bits = NULL;
+        free(info->sendShadow);
+        free(info->recvShadow);
+        info->sendShadow = info->recvShadow = NULL;
       }
     }
     total += sz;
@@ -1461,15 +2206,35 @@ ALOGI("ITERATION E %d", iterations);
   }
   auxVectorResize(&gDvm.offWriteQueue, sz);
 
-  gDvm.nextId = 0;
+  /* Collect the free local slots so that new objects reuse them before the
+   * table grows any further. */
+  UnlockedInfoTable* table = &gDvm.objTables[GET_ID_NUM(gDvm.idMask)];
+  auxVectorResize(&gDvm.offFreeIds, 0);
+  for(j = 0; j < offTableSize(table); ++j) {
+    ObjectInfo* info = offTableGet(table, j);
+    if(info == NULL || info->obj == NULL) {
+      auxVectorPushI(&gDvm.offFreeIds, j);
+    }
+  }
+  gDvm.offFreeIdPos = 0;
+  gDvm.offIdEpoch++;
   ALOGI("GC_TRACK_TRIM: Trimmed %d/%d objects in %d iterations "
-        "purging %d objects from the write queue",
-        trimmed, total, iterations, purged);
+        "(%llu us, %u bytes sent) purging %d objects from the write queue",
+        trimmed, total, iterations, elapsed, bytesSent, purged);
+
+  Thread* self = dvmThreadSelf();
+  offTelemetryRecord(self, OFF_HIST_TRIM_US, elapsed);
+  offTelemetryCount(self, OFF_STAT_TRIM_ROUNDS, iterations);
+  offTelemetryCount(self, OFF_STAT_TRIM_BYTES, bytesSent);
+  offTelemetryCount(self, OFF_STAT_TRIMMED_OBJECTS, trimmed);
 }
 
 bool offCommStartup() {
   gDvm.conGcDisabled = false;
   gDvm.nextId = 0;
+  gDvm.offFreeIds = auxVectorCreate(0);
+  gDvm.offFreeIdPos = 0;
+  gDvm.offIdEpoch = 1;
   gDvm.idMask = gDvm.isServer ? 1U << 30 : 0;
   memset(gDvm.objTables, 0, sizeof(gDvm.objTables));
   pthread_mutex_init(&gDvm.offCommLock, NULL);
@@ -1480,12 +2245,41 @@ bool offCommStartup() {
   gDvm.offProxyFifo = auxFifoCreate();
   gDvm.offProxyFifoAll = auxFifoCreate();
   gDvm.offStatusUpdate = auxVectorCreate(0);
+  gDvm.offSyncSnapshot = getenv("OFF_SYNC_SNAPSHOT") != NULL;
+  gDvm.offActiveSnapshot = NULL;
+  gDvm.offSyncPauseTime = 0;
+
+  gDvm.offSyncDelta = getenv("OFF_SYNC_DELTA") != NULL;
+
+  /* OFF_PREFETCH_MAX caps the bytes of arrays and strings a migration sends
+   * ahead of use, 0 turns the prefetch off. */
+  const char* prefetch = getenv("OFF_PREFETCH_MAX");
+  gDvm.offPrefetchMax = prefetch ? strtoul(prefetch, NULL, 10) : 256 << 10;
+
+  /* OFF_MIGRATE_FRAMES caps how many frames of a deep stack are migrated. */
+  const char* frames = getenv("OFF_MIGRATE_FRAMES");
+  gDvm.offMigrateFrames = frames ? strtoul(frames, NULL, 10) : 0;
+
+  /* OFF_ARRAY_CHUNK gives the number of bytes of a primitive array covered by
+   * one dirty bit.  It is rounded down to a power of two. */
+  gDvm.offArrayChunkShift = 0;
+  const char* chunk = getenv("OFF_ARRAY_CHUNK");
+  if(chunk != NULL) {
+    u4 bytes = strtoul(chunk, NULL, 10);
+    while(bytes >> (gDvm.offArrayChunkShift + 1)) {
+      gDvm.offArrayChunkShift++;
+    }
+    if(gDvm.offArrayChunkShift < 3) {
+      gDvm.offArrayChunkShift = 0;
+    }
+  }
   return true;
 }
 
 void offCommShutdown() {
   u4 i;
   pthread_mutex_destroy(&gDvm.offCommLock);
+  auxVectorDestroy(&gDvm.offFreeIds);
   for(i = 0; i < sizeof(gDvm.objTables) / sizeof(gDvm.objTables[0]); ++i) {
     offTableDestroy(&gDvm.objTables[i]);
   }
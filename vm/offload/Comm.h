@@ -11,6 +11,13 @@
 #define STRIP_ID_MASK(id) ((id) & ~(3U << 30U))
 #define ADD_ID_MASK(id) ((id) | gDvm.idMask)
 
+/* Number of object ids a thread reserves at a time. */
+#define OFF_ID_BLOCK 64
+
+/* Sync payloads are sent in frames of at most this many bytes as they are
+ * serialized. */
+#define OFF_SYNC_FRAME_SIZE (16 << 10)
+
 struct Thread;
 struct Object;
 struct Method;
@@ -18,6 +25,7 @@ struct ArrayObject;
 struct ClassObject;
 struct InstField;
 struct StaticField;
+struct SyncSnapshot;
 //struct ObjectAccResult;
 
 typedef struct ObjectInfo {
@@ -30,6 +38,16 @@ typedef struct ObjectInfo {
   /* Tracks the dirtiness of high field indexes. */
   u4* bits;
 
+  /* For a primitive array, the chunk shift the dirty bits were sized for
+   * when bits was allocated, 0 if they track single elements.  The shift in
+   * force can change at the handshake after the array was tracked. */
+  u1 chunkShift;
+
+  /* Last values sent to and received from the other endpoint per field index
+   * when delta encoding is on.  Allocated on first use. */
+  u8* sendShadow;
+  u8* recvShadow;
+
   /* Used by sync to avoid un-needed notifies. */
   u4 remoteWaitCount;
 
@@ -39,10 +57,20 @@ typedef struct ObjectInfo {
   /* Tracks if the current endpoint owns this object for locking. */
   bool isLockOwner;
 
-  /* Tracks if the current endpoint owns this object's volatiles. */
-  volatile bool isVolatileOwner;
+  /* Decayed rate of lock ownership transfers per second and the time of the
+   * last one, used to hold on to contended locks for a lease. */
+  u4 lockFlips;
+  u8 lockSince;
+
+  /* Volatile field groups this endpoint owns.  Field index i belongs to group
+   * OFF_VOLATILE_GROUP(i) so volatiles of one object that are used by
+   * different endpoints need not move together. */
+  volatile u4 volatileOwned;
 } ObjectInfo;
 
+#define OFF_VOLATILE_GROUP(fieldIndex) (1U << ((fieldIndex) & 0x1F))
+#define OFF_VOLATILE_ALL 0xFFFFFFFFU
+
 /* Get the object associated with the passed identifier. */
 struct Object* offIdToObject(u4 objId);
 
@@ -58,7 +86,7 @@ void offAddObjectIntoTrack(struct Object* objToAdd, struct ObjectAccResult* objA
 void offAddVectorIntoTrack(std::vector<Object*>* objVec, FifoBuffer* fb);
 
 void pushAllClazzInfo(FifoBuffer* fb);
-void pushClazzInfo(const Method* method, char* key, FifoBuffer* fb);
+void pushClazzInfo(const Method* method, FifoBuffer* fb);
 
 /* Register the proxy class. */
 void offRegisterProxy(struct ClassObject* clazz, char* str,
@@ -75,6 +103,17 @@ bool offSyncPull();
 bool offSyncPullDo(void(*before_func)(void*), void* before_arg,
               void(*after_func)(void*, struct FifoBuffer*), void* after_arg);
 
+/* Volatile handoff.  When nothing but one object has changed since the last
+ * sync, handing over one of its volatile groups only needs that object's
+ * dirty fields rather than a full sync.  offSyncCaptureObject writes them to
+ * fb and clears them if that is the case and returns false otherwise.  It must
+ * be called with all threads suspended and the caller must take a revision
+ * for the handoff so offSyncPullObject applies it in order with the syncs
+ * around it. */
+bool offSyncCaptureObject(struct ObjectInfo* info, struct FifoBuffer* fb);
+bool offSyncPullObject(struct Thread* self, struct ObjectInfo* info, u4 rev,
+                       struct FifoBuffer* fb);
+
 /* Protect tracked objects from the garbage collector. */
 void offGcMarkOffloadRefs(const GcSpec* spec, bool remark);
 
@@ -3,6 +3,23 @@ INLINE void offAddToWriteQueueLocked(Object* obj) {
   auxVectorPushL(&gDvm.offWriteQueue, obj);
 }
 
+/* Put the object on the write queue if it isn't there already.  Only the
+ * server keeps a write queue; the client discovers dirty objects from the
+ * stacks at sync time. */
+INLINE void offQueueDirtyObject(ObjectInfo* info) {
+  // Modified by Yong, only add it into write queue for a server
+  if(gDvm.isServer) {
+    if(!info->isQueued) {
+      pthread_mutex_lock(&gDvm.offCommLock);
+      if(!info->isQueued) {
+        info->isQueued = true;
+        offAddToWriteQueueLocked(info->obj);
+      }
+      pthread_mutex_unlock(&gDvm.offCommLock);
+    }
+  }
+}
+
 INLINE void offMarkField(ObjectInfo* info, u4 fieldIndex) {
   int32_t val;
   int32_t* ptr;
@@ -16,18 +33,34 @@ INLINE void offMarkField(ObjectInfo* info, u4 fieldIndex) {
   if(~*ptr & val) {
     android_atomic_or(val, ptr);
   }
-  
-  // Modified by Yong, only add it into write queue for a server
-  if(gDvm.isServer) {
-    if(!info->isQueued) {
-      pthread_mutex_lock(&gDvm.offCommLock);
-      if(!info->isQueued) {
-        info->isQueued = true;
-        offAddToWriteQueueLocked(info->obj);
-      }
-      pthread_mutex_unlock(&gDvm.offCommLock);
+  offQueueDirtyObject(info);
+}
+
+/* Mark the field indexes [startIndex, endIndex) dirty.  Each 32 bit word of the
+ * dirty bitmap is updated with at most one atomic operation and the object is
+ * queued once for the whole range. */
+INLINE void offMarkFieldRange(ObjectInfo* info, u4 startIndex, u4 endIndex) {
+  if(startIndex >= endIndex) return;
+
+  /* Word 0 is info->dirty, word w > 0 is info->bits[w - 1]. */
+  u4 lastIndex = endIndex - 1;
+  u4 firstWord = startIndex >> 5;
+  u4 lastWord = lastIndex >> 5;
+  for(u4 w = firstWord; w <= lastWord; w++) {
+    u4 val = ~0U;
+    if(w == firstWord) {
+      val &= ~0U << (startIndex & 0x1F);
+    }
+    if(w == lastWord) {
+      val &= ~0U >> (31 - (lastIndex & 0x1F));
+    }
+    int32_t* ptr = w == 0 ? (int32_t*)&info->dirty :
+                            (int32_t*)info->bits + (w - 1);
+    if(~*ptr & val) {
+      android_atomic_or((int32_t)val, ptr);
     }
   }
+  offQueueDirtyObject(info);
 }
 
 /* Track a write to an instance member of an object. */
@@ -92,20 +125,38 @@ INLINE void offTrackGlobalWriteVolatile(const StaticField* field) {
   }
 }
 
+/* Primitive arrays may be tracked with one dirty bit per chunk of
+ * 1 << gDvm.offArrayChunkShift bytes rather than one bit per element.  Syncs
+ * always use the shift in force; an array's own bitmap uses the shift saved
+ * in its ObjectInfo. */
+INLINE bool offIsChunkedArray(const ArrayObject* aobj) {
+  char type = aobj->clazz->descriptor[1];
+  return gDvm.offArrayChunkShift != 0 && type != '[' && type != 'L';
+}
+
+/* Number of dirty bits used to track an array in chunks of 1 << shift
+ * bytes. */
+INLINE u4 offArrayChunkCount(const ArrayObject* aobj, u4 shift) {
+  u8 bytes = (u8)aobj->length * auxTypeWidth(aobj->clazz->descriptor[1]);
+  return (u4)((bytes + (1U << shift) - 1) >> shift);
+}
+
 /* Track a write to an array range [startIndex, endIndex). */
 INLINE void offTrackArrayWrite(const ArrayObject* aobj,
                                u4 startIndex, u4 endIndex) {
   if((gDvm.isServer && gDvm.initializing) ||
       aobj->objId == COMM_INVALID_ID) return;
 
-  u4 ind;
   ObjectInfo* info = offIdObjectInfo(aobj->objId);
   assert(info && "failed to get object info");
-
-  // TODO: Do this more efficiently.
-  for(ind = startIndex; ind < endIndex; ind++) {
-    offMarkField(info, ind);
+  if(info->chunkShift != 0 && startIndex < endIndex) {
+    /* Convert the element range into the range of chunks it touches. */
+    u4 width = auxTypeWidth(aobj->clazz->descriptor[1]);
+    u4 shift = info->chunkShift;
+    endIndex = (u4)((((u8)endIndex * width - 1) >> shift) + 1);
+    startIndex = (u4)(((u8)startIndex * width) >> shift);
   }
+  offMarkFieldRange(info, startIndex, endIndex);
 }
 
 INLINE void offPrepInstanceReadVolatile(const Object* obj, int offset) {
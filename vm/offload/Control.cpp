@@ -4,7 +4,12 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -16,14 +21,21 @@
 #include <errno.h>
 #include <iostream>
 #include <fstream>
+#include <map>
 #include <vector>
 
 /* <linux/tcp.h> was giving me a problem on some systems.  Copied below are the
  * definitions we need from it. */
 #define TCP_NODELAY   1 /* Turn off Nagle's algorithm. */
 #define TCP_CORK    3 /* Never send partially complete segments */
+#define TCP_KEEPIDLE  4 /* Start keeplives after this period */
+#define TCP_KEEPINTVL 5 /* Interval between keepalives */
+#define TCP_KEEPCNT   6 /* Number of keepalives before death */
+#define TCP_USER_TIMEOUT 18 /* How long for loss retry before timeout */
 
 #include "Dalvik.h"
+#include "offload/Codec.h"
+#include "alloc/HeapSource.h"
 
 #define RTT_INFINITE 10*1000*1000 // 10 seconds
 
@@ -32,14 +44,6 @@
 
 #define MAX_CONTROL_VPACKET_SIZE (1<<16)
 
-// TODO: Move compression only into tcpmux layer.
-#define USE_COMPRESSION
-
-#ifdef USE_COMPRESSION
-#include "zlib.h"
-#define Z_LEVEL Z_DEFAULT_COMPRESSION
-#endif
-
 #define SETOPT(s, opt, val) do { \
     int v = (val); \
     if(setsockopt((s), IPPROTO_TCP, (opt), (void*)&v, sizeof(int))) { \
@@ -63,6 +67,10 @@ typedef struct MsgHeader {
   u4 sz;
 } MsgHeader;
 
+/* Written to offNetPipe in place of a thread to give up on the session, see
+ * offControlEndSession.  0 in its place shuts the control loop down. */
+#define PIPE_END_SESSION 1
+
 static u4 readFdFull(int fd) {
   ssize_t res;
   u4 ret = 0; u4 amt = 0;
@@ -101,44 +109,712 @@ static int signalThread(void* pthread, void* arg) {
   return 0;
 }
 
-static void message_loop(int s) {
+/* Threads with data to send take turns in deficit round robin order.  Each
+ * turn adds SEND_QUANTUM bytes of credit and a thread may send as long as it
+ * has credit left, so a thread pushing a large sync can't hold up the small
+ * lock or notify messages of the others for more than one quantum. */
+#define SEND_QUANTUM (16 << 10)
+
+/* Largest message payload before compression.  Leaves room for the codec
+ * overhead within the receiver's MAX_CONTROL_VPACKET_SIZE limit. */
+#define SEND_MAX_MESSAGE (MAX_CONTROL_VPACKET_SIZE - (1 << 10))
+
+/* Most write buffer segments (16Kb each) a message can span. */
+#define SEND_MAX_SEGMENTS (SEND_MAX_MESSAGE / (16 << 10) + 2)
+
+/* Limits on the messages sent with one writev. */
+#define SEND_BATCH_MSGS 32
+#define SEND_BATCH_IOVS 128
+#define SEND_BATCH_BYTES (4 * MAX_CONTROL_VPACKET_SIZE)
+
+/* Messages from several threads gathered for a single writev.  Data is only
+ * popped from the threads' write buffers once the whole batch is out. */
+typedef struct SendBatch {
+  struct iovec iov[SEND_BATCH_IOVS];
+  u4 iovcnt;
+  u4 iovpos;
+  MsgHeader hdrs[SEND_BATCH_MSGS];
+  /* NULL for messages that don't come from a thread's write buffer. */
+  Thread* threads[SEND_BATCH_MSGS];
+  u4 bytes[SEND_BATCH_MSGS];
+  /* One past the last iovec of each message. */
+  u4 iovEnd[SEND_BATCH_MSGS];
+  u4 msgs;
+  u4 inBytes;
+  u4 outBytes;
+
+  /* Set if a writev couldn't take the whole batch, meaning the network
+   * rather than the sender set the pace. */
+  bool stalled;
+  u8 startTime;
+
+  /* Payload of an acknowledgement in the batch. */
+  u4 ack;
+
+  /* Compressed messages are written here; uncompressed ones are sent
+   * straight from the threads' write buffers. */
+  u4 outUsed;
+  char out[SEND_BATCH_BYTES];
+} SendBatch;
+
+static void queueSender(Queue* active, Thread* thread) {
+  if(!thread->offSendQueued) {
+    thread->offSendQueued = true;
+    auxQueuePushV(active, thread);
+  }
+}
+
+/* A session outlives the link it started on.  Every message written to the
+ * link is numbered and kept in a journal until the peer acknowledges it.  When
+ * the link drops both ends keep all of their offload state and the client
+ * reconnects.  Each end then tells the other how many messages it received
+ * and resends the rest from its journal.  Nothing is lost, so the object
+ * tables, sync revisions and pushed dex files all stay valid.  The session is
+ * only torn down when the journal no longer holds what the peer missed, the
+ * peer has forgotten the session or no link comes back in time. */
+
+/* Message id of an acknowledgement.  Its payload is the number of messages
+ * received so far. */
+#define SESSION_ACK_ID 0xFFFFFFFFU
+
+/* Messages received between acknowledgements. */
+#define SESSION_ACK_INTERVAL 32
+
+/* Limits on the journal.  Once either is reached the oldest messages are
+ * dropped, and a link lost before the peer had them can't be bridged. */
+#define SESSION_JOURNAL_MSGS 4096
+#define SESSION_JOURNAL_BYTES (8 << 20)
+
+/* How long the client keeps trying to resume.  The server waits a
+ * handshake longer. */
+#define SESSION_GRACE_SEC 30
+#define SESSION_HANDSHAKE_SEC 10
+
+/* Delay between attempts to resume, doubled each time up to 4 seconds. */
+#define SESSION_RETRY_MS 250
+
+/* Both ends start with the magic value, the link configuration, one of the
+ * flags below, the session id, the number of messages they received, the
+ * session token and the client's tenant.  The token is chosen by the client
+ * along with the id but never logged, so only the client can resume. */
+#define SESSION_HELLO_SIZE 30
+#define SESSION_NEW 0
+#define SESSION_RESUME 1
+#define SESSION_REFUSE 2
+
+/* How message_loop ended. */
+enum {
+  LINK_SHUTDOWN, /* We were signaled to bail. */
+  LINK_LOST,     /* The link went down, the session may be resumed. */
+  LINK_REFUSED,  /* The session can't go on over any link. */
+};
+
+typedef struct JournalEntry {
+  u4 id;
+  u4 bytes;
+} JournalEntry;
+
+typedef struct Session {
+  /* Chosen by the client, 0 if there is no session. */
+  u8 id;
+  u8 token;
+  /* Set once a link has completed the handshake. */
+  bool established;
+  u8 lostTime;
+
+  /* Messages written to and received from the link. */
+  u4 sendSeq;
+  u4 recvSeq;
+  /* Last acknowledgement sent and received. */
+  u4 ackSent;
+  u4 peerAck;
+
+  /* Bytes that went over all of the session's links. */
+  u8 bytesIn;
+  u8 bytesOut;
+
+  /* Messages journalSeq up to sendSeq, oldest first from journalHead.  Their
+   * payloads follow each other in journalData. */
+  JournalEntry journal[SESSION_JOURNAL_MSGS];
+  u4 journalHead;
+  u4 journalSeq;
+  FifoBuffer journalData;
+
+  /* Journal messages still to be resent after a resume, starting with
+   * replaySeq at replayOffset bytes into journalData. */
+  u4 replayLeft;
+  u4 replaySeq;
+  u4 replayOffset;
+
+  /* Threads with data to send.  Kept across links so no thread is forgotten
+   * while the link is down. */
+  Queue senders;
+} Session;
+
+static Session session;
+
+/* Our end of the channel the listening server passes resumed links over. */
+static int sessionChannel = -1;
+
+static JournalEntry* journalEntry(u4 seq) {
+  return &session.journal[(session.journalHead + (seq - session.journalSeq)) %
+                          SESSION_JOURNAL_MSGS];
+}
+
+static void journalDropOldest() {
+  JournalEntry* entry = &session.journal[session.journalHead];
+  auxFifoDiscard(&session.journalData, entry->bytes);
+  if(session.replayLeft != 0) {
+    session.replayOffset -= entry->bytes;
+  }
+  session.journalHead = (session.journalHead + 1) % SESSION_JOURNAL_MSGS;
+  session.journalSeq++;
+}
+
+/* Forget the messages before seq.  Only safe when no batch refers to the
+ * journal. */
+static void journalTrim(u4 seq) {
+  while((int)(seq - session.journalSeq) > 0 &&
+        session.journalSeq != session.sendSeq) {
+    journalDropOldest();
+  }
+}
+
+/* Journal the first bytes of thread's write buffer, which have just been
+ * written as one message.  Called with the thread's buffer lock held. */
+static void journalAdd(Thread* thread, u4 bytes) {
+  while(session.journalSeq != session.sendSeq &&
+        (session.sendSeq - session.journalSeq == SESSION_JOURNAL_MSGS ||
+         auxFifoSize(&session.journalData) + bytes > SESSION_JOURNAL_BYTES)) {
+    journalDropOldest();
+  }
+
+  struct iovec data[SEND_MAX_SEGMENTS];
+  u4 cnt = sizeof(data) / sizeof(data[0]);
+  auxFifoGather(&thread->offWriteBuffer, 0, bytes, data, &cnt);
+  for(u4 i = 0; i < cnt; i++) {
+    auxFifoPushData(&session.journalData, (char*)data[i].iov_base,
+                    data[i].iov_len);
+  }
+
+  JournalEntry* entry = journalEntry(session.sendSeq++);
+  entry->id = thread->threadId;
+  entry->bytes = bytes;
+}
+
+/* Arrange to resend everything after the first seq messages, which the peer
+ * says it has.  Returns false if the journal no longer holds them all. */
+static bool journalReplayFrom(u4 seq) {
+  session.replayLeft = 0;
+  if((int)(seq - session.journalSeq) < 0 ||
+     (int)(session.sendSeq - seq) < 0) {
+    return false;
+  }
+  journalTrim(seq);
+  session.replaySeq = seq;
+  session.replayLeft = session.sendSeq - seq;
+  session.replayOffset = 0;
+  return true;
+}
+
+/* Returns true if the batch can take another message of up to
+ * SEND_MAX_MESSAGE bytes. */
+static bool batchHasRoom(SendBatch* batch) {
+  return batch->msgs < SEND_BATCH_MSGS &&
+         SEND_BATCH_BYTES - batch->outUsed >= MAX_CONTROL_VPACKET_SIZE &&
+         batch->iovcnt + 1 + SEND_MAX_SEGMENTS <= SEND_BATCH_IOVS;
+}
+
+/* Add amt bytes of fb following the first skip bytes to the batch as one
+ * message for thread id.  thread is the owner of fb if it is a thread's write
+ * buffer, in which case its buffer lock is held. */
+static void batchAdd(SendBatch* batch, FifoBuffer* fb, u4 skip, u4 amt,
+                     u4 id, Thread* thread, OffCodecLink* link) {
+  u4 msg = batch->msgs++;
+  struct iovec* hiov = &batch->iov[batch->iovcnt++];
+  struct iovec data[SEND_MAX_SEGMENTS];
+  u4 cnt = sizeof(data) / sizeof(data[0]);
+  amt = auxFifoGather(fb, skip, amt, data, &cnt);
+
+  u4 csz;
+  int codec = offCodecChoose(link);
+  if(codec == OFF_CODEC_NONE) {
+    /* Send straight out of the fifo segments. */
+    csz = amt;
+    memcpy(&batch->iov[batch->iovcnt], data, cnt * sizeof(struct iovec));
+    batch->iovcnt += cnt;
+  } else {
+    /* Compress out of the fifo segments into the batch buffer. */
+    char* out = batch->out + batch->outUsed;
+    csz = offCodecCompress(link, codec, data, cnt, out,
+                           SEND_BATCH_BYTES - batch->outUsed);
+    batch->outUsed += csz;
+    batch->iov[batch->iovcnt].iov_base = out;
+    batch->iov[batch->iovcnt].iov_len = csz;
+    batch->iovcnt++;
+  }
+  batch->outBytes += csz;
+
+  batch->hdrs[msg].id = htonl(id);
+  batch->hdrs[msg].sz = htonl(csz | (u4)codec << OFF_CODEC_SHIFT);
+  hiov->iov_base = &batch->hdrs[msg];
+  hiov->iov_len = sizeof(MsgHeader);
+  batch->threads[msg] = thread;
+  batch->bytes[msg] = amt;
+  batch->iovEnd[msg] = batch->iovcnt;
+  batch->inBytes += amt;
+  if(thread != NULL) {
+    thread->offSendPending += amt;
+  }
+}
+
+/* Acknowledge the messages received so far. */
+static void batchAddAck(SendBatch* batch) {
+  u4 msg = batch->msgs++;
+  batch->ack = htonl(session.recvSeq);
+  batch->hdrs[msg].id = htonl(SESSION_ACK_ID);
+  batch->hdrs[msg].sz = htonl(sizeof(batch->ack));
+  batch->iov[batch->iovcnt].iov_base = &batch->hdrs[msg];
+  batch->iov[batch->iovcnt].iov_len = sizeof(MsgHeader);
+  batch->iovcnt++;
+  batch->iov[batch->iovcnt].iov_base = &batch->ack;
+  batch->iov[batch->iovcnt].iov_len = sizeof(batch->ack);
+  batch->iovcnt++;
+  batch->threads[msg] = NULL;
+  batch->bytes[msg] = 0;
+  batch->iovEnd[msg] = batch->iovcnt;
+  session.ackSent = session.recvSeq;
+}
+
+static bool ackDue() {
+  return session.recvSeq - session.ackSent >= SESSION_ACK_INTERVAL;
+}
+
+/* Returns true if there is anything for buildBatch to send. */
+static bool haveOutput(Queue* active) {
+  return !auxQueueEmpty(active) || session.replayLeft != 0 || ackDue();
+}
+
+/* Fill the batch from the journal if a resume left messages to resend and
+ * then from the active threads.  Returns the number of messages added. */
+static u4 buildBatch(SendBatch* batch, Queue* active, OffCodecLink* link) {
+  batch->iovcnt = batch->iovpos = 0;
+  batch->msgs = batch->inBytes = batch->outBytes = batch->outUsed = 0;
+  batch->stalled = false;
+  batch->startTime = dvmGetRelativeTimeUsec();
+  if(ackDue()) {
+    batchAddAck(batch);
+  }
+  while(session.replayLeft != 0 && batchHasRoom(batch)) {
+    JournalEntry* entry = journalEntry(session.replaySeq);
+    batchAdd(batch, &session.journalData, session.replayOffset, entry->bytes,
+             entry->id, NULL, link);
+    session.replayOffset += entry->bytes;
+    session.replaySeq++;
+    session.replayLeft--;
+  }
+  while(session.replayLeft == 0 && !auxQueueEmpty(active) &&
+        batchHasRoom(batch)) {
+    Thread* thread = (Thread*)auxQueuePop(active).v;
+    thread->offSendQueued = false;
+    thread->offSendDeficit += SEND_QUANTUM;
+    pthread_mutex_lock(&thread->offBufferLock); {
+      for(;;) {
+        u4 avail = auxFifoSize(&thread->offWriteBuffer) -
+                   thread->offSendPending;
+        if(avail == 0) {
+          /* Nothing left.  Credit doesn't carry over an idle period. */
+          thread->offSendDeficit = 0;
+          break;
+        }
+        if(thread->offSendDeficit <= 0 || !batchHasRoom(batch)) {
+          queueSender(active, thread);
+          break;
+        }
+        u4 amt = avail < (u4)thread->offSendDeficit ? avail :
+                                                      thread->offSendDeficit;
+        amt = amt < SEND_MAX_MESSAGE ? amt : SEND_MAX_MESSAGE;
+        batchAdd(batch, &thread->offWriteBuffer, thread->offSendPending, amt,
+                 thread->threadId, thread, link);
+        thread->offSendDeficit -= amt;
+      }
+    } pthread_mutex_unlock(&thread->offBufferLock);
+  }
+  return batch->msgs;
+}
+
+/* The first count messages of the batch have been written.  Journal and pop
+ * their data, leave the data of the rest to be sent again and put threads
+ * that still have data back on the active list. */
+static void completeMessages(SendBatch* batch, u4 count, Queue* active) {
+  for(u4 i = 0; i < batch->msgs; i++) {
+    Thread* thread = batch->threads[i];
+    if(thread == NULL) continue;
+    pthread_mutex_lock(&thread->offBufferLock); {
+      if(i < count) {
+        journalAdd(thread, batch->bytes[i]);
+        auxFifoDiscard(&thread->offWriteBuffer, batch->bytes[i]);
+      }
+      thread->offSendPending -= batch->bytes[i];
+      if(auxFifoEmpty(&thread->offWriteBuffer)) {
+        /* If the write buffer is empty signal the thread so if it was
+         * waiting for a flush it will wake up. */
+        pthread_cond_signal(&thread->offBufferCond);
+      } else if(auxFifoSize(&thread->offWriteBuffer) >
+                thread->offSendPending) {
+        queueSender(active, thread);
+      }
+    } pthread_mutex_unlock(&thread->offBufferLock);
+  }
+  batch->msgs = 0;
+}
+
+/* The whole batch has been written. */
+static void completeBatch(SendBatch* batch, Queue* active) {
+  if(batch->stalled) {
+    offCodecNoteTransfer(batch->outBytes,
+                         dvmGetRelativeTimeUsec() - batch->startTime);
+  }
+  completeMessages(batch, batch->msgs, active);
+}
+
+/* The link went down partway through the batch.  Messages that were written
+ * in full count as sent since the peer may have them, the rest are sent again
+ * on the next link. */
+static void rewindBatch(SendBatch* batch, Queue* active) {
+  u4 count = 0;
+  while(count < batch->msgs && batch->iovEnd[count] <= batch->iovpos) {
+    count++;
+  }
+  completeMessages(batch, count, active);
+}
+
+/* Forget the send state of threads left behind when the link goes down. */
+static void abandonBatch(SendBatch* batch, Queue* active) {
+  for(u4 i = 0; i < batch->msgs; i++) {
+    if(batch->threads[i] != NULL) {
+      batch->threads[i]->offSendPending = 0;
+    }
+  }
+  batch->msgs = 0;
+  while(!auxQueueEmpty(active)) {
+    Thread* thread = (Thread*)auxQueuePop(active).v;
+    thread->offSendQueued = false;
+    thread->offSendDeficit = 0;
+  }
+}
+
+static void setWriteInterest(int ep, int s, bool want, bool* have) {
+  if(want == *have) return;
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | (want ? EPOLLOUT : 0);
+  ev.data.fd = s;
+  epoll_ctl(ep, EPOLL_CTL_MOD, s, &ev);
+  *have = want;
+}
+
+static void setRecvTimeout(int s, int sec) {
+  struct timeval tv;
+  tv.tv_sec = sec;
+  tv.tv_usec = 0;
+  setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+static void buildHello(u1* hello, const u1* config, u1 flags, u8 id,
+                       u4 recvSeq, u8 token) {
+  hello[0] = 0x55;
+  memcpy(hello + 1, config, 4);
+  hello[5] = flags;
+  id = htonll(id);
+  memcpy(hello + 6, &id, sizeof(id));
+  recvSeq = htonl(recvSeq);
+  memcpy(hello + 14, &recvSeq, sizeof(recvSeq));
+  token = htonll(token);
+  memcpy(hello + 18, &token, sizeof(token));
+  u4 tenant = htonl(gDvm.offTenant);
+  memcpy(hello + 26, &tenant, sizeof(tenant));
+}
+
+static u8 helloId(const u1* hello) {
+  u8 id;
+  memcpy(&id, hello + 6, sizeof(id));
+  return ntohll(id);
+}
+
+static u4 helloRecvSeq(const u1* hello) {
+  u4 seq;
+  memcpy(&seq, hello + 14, sizeof(seq));
+  return ntohl(seq);
+}
+
+static u8 helloToken(const u1* hello) {
+  u8 token;
+  memcpy(&token, hello + 18, sizeof(token));
+  return ntohll(token);
+}
+
+static u4 helloTenant(const u1* hello) {
+  u4 tenant;
+  memcpy(&tenant, hello + 26, sizeof(tenant));
+  return ntohl(tenant);
+}
+
+static u8 newSessionId() {
+  u8 id = 0;
+  int fd = open("/dev/urandom", O_RDONLY);
+  if(fd != -1) {
+    if(read(fd, &id, sizeof(id)) != sizeof(id)) id = 0;
+    close(fd);
+  }
+  if(id == 0) {
+    id = dvmGetRelativeTimeUsec() ^ (u8)getpid() << 32;
+  }
+  return id ? id : 1;
+}
+
+static void sessionBegin(u8 id) {
+  memset(&session, 0, sizeof(session));
+  session.id = id;
+  session.token = id != 0 ? newSessionId() : 0;
+  session.journalData = auxFifoCreate();
+  session.senders = auxQueueCreate();
+
+  /* Create the write event pipe.  We don't want to do it earlier before the
+   * server/zygote forks as the messages will cross processes. */
+  pipe(gDvm.offNetPipe);
+}
+
+/* Give up on the session. */
+static void sessionEnd() {
+  if(session.established) {
+    /* Singal that we're no longer connected and wake up anybody who is
+     * waiting for the remote endpoint to do something. */
+    gDvm.offConnected = false;
+    gDvm.offNetStatTime = 0;
+    gDvm.offNetRTT = gDvm.offNetRTTVar = RTT_INFINITE;
+    gDvm.offNetBandwidth = 0;
+
+    /* Wake up those waiting on data. */
+    dvmHashTableLock(gDvm.offThreadTable); {
+      dvmHashForeach(gDvm.offThreadTable, signalThread, NULL);
+    } dvmHashTableUnlock(gDvm.offThreadTable);
+
+    /* Wake up those waiting on their turn to pull. */
+    pthread_mutex_lock(&gDvm.offCommLock); {
+      pthread_cond_broadcast(&gDvm.offPullCond);
+    } pthread_mutex_unlock(&gDvm.offCommLock);
+
+    offRecoveryWaitForClearance(NULL);
+  }
+
+  while(!auxQueueEmpty(&session.senders)) {
+    Thread* thread = (Thread*)auxQueuePop(&session.senders).v;
+    thread->offSendQueued = false;
+    thread->offSendDeficit = 0;
+  }
+  auxQueueDestroy(&session.senders);
+  auxFifoDestroy(&session.journalData);
+  session.id = 0;
+  session.established = false;
+
+  close(gDvm.offNetPipe[0]);
+  close(gDvm.offNetPipe[1]);
+}
+
+/* Wait up to ms milliseconds for fd, if not -1, to become readable, taking
+ * in the threads that get data to send meanwhile.  Returns -1 if we have been
+ * signaled to bail, 1 if fd is readable and 0 otherwise. */
+static int sessionWait(int fd, u4 ms) {
+  u8 end = dvmGetRelativeTimeUsec() + (u8)ms * 1000;
+  for(;;) {
+    u8 now = dvmGetRelativeTimeUsec();
+    if(now >= end) return 0;
+
+    struct pollfd fds[2];
+    fds[0].fd = gDvm.offNetPipe[0];
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd = fd;
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+    int res = poll(fds, 2, (int)((end - now + 999) / 1000));
+    if(res == -1 && errno == EINTR) continue;
+    if(res <= 0) return 0;
+
+    if(fds[1].revents) return 1;
+    if(fds[0].revents) {
+      Thread* thread = (Thread*)readFdFull(gDvm.offNetPipe[0]);
+      if(thread == NULL) return -1;
+      /* Without a link there is nothing left to give up on. */
+      if(thread != (Thread*)PIPE_END_SESSION) {
+        queueSender(&session.senders, thread);
+      }
+    }
+  }
+}
+
+/* Handed to a server worker along with a link.  Only the first link of a
+ * session carries a limit. */
+typedef struct HostAssign {
+  /* Heap the session may use, 0 for no limit. */
+  u8 heapLimit;
+} HostAssign;
+
+/* Pass the socket s to the process at the other end of channel along with
+ * len bytes of data. */
+static bool sendFd(int channel, int s, const void* data, size_t len) {
+  struct iovec iov;
+  iov.iov_base = (void*)data;
+  iov.iov_len = len;
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } ctl;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof(ctl.buf);
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &s, sizeof(int));
+  return sendmsg(channel, &msg, MSG_NOSIGNAL) == (ssize_t)len;
+}
+
+static int recvFd(int channel, void* data, size_t len) {
+  struct iovec iov;
+  iov.iov_base = data;
+  iov.iov_len = len;
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } ctl;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof(ctl.buf);
+  if(recvmsg(channel, &msg, 0) != (ssize_t)len) return -1;
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if(cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+     cmsg->cmsg_type != SCM_RIGHTS) {
+    return -1;
+  }
+  int s;
+  memcpy(&s, CMSG_DATA(cmsg), sizeof(int));
+  return s;
+}
+
+/* Wait for the listening server to pass us the next link of our session. */
+static int awaitResume() {
+  u8 deadline = session.lostTime +
+      (u8)(SESSION_GRACE_SEC + SESSION_HANDSHAKE_SEC) * 1000000;
+  for(;;) {
+    u8 now = dvmGetRelativeTimeUsec();
+    if(now >= deadline) return -1;
+    int res = sessionWait(sessionChannel, (u4)((deadline - now) / 1000));
+    if(res < 0) return -1;
+    if(res > 0) {
+      HostAssign assign;
+      return recvFd(sessionChannel, &assign, sizeof(assign));
+    }
+  }
+}
+
+static int message_loop(int s) {
   ALOGI("Starting message loop");
 
-  u1 magic_value = 0x55;
-  if(1 != write(s, &magic_value, 1)) return;
-  if(1 != read(s, &magic_value, 1)) return;
-  if(magic_value != 0x55) {
-    ALOGW("Bad magic value from server");
-    return;
+  /* Both ends have to track primitive arrays at the same granularity and
+   * agree on the value encoding.  The client's settings are used unless the
+   * byte orders differ, in which case the raw chunk runs can't be used at
+   * all.  Each end may send with any codec the other can decode. */
+  u2 order = 1;
+  u1 config[4] = { (u1)gDvm.offArrayChunkShift, *(u1*)&order,
+                   (u1)gDvm.offSyncDelta, (u1)OFF_CODEC_ALL };
+
+  /* The client sends its hello without waiting so the listening server can
+   * look at it to find the process the session belongs to.  A failed
+   * handshake only costs the session if it was never established. */
+  int failed = session.established ? LINK_LOST : LINK_REFUSED;
+  u1 flags = session.established ? SESSION_RESUME : SESSION_NEW;
+  u1 hello[SESSION_HELLO_SIZE];
+  u1 peer[SESSION_HELLO_SIZE];
+  setRecvTimeout(s, SESSION_HANDSHAKE_SEC);
+  if(!gDvm.isServer) {
+    buildHello(hello, config, flags, session.id, session.recvSeq,
+               session.token);
+    if(SESSION_HELLO_SIZE != write(s, hello, SESSION_HELLO_SIZE)) return failed;
+  }
+  if(SESSION_HELLO_SIZE != recv(s, peer, SESSION_HELLO_SIZE, MSG_WAITALL)) return failed;
+  if(peer[0] != 0x55) {
+    ALOGW("Bad magic value from peer");
+    return failed;
+  }
+  if(gDvm.isServer) {
+    if(!session.established) {
+      session.id = helloId(peer);
+      session.token = helloToken(peer);
+    }
+    if(peer[5] != flags || helloId(peer) != session.id ||
+       helloToken(peer) != session.token) {
+      flags = SESSION_REFUSE;
+    }
+    buildHello(hello, config, flags, session.id, session.recvSeq,
+               session.token);
+    if(SESSION_HELLO_SIZE != write(s, hello, SESSION_HELLO_SIZE)) return failed;
+    if(flags == SESSION_REFUSE) return LINK_REFUSED;
+  } else if(peer[5] != flags || helloId(peer) != session.id) {
+    ALOGW("Server does not know session %llx", session.id);
+    return LINK_REFUSED;
+  }
+
+  /* Each end says whether it can resend everything the other is missing. */
+  u1 ok = journalReplayFrom(helloRecvSeq(peer));
+  u1 peerOk;
+  if(1 != write(s, &ok, 1)) return failed;
+  if(1 != recv(s, &peerOk, 1, MSG_WAITALL)) return failed;
+  if(!ok || !peerOk) {
+    ALOGW("Session %llx lost too much to resume", session.id);
+    return LINK_REFUSED;
+  }
+  setRecvTimeout(s, 0);
+  if(session.established) {
+    ALOGI("Resumed session %llx, resending %u messages", session.id,
+          session.replayLeft);
+  }
+  session.established = true;
+  session.peerAck = helloRecvSeq(peer);
+  session.ackSent = session.recvSeq;
+
+  if(gDvm.isServer) {
+    gDvm.offArrayChunkShift = peer[1];
+    gDvm.offSyncDelta = peer[3] != 0;
+  }
+  if(peer[2] != config[1]) {
+    gDvm.offArrayChunkShift = 0;
   }
   gDvm.offConnected = true;
   gDvm.offRecovered = false;
 
   int res;
-  Queue wthreads = auxQueueCreate();
+  Queue* wthreads = &session.senders;
   Thread* wthread;
+  SendBatch* batch = (SendBatch*)malloc(sizeof(SendBatch));
+  batch->msgs = 0;
+  OffCodecLink* link = (OffCodecLink*)malloc(sizeof(OffCodecLink));
+  offCodecLinkInit(link, OFF_CODEC_ALL & peer[4]);
 
   MsgHeader rhdr;
   int rst = 0; u4 rsz = sizeof(rhdr); u4 rpos = 0;
+  int rcodec = OFF_CODEC_NONE;
   char rbuf[2*MAX_CONTROL_VPACKET_SIZE];
-
-  MsgHeader whdr;
-  int wst = -1; u4 wsz = sizeof(whdr); u4 wpos = 0;
-  u4 owsz = -1;
-  char* wbuf = NULL;
-
-#ifdef USE_COMPRESSION
   char rbuftmp[2*MAX_CONTROL_VPACKET_SIZE];
-  char wtmpbuf[2*MAX_CONTROL_VPACKET_SIZE];
-
-  z_stream wstrm;
-  wstrm.zalloc = Z_NULL; wstrm.zfree = Z_NULL; wstrm.opaque = Z_NULL;
-  deflateInit(&wstrm, Z_LEVEL);
-
-  z_stream rstrm;
-  rstrm.zalloc = Z_NULL; rstrm.zfree = Z_NULL; rstrm.opaque = Z_NULL;
-  inflateInit(&rstrm);
-#endif
 
   // These four variables are for debugging purposes.
   long long read_bytes = 0;
@@ -152,55 +828,64 @@ static void message_loop(int s) {
 
   SETOPT(s, TCP_CORK, 1);
 
-  int nfd = s < gDvm.offNetPipe[0] ? gDvm.offNetPipe[0] + 1 : s + 1;
+  /* Notice a dead link within seconds so it can be resumed while the peer
+   * still holds the session.  Keepalives cover an idle link and the user
+   * timeout one with data outstanding.  Older kernels may lack the latter. */
+  int one = 1;
+  int keepalive[3][2] = { { TCP_KEEPIDLE, 5 }, { TCP_KEEPINTVL, 2 },
+                          { TCP_KEEPCNT, 3 } };
+  int userTimeout = SESSION_HANDSHAKE_SEC * 1000;
+  setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+  for(int i = 0; i < 3; i++) {
+    setsockopt(s, IPPROTO_TCP, keepalive[i][0], &keepalive[i][1], sizeof(int));
+  }
+  setsockopt(s, IPPROTO_TCP, TCP_USER_TIMEOUT, &userTimeout, sizeof(int));
+
+  int ep = epoll_create(2);
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = s;
+  epoll_ctl(ep, EPOLL_CTL_ADD, s, &ev);
+  ev.data.fd = gDvm.offNetPipe[0];
+  epoll_ctl(ep, EPOLL_CTL_ADD, gDvm.offNetPipe[0], &ev);
+  bool wantWrite = false;
+
   while(1) {
-    if(wst == -1 && !auxQueueEmpty(&wthreads)) {
-      Thread* wthread = (Thread*)auxQueuePeek(&wthreads).v;
-      pthread_mutex_lock(&wthread->offBufferLock); {
-        wst = 0;
-        wsz = sizeof(whdr);
-        wpos = 0;
-        whdr.id = htonl(wthread->threadId);
-
-        whdr.sz = auxFifoGetBufferSize(&wthread->offWriteBuffer);
-        whdr.sz = htonl(whdr.sz < MAX_CONTROL_VPACKET_SIZE ?
-                        whdr.sz : MAX_CONTROL_VPACKET_SIZE);
-        owsz = ntohl(whdr.sz);
-
-        wbuf = auxFifoGetBuffer(&wthread->offWriteBuffer);
-      } pthread_mutex_unlock(&wthread->offBufferLock);
-
-      sent_bytes += ntohl(whdr.sz);
-#ifdef USE_COMPRESSION
-      /* Perform the compression with zlib. */
-      wstrm.avail_in = ntohl(whdr.sz);
-      wstrm.next_in = (unsigned char*)wbuf;
-      wstrm.avail_out = sizeof(wtmpbuf);
-      wstrm.next_out = (unsigned char*)wtmpbuf;
-      deflate(&wstrm, Z_SYNC_FLUSH);
-      wbuf = wtmpbuf;
-      whdr.sz = htonl(sizeof(wtmpbuf) - wstrm.avail_out);
-#endif
-      csent_bytes += ntohl(whdr.sz);
-    } else if(wst == -1 && sent_bytes != sent_acked_bytes) {
+    if(batch->msgs == 0) {
+      /* Nothing refers to the journal between batches. */
+      journalTrim(session.peerAck);
+    }
+    if(batch->msgs == 0 && haveOutput(wthreads)) {
+      buildBatch(batch, wthreads, link);
+      sent_bytes += batch->inBytes;
+      csent_bytes += batch->outBytes;
+      session.bytesOut += batch->outBytes;
+    } else if(batch->msgs == 0 && sent_bytes != sent_acked_bytes) {
 //      ALOGI("WRITE[b, db, cb, dcb] = [%lld, %lld, %lld, %lld]",
 //           sent_bytes, sent_bytes - sent_acked_bytes,
 //           csent_bytes, csent_bytes - csent_acked_bytes);
       sent_acked_bytes = sent_bytes;
       csent_acked_bytes = csent_bytes;
     }
-
-    fd_set rdst; FD_ZERO(&rdst);
-    fd_set wrst; FD_ZERO(&wrst);
-    FD_SET(s, &rdst);
-    FD_SET(gDvm.offNetPipe[0], &rdst);
-    if(!auxQueueEmpty(&wthreads)) {
-      FD_SET(s, &wrst);
+    setWriteInterest(ep, s, batch->msgs != 0, &wantWrite);
+
+    struct epoll_event events[2];
+    res = epoll_wait(ep, events, 2, -1);
+    if(res == -1 && errno == EINTR) continue;
+    CHECK_RESULT("epoll_wait", res);
+
+    bool readable = false, writable = false, signaled = false;
+    for(int i = 0; i < res; i++) {
+      if(events[i].data.fd == s) {
+        readable = (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0;
+        writable = (events[i].events & EPOLLOUT) != 0;
+      } else {
+        signaled = true;
+      }
     }
-    res = select(nfd, &rdst, &wrst, NULL, NULL);
-    CHECK_RESULT("select", res);
 
-    if(FD_ISSET(s, &rdst)) {
+    if(readable) {
       if(rst == 0) {
         res = read(s, ((char*)&rhdr) + rpos, rsz - rpos);
         CHECK_RESULT("read", res);
@@ -211,30 +896,47 @@ static void message_loop(int s) {
           rhdr.sz = ntohl(rhdr.sz);
           rst = 1;
           rpos = 0;
-          rsz = rhdr.sz;
+          rsz = rhdr.sz & OFF_CODEC_SIZE_MASK;
+          rcodec = rhdr.sz >> OFF_CODEC_SHIFT;
 
           if(rsz > MAX_CONTROL_VPACKET_SIZE) {
             ALOGE("Invalid message size %d", rsz);
             dvmAbort();
           }
+          if(rcodec >= OFF_CODEC_COUNT || !(link->allowed & 1U << rcodec)) {
+            ALOGE("Invalid message codec %d", rcodec);
+            dvmAbort();
+          }
+          if(rhdr.id == SESSION_ACK_ID &&
+             (rsz != sizeof(u4) || rcodec != OFF_CODEC_NONE)) {
+            ALOGE("Invalid acknowledgement");
+            dvmAbort();
+          }
         }
       } else if(rst == 1) {
         res = read(s, rbuf + rpos, rsz - rpos);
         CHECK_RESULT("read", res);
         rpos += res;
 
-        if(rpos == rsz) {
-#ifdef USE_COMPRESSION
+        if(rpos == rsz && rhdr.id == SESSION_ACK_ID) {
+          u4 ack;
+          memcpy(&ack, rbuf, sizeof(ack));
+          session.peerAck = ntohl(ack);
+          rst = 0;
+          rpos = 0;
+          rsz = sizeof(MsgHeader);
+        } else if(rpos == rsz) {
           /* Do the decompression and push the data to the thread. */
-          rstrm.avail_in = rsz;
-          rstrm.next_in = (unsigned char*)rbuf;
-          rstrm.avail_out = sizeof(rbuftmp);
-          rstrm.next_out = (unsigned char*)rbuftmp;
-          inflate(&rstrm, Z_SYNC_FLUSH);
-#endif
+          int dsz = offCodecDecompress(link, rcodec, rbuf, rsz, rbuftmp,
+                                       sizeof(rbuftmp));
+          if(dsz < 0) {
+            ALOGE("Corrupt message from remote endpoint (codec %d)", rcodec);
+            dvmAbort();
+          }
 
           cread_bytes += rsz;
-          read_bytes += sizeof(rbuftmp) - rstrm.avail_out;
+          session.bytesIn += rsz;
+          read_bytes += dsz;
           if(read_bytes - read_acked_bytes > (1<<10)) {
 //            ALOGI("READ [b, db, cb, dcb] = [%lld, %lld, %lld, %lld]",
 //                 read_bytes, read_bytes - read_acked_bytes,
@@ -243,23 +945,15 @@ static void message_loop(int s) {
             cread_acked_bytes = cread_bytes;
           }
 
-#ifdef USE_COMPRESSION
-          if(rstrm.avail_out != sizeof(rbuftmp)) {
-#else
-          if(rsz != 0) {
-#endif
+          if(dsz != 0) {
             Thread* rthread = rhdr.id ? offIdToThread(rhdr.id) :
                                         &gDvm.gcThreadContext;
             pthread_mutex_lock(&rthread->offBufferLock); {
-#ifdef USE_COMPRESSION
-              auxFifoPushData(&rthread->offReadBuffer, rbuftmp,
-                              sizeof(rbuftmp) - rstrm.avail_out);
-#else
-              auxFifoPushData(&rthread->offReadBuffer, rbuf, rsz);
-#endif
+              auxFifoPushData(&rthread->offReadBuffer, rbuftmp, dsz);
               pthread_cond_signal(&rthread->offBufferCond);
             } pthread_mutex_unlock(&rthread->offBufferLock);
           }
+          session.recvSeq++;
 
           rst = 0;
           rpos = 0;
@@ -267,76 +961,530 @@ static void message_loop(int s) {
         }
       }
     }
-    if(FD_ISSET(s, &wrst)) {
-      if(wst == 0) {
-        res = write(s, ((char*)&whdr) + wpos, wsz - wpos);
-        CHECK_RESULT("write", res);
-        wpos += res;
-
-        if(wpos == wsz) {
-          wsz = ntohl(whdr.sz);
-          wpos = 0;
-          wst = 1;
+    if(writable && batch->msgs != 0) {
+      /* Gather the headers and payloads of the whole batch into one call.
+       * A reset link must show up as an error rather than SIGPIPE. */
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = batch->iov + batch->iovpos;
+      msg.msg_iovlen = batch->iovcnt - batch->iovpos;
+      res = sendmsg(s, &msg, MSG_NOSIGNAL);
+      CHECK_RESULT("sendmsg", res);
+      while(res > 0) {
+        struct iovec* iov = &batch->iov[batch->iovpos];
+        if((size_t)res >= iov->iov_len) {
+          res -= iov->iov_len;
+          batch->iovpos++;
+        } else {
+          iov->iov_base = (char*)iov->iov_base + res;
+          iov->iov_len -= res;
+          res = 0;
         }
-      } else if(wst == 1) {
-        res = write(s, wbuf, wsz - wpos);
-        CHECK_RESULT("write", res);
-        wbuf += res;
-        wpos += res;
-
-        if(wpos == wsz) {
-          wst = -1;
-
-          wthread = (Thread*)auxQueuePop(&wthreads).v;
-          pthread_mutex_lock(&wthread->offBufferLock); {
-            auxFifoPopBytes(&wthread->offWriteBuffer, owsz);
-            if(auxFifoEmpty(&wthread->offWriteBuffer)) {
-              /* If the write buffer is empty signal the thread so if it was
-               * waiting for a flush it will wake up. */
-              pthread_cond_signal(&wthread->offBufferCond);
-            } else {
-              auxQueuePushV(&wthreads, wthread);
-            }
-          } pthread_mutex_unlock(&wthread->offBufferLock);
+      }
 
-          if(auxQueueEmpty(&wthreads) && wthread->offCorkLevel == 0) {
-            /* We have nothing more to send right now.  Let any partial packets
-             * go over the wire now. */
-            SETOPT(s, TCP_NODELAY, 1);
-            SETOPT(s, TCP_NODELAY, 0);
-          }
+      if(batch->iovpos != batch->iovcnt) {
+        batch->stalled = true;
+      } else {
+        wthread = batch->threads[batch->msgs - 1];
+        completeBatch(batch, wthreads);
+        if(auxQueueEmpty(wthreads) &&
+           (wthread == NULL || wthread->offCorkLevel == 0)) {
+          /* We have nothing more to send right now.  Let any partial packets
+           * go over the wire now. */
+          SETOPT(s, TCP_NODELAY, 1);
+          SETOPT(s, TCP_NODELAY, 0);
         }
       }
     }
-    if(FD_ISSET(gDvm.offNetPipe[0], &rdst)) {
+    if(signaled) {
       wthread = (Thread*)readFdFull(gDvm.offNetPipe[0]);
       if(wthread == NULL) {
         /* We have been signaled to bail. */
-        return;
+        close(ep);
+        abandonBatch(batch, wthreads);
+        free(batch);
+        offCodecLinkDestroy(link);
+        free(link);
+        return LINK_SHUTDOWN;
       }
-      auxQueuePushV(&wthreads, wthread);
+      if(wthread == (Thread*)PIPE_END_SESSION) {
+        ALOGW("Giving up on session %llx", session.id);
+        close(ep);
+        abandonBatch(batch, wthreads);
+        free(batch);
+        offCodecLinkDestroy(link);
+        free(link);
+        return LINK_REFUSED;
+      }
+      queueSender(wthreads, wthread);
+    }
+  }
+
+  /* Keep everything that wasn't surely written for the next link. */
+  close(ep);
+  rewindBatch(batch, wthreads);
+  free(batch);
+  offCodecLinkDestroy(link);
+  free(link);
+  session.lostTime = dvmGetRelativeTimeUsec();
+  return LINK_LOST;
+}
+
+/* The server hosts the clients of many tenants, a tenant being a client
+ * address.  The tenant id a client sends in its hello, see OFF_TENANT, is
+ * only advisory: it tells apart clients behind one address in the logs, but
+ * as the client picks it freely all quotas apply to the address across all
+ * of its ids.  Every session runs in a worker process of its own.  Workers
+ * are forked ahead of time from the fully started server and wait in a pool, so
+ * taking on a session costs a socket handoff rather than a process start.
+ * The listening process hands each new link to an idle worker along with the
+ * heap its session may use, and keeps account of what every tenant's workers
+ * use.  A tenant over its CPU share has its workers stopped until the share
+ * catches up.  Set with
+ *
+ *   OFF_POOL_SIZE        idle workers kept ready (2)
+ *   OFF_TENANT_SESSIONS  sessions a tenant may have at once (8)
+ *   OFF_TENANT_HEAP_MB   heap shared by a tenant's sessions (no limit)
+ *   OFF_TENANT_CPU_PCT   share of one core a tenant may use (no limit)
+ */
+
+/* Accounting period, and periods between tenant reports. */
+#define HOST_TICK_MS 200
+#define HOST_REPORT_TICKS 50
+
+#define HOST_WORKER_REPORT_MS 1000
+
+/* Least heap a session is started with. */
+#define HOST_MIN_HEAP (16 << 20)
+
+/* Most CPU time a tenant can owe, so one burst can't stop it for long. */
+#define HOST_MAX_CPU_DEBT 1000000
+
+/* How long a new link may take to send its hello. */
+#define HOST_PEEK_SEC 2
+
+/* Sent by a worker to the listening process. */
+typedef struct HostReport {
+  u8 heapBytes;
+  u8 bytesIn;
+  u8 bytesOut;
+} HostReport;
+
+typedef struct Worker {
+  int channel;
+  /* 0 while in the pool. */
+  u8 session;
+  u8 token;
+  u4 tenant;
+  u4 tenantId;
+  u8 heapGrant;
+  bool stopped;
+  u8 cpuUsec;
+  HostReport report;
+} Worker;
+
+typedef struct Tenant {
+  u4 sessions;
+  u8 heapGranted;
+  u8 heapBytes;
+  s8 cpuDebt;
+
+  /* Use since the last report. */
+  u8 cpuUsec;
+  u8 bytesIn;
+  u8 bytesOut;
+} Tenant;
+
+typedef struct Host {
+  u4 poolSize;
+  u4 maxSessions;
+  u8 heapQuota;
+  u4 cpuPct;
+  std::map<pid_t, Worker> workers;
+  std::map<u4, Tenant> tenants;
+} Host;
+
+static u4 envInt(const char* name, u4 def) {
+  const char* val = getenv(name);
+  return val ? (u4)atoi(val) : def;
+}
+
+/* CPU time used by process pid so far. */
+static u8 processCpuUsec(pid_t pid) {
+  char path[32];
+  char buf[512];
+  sprintf(path, "/proc/%d/stat", (int)pid);
+  FILE* f = fopen(path, "r");
+  if(!f) return 0;
+  size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+  fclose(f);
+  buf[len] = '\0';
+
+  /* utime and stime are the 12th and 13th fields after the command name,
+   * which may itself contain spaces. */
+  unsigned long utime, stime;
+  char* p = strrchr(buf, ')');
+  if(!p || sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*lu %*lu %*lu %*lu "
+                  "%lu %lu", &utime, &stime) != 2) {
+    return 0;
+  }
+  return (u8)(utime + stime) * 1000000 / sysconf(_SC_CLK_TCK);
+}
+
+static void* workerReportLoop(void* arg) {
+  size_t base = (size_t)arg;
+  for(;;) {
+    usleep(HOST_WORKER_REPORT_MS * 1000);
+    HostReport report;
+    size_t heap = dvmHeapSourceGetValue(HS_BYTES_ALLOCATED, NULL, 0);
+    report.heapBytes = heap > base ? heap - base : 0;
+    report.bytesIn = session.bytesIn;
+    report.bytesOut = session.bytesOut;
+    if(send(sessionChannel, &report, sizeof(report),
+            MSG_NOSIGNAL | MSG_DONTWAIT) == -1 &&
+       errno != EAGAIN && errno != EINTR) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+/* Wait in the pool for a link, then hold the session to the heap it was
+ * given and start reporting to the listening process. */
+static int workerAwaitLink() {
+  HostAssign assign;
+  int s = recvFd(sessionChannel, &assign, sizeof(assign));
+  if(s == -1) return -1;
+  prctl(PR_SET_PDEATHSIG, 0);
+
+  size_t base = dvmHeapSourceGetValue(HS_BYTES_ALLOCATED, NULL, 0);
+  if(assign.heapLimit != 0) {
+    dvmSetGrowthLimit(assign.heapLimit);
+  }
+  pthread_t reporter;
+  if(!pthread_create(&reporter, NULL, workerReportLoop, (void*)base)) {
+    pthread_detach(reporter);
+  }
+  return s;
+}
+
+/* Fork a worker into the pool.  Returns 0 in the worker. */
+static pid_t spawnWorker(Host* host, int listener) {
+  int channel[2];
+  if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, channel)) {
+    perror("socketpair");
+    return -1;
+  }
+  pid_t pid = fork();
+  if(pid == -1) {
+    perror("fork");
+    close(channel[0]);
+    close(channel[1]);
+    return -1;
+  } else if(pid == 0) {
+    /* Don't outlive the listening process while still in the pool. */
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    close(listener);
+    close(channel[0]);
+    std::map<pid_t, Worker>::iterator it;
+    for(it = host->workers.begin(); it != host->workers.end(); ++it) {
+      close(it->second.channel);
+    }
+    sessionChannel = channel[1];
+    return 0;
+  }
+  close(channel[1]);
+
+  Worker* worker = &host->workers[pid];
+  memset(worker, 0, sizeof(*worker));
+  worker->channel = channel[0];
+  return pid;
+}
+
+static void reapWorkers(Host* host) {
+  pid_t pid;
+  while((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+    std::map<pid_t, Worker>::iterator it = host->workers.find(pid);
+    if(it == host->workers.end()) continue;
+    Worker* worker = &it->second;
+    if(worker->session != 0) {
+      Tenant* tenant = &host->tenants[worker->tenant];
+      tenant->sessions--;
+      tenant->heapGranted -= worker->heapGrant;
+    }
+    close(worker->channel);
+    host->workers.erase(it);
+  }
+}
+
+static void refuseLink(int s, u8 id) {
+  u1 none[4] = { 0, 0, 0, 0 };
+  u1 hello[SESSION_HELLO_SIZE];
+  buildHello(hello, none, SESSION_REFUSE, id, 0, 0);
+  write(s, hello, SESSION_HELLO_SIZE);
+}
+
+static const char* tenantName(u4 addr, u4 id, char* buf) {
+  struct in_addr in;
+  in.s_addr = addr;
+  if(id != 0) {
+    sprintf(buf, "%u@%s", id, inet_ntoa(in));
+  } else {
+    strcpy(buf, inet_ntoa(in));
+  }
+  return buf;
+}
+
+/* Take the next link.  One that resumes a session goes to the session's
+ * worker if it comes from the same client with the session's token; one
+ * that starts a session goes to a worker from the pool if the tenant is
+ * within its quotas. */
+static void acceptLink(Host* host, int listener) {
+  union {
+    struct sockaddr_in addrin;
+    struct sockaddr addr;
+  } cli_addr;
+  socklen_t cli_len = sizeof(cli_addr.addrin);
+  int s = accept(listener, &cli_addr.addr, &cli_len);
+  if(s == -1) {
+    perror("accept");
+    return;
+  }
+
+  u1 hello[SESSION_HELLO_SIZE];
+  setRecvTimeout(s, HOST_PEEK_SEC);
+  if(SESSION_HELLO_SIZE != recv(s, hello, SESSION_HELLO_SIZE,
+                                MSG_PEEK | MSG_WAITALL) ||
+     hello[0] != 0x55) {
+    close(s);
+    return;
+  }
+  u8 id = helloId(hello);
+  u8 token = helloToken(hello);
+  u4 addr = cli_addr.addrin.sin_addr.s_addr;
+  u4 tenantId = helloTenant(hello);
+  char name[32];
+  HostAssign assign;
+  assign.heapLimit = 0;
+
+  if(hello[5] == SESSION_RESUME) {
+    std::map<pid_t, Worker>::iterator it;
+    for(it = host->workers.begin(); it != host->workers.end(); ++it) {
+      if(it->second.session == id) break;
+    }
+    if(it != host->workers.end() &&
+       (it->second.tenant != addr || it->second.tenantId != tenantId ||
+        it->second.token != token)) {
+      ALOGW("Refused resume of session %llx from %s: not its owner", id,
+            tenantName(addr, tenantId, name));
+      it = host->workers.end();
+    }
+    if(it == host->workers.end() ||
+       !sendFd(it->second.channel, s, &assign, sizeof(assign))) {
+      refuseLink(s, id);
+    }
+    close(s);
+    return;
+  }
+
+  Tenant* tenant = &host->tenants[addr];
+  const char* reason = NULL;
+  if(tenant->sessions >= host->maxSessions) {
+    reason = "too many sessions";
+  } else if(host->heapQuota != 0) {
+    /* Sessions share the quota out between them as they start. */
+    u8 left = host->heapQuota - tenant->heapGranted;
+    u8 share = host->heapQuota / host->maxSessions;
+    share = share > HOST_MIN_HEAP ? share : HOST_MIN_HEAP;
+    if(left < HOST_MIN_HEAP) {
+      reason = "heap quota used up";
+    }
+    assign.heapLimit = left < share ? left : share;
+  }
+
+  pid_t pid = -1;
+  std::map<pid_t, Worker>::iterator it;
+  for(it = host->workers.begin(); it != host->workers.end(); ++it) {
+    if(it->second.session == 0) {
+      pid = it->first;
+      break;
+    }
+  }
+  if(reason == NULL && pid == -1) {
+    reason = "no idle worker";
+  }
+  if(reason == NULL &&
+     !sendFd(it->second.channel, s, &assign, sizeof(assign))) {
+    reason = "worker gone";
+  }
+
+  if(reason != NULL) {
+    ALOGW("Refused session %llx of %s: %s", id,
+          tenantName(addr, tenantId, name), reason);
+    refuseLink(s, id);
+  } else {
+    Worker* worker = &it->second;
+    worker->session = id;
+    worker->token = token;
+    ALOGI("Session %llx of %s on worker %d", id,
+          tenantName(addr, tenantId, name), (int)pid);
+    worker->tenant = addr;
+    worker->tenantId = tenantId;
+    worker->heapGrant = assign.heapLimit;
+    worker->cpuUsec = processCpuUsec(pid);
+    tenant->sessions++;
+    tenant->heapGranted += assign.heapLimit;
+  }
+  close(s);
+}
+
+static void readReport(Host* host, Worker* worker) {
+  HostReport report;
+  if(recv(worker->channel, &report, sizeof(report), MSG_DONTWAIT) !=
+     sizeof(report) || worker->session == 0) {
+    return;
+  }
+  Tenant* tenant = &host->tenants[worker->tenant];
+  tenant->bytesIn += report.bytesIn - worker->report.bytesIn;
+  tenant->bytesOut += report.bytesOut - worker->report.bytesOut;
+  worker->report = report;
+}
+
+/* Charge the CPU time used in the last period to the tenants and stop or
+ * continue their workers according to their share. */
+static void accountTenants(Host* host, u8 elapsedUsec) {
+  std::map<u4, Tenant>::iterator tt;
+  for(tt = host->tenants.begin(); tt != host->tenants.end(); ++tt) {
+    tt->second.heapBytes = 0;
+  }
+
+  std::map<pid_t, Worker>::iterator it;
+  for(it = host->workers.begin(); it != host->workers.end(); ++it) {
+    Worker* worker = &it->second;
+    if(worker->session == 0) continue;
+    Tenant* tenant = &host->tenants[worker->tenant];
+    u8 cpu = processCpuUsec(it->first);
+    if(cpu > worker->cpuUsec) {
+      tenant->cpuUsec += cpu - worker->cpuUsec;
+      tenant->cpuDebt += cpu - worker->cpuUsec;
+      worker->cpuUsec = cpu;
+    }
+    tenant->heapBytes += worker->report.heapBytes;
+  }
+
+  for(tt = host->tenants.begin(); tt != host->tenants.end(); ++tt) {
+    Tenant* tenant = &tt->second;
+    if(host->cpuPct == 0) {
+      tenant->cpuDebt = 0;
+      continue;
+    }
+    tenant->cpuDebt -= (s8)(elapsedUsec * host->cpuPct / 100);
+    if(tenant->cpuDebt < 0) tenant->cpuDebt = 0;
+    if(tenant->cpuDebt > HOST_MAX_CPU_DEBT) {
+      tenant->cpuDebt = HOST_MAX_CPU_DEBT;
     }
   }
 
-  auxQueueDestroy(&wthreads);
+  for(it = host->workers.begin(); it != host->workers.end(); ++it) {
+    Worker* worker = &it->second;
+    if(worker->session == 0) continue;
+    bool stop = host->tenants[worker->tenant].cpuDebt > 0;
+    if(stop != worker->stopped) {
+      kill(it->first, stop ? SIGSTOP : SIGCONT);
+      worker->stopped = stop;
+    }
+  }
+}
 
-  /* Singal that we're no longer connected and wake up anybody who is waiting
-   * for the remote endpoint to do something. */
-  gDvm.offConnected = false;
-  gDvm.offNetStatTime = 0;
-  gDvm.offNetRTT = gDvm.offNetRTTVar = RTT_INFINITE;
+static void reportTenants(Host* host, u8 elapsedUsec) {
+  std::map<u4, Tenant>::iterator tt = host->tenants.begin();
+  while(tt != host->tenants.end()) {
+    Tenant* tenant = &tt->second;
+    char name[32];
+    ALOGI("Tenant %s: %u sessions, cpu %llu%%, heap %lluKb, "
+          "in %lluKb/s, out %lluKb/s", tenantName(tt->first, 0, name),
+          tenant->sessions,
+          tenant->cpuUsec * 100 / elapsedUsec, tenant->heapBytes >> 10,
+          (tenant->bytesIn * 1000000 / elapsedUsec) >> 10,
+          (tenant->bytesOut * 1000000 / elapsedUsec) >> 10);
+    tenant->cpuUsec = tenant->bytesIn = tenant->bytesOut = 0;
+    if(tenant->sessions == 0) {
+      host->tenants.erase(tt++);
+    } else {
+      ++tt;
+    }
+  }
+}
 
-  /* Wake up those waiting on data. */
-  dvmHashTableLock(gDvm.offThreadTable); {
-    dvmHashForeach(gDvm.offThreadTable, signalThread, NULL);
-  } dvmHashTableUnlock(gDvm.offThreadTable);
+/* Run the listening server.  Only returns in a worker, with the first link
+ * of its session, or on failure. */
+static int hostServe(int listener) {
+  Host host;
+  host.poolSize = envInt("OFF_POOL_SIZE", 2);
+  host.poolSize = host.poolSize ? host.poolSize : 1;
+  host.maxSessions = envInt("OFF_TENANT_SESSIONS", 8);
+  host.maxSessions = host.maxSessions ? host.maxSessions : 1;
+  host.heapQuota = (u8)envInt("OFF_TENANT_HEAP_MB", 0) << 20;
+  host.cpuPct = envInt("OFF_TENANT_CPU_PCT", 0);
+
+  u8 lastTick = dvmGetRelativeTimeUsec();
+  u4 ticks = 0;
+  for(;;) {
+    reapWorkers(&host);
+
+    /* Top up the pool, which happens after a handoff rather than before. */
+    u4 idle = 0;
+    std::map<pid_t, Worker>::iterator it;
+    for(it = host.workers.begin(); it != host.workers.end(); ++it) {
+      idle += it->second.session == 0;
+    }
+    for(; idle < host.poolSize; idle++) {
+      pid_t pid = spawnWorker(&host, listener);
+      if(pid == 0) return workerAwaitLink();
+      if(pid == -1) break;
+    }
 
-  /* Wake up those waiting on their turn to pull. */
-  pthread_mutex_lock(&gDvm.offCommLock); {
-    pthread_cond_broadcast(&gDvm.offPullCond);
-  } pthread_mutex_unlock(&gDvm.offCommLock);
+    std::vector<struct pollfd> fds(1);
+    std::vector<Worker*> polled(1);
+    fds[0].fd = listener;
+    fds[0].events = POLLIN;
+    for(it = host.workers.begin(); it != host.workers.end(); ++it) {
+      struct pollfd fd;
+      fd.fd = it->second.channel;
+      fd.events = POLLIN;
+      fds.push_back(fd);
+      polled.push_back(&it->second);
+    }
+    for(size_t i = 0; i < fds.size(); i++) {
+      fds[i].revents = 0;
+    }
 
-  offRecoveryWaitForClearance(NULL);
+    u8 now = dvmGetRelativeTimeUsec();
+    u8 next = lastTick + HOST_TICK_MS * 1000;
+    int res = poll(&fds[0], fds.size(),
+                   next > now ? (int)((next - now + 999) / 1000) : 0);
+    if(res == -1 && errno != EINTR) {
+      perror("poll");
+      return -1;
+    }
+    for(size_t i = 1; res > 0 && i < fds.size(); i++) {
+      if(fds[i].revents & POLLIN) {
+        readReport(&host, polled[i]);
+      }
+    }
+    if(res > 0 && (fds[0].revents & POLLIN)) {
+      acceptLink(&host, listener);
+    }
+
+    now = dvmGetRelativeTimeUsec();
+    if(now >= next) {
+      accountTenants(&host, now - lastTick);
+      lastTick = now;
+      if(++ticks % HOST_REPORT_TICKS == 0) {
+        reportTenants(&host, (u8)HOST_REPORT_TICKS * HOST_TICK_MS * 1000);
+      }
+    }
+  }
 }
 
 static int getprocname(char *buf, size_t len) {
@@ -361,6 +1509,22 @@ void* offControlLoop(void* junk) {
   int iter;
   int s = -1;
   for(iter = 0; ; iter = iter < 7 ? iter + 1 : 7) {
+    bool fresh = session.id == 0;
+    if(!gDvm.isServer && !fresh) {
+      /* Keep trying to resume the session for a while before giving up. */
+      if(dvmGetRelativeTimeUsec() - session.lostTime >
+         (u8)SESSION_GRACE_SEC * 1000000) {
+        ALOGW("Could not resume session %llx", session.id);
+        sessionEnd();
+        continue;
+      }
+      if(sessionWait(-1, SESSION_RETRY_MS << (iter < 4 ? iter : 4)) < 0) {
+        close(gDvm.offNetPipe[0]);
+        close(gDvm.offNetPipe[1]);
+        goto bail;
+      }
+    }
+
     s = socket(AF_INET, SOCK_STREAM, 0);
     if(s == -1) {
       perror("socket");
@@ -368,10 +1532,12 @@ void* offControlLoop(void* junk) {
     }
     
     if(!gDvm.isServer) {
-      struct timespec req;
-      req.tv_sec = 1 << iter;
-      req.tv_nsec = 0;
-      nanosleep(&req, NULL);
+      if(fresh) {
+        struct timespec req;
+        req.tv_sec = 1 << iter;
+        req.tv_nsec = 0;
+        nanosleep(&req, NULL);
+      }
 
       struct addrinfo* rp;
       for(rp = gDvm.offTransportAddr; rp; rp = rp->ai_next) {
@@ -402,56 +1568,63 @@ void* offControlLoop(void* junk) {
         return NULL;
       }
       ALOGI("Ready to accept connections on %s", listen_port);
-      while(1) {
-        union {
-          struct sockaddr_in addrin;
-          struct sockaddr addr;
-        } cli_addr;
-        socklen_t cli_len = sizeof(cli_addr.addrin);
-        int s_cli = accept(s, &cli_addr.addr, &cli_len);
-        if(s_cli == -1) {
-          perror("accept");
-        } else {
-          int pid = fork();
-          if(pid == -1) {
-            perror("fork");
-          } else if(pid == 0) {
-            close(s);
-            s = s_cli;
-            break;
-          }
-          close(s_cli);
-        }
+
+      /* Only returns in a worker, with the first link of its session. */
+      int s_cli = hostServe(s);
+      if(s_cli == -1) {
+        return NULL;
       }
+      s = s_cli;
     }
 
-    /* Create the write event pipe.  We don't want to do it earlier before the
-     * server/zygote forks as the messages will cross processes. */
-    pipe(gDvm.offNetPipe);
+    if(fresh) {
+      sessionBegin(gDvm.isServer ? 0 : newSessionId());
+    }
     // Modified by Yong 06/23/2014
     // before entering the loop, we load the apk parse result into memory, if cannot find locally, transmit from the remote server
-    if(!gDvm.isServer) {
+    /* The results stay loaded across sessions: method slots and objects
+     * already tracked point into them. */
+    if(!gDvm.isServer && fresh && !offAnalysisImageLoaded() &&
+       gDvm.methodAccMap == NULL) {
         char filename[100];
         strcpy(filename, "/data/data/");
         char procname[80];
         getprocname(procname, 80);
         strcat(filename, procname);
-        strcat(filename, "/parse.txt");
-        gDvm.methodAccMap = new std::map<char*, MethodAccResult*, charscomp>(); // todel
-        retrieveMethodInfo(gDvm.methodAccMap, filename); //todel
-        
-        gDvm.methodClzOffsetMap = new std::map<char*, u4, charscomp>();
+
         char offsetfile[100];
-        strcpy(offsetfile, "/data/data/");
-        strcat(offsetfile, procname);
+        strcpy(offsetfile, filename);
         strcat(offsetfile, "/offset.txt");
-        retrieveOffsetMap(gDvm.methodClzOffsetMap, offsetfile);
-        
+
         char staticfilename[100];
-        strcpy(staticfilename, "/data/data/");
-        strcat(staticfilename, procname);
+        strcpy(staticfilename, filename);
         strcat(staticfilename, "/static.txt");
-        staticfile.open(staticfilename);
+
+        /* Prefer the mapped binary image of the analysis results.  If it is
+         * missing or older than the text results parse those instead and
+         * write a new image for the next start. */
+        char imagefile[100];
+        strcpy(imagefile, filename);
+        strcat(imagefile, "/analysis.bin");
+        strcat(filename, "/parse.txt");
+        const char* sources[ANALYSIS_IMAGE_SOURCES] = {
+          filename, offsetfile, staticfilename
+        };
+        if(!offAnalysisImageOpen(imagefile, sources)) {
+          gDvm.methodAccMap = new std::map<char*, MethodAccResult*, charscomp>(); // todel
+          retrieveMethodInfo(gDvm.methodAccMap, filename); //todel
+
+          gDvm.methodClzOffsetMap = new std::map<char*, u4, charscomp>();
+          retrieveOffsetMap(gDvm.methodClzOffsetMap, offsetfile);
+
+          staticfile.open(staticfilename);
+
+          offAnalysisImageBuild(imagefile, sources, gDvm.methodAccMap,
+                                gDvm.methodClzOffsetMap, &staticfile);
+        }
+        /* Methods that ran before this point resolved their slots without
+         * any results. */
+        offMethodSlotsInvalidate();
      } //todel
         
  /*       int openfd = open(filename, O_RDONLY, 0664);
@@ -525,9 +1698,28 @@ void* offControlLoop(void* junk) {
         }
     }*/
     // Modified end
-    message_loop(s);
-    close(gDvm.offNetPipe[0]);
-    close(gDvm.offNetPipe[1]);
+    int res;
+    while((res = message_loop(s)) == LINK_LOST && gDvm.isServer &&
+          !gDvm.offControlShutdown) {
+      /* The client will be back with a new link if it can. */
+      close(s);
+      s = awaitResume();
+      if(s == -1) break;
+    }
+    if(s != -1) {
+      close(s); s = -1;
+    }
+    if(res == LINK_SHUTDOWN) {
+      close(gDvm.offNetPipe[0]);
+      close(gDvm.offNetPipe[1]);
+      goto bail;
+    }
+    if(res == LINK_LOST && !gDvm.isServer && !gDvm.offControlShutdown) {
+      ALOGW("Lost connection to server, resuming session %llx", session.id);
+      iter = -1;
+      continue;
+    }
+    sessionEnd();
 
     /* Cleanup all transport state for the client.  Otherwise just quit. */
     if(gDvm.isServer) {
@@ -539,8 +1731,6 @@ void* offControlLoop(void* junk) {
     } else {
       ALOGW("Lost connection to server\n");
     }
-
-    close(s); s = -1;
   }
 
 bail:
@@ -663,6 +1853,31 @@ void offReadBuffer(Thread* self, char* buf, u4 size) {
   pthread_mutex_unlock(&self->offBufferLock);
 }
 
+void offReadFifo(Thread* self, FifoBuffer* fb, u4 size) {
+  if(size == 0) return;
+
+  pthread_mutex_lock(&self->offBufferLock);
+  while(size != 0) {
+    if(!gDvm.offConnected) {
+      /* The caller is expected to check the connection afterwards. */
+      break;
+    } else if(!auxFifoEmpty(&self->offReadBuffer)) {
+      u4 bytes = auxFifoGetBufferSize(&self->offReadBuffer);
+      bytes = size < bytes ? size : bytes;
+      auxFifoPushData(fb, auxFifoGetBuffer(&self->offReadBuffer), bytes);
+      auxFifoPopBytes(&self->offReadBuffer, bytes);
+      size -= bytes;
+    } else {
+      ThreadStatus status = dvmChangeStatus(self, THREAD_VMWAIT);
+      pthread_cond_wait(&self->offBufferCond, &self->offBufferLock);
+      pthread_mutex_unlock(&self->offBufferLock);
+      dvmChangeStatus(self, status);
+      pthread_mutex_lock(&self->offBufferLock);
+    }
+  }
+  pthread_mutex_unlock(&self->offBufferLock);
+}
+
 void offCorkStream(Thread* self) {
   pthread_mutex_lock(&self->offBufferLock);
   self->offCorkLevel++;
@@ -694,12 +1909,13 @@ bool offControlStartup(int afterZygote) {
 
     const char* env_server = getenv("OFF_SERVER");
     gDvm.isServer = env_server && !strcmp("1", env_server);
+    const char* env_tenant = getenv("OFF_TENANT");
+    gDvm.offTenant = env_tenant ? strtoul(env_tenant, NULL, 10) : 0;
     gDvm.methodExePointMap = new std::map<const Method*, u4>();
-    gDvm.methodExeCountMap = new std::map<char*, u4, charscomp>();
-    res = offThreadingStartup() &&
+    res = offTelemetryStartup() && offThreadingStartup() &&
           offDexLoaderStartup() && offCommStartup() &&
           offSyncStartup() && offMethodRulesStartup() &&
-          offRecoveryStartup();
+          offRecoveryStartup() && offSchedulerStartup();
   } else {
     struct addrinfo hints;
     memset(&hints, 0, sizeof(hints));
@@ -728,6 +1944,10 @@ bool offControlStartup(int afterZygote) {
   return res;
 }
 
+void offControlEndSession() {
+  writeFdFull(gDvm.offNetPipe[1], PIPE_END_SESSION);
+}
+
 void offControlShutdown() {
   gDvm.offControlShutdown = true;
   if(gDvm.offConnected) {
@@ -737,12 +1957,15 @@ void offControlShutdown() {
   }
 
   staticfile.close();
+  offAnalysisImageClose();
   offSyncShutdown();
   offEngineShutdown();
   offCommShutdown();
   offDexLoaderShutdown();
   offThreadingShutdown();
   offRecoveryShutdown();
+  offSchedulerShutdown();
+  offTelemetryShutdown();
 
   pthread_mutex_destroy(&gDvm.offNetStatLock);
 }
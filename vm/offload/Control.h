@@ -10,7 +10,8 @@
 bool offWellConnected();
 
 /* Check if the offload engine still has a connection to the tcpmux daemon.
- * Probably not much should need to use this. */
+ * A link that is being resumed still counts.  Probably not much should need
+ * to use this. */
 bool offConnected();
 
 /* Write data to the fifo buffer of the parallel thread. */
@@ -33,6 +34,9 @@ SIZED_WRITE(8, htonll);
  * of data comes in. */
 void offReadBuffer(struct Thread* self, char* buf, u4 size);
 
+/* Like offReadBuffer but appends the data to fb without an extra copy. */
+void offReadFifo(struct Thread* self, FifoBuffer* fb, u4 size);
+
 //TODO: We can actually handle the common case without a lock if we're a bit
 // cleverer or change the semantics of the fifo read functions.
 #define SIZED_READ(sz, ntoh)                                                \
@@ -67,4 +71,9 @@ bool offControlStartup(int afterZygote);
 
 void offControlShutdown();
 
+/* Give up on the current session from any thread, e.g. when the peer sent
+ * something that can't be used.  The control loop ends it as if the link had
+ * been refused. */
+void offControlEndSession();
+
 #endif // OFFLOAD_CONTROL_H
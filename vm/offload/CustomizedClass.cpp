@@ -839,6 +839,10 @@ static void cloneMethod(Method* dst, const Method* src)
         dvmAbort();
     }
     memcpy(dst, src, sizeof(Method));
+#ifdef WITH_OFFLOAD
+    /* The clone gets a class of its own, and with that a different key. */
+    dst->offSlot = NULL;
+#endif
 }
 
 /*
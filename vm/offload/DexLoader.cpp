@@ -3,11 +3,55 @@
 #include "alloc/HeapInternal.h"
 #include "alloc/MarkSweep.h"
 
+#include "libdex/sha1.h"
+
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <limits.h>
 
+#include <algorithm>
+#include <vector>
+
+/* Dex files the server is missing are sent as a diff against the cached file
+ * that most likely holds an earlier version of them, rsync style.  The server
+ * sends a weak rolling checksum and a truncated SHA-1 of every block of the
+ * base and the client answers with a series of ops: copy a block of the base
+ * or take literal bytes. */
+#define DEX_DIFF_BLOCK 2048
+#define DEX_DIFF_STRONG 8
+#define DEX_DIFF_MAX_LITERAL (64 << 10)
+
+#define DEX_OP_END     0
+#define DEX_OP_COPY    1
+#define DEX_OP_LITERAL 2
+
+/* An entry of the server's dex cache. */
+typedef struct DexCacheEntry {
+  u1 hash[kSHA1DigestLen];
+
+  /* Path the client loaded the file from, used to find the base for a diff.
+   * Empty if unknown. */
+  char* source;
+  u4 length;
+} DexCacheEntry;
+
+/* A dex file announced by the pushing end. */
+typedef struct PendingDex {
+  u4 dexId;
+  u1 hash[kSHA1DigestLen];
+  char* source;
+  bool missing;
+  DexCacheEntry* base;
+} PendingDex;
+
+typedef struct BlockSum {
+  u4 weak;
+  u1 strong[DEX_DIFF_STRONG];
+  u4 index;
+} BlockSum;
+
 static
 void makeClassLoader(DvmDex* pDvmDex) {
   // This is sort of a hack but much better than what existed before.  We need
@@ -85,20 +129,19 @@ void makeClassLoader(DvmDex* pDvmDex) {
   --self->offProtection;
 }
 
-// Get the path to the cached dex file for a given hash.
-static int getCacheFile(char* path, u4 size, bool tmp, u1* hash) {
+// Get the path to the cached dex file for a given hash, with suffix appended.
+static int getCacheFile(char* path, u4 size, const char* suffix, u1* hash) {
   char* BASE_PATH = getenv("OFFLOAD_DEX_CACHE");
+  if(BASE_PATH == NULL) return 0;
   u4 basePathLen = strlen(BASE_PATH);
-  if(basePathLen + kSHA1DigestLen * 2 + 6 >= size) return 0;
+  if(basePathLen + kSHA1DigestLen * 2 + strlen(suffix) + 2 >= size) return 0;
   memcpy(path, BASE_PATH, basePathLen);
   path[basePathLen] = '/';
   u4 i;
   for(i = 0; i < kSHA1DigestLen; i++) {
     sprintf(path + basePathLen + 1 + 2 * i, "%02x", hash[i]);
   }
-  if(tmp) {
-    sprintf(path + basePathLen + 1 + kSHA1DigestLen * 2, "%s", ".tmp");
-  }
+  sprintf(path + basePathLen + 1 + kSHA1DigestLen * 2, "%s", suffix);
   return 1;
 }
 
@@ -106,8 +149,8 @@ static int getCacheFile(char* path, u4 size, bool tmp, u1* hash) {
 // returns a file descriptor for it.  Returns -1 on failure.
 static int openCachedDex(u1* hash, bool tmp) {
   char path[PATH_MAX];
-  if(getCacheFile(path, sizeof(path), tmp, hash)) {
-    return open(path, tmp ? O_CREAT|O_WRONLY|O_TRUNC : O_RDONLY, 0664);
+  if(getCacheFile(path, sizeof(path), tmp ? ".tmp" : "", hash)) {
+    return open(path, tmp ? O_CREAT|O_RDWR|O_TRUNC : O_RDONLY, 0664);
   } else {
     return -1;
   }
@@ -116,8 +159,8 @@ static int openCachedDex(u1* hash, bool tmp) {
 static int moveTmpAndOpen(u1* hash) {
   char path[PATH_MAX];
   char pathtmp[PATH_MAX];
-  if(getCacheFile(path, sizeof(path), false, hash) &&
-     getCacheFile(pathtmp, sizeof(pathtmp), true, hash)) {
+  if(getCacheFile(path, sizeof(path), "", hash) &&
+     getCacheFile(pathtmp, sizeof(pathtmp), ".tmp", hash)) {
     if(link(pathtmp, path)) {
       perror("moveTmpAndOpen (link)");
       return -1;
@@ -130,6 +173,305 @@ static int moveTmpAndOpen(u1* hash) {
   return open(path, O_RDONLY);
 }
 
+static bool parseHash(const char* hex, u1* hash) {
+  for(u4 i = 0; i < kSHA1DigestLen; i++) {
+    unsigned int b;
+    if(sscanf(hex + 2 * i, "%2x", &b) != 1) return false;
+    hash[i] = (u1)b;
+  }
+  return true;
+}
+
+static void addCacheEntry(u1* hash, const char* source, u4 length) {
+  DexCacheEntry* entry = (DexCacheEntry*)malloc(sizeof(DexCacheEntry));
+  memcpy(entry->hash, hash, kSHA1DigestLen);
+  entry->source = strdup(source);
+  entry->length = length;
+  auxVectorPushV(&gDvm.dexCacheIndex, entry);
+}
+
+/* Build the index of the cache directory.  Each cached file is named by its
+ * signature and has a .src file next to it with the path the client had it
+ * at, so the index survives server restarts. */
+static void scanDexCache() {
+  if(gDvm.dexCacheScanned) return;
+  gDvm.dexCacheScanned = true;
+
+  char* base = getenv("OFFLOAD_DEX_CACHE");
+  DIR* dir = base ? opendir(base) : NULL;
+  if(dir == NULL) return;
+  struct dirent* ent;
+  while((ent = readdir(dir)) != NULL) {
+    u1 hash[kSHA1DigestLen];
+    if(strlen(ent->d_name) != kSHA1DigestLen * 2 ||
+       !parseHash(ent->d_name, hash)) {
+      continue;
+    }
+
+    char path[PATH_MAX];
+    struct stat st;
+    if(!getCacheFile(path, sizeof(path), "", hash) || stat(path, &st)) {
+      continue;
+    }
+    char source[PATH_MAX] = "";
+    if(getCacheFile(path, sizeof(path), ".src", hash)) {
+      int fd = open(path, O_RDONLY);
+      if(fd != -1) {
+        ssize_t n = read(fd, source, sizeof(source) - 1);
+        source[n > 0 ? n : 0] = 0;
+        close(fd);
+      }
+    }
+    addCacheEntry(hash, source, (u4)st.st_size);
+  }
+  closedir(dir);
+  ALOGI("Dex cache holds %u files", auxVectorSize(&gDvm.dexCacheIndex));
+}
+
+/* Record a file just added to the cache. */
+static void noteCachedDex(u1* hash, const char* source, u4 length) {
+  char path[PATH_MAX];
+  if(getCacheFile(path, sizeof(path), ".src", hash)) {
+    int fd = open(path, O_CREAT|O_WRONLY|O_TRUNC, 0664);
+    if(fd != -1) {
+      if(write(fd, source, strlen(source)) < 0) {
+        perror("noteCachedDex (write)");
+      }
+      close(fd);
+    }
+  }
+  addCacheEntry(hash, source, length);
+}
+
+/* Pick the cached file most likely to be an earlier version of a file the
+ * client loaded from source: the one whose source path shares the longest
+ * prefix with it, which catches reinstalls (foo-1.apk, foo-2.apk) of the
+ * same package. */
+static DexCacheEntry* findDiffBase(const char* source) {
+  DexCacheEntry* best = NULL;
+  u4 bestLen = strlen(source) / 2;
+  for(u4 i = 0; i < auxVectorSize(&gDvm.dexCacheIndex); i++) {
+    DexCacheEntry* entry =
+        (DexCacheEntry*)auxVectorGet(&gDvm.dexCacheIndex, i).v;
+    u4 len = 0;
+    while(source[len] && source[len] == entry->source[len]) len++;
+    if(len > bestLen) {
+      best = entry;
+      bestLen = len;
+    }
+  }
+  return best;
+}
+
+/* rsync's weak checksum of n bytes; it can be rolled forward a byte at a
+ * time by rollWeak. */
+static u4 weakSum(const u1* p, u4 n) {
+  u4 a = 0, b = 0;
+  for(u4 i = 0; i < n; i++) {
+    a += p[i];
+    b += (n - i) * p[i];
+  }
+  return (a & 0xFFFF) | b << 16;
+}
+
+static u4 rollWeak(u4 sum, u4 n, u1 out, u1 in) {
+  u4 a = (sum & 0xFFFF) - out + in;
+  u4 b = (sum >> 16) - n * out + a;
+  return (a & 0xFFFF) | b << 16;
+}
+
+static void strongSum(const u1* p, u4 n, u1* out) {
+  SHA1_CTX ctx;
+  unsigned char digest[HASHSIZE];
+  SHA1Init(&ctx);
+  SHA1Update(&ctx, p, n);
+  SHA1Final(digest, &ctx);
+  memcpy(out, digest, DEX_DIFF_STRONG);
+}
+
+static bool blockSumLess(const BlockSum& x, const BlockSum& y) {
+  return x.weak < y.weak;
+}
+
+/* Send the block sums of the cached file base, or an empty list if there
+ * is no base or it can't be read. */
+static void writeBlockSums(Thread* self, DexCacheEntry* base) {
+  int fd = base ? openCachedDex(base->hash, false) : -1;
+  MemMapping mMap;
+  if(fd == -1 || sysMapFileInShmemReadOnly(fd, &mMap)) {
+    if(fd != -1) close(fd);
+    offWriteU4(self, DEX_DIFF_BLOCK);
+    offWriteU4(self, 0);
+    return;
+  }
+  close(fd);
+
+  u4 blocks = mMap.length / DEX_DIFF_BLOCK;
+  offWriteU4(self, DEX_DIFF_BLOCK);
+  offWriteU4(self, blocks);
+  for(u4 i = 0; i < blocks; i++) {
+    const u1* p = (const u1*)mMap.addr + i * DEX_DIFF_BLOCK;
+    u1 strong[DEX_DIFF_STRONG];
+    strongSum(p, DEX_DIFF_BLOCK, strong);
+    offWriteU4(self, weakSum(p, DEX_DIFF_BLOCK));
+    offSendMessage(self, (char*)strong, DEX_DIFF_STRONG);
+  }
+  sysReleaseShmem(&mMap);
+}
+
+static void writeLiteral(Thread* self, const u1* p, u4 n) {
+  while(n > 0) {
+    u4 amt = n < DEX_DIFF_MAX_LITERAL ? n : DEX_DIFF_MAX_LITERAL;
+    offWriteU1(self, DEX_OP_LITERAL);
+    offWriteU4(self, amt);
+    offSendMessage(self, (const char*)p, amt);
+    p += amt;
+    n -= amt;
+  }
+}
+
+/* Send data as ops against the blocks described by sums followed by the
+ * SHA-1 of the whole of data.  Returns the number of literal bytes. */
+static u4 writeDexDiff(Thread* self, const u1* data, u4 n, u4 blockSize,
+                       std::vector<BlockSum>* sums) {
+  std::sort(sums->begin(), sums->end(), blockSumLess);
+  u4 literal = 0;
+  u4 pos = 0, litStart = 0;
+  if(!sums->empty() && n >= blockSize) {
+    u4 weak = weakSum(data, blockSize);
+    for(;;) {
+      BlockSum key;
+      key.weak = weak;
+      std::vector<BlockSum>::iterator it =
+          std::lower_bound(sums->begin(), sums->end(), key, blockSumLess);
+      bool matched = false;
+      if(it != sums->end() && it->weak == weak) {
+        u1 strong[DEX_DIFF_STRONG];
+        strongSum(data + pos, blockSize, strong);
+        for(; it != sums->end() && it->weak == weak; ++it) {
+          if(!memcmp(strong, it->strong, DEX_DIFF_STRONG)) {
+            matched = true;
+            break;
+          }
+        }
+      }
+      if(matched) {
+        writeLiteral(self, data + litStart, pos - litStart);
+        literal += pos - litStart;
+        offWriteU1(self, DEX_OP_COPY);
+        offWriteU4(self, it->index);
+        pos += blockSize;
+        litStart = pos;
+        if(pos + blockSize > n) break;
+        weak = weakSum(data + pos, blockSize);
+      } else {
+        if(pos + blockSize >= n) break;
+        weak = rollWeak(weak, blockSize, data[pos], data[pos + blockSize]);
+        pos++;
+      }
+    }
+  }
+  writeLiteral(self, data + litStart, n - litStart);
+  literal += n - litStart;
+  offWriteU1(self, DEX_OP_END);
+
+  SHA1_CTX ctx;
+  unsigned char digest[HASHSIZE];
+  SHA1Init(&ctx);
+  SHA1Update(&ctx, data, n);
+  SHA1Final(digest, &ctx);
+  offSendMessage(self, (char*)digest, HASHSIZE);
+  return literal;
+}
+
+static void writeAll(int fd, const char* buf, u4 amt) {
+  u4 wamt = 0;
+  while(wamt < amt) {
+    ssize_t res = write(fd, buf + wamt, amt - wamt);
+    if(res < 0) {
+      ALOGE("Error loading dex from client");
+      dvmAbort();
+    }
+    wamt += res;
+  }
+}
+
+/* How readDexDiff ended. */
+enum {
+  DEX_DIFF_APPLIED,
+  DEX_DIFF_LOST,     /* The link went down. */
+  DEX_DIFF_MISMATCH, /* The ops did not rebuild the client's file. */
+};
+
+/* Rebuild a missing dex file from the ops sent by writeDexDiff into the cache.
+ * The ops come from the client, which may be out of date or broken; if they
+ * refer to blocks we don't have or produce the wrong file the rest of them is
+ * still read so the stream stays in step, and nothing is added to the cache. */
+static int readDexDiff(Thread* self, PendingDex* pend) {
+  u4 length = offReadU4(self);
+  int baseFd = pend->base ? openCachedDex(pend->base->hash, false) : -1;
+  int fd = openCachedDex(pend->hash, true);
+  if(fd == -1) {
+    ALOGE("Failed to create dex cache file");
+    dvmAbort();
+  }
+
+  SHA1_CTX ctx;
+  SHA1Init(&ctx);
+  char buf[DEX_DIFF_BLOCK];
+  u4 written = 0;
+  bool bad = false;
+  for(u1 op = offReadU1(self); op != DEX_OP_END && gDvm.offConnected;
+      op = offReadU1(self)) {
+    if(op == DEX_OP_COPY) {
+      u4 index = offReadU4(self);
+      if(bad) continue;
+      if(baseFd == -1 || pread(baseFd, buf, DEX_DIFF_BLOCK,
+                               (off_t)index * DEX_DIFF_BLOCK) !=
+                         DEX_DIFF_BLOCK) {
+        ALOGW("Bad block %u in dex diff for %s", index, pend->source);
+        bad = true;
+        continue;
+      }
+      writeAll(fd, buf, DEX_DIFF_BLOCK);
+      SHA1Update(&ctx, (unsigned char*)buf, DEX_DIFF_BLOCK);
+      written += DEX_DIFF_BLOCK;
+    } else {
+      for(u4 amt = offReadU4(self); amt > 0 && gDvm.offConnected; ) {
+        u4 n = amt < sizeof(buf) ? amt : sizeof(buf);
+        offReadBuffer(self, buf, n);
+        if(!bad) {
+          writeAll(fd, buf, n);
+          SHA1Update(&ctx, (unsigned char*)buf, n);
+          written += n;
+        }
+        amt -= n;
+      }
+    }
+  }
+  u1 digest[HASHSIZE];
+  u1 expected[HASHSIZE];
+  offReadBuffer(self, (char*)expected, sizeof(expected));
+  SHA1Final(digest, &ctx);
+  close(fd);
+  if(baseFd != -1) close(baseFd);
+  if(!gDvm.offConnected) return DEX_DIFF_LOST;
+
+  if(bad || written != length || memcmp(digest, expected, HASHSIZE)) {
+    ALOGW("Dex file %s rebuilt from diff does not match the client's",
+          pend->source);
+    char path[PATH_MAX];
+    if(getCacheFile(path, sizeof(path), ".tmp", pend->hash)) {
+      unlink(path);
+    }
+    return DEX_DIFF_MISMATCH;
+  }
+  fd = moveTmpAndOpen(pend->hash);
+  if(fd != -1) close(fd);
+  noteCachedDex(pend->hash, pend->source, length);
+  return DEX_DIFF_APPLIED;
+}
+
 void offRegisterDex(DvmDex* pDvmDex, Object* loader, const char* cacheFile) {
   u4 dexId;
   pthread_mutex_lock(&gDvm.dexLoadLock); {
@@ -155,7 +497,6 @@ void offPushDexFiles(Thread* self) {
   Vector vamp;
   memset(&vamp, 0, sizeof(vamp)); /* memset to get rid of warning. */
 
-ALOGI("PUSHHY %d", auxVectorSize(&gDvm.dexList));
   pthread_mutex_lock(&gDvm.dexLoadLock); {
     /* If someone is already pushing out dex files we need to wait until it's
      * completed before we move on */
@@ -175,81 +516,120 @@ ALOGI("PUSHHY %d", auxVectorSize(&gDvm.dexList));
   } pthread_mutex_unlock(&gDvm.dexLoadLock);
 
   if(doPush) {
+    /* Announce every pending dex file in one go with its signature and where
+     * we loaded it from.  The remote end asks for the ones it doesn't have
+     * cached in a single query and resumes us once they are all loaded. */
+    u8 start = dvmGetRelativeTimeUsec();
     u4 i;
     for(i = 0; i < auxVectorSize(&vamp); i++) {
-ALOGI("PUSHING DEX");
-      /* Send a dex load message along with the dex id and signature so the
-       * remote end can load it if it already owns the dex file. */
       DvmDex* pDvmDex = (DvmDex*)auxVectorGet(&vamp, i).v;
+      u4 len = strlen(pDvmDex->cacheFile);
       offWriteU4(self, offDexToId(pDvmDex));
       offSendMessage(self, (char*)pDvmDex->pHeader->signature, kSHA1DigestLen);
-      offThreadWaitForResume(self);
+      offWriteU4(self, len);
+      offSendMessage(self, pDvmDex->cacheFile, len);
     }
+    offWriteU4(self, (u4)-1);
+    offThreadWaitForResume(self);
+    offTelemetryRecord(self, OFF_HIST_DEX_PUSH_US,
+                       dvmGetRelativeTimeUsec() - start);
 
     pthread_mutex_lock(&gDvm.dexLoadLock); {
       gDvm.dexPushing = false;
       pthread_cond_broadcast(&gDvm.dexPushedCond);
     } pthread_mutex_unlock(&gDvm.dexLoadLock);
     auxVectorDestroy(&vamp);
+    return;
   }
   offWriteU4(self, (u4)-1);
 }
 
-void offPullDexFiles(Thread* self) {
-  u4 dexId;
-  for(dexId = offReadU4(self); dexId != (u4)-1; dexId = offReadU4(self)) {
-    u1 hash[kSHA1DigestLen];
-    offReadBuffer(self, (char*)hash, sizeof(hash));
-    if(!gDvm.offConnected) return;
-
-ALOGI("READ DEX %d", dexId);
+bool offPullDexFiles(Thread* self) {
+  std::vector<PendingDex> pending;
+  u4 dexId, i;
+  for(dexId = offReadU4(self); dexId != (u4)-1 && gDvm.offConnected;
+      dexId = offReadU4(self)) {
+    PendingDex pend;
+    pend.dexId = dexId;
+    offReadBuffer(self, (char*)pend.hash, sizeof(pend.hash));
+    u4 len = offReadU4(self);
+    if(!gDvm.offConnected) break;
+    pend.source = (char*)malloc(len + 1);
+    offReadBuffer(self, pend.source, len);
+    pend.source[len] = 0;
+    pend.missing = false;
+    pend.base = NULL;
+    pending.push_back(pend);
+  }
 
-    DvmDex* result = NULL;
-    int fd = openCachedDex(hash, false);
+  bool ok = gDvm.offConnected;
+  u4 missing = 0;
+  for(i = 0; ok && i < pending.size(); i++) {
+    int fd = openCachedDex(pending[i].hash, false);
     if(fd != -1) {
-      /* Hooray we have the dex file cached, load that! */
-      dvmDexFileOpenFromFd(fd, &result);
       close(fd);
     } else {
-      /* That failed... now we need to request the whole dex file. */
-      offWriteU1(self, OFF_ACTION_DEX_QUERYDEX);
-      offWriteU4(self, dexId);
-      offThreadWaitForResume(self);
-
-      char buf[512];
-      u4 length = offReadU4(self);
-      if(!gDvm.offConnected) return;
-
-      fd = openCachedDex(hash, true);
-      while(length > 0) {
-        u4 amt = length < sizeof(buf) ? length : sizeof(buf);
-        offReadBuffer(self, buf, amt);
-        if(!gDvm.offConnected) {
-          close(fd);
-          return;
-        }
-        
-        u4 wamt = 0;
-        while(wamt < amt) {
-          ssize_t res = write(fd, buf + wamt, amt - wamt);
-          if(res < 0) {
-            ALOGE("Error loading dex from client");
-            dvmAbort();
-          }
-          wamt += res;
-        }
-        length -= amt;
+      pending[i].missing = true;
+      missing++;
+    }
+  }
+
+  if(ok && missing > 0) {
+    scanDexCache();
+    for(i = 0; i < pending.size(); i++) {
+      if(pending[i].missing) {
+        pending[i].base = findDiffBase(pending[i].source);
       }
-      close(fd);
+    }
+  }
 
+  /* Ask for everything we are missing at once, offering a diff base for
+   * each.  Files whose diff did not apply are asked for again in full. */
+  bool full = false;
+  while(ok && missing > 0) {
+    offWriteU1(self, OFF_ACTION_DEX_QUERYDEX);
+    offWriteU4(self, missing);
+    for(i = 0; i < pending.size(); i++) {
+      if(!pending[i].missing) continue;
+      offWriteU4(self, pending[i].dexId);
+      writeBlockSums(self, full ? NULL : pending[i].base);
+    }
+    offThreadWaitForResume(self);
+
+    missing = 0;
+    for(i = 0; ok && i < pending.size(); i++) {
+      if(!pending[i].missing) continue;
+      int res = readDexDiff(self, &pending[i]);
+      if(res == DEX_DIFF_LOST) {
+        ok = false;
+      } else if(res == DEX_DIFF_APPLIED) {
+        pending[i].missing = false;
+      } else {
+        missing++;
+      }
+    }
+    if(ok) {
       offWriteU1(self, OFF_ACTION_RESUME);
+    }
+    if(ok && missing > 0 && full) {
+      ALOGE("Client sent %u dex files that do not match their signature",
+            missing);
+      offControlEndSession();
+      ok = false;
+    }
+    full = true;
+  }
 
-      fd = moveTmpAndOpen(hash);
+  for(i = 0; ok && i < pending.size(); i++) {
+    DvmDex* result = NULL;
+    int fd = openCachedDex(pending[i].hash, false);
+    if(fd != -1) {
       dvmDexFileOpenFromFd(fd, &result);
       close(fd);
     }
     assert(result && "failed to load dex file");
-    
+
+    dexId = pending[i].dexId;
     result->id = dexId;
     makeClassLoader(result);
     pthread_mutex_lock(&gDvm.dexLoadLock); {
@@ -258,9 +638,15 @@ ALOGI("READ DEX %d", dexId);
       }
       auxVectorSetV(&gDvm.dexList, dexId, result);
     } pthread_mutex_unlock(&gDvm.dexLoadLock);
-
+  }
+  if(ok && !pending.empty()) {
     offWriteU1(self, OFF_ACTION_RESUME);
   }
+
+  for(i = 0; i < pending.size(); i++) {
+    free(pending[i].source);
+  }
+  return ok;
 }
 
 DvmDex* offIdToDex(u4 id) {
@@ -274,25 +660,47 @@ u4 offDexToId(DvmDex* pDvmDex) {
 }
 
 void offPerformQueryDex(Thread* self) {
-  u4 dexId = offReadU4(self);
+  u4 count = offReadU4(self);
+  std::vector<u4> ids;
+  std::vector<u4> blockSizes;
+  std::vector<std::vector<BlockSum> > sums(count);
+  for(u4 i = 0; i < count && gDvm.offConnected; i++) {
+    ids.push_back(offReadU4(self));
+    blockSizes.push_back(offReadU4(self));
+    u4 blocks = offReadU4(self);
+    for(u4 j = 0; j < blocks && gDvm.offConnected; j++) {
+      BlockSum sum;
+      sum.weak = offReadU4(self);
+      offReadBuffer(self, (char*)sum.strong, DEX_DIFF_STRONG);
+      sum.index = j;
+      sums[i].push_back(sum);
+    }
+  }
   if(!gDvm.offConnected) return;
-  DvmDex* dex = offIdToDex(dexId);
-  assert(dex->cacheFile != NULL);
-
-  int fd = open(dex->cacheFile, O_RDONLY);
-  assert(fd != -1);
-
-  MemMapping mMap;
-  int res = sysMapFileInShmemReadOnly(fd, &mMap);
-  if(res) dvmAbort();
-  close(fd);
 
   offWriteU1(self, OFF_ACTION_RESUME);
-  offWriteU4(self, dex->memMap.length);
-  offSendMessage(self, (char*)mMap.addr, mMap.length);
+  for(u4 i = 0; i < count; i++) {
+    DvmDex* dex = offIdToDex(ids[i]);
+    assert(dex->cacheFile != NULL);
+
+    int fd = open(dex->cacheFile, O_RDONLY);
+    assert(fd != -1);
+
+    MemMapping mMap;
+    int res = sysMapFileInShmemReadOnly(fd, &mMap);
+    if(res) dvmAbort();
+    close(fd);
+
+    offWriteU4(self, mMap.length);
+    u4 literal = writeDexDiff(self, (const u1*)mMap.addr, mMap.length,
+                              blockSizes[i], &sums[i]);
+    ALOGI("Sent dex %s: %u of %u bytes literal", dex->cacheFile, literal,
+          (u4)mMap.length);
+    offTelemetryCount(self, OFF_STAT_DEX_FILES, 1);
+    offTelemetryCount(self, OFF_STAT_DEX_BYTES, literal);
+    sysReleaseShmem(&mMap);
+  }
   offThreadWaitForResume(self);
-
-  sysReleaseShmem(&mMap);
 }
 
 void offGcMarkDexRefs(bool remark) {
@@ -321,6 +729,8 @@ bool offDexLoaderStartup() {
   gDvm.dexPushList = auxVectorCreate(1);
   gDvm.dexPushing = false;
   gDvm.dexBootstrapCount = 0;
+  gDvm.dexCacheIndex = auxVectorCreate(0);
+  gDvm.dexCacheScanned = false;
   return true;
 }
 
@@ -329,4 +739,11 @@ void offDexLoaderShutdown() {
   pthread_cond_destroy(&gDvm.dexPushedCond);
   auxVectorDestroy(&gDvm.dexList);
   auxVectorDestroy(&gDvm.dexPushList);
+  for(u4 i = 0; i < auxVectorSize(&gDvm.dexCacheIndex); i++) {
+    DexCacheEntry* entry =
+        (DexCacheEntry*)auxVectorGet(&gDvm.dexCacheIndex, i).v;
+    free(entry->source);
+    free(entry);
+  }
+  auxVectorDestroy(&gDvm.dexCacheIndex);
 }
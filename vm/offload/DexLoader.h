@@ -20,7 +20,10 @@ u4 offDexToId(struct DvmDex* pDvmDex);
  * waits for any pending dex files to finish sending. */
 void offPushDexFiles(Thread* self);
 
-void offPullDexFiles(struct Thread* self);
+/* Load the dex files announced by offPushDexFiles, fetching any we don't have
+ * cached.  Returns false if the link went down or the session had to be given
+ * up because the client's files could not be rebuilt. */
+bool offPullDexFiles(struct Thread* self);
 
 void offPerformQueryDex(struct Thread* self);
 
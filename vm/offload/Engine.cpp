@@ -10,7 +10,8 @@
 #define READWRITEFUNC(type, size, ntoh, hton)                                 \
   static void write##size(FifoBuffer* fb, type v) {                           \
     v = hton(v);                                                              \
-    auxFifoPushData(fb, (char*)&v, sizeof(v));                                \
+    memcpy(auxFifoReserve(fb, sizeof(v)), &v, sizeof(v));                    \
+    auxFifoCommit(fb, sizeof(v));                                             \
   }                                                                           \
   static type read##size(FifoBuffer* fb) {                                    \
     type v;                                                                   \
@@ -41,15 +42,17 @@ void offJumpIntoInterp(Thread* self) {
     dvmAbort();
   }
 
-ALOGI("Enter interp %s %s %d", saveArea->method->clazz->descriptor,
-saveArea->method->name, saveArea->xtra.currentPc - saveArea->method->insns);
+  ALOGV("Enter interp %s %s %d", saveArea->method->clazz->descriptor,
+        saveArea->method->name,
+        saveArea->xtra.currentPc - saveArea->method->insns);
 
   dvmInterpretPortable(self);
 
-saveArea = SAVEAREA_FROM_FP(sst->curFrame);
-ALOGI("Leave interp %s %s %d %d", saveArea->method->clazz->descriptor,
-saveArea->method->name, saveArea->xtra.currentPc - saveArea->method->insns,
-dvmCheckException(self));
+  saveArea = SAVEAREA_FROM_FP(sst->curFrame);
+  ALOGV("Leave interp %s %s %d %d", saveArea->method->clazz->descriptor,
+        saveArea->method->name,
+        saveArea->xtra.currentPc - saveArea->method->insns,
+        dvmCheckException(self));
 }
 
 static void doActivate(Thread* self, FifoBuffer* fb) {
@@ -58,7 +61,7 @@ static void doActivate(Thread* self, FifoBuffer* fb) {
 
   u4 objId;
   for(objId = readU4(fb); objId != (u4)-1; objId = readU4(fb)) {
-ALOGI("THREAD %d: RECEIVE OWNERSHIP OF %d", self->threadId, objId);
+    ALOGV("THREAD %d: RECEIVE OWNERSHIP OF %d", self->threadId, objId);
     ObjectInfo* info = offIdObjectInfo(objId);
     assert(info && info->obj && !info->isLockOwner);
     offTakeOwnershipSuspend(info->obj, readU4(fb));
@@ -91,7 +94,7 @@ static void doDeactivate(Thread* self, FifoBuffer* fb) {
     assert(info && info->obj == obj);
     if(!info->isLockOwner) continue;
 
-ALOGI("THREAD %d: SEND OWNERSHIP OF %d", self->threadId, objId);
+    ALOGV("THREAD %d: SEND OWNERSHIP OF %d", self->threadId, objId);
     writeU4(fb, objId);
     writeU4(fb, offGetLocalWaiters(info->obj));
     info->isLockOwner = false;
@@ -109,7 +112,7 @@ void offMigrateThread(Thread* self) {
   if(self->offProtection) return;
   if(!offRecoveryCheckEnterHazard(self)) return;
 
-  ALOGI("Migrating thread %d", self->threadId);
+  ALOGV("Migrating thread %d", self->threadId);
   
     // print stack information
   /*InterpSaveState* sst = &self->interpSave;
@@ -125,12 +128,15 @@ void offMigrateThread(Thread* self) {
     fp = saveArea->prevFrame;
   }*/
 
+  u8 start = dvmGetRelativeTimeUsec();
   self->offLocalOnly = false;
   self->migrationCounter++;
   self->offDeactivateBreakFrames = self->breakFrames;
   offWriteU1(self, OFF_ACTION_MIGRATE);
   deactivate(self);
   offThreadWaitForResume(self);
+  offTelemetryRecord(self, OFF_HIST_MIGRATION_US,
+                     dvmGetRelativeTimeUsec() - start);
 
   if(!self->offLocal && !self->offFlagDeath) {
     /* We lost the server.  Move back to running locally. */
@@ -139,7 +145,7 @@ void offMigrateThread(Thread* self) {
   }
 
   offRecoveryClearHazard(self);
-  ALOGI("Excep %d", dvmCheckException(self));
+  ALOGV("Excep %d", dvmCheckException(self));
 }
 
 bool offPerformMigrate(Thread* self) {
@@ -178,7 +184,7 @@ bool offPerformMigrate(Thread* self) {
   // let it run somehow
   //offJumpIntoInterp(self);
 
-  ALOGI("COLLAPSING DOWN %d %d", self->breakFrames, originalBreaks);
+  ALOGV("COLLAPSING DOWN %d %d", self->breakFrames, originalBreaks);
   return true;
 }
 
@@ -26,7 +26,7 @@ std::stringstream converter;
 /* the dictionary to match the class name and its index in the file */
 //std::map<char*, unsigned int, charscomp>* clazzNameDict = new std::map<char*, unsigned int, charscomp>();
 /* to store the offset in the file for a certain method */
-std::map<char*, unsigned int, charscomp>* methodClzAccMap = new std::map<char*, unsigned int, charscomp>();
+std::map<const Method*, unsigned int>* methodClzAccMap = new std::map<const Method*, unsigned int>();
 
 //void scanStatic(Method* method, std::set<Method*>* chain, std::map<ClassObject*, BitsVec*>* methodClzAccInfo);
 
@@ -42,65 +42,39 @@ void freeClazzAccInfoMap(std::map<ClassObject*, BitsVec*>* accMap) {
     delete accMap;
 }
 
-void persistClzAccInfo(Method* method, std::map<ClassObject*, BitsVec*>* result) {
-    std::streampos begin, end;
-    outputfile.seekp(0, std::ios::beg);
-    begin = outputfile.tellp(); 
-    outputfile.seekp(0, std::ios::end);
-    end = outputfile.tellp();
-    unsigned int offset = end - begin;
-    
-    const char* clazzName = method->clazz->descriptor;
-    const char* methodName = method->name;
-    char idxStr[33];
-    converter << method->idx;
-    converter >> idxStr;
-    converter.str("");
-    converter.clear();
-    char* key = new char[strlen(clazzName) + strlen(methodName) + strlen(idxStr) + 3];
-    strcpy(key, clazzName);
-    strcat(key, " ");
-    strcat(key, methodName);
-    strcat(key, " ");
-    strcat(key, idxStr);
-  
-    (*methodClzAccMap)[key] = offset;
-    //ALOGE("offset is: %u, key is: %s", offset, key);
-    // output method identification
-    outputfile << key << std::endl;
+static void writeClzAccInfo(std::ostream* dstfile, std::map<ClassObject*, BitsVec*>* result) {
     for (std::map<ClassObject*, BitsVec*>::iterator it = result->begin(); it != result->end(); ++it) {
         ClassObject* obj = it->first;
         //dstfile << (*clazzNameDict)[obj->descriptor] << std::endl;
-        outputfile << obj->descriptor << std::endl;
+        *dstfile << obj->descriptor << std::endl;
         BitsVec* bitsvec = it->second;
-        outputfile << bitsvec->size;
+        *dstfile << bitsvec->size;
         u4 sz = ((bitsvec->size - 1) >> 5) + 1;
         for(u4 i = 0; i < sz; i++) {
-            outputfile << " " << bitsvec->bits[i];
+            *dstfile << " " << bitsvec->bits[i];
         }
-        outputfile << std::endl;
+        *dstfile << std::endl;
     }
-    outputfile << std::endl;
 }
 
-void retrieveClzAccInfo(unsigned int fileoffset, std::map<ClassObject*, BitsVec*>* result) {
-    //ALOGE("retrive is called, where file offset is: %u", fileoffset);
-    outputfile.seekg(fileoffset);
+static void readClzAccInfo(std::istream* srcfile, std::map<ClassObject*, BitsVec*>* result) {
     std::string line;
-    // read the method name info
-    std::getline(outputfile, line);
     while(true) {
-        std::getline(outputfile, line);
+        std::getline(*srcfile, line);
         if(line.compare("") == 0) {
             break;
         }
         //unsigned int clazzIdx = atoi(line.c_str());
         //ClassObject* resClass = dvmLookupClass((*idxClazzNameDict)[clazzIdx], NULL, false);
         ClassObject* resClass = dvmLookupClass(line.c_str(), NULL, false);
-        std::getline(outputfile, line);
+        std::getline(*srcfile, line);
+        if(resClass == NULL) { // a cached result may name a class that has been removed since
+            continue;
+        }
         BitsVec* bitsvec = new BitsVec();
         unsigned int size = atoi(line.substr(0, line.find(" ")).c_str());
         bitsvec->size = size;
+        bitsvec->bits = NULL;
         if(size != 0) {
             u4 sz = ((size - 1) >> 5) + 1;
             bitsvec->bits = (u4*)calloc(sz, 4);
@@ -114,6 +88,77 @@ void retrieveClzAccInfo(unsigned int fileoffset, std::map<ClassObject*, BitsVec*
     }
 }
 
+void persistClzAccInfo(Method* method, std::map<ClassObject*, BitsVec*>* result) {
+    std::streampos begin, end;
+    outputfile.seekp(0, std::ios::beg);
+    begin = outputfile.tellp(); 
+    outputfile.seekp(0, std::ios::end);
+    end = outputfile.tellp();
+    unsigned int offset = end - begin;
+    
+    (*methodClzAccMap)[method] = offset;
+    // output method identification
+    outputfile << method->clazz->descriptor << " " << method->name << " "
+               << method->idx << std::endl;
+    writeClzAccInfo(&outputfile, result);
+    outputfile << std::endl;
+}
+
+void retrieveClzAccInfo(unsigned int fileoffset, std::map<ClassObject*, BitsVec*>* result) {
+    //ALOGE("retrive is called, where file offset is: %u", fileoffset);
+    outputfile.seekg(fileoffset);
+    std::string line;
+    // read the method name info
+    std::getline(outputfile, line);
+    readClzAccInfo(&outputfile, result);
+}
+
+/* deep hashes of the methods scanStatic may reach, results stored under them in the analysis cache stay valid */
+static std::map<Method*, u8> staticHashes;
+
+static void collectStaticCallees(Method* method, std::vector<Method*>* callees) {
+    collectCallees(method, javaLangObject, callees);
+}
+
+static void openStaticCache(const char* basePath, std::vector<char*>* dexLocations) {
+    std::string cacheDir = std::string(basePath) + "/analysis-cache";
+    if(!offAnalysisCacheOpen(cacheDir.c_str())) {
+        return;
+    }
+    for(unsigned int idx = 0; idx < loadedDex.size(); idx++) {
+        offAnalysisCacheAddDex(loadedDex[idx], dexLocations->at(idx));
+    }
+    std::vector<Method*> methods;
+    offCollectDexMethods(&loadedDex, &methods);
+    offMethodDeepHashes(&methods, collectStaticCallees, &staticHashes);
+}
+
+static void closeStaticCache() {
+    offAnalysisCacheClose();
+    staticHashes.clear();
+}
+
+static bool loadCachedClzAccInfo(Method* method, std::map<ClassObject*, BitsVec*>* result) {
+    std::map<Method*, u8>::iterator hash = staticHashes.find(method);
+    std::string data;
+    if(hash == staticHashes.end() || !offAnalysisCacheLookup(method, hash->second, &data)) {
+        return false;
+    }
+    std::istringstream srcfile(data);
+    readClzAccInfo(&srcfile, result);
+    return true;
+}
+
+static void cacheClzAccInfo(Method* method, std::map<ClassObject*, BitsVec*>* result) {
+    std::map<Method*, u8>::iterator hash = staticHashes.find(method);
+    if(hash == staticHashes.end()) {
+        return;
+    }
+    std::ostringstream dstfile;
+    writeClzAccInfo(&dstfile, result);
+    offAnalysisCacheStore(method, hash->second, dstfile.str());
+}
+
 void mergeClzAccInfo(std::map<ClassObject*, BitsVec*>* methodClzAccInfo, std::map<ClassObject*, BitsVec*>* clazzAccMap) {
     for (std::map<ClassObject*, BitsVec*>::iterator it = clazzAccMap->begin(); it != clazzAccMap->end(); ++it) {
         if(methodClzAccInfo->find(it->first) == methodClzAccInfo->end()) {
@@ -163,22 +208,11 @@ void scanStatic(Method* method, std::map<ClassObject*, BitsVec*>* methodClzAccIn
         MethodFrame* curFrame = toprocess->at(frameIdx);
         // check if the current frame is making a cycle
         if((u4)curFrame->leftSize == dvmGetMethodInsnsSize(curFrame->method)) {
-            const char* clazzName = curFrame->method->clazz->descriptor;
-            const char* methodName = curFrame->method->name;
-            char idxStr[33];
-            converter << curFrame->method->idx;
-            converter >> idxStr;
-            converter.str("");
-            converter.clear();
-            char* key = new char[strlen(clazzName) + strlen(methodName) + strlen(idxStr) + 3];
-            strcpy(key, clazzName);
-            strcat(key, " ");
-            strcat(key, methodName);
-            strcat(key, " ");
-            strcat(key, idxStr);
             int callerIdx = curFrame->callerIdx;
-            if(methodClzAccMap->find(key) != methodClzAccMap->end()) {
-                unsigned int fileoffset = (*methodClzAccMap)[key];
+            std::map<const Method*, unsigned int>::iterator cached =
+                methodClzAccMap->find(curFrame->method);
+            if(cached != methodClzAccMap->end()) {
+                unsigned int fileoffset = cached->second;
                 retrieveClzAccInfo(fileoffset, curFrame->clzAccInfo);
                 if(callerIdx != -1) {
                     mergeClzAccInfo(toprocess->at(callerIdx)->clzAccInfo, curFrame->clzAccInfo);
@@ -187,7 +221,16 @@ void scanStatic(Method* method, std::map<ClassObject*, BitsVec*>* methodClzAccIn
                 delete curFrame;
                 continue;
             }
-            delete[] key;
+            // nothing the method reaches has changed since an earlier run
+            if(loadCachedClzAccInfo(curFrame->method, curFrame->clzAccInfo)) {
+                persistClzAccInfo(curFrame->method, curFrame->clzAccInfo);
+                if(callerIdx != -1) {
+                    mergeClzAccInfo(toprocess->at(callerIdx)->clzAccInfo, curFrame->clzAccInfo);
+                }
+                toprocess->pop_back();
+                delete curFrame;
+                continue;
+            }
             bool isCycle = false;
             while(callerIdx != -1) {
                 MethodFrame* callerFrame = toprocess->at(callerIdx);
@@ -209,6 +252,7 @@ void scanStatic(Method* method, std::map<ClassObject*, BitsVec*>* methodClzAccIn
         // check if the current method reaches the end
         if(curFrame->leftSize <= 0) {
             persistClzAccInfo(curFrame->method, curFrame->clzAccInfo);
+            cacheClzAccInfo(curFrame->method, curFrame->clzAccInfo);
             if(curFrame->callerIdx != -1) {
                 mergeClzAccInfo(toprocess->at(curFrame->callerIdx)->clzAccInfo, curFrame->clzAccInfo);
             }
@@ -447,18 +491,7 @@ static void persistResult(std::ofstream* staticfile, std::ofstream* offsetfile,
     //ALOGE("offset is: %u, key is: %s", offset, key);
     // output method identification
     *staticfile << key << std::endl;
-    for (std::map<ClassObject*, BitsVec*>::iterator it = result->begin(); it != result->end(); ++it) {
-        ClassObject* obj = it->first;
-        //dstfile << (*clazzNameDict)[obj->descriptor] << std::endl;
-        *staticfile << obj->descriptor << std::endl;
-        BitsVec* bitsvec = it->second;
-        *staticfile << bitsvec->size;
-        u4 sz = ((bitsvec->size - 1) >> 5) + 1;
-        for(u4 i = 0; i < sz; i++) {
-            *staticfile << " " << bitsvec->bits[i];
-        }
-        *staticfile << std::endl;
-    }
+    writeClzAccInfo(staticfile, result);
     *staticfile << std::endl;
     delete[] key;
 }
@@ -467,6 +500,7 @@ void loadKernel() {
     ClassPathEntry* entry;
     const char* bootPath = "/home/yli118/androidapk/data/data/jars/core.jar:/home/yli118/androidapk/data/data/jars/core-junit.jar:/home/yli118/androidapk/data/data/jars/bouncycastle.jar:/home/yli118/androidapk/data/data/jars/ext.jar:/home/yli118/androidapk/data/data/jars/framework.jar:/home/yli118/androidapk/data/data/jars/framework2.jar:/home/yli118/androidapk/data/data/jars/android.policy.jar:/home/yli118/androidapk/data/data/jars/services.jar:/home/yli118/androidapk/data/data/jars/apache-xml.jar:";
     entry = processClassPath(bootPath);
+    std::vector<char*> dexLocations;
     while (entry->kind != kCpeLastEntry) {
         DvmDex* pDvmDex;
         switch (entry->kind) {
@@ -490,6 +524,7 @@ void loadKernel() {
             return;
         }
         loadedDex.push_back(pDvmDex);
+        dexLocations.push_back(entry->fileName);
         pDvmDex->pDexFile->pClassLookup = dexCreateClassLookup(pDvmDex->pDexFile);
         entry++;
     }
@@ -556,6 +591,7 @@ void loadKernel() {
             }
         }
     }
+    openStaticCache(BASE_PATH, &dexLocations);
     
     for(unsigned int idx = 0; idx < loadedDex.size(); idx++) {
         DvmDex* pDvmDex = loadedDex[idx];
@@ -621,6 +657,7 @@ void loadKernel() {
     outputfile.close();
     reachableMethodFile.close();
     reachableOffsetFile.close();
+    closeStaticCache();
 }
 
 void loadApkStatic(char* apkPath) {
@@ -631,6 +668,7 @@ void loadApkStatic(char* apkPath) {
     strcat(classPath, apkPath);
     entry = processClassPath(classPath);
     delete[] classPath;
+    std::vector<char*> dexLocations;
     while (entry->kind != kCpeLastEntry) {
         DvmDex* pDvmDex;
         switch (entry->kind) {
@@ -654,6 +692,7 @@ void loadApkStatic(char* apkPath) {
             return;
         }
         loadedDex.push_back(pDvmDex);
+        dexLocations.push_back(entry->fileName);
         pDvmDex->pDexFile->pClassLookup = dexCreateClassLookup(pDvmDex->pDexFile);
         entry++;
     }
@@ -712,6 +751,7 @@ void loadApkStatic(char* apkPath) {
             }
         }
     }
+    openStaticCache(BASE_PATH, &dexLocations);
     
     //for(unsigned int idx = 0; idx < loadedDex.size(); idx++) {
         DvmDex* pDvmDex = loadedDex[loadedDex.size() - 1];
@@ -775,13 +815,14 @@ void loadApkStatic(char* apkPath) {
     staticfile.close();
     offsetfile.close();
     outputfile.close();
+    closeStaticCache();
     
     /*char offsetFileName[160];
     strcpy(offsetFileName, BASE_PATH);
     strcat(offsetFileName, "/offset.txt");
     std::ofstream offsetfile;
     offsetfile.open(offsetFileName, std::ios::trunc);
-    for (std::map<char*, unsigned int, charscomp>::iterator it = methodClzAccMap->begin(); it != methodClzAccMap->end(); ++it) {
+    for (std::map<const Method*, unsigned int>::iterator it = methodClzAccMap->begin(); it != methodClzAccMap->end(); ++it) {
         offsetfile << it->first << std::endl;
         offsetfile << it->second << std::endl;
     }
@@ -2,6 +2,8 @@
 #include "Dalvik.h"
 #include "CustomizedClass.h"
 #include "libdex/DexCatch.h"
+#include <new>
+#include <unistd.h>
 
 struct ParsedMethoOffInfo {
     int offStart;
@@ -20,6 +22,9 @@ std::fstream strDictFile;
 std::fstream poffFile;
 std::fstream presultFile;
 std::fstream presultFileTxt;
+// deep hashes of the methods in presult.bin when they were parsed, see AnalysisCache.h
+std::fstream phashFile;
+static std::map<Method*, u8> parsedMethodHashes;
 std::map<const char*, int, charscomp>* strOffMap = new std::map<const char*, int, charscomp>();
 std::map<int, const char*>* offStrMap = new std::map<int, const char*>();
 std::map<Method*, ParsedMethoOffInfo*>* parsedMethodOffMap = new std::map<Method*, ParsedMethoOffInfo*>();
@@ -33,8 +38,174 @@ static void copyParseInfo(ParseInfo* src, ParseInfo* dst);
 static void freeParseInfo(ParseInfo* parseInfo);
 static bool checkInterest(ParseInfo* parseInfo);
 static void loadStructureInFile(MethodAccInfo* methodAccInfo, int offStart, int length);
+static bool loadMethodSummary(MethodAccInfo* methodAccInfo);
+static bool claimMethodSummary(Method* method, bool* cycle);
+static void releaseMethodSummary(Method* method);
 void parseInsns(const u2* insns, MethodAccInfo* methodAccInfo, std::vector<Method*>* chain, int depth, bool* exitMethod);
 
+/*
+ * ObjectAccInfo and ClazzAccInfo nodes are allocated from an arena instead of
+ * new/delete.  Each analysis thread has its own arena, so allocation takes no
+ * lock; freed nodes go back on the arena's free list, and resetting the arena
+ * reclaims the nodes that became unreachable without being freed.  Summaries
+ * kept in the summary cache live in a separate arena guarded by the cache
+ * lock.
+ */
+#define ACC_ARENA_CHUNK_SLOTS 1024
+
+// stack of the analysis threads started by parseMethods
+static const size_t kParseThreadStackSize = 32 * 1024 * 1024;
+
+struct AccArena;
+
+struct AccSlot {
+    AccArena* arena;
+    AccSlot* nextFree;
+    bool live;
+    union {
+        char bytes[sizeof(ClazzAccInfo)];
+        void* alignPtr;
+        u8 alignLong;
+    } storage;
+};
+
+struct AccArenaChunk {
+    AccArenaChunk* next;
+    AccSlot slots[ACC_ARENA_CHUNK_SLOTS];
+};
+
+struct AccArena {
+    AccArenaChunk* chunks;
+    // slots handed out from the newest chunk
+    unsigned int used;
+    AccSlot* freeList;
+};
+
+static pthread_once_t parseStateOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t accArenaKey;
+// guards the summary cache, its arena and the summary owners
+static pthread_mutex_t summaryLock;
+// signalled when a summary owner lets go of its method
+static pthread_cond_t summaryCond;
+// guards the result files, strOffMap and parsedMethodOffMap
+static pthread_mutex_t parseFileLock;
+// guards subclassMap, implclassMap and class loading during resolution
+static pthread_mutex_t parseClassLock;
+static AccArena summaryArena;
+static std::map<Method*, MethodAccInfo*> summaryCache;
+// the thread parsing each method whose summary is not cached yet, and the method each waiting thread waits for
+static std::map<Method*, pthread_t> summaryOwners;
+static std::map<pthread_t, Method*> summaryWaits;
+// set while the analysis threads run, nothing new is resolved then
+static bool resolveFrozen;
+
+static void freeAccArena(void* arena);
+
+static void initParseState() {
+    pthread_key_create(&accArenaKey, freeAccArena);
+    pthread_mutex_init(&summaryLock, NULL);
+    pthread_cond_init(&summaryCond, NULL);
+    pthread_mutex_init(&parseFileLock, NULL);
+    pthread_mutex_init(&parseClassLock, NULL);
+}
+
+static void* allocAccSlot(AccArena* arena) {
+    AccSlot* slot = arena->freeList;
+    if(slot != NULL) {
+        arena->freeList = slot->nextFree;
+    } else {
+        if(arena->chunks == NULL || arena->used == ACC_ARENA_CHUNK_SLOTS) {
+            AccArenaChunk* chunk = (AccArenaChunk*) malloc(sizeof(AccArenaChunk));
+            if(chunk == NULL) {
+                ALOGE("methodParser failed to grow the node arena");
+                dvmAbort();
+            }
+            chunk->next = arena->chunks;
+            arena->chunks = chunk;
+            arena->used = 0;
+        }
+        slot = &arena->chunks->slots[arena->used++];
+    }
+    slot->arena = arena;
+    slot->live = true;
+    return slot->storage.bytes;
+}
+
+static void destroyAccNode(ObjectAccInfo* objAccInfo) {
+    for(unsigned int j = 0; j < objAccInfo->trackSet.size(); j++) {
+        if(objAccInfo->trackSet[j] != NULL) {
+            delete objAccInfo->trackSet[j];
+        }
+    }
+    objAccInfo->~ObjectAccInfo();
+}
+
+/* destroy every node still live in the arena and give its memory back */
+static void resetAccArena(AccArena* arena) {
+    // only the newest chunk is partly handed out
+    unsigned int count = arena->used;
+    while(arena->chunks != NULL) {
+        AccArenaChunk* chunk = arena->chunks;
+        for(unsigned int i = 0; i < count; i++) {
+            if(chunk->slots[i].live) {
+                destroyAccNode((ObjectAccInfo*) chunk->slots[i].storage.bytes);
+            }
+        }
+        arena->chunks = chunk->next;
+        count = ACC_ARENA_CHUNK_SLOTS;
+        free(chunk);
+    }
+    arena->used = 0;
+    arena->freeList = NULL;
+}
+
+static void freeAccArena(void* arena) {
+    resetAccArena((AccArena*) arena);
+    free(arena);
+}
+
+/* the calling thread's arena, created on first use */
+static AccArena* currentAccArena() {
+    pthread_once(&parseStateOnce, initParseState);
+    AccArena* arena = (AccArena*) pthread_getspecific(accArenaKey);
+    if(arena == NULL) {
+        arena = (AccArena*) calloc(1, sizeof(AccArena));
+        if(arena == NULL) {
+            ALOGE("methodParser failed to allocate a node arena");
+            dvmAbort();
+        }
+        pthread_setspecific(accArenaKey, arena);
+    }
+    return arena;
+}
+
+static ObjectAccInfo* newObjectAccInfo(AccArena* arena) {
+    return new (allocAccSlot(arena)) ObjectAccInfo();
+}
+
+static ObjectAccInfo* newObjectAccInfo() {
+    return newObjectAccInfo(currentAccArena());
+}
+
+static ClazzAccInfo* newClazzAccInfo(AccArena* arena) {
+    ClazzAccInfo* clazzAccInfo = new (allocAccSlot(arena)) ClazzAccInfo();
+    clazzAccInfo->clazz = NULL;
+    return clazzAccInfo;
+}
+
+static ClazzAccInfo* newClazzAccInfo() {
+    return newClazzAccInfo(currentAccArena());
+}
+
+/* return a node to the arena it was allocated from */
+static void freeObjectAccInfo(ObjectAccInfo* objAccInfo) {
+    AccSlot* slot = (AccSlot*) ((char*) objAccInfo - offsetof(AccSlot, storage));
+    destroyAccNode(objAccInfo);
+    slot->live = false;
+    slot->nextFree = slot->arena->freeList;
+    slot->arena->freeList = slot;
+}
+
 u2 inst_a(const u2* insns) {
     return (*insns >> 8) & 0x0f;
 }
@@ -58,17 +229,18 @@ static inline s4 s4FromSwitchData(const void* switchData) {
 }
 #endif
 
-ClassObject* resolveClass(const ClassObject* referrer, u4 classIdx,
+/*
+ * Load and resolve a class that is not in the resolved table yet.  Called
+ * with parseClassLock held.
+ */
+static ClassObject* resolveClassLocked(const ClassObject* referrer, u4 classIdx,
     bool fromUnverifiedConstant)
 {
     DvmDex* pDvmDex = referrer->pDvmDex;
     ClassObject* resClass;
     const char* className;
 
-    /*
-     * Check the table first -- this gets called from the other "resolve"
-     * methods.
-     */
+    /* another analysis thread may have got here first */
     resClass = dvmDexGetResolvedClass(pDvmDex, classIdx);
     if (resClass != NULL)
         return resClass;
@@ -118,6 +290,27 @@ ClassObject* resolveClass(const ClassObject* referrer, u4 classIdx,
     return resClass;
 }
 
+ClassObject* resolveClass(const ClassObject* referrer, u4 classIdx,
+    bool fromUnverifiedConstant)
+{
+    ClassObject* resClass;
+
+    /*
+     * Check the table first -- this gets called from the other "resolve"
+     * methods.  While the analysis threads run it is all there is.
+     */
+    resClass = dvmDexGetResolvedClass(referrer->pDvmDex, classIdx);
+    if (resClass != NULL || resolveFrozen)
+        return resClass;
+
+    /* class loading isn't safe to run from several analysis threads */
+    pthread_once(&parseStateOnce, initParseState);
+    pthread_mutex_lock(&parseClassLock);
+    resClass = resolveClassLocked(referrer, classIdx, fromUnverifiedConstant);
+    pthread_mutex_unlock(&parseClassLock);
+    return resClass;
+}
+
 Method* resolveMethod(const ClassObject* referrer, u4 methodIdx,
     MethodType methodType) {
     DvmDex* pDvmDex = referrer->pDvmDex;
@@ -127,6 +320,9 @@ Method* resolveMethod(const ClassObject* referrer, u4 methodIdx,
 
     assert(methodType != METHOD_INTERFACE);
 
+    if (resolveFrozen)
+        return NULL;
+
     pMethodId = dexGetMethodId(pDvmDex->pDexFile, methodIdx);
 
     resClass = resolveClass(referrer, pMethodId->classIdx, false);
@@ -172,6 +368,9 @@ Method* resolveInterfaceMethod(const ClassObject* referrer, u4 methodIdx)
     const DexMethodId* pMethodId;
     Method* resMethod;
 
+    if (resolveFrozen)
+        return NULL;
+
     pMethodId = dexGetMethodId(pDvmDex->pDexFile, methodIdx);
 
     resClass = resolveClass(referrer, pMethodId->classIdx, false);
@@ -180,8 +379,11 @@ Method* resolveInterfaceMethod(const ClassObject* referrer, u4 methodIdx)
     }
     if (!dvmIsInterfaceClass(resClass)) {
         /* whoops */
+        pthread_once(&parseStateOnce, initParseState);
+        pthread_mutex_lock(&parseClassLock);
         dvmThrowIncompatibleClassChangeErrorWithClassMessage(
                 resClass->descriptor);
+        pthread_mutex_unlock(&parseClassLock);
         return NULL;
     }
 
@@ -214,6 +416,9 @@ InstField* resolveInstField(const ClassObject* referrer, u4 ifieldIdx)
     const DexFieldId* pFieldId;
     InstField* resField;
 
+    if (resolveFrozen)
+        return NULL;
+
     pFieldId = dexGetFieldId(pDvmDex->pDexFile, ifieldIdx);
 
     /*
@@ -250,6 +455,9 @@ StaticField* resolveStaticField(const ClassObject* referrer, u4 sfieldIdx)
     const DexFieldId* pFieldId;
     StaticField* resField;
 
+    if (resolveFrozen)
+        return NULL;
+
     pFieldId = dexGetFieldId(pDvmDex->pDexFile, sfieldIdx);
 
     /*
@@ -275,7 +483,7 @@ void populateMethodAccInfo(MethodAccInfo* methodAccInfo) {
     Method* method = methodAccInfo->method;
     methodAccInfo->args = new std::vector<ObjectAccInfo*>();
     for(int i = 0; i < method->insSize; i++) {
-        methodAccInfo->args->push_back(new ObjectAccInfo());
+        methodAccInfo->args->push_back(newObjectAccInfo());
     }
     methodAccInfo->globalClazz = new std::vector<ClazzAccInfo*>();
 }
@@ -420,7 +628,7 @@ static void unionObjectFieldInfo(ObjectAccInfo* dstObjAccInfo, ObjectAccInfo* sr
             continue;
         }
         if(dstObjAccInfo->fieldSet[i] == NULL) {
-            dstObjAccInfo->fieldSet[i] = new ObjectAccInfo();
+            dstObjAccInfo->fieldSet[i] = newObjectAccInfo();
             dstObjAccInfo->fieldSet[i]->belonging = dstObjAccInfo;
         }
         unionObjectFieldInfo(dstObjAccInfo->fieldSet[i], srcObjAccInfo->fieldSet[i], addrMap, isDstBranch);
@@ -429,7 +637,7 @@ static void unionObjectFieldInfo(ObjectAccInfo* dstObjAccInfo, ObjectAccInfo* sr
 
 static void createMatchTrack(ObjectAccInfo* srcTrackObj, std::map<ObjectAccInfo*, ObjectAccInfo*>* addrMap) {
     // indicates that in the iput, only the vdst is in the interest, we make a new corresponding object
-    ObjectAccInfo* newAccInfo = new ObjectAccInfo();
+    ObjectAccInfo* newAccInfo = newObjectAccInfo();
     (*addrMap)[srcTrackObj] = newAccInfo;
     if(srcTrackObj->allFlag) {
         newAccInfo->allFlag = true;
@@ -549,7 +757,7 @@ static void unionClazzFieldInfo(MethodAccInfo* dstAccInfo, MethodAccInfo* srcAcc
             }
         }
         if(j == dstAccInfo->globalClazz->size()) {
-            dstAccInfo->globalClazz->push_back(new ClazzAccInfo());
+            dstAccInfo->globalClazz->push_back(newClazzAccInfo());
             dstAccInfo->globalClazz->at(j)->clazz = srcAccInfo->globalClazz->at(i)->clazz;
         }
         unionObjectFieldInfo(dstAccInfo->globalClazz->at(j), srcAccInfo->globalClazz->at(i), addrMap, isDstBranch);
@@ -660,7 +868,7 @@ static void mergeObjectAccFieldInfo(std::set<ObjectAccInfo*>* dstAccInfoList, Ob
                 ALOGE("find the specified address parsing, dst addr: %p", *it);
             }
             if((*it)->trackSet[i] == NULL) { // indicates that the field accessed is the original field
-                (*it)->fieldSet[i] = new ObjectAccInfo();
+                (*it)->fieldSet[i] = newObjectAccInfo();
                 (*it)->fieldSet[i]->belonging = *it;
                 (*it)->trackSet[i] = new std::set<ObjectAccInfo*>();
                 (*it)->trackSet[i]->insert((*it)->fieldSet[i]);
@@ -678,7 +886,7 @@ void mergeObjectAccTrackInfo(std::set<ObjectAccInfo*>* dstAccInfoList, ObjectAcc
 static void createVecMatchTrack(ObjectAccInfo* srcTrackObj, std::map<ObjectAccInfo*, std::set<ObjectAccInfo*> >* addrMap) {
     // indicates that in the iput, only the vdst is in the interest, we make a new corresponding object
     std::set<ObjectAccInfo*> result;
-    ObjectAccInfo* newAccInfo = new ObjectAccInfo();
+    ObjectAccInfo* newAccInfo = newObjectAccInfo();
     result.insert(newAccInfo);
     (*addrMap)[srcTrackObj] = result;
     if(srcTrackObj->allFlag) {
@@ -874,7 +1082,7 @@ static void mergeGlobalClazzField(MethodAccInfo* methodAccInfo, MethodAccInfo* s
             }
         }
         if(j == methodAccInfo->globalClazz->size()) {
-            methodAccInfo->globalClazz->push_back(new ClazzAccInfo());
+            methodAccInfo->globalClazz->push_back(newClazzAccInfo());
             methodAccInfo->globalClazz->at(j)->clazz = subAccInfo->globalClazz->at(i)->clazz;
         }
         std::set<ObjectAccInfo*> argVec;
@@ -1361,7 +1569,7 @@ void parseInsns(const u2* methInsns, MethodAccInfo* methodAccInfo, std::vector<M
                 }
                 // if the field has not been setup, then set the field
                 if(objAccInfo->trackSet[offset] == NULL || (objAccInfo->nullBranchFlags[offset] && objAccInfo->fieldSet[offset] == NULL)) {
-                    ObjectAccInfo* fieldInfo = new ObjectAccInfo();
+                    ObjectAccInfo* fieldInfo = newObjectAccInfo();
                     fieldInfo->belonging = objAccInfo;
                     if(objAccInfo->inArray) {
                         fieldInfo->inArray = true;
@@ -1422,7 +1630,7 @@ void parseInsns(const u2* methInsns, MethodAccInfo* methodAccInfo, std::vector<M
             }
             // the dst register is in our interest
             if(interestRegObjMap->find(vsrc1) == interestRegObjMap->end()) {
-                (*interestRegObjMap)[vsrc1].insert(new ObjectAccInfo());
+                (*interestRegObjMap)[vsrc1].insert(newObjectAccInfo());
             }
                     
             std::set<ObjectAccInfo*> srcVector = (*interestRegObjMap)[vsrc1];
@@ -1469,7 +1677,7 @@ void parseInsns(const u2* methInsns, MethodAccInfo* methodAccInfo, std::vector<M
                 }
             }
             if(i == toParse->methodAccInfo->globalClazz->size()) { // The first time to deal this global class object
-                ClazzAccInfo* clazzAccInfo = new ClazzAccInfo();
+                ClazzAccInfo* clazzAccInfo = newClazzAccInfo();
                 clazzAccInfo->clazz = sfield->clazz;
                 toParse->methodAccInfo->globalClazz->push_back(clazzAccInfo);
             }
@@ -1481,7 +1689,7 @@ void parseInsns(const u2* methInsns, MethodAccInfo* methodAccInfo, std::vector<M
             }
             // if the field has not been setup, then set the field
             if(clazzAccInfo->trackSet[offset] == NULL) {
-                ObjectAccInfo* fieldInfo = new ObjectAccInfo();
+                ObjectAccInfo* fieldInfo = newObjectAccInfo();
                 fieldInfo->belonging = clazzAccInfo;
                 if(clazzAccInfo->inArray) {
                     fieldInfo->inArray = true;
@@ -1522,7 +1730,7 @@ void parseInsns(const u2* methInsns, MethodAccInfo* methodAccInfo, std::vector<M
                 }
             }
             if(i == toParse->methodAccInfo->globalClazz->size()) { // The first time to deal this global class object
-                ClazzAccInfo* clazzAccInfo = new ClazzAccInfo();
+                ClazzAccInfo* clazzAccInfo = newClazzAccInfo();
                 clazzAccInfo->clazz = sfield->clazz;
                 toParse->methodAccInfo->globalClazz->push_back(clazzAccInfo);
             }
@@ -2083,7 +2291,7 @@ void parseInsns(const u2* methInsns, MethodAccInfo* methodAccInfo, std::vector<M
             }
             interestRegObjMap->erase(vdst);
             if(opcode == OP_AGET_OBJECT) {
-                ObjectAccInfo* objAccInfo = new ObjectAccInfo();
+                ObjectAccInfo* objAccInfo = newObjectAccInfo();
                 objAccInfo->allFlag = true;
                 objAccInfo->inArray = true;
                 (*interestRegObjMap)[vdst].insert(objAccInfo);
@@ -2127,12 +2335,9 @@ void parseMethod(MethodAccInfo* methodAccInfo, std::vector<Method*>* chain) {
             && method->idx == 79) {
         ALOGE("offset map has it or not: %d", parsedMethodOffMap->find(method) != parsedMethodOffMap->end());
     }*/
-    if(parsedMethodOffMap->find(method) != parsedMethodOffMap->end()) {
-        ParsedMethoOffInfo* poffInfo = (*parsedMethodOffMap)[method];
-        loadStructureInFile(methodAccInfo, poffInfo->offStart, poffInfo->length);
+    if(loadMethodSummary(methodAccInfo)) {
         return;
     }
-    populateMethodAccInfo(methodAccInfo);
     bool isCycle = false;
     // check if this method makes an invocation cycle, if true, then set all the parameters as need to be migrate all
     for(unsigned int i = 0; i < chain->size(); i++) {
@@ -2140,12 +2345,26 @@ void parseMethod(MethodAccInfo* methodAccInfo, std::vector<Method*>* chain) {
             isCycle = true;
         }
     }
+    // a cycle through the chains of several threads is flagged the same way, the thread that owns the method stores its summary
+    bool crossCycle = false;
+    if(!isCycle && !claimMethodSummary(method, &crossCycle)) {
+        if(loadMethodSummary(methodAccInfo)) {
+            return;
+        }
+        crossCycle = true;
+    }
+    populateMethodAccInfo(methodAccInfo);
     // a method invocation cycle, an abstract or native method cannot be parsed, then we just set all the parameters as need migration
-    if(isCycle || dvmIsNativeMethod(method) || dvmIsAbstractMethod(method)) {
+    if(isCycle || crossCycle || dvmIsNativeMethod(method) || dvmIsAbstractMethod(method)) {
         for(unsigned int idx = 0; idx < methodAccInfo->args->size(); idx++) {
             flagObjAll(methodAccInfo->args->at(idx));
         }
-        persistMethodAllInfo(methodAccInfo);
+        if(!crossCycle) {
+            persistMethodAllInfo(methodAccInfo);
+        }
+        if(!isCycle && !crossCycle) {
+            releaseMethodSummary(method);
+        }
         return;
     }
     chain->push_back(method);
@@ -2160,13 +2379,19 @@ void parseMethod(MethodAccInfo* methodAccInfo, std::vector<Method*>* chain) {
     chain->pop_back();
 
     persistMethodAllInfo(methodAccInfo);
+    releaseMethodSummary(method);
 }
 
 std::vector<ClassObject*>* findSubClass(ClassObject* clazz) {
+    std::vector<ClassObject*>* result;
+    pthread_once(&parseStateOnce, initParseState);
+    pthread_mutex_lock(&parseClassLock);
     if(subclassMap.find(clazz) != subclassMap.end()) {
-        return subclassMap[clazz];
+        result = subclassMap[clazz];
+        pthread_mutex_unlock(&parseClassLock);
+        return result;
     }
-    std::vector<ClassObject*>* result = new std::vector<ClassObject*>();
+    result = new std::vector<ClassObject*>();
     subclassMap[clazz] = result;
     for(unsigned int idx = 0; idx < loadedDex.size(); idx++) {
         DvmDex* pDvmDex;
@@ -2197,6 +2422,7 @@ std::vector<ClassObject*>* findSubClass(ClassObject* clazz) {
             }
         }
     }
+    pthread_mutex_unlock(&parseClassLock);
     return result;
     /*for(unsigned int i = 0; i < (*result).size(); i++) {
         ALOGE("findsubclass class: %s", (*result)[i]->descriptor);
@@ -2204,10 +2430,15 @@ std::vector<ClassObject*>* findSubClass(ClassObject* clazz) {
 }
 
 std::vector<ClassObject*>* findImplementClass(ClassObject* clazz) {
+    std::vector<ClassObject*>* result;
+    pthread_once(&parseStateOnce, initParseState);
+    pthread_mutex_lock(&parseClassLock);
     if(implclassMap.find(clazz) != implclassMap.end()) {
-        return implclassMap[clazz];
+        result = implclassMap[clazz];
+        pthread_mutex_unlock(&parseClassLock);
+        return result;
     }
-    std::vector<ClassObject*>* result = new std::vector<ClassObject*>();
+    result = new std::vector<ClassObject*>();
     implclassMap[clazz] = result;
     for(unsigned int idx = 0; idx < loadedDex.size(); idx++) {
         DvmDex* pDvmDex;
@@ -2238,6 +2469,7 @@ std::vector<ClassObject*>* findImplementClass(ClassObject* clazz) {
             }
         }
     }
+    pthread_mutex_unlock(&parseClassLock);
     return result;
    /* for(unsigned int i = 0; i < (*result).size(); i++) {
         ALOGE("findimplementedclass class: %s", (*result)[i]->descriptor);
@@ -2375,28 +2607,15 @@ static bool checkInterest(ParseInfo* parseInfo) {
 	return true;
 }
 
-static void copyParseInfo(ParseInfo* src, ParseInfo* dst) {
-    dst->insoff = src->insoff;
-    dst->lastop = src->lastop;
-    dst->insOffsets = new std::set<int>(src->insOffsets->begin(), src->insOffsets->end());
-
-    // copy MethodAccInfo
-    MethodAccInfo* srcMethAccInfo = src->methodAccInfo;
-    MethodAccInfo* dstMethAccInfo = new MethodAccInfo();
-    dst->methodAccInfo = dstMethAccInfo;
-    dstMethAccInfo->method = srcMethAccInfo->method;
-    populateMethodAccInfo(dstMethAccInfo);
-    std::vector<ObjectAccInfo*> objList;
-    indexMethodAccInfo(srcMethAccInfo, &objList);
-    indexRegObj(src->interestRegObjMap, &objList);
-    std::vector<ObjectAccInfo*> newObjList;
+/* copy the indexed objects of srcMethAccInfo into dstMethAccInfo, newObjList gets the copy of each object at its index */
+static void copyIndexedObjs(MethodAccInfo* srcMethAccInfo, MethodAccInfo* dstMethAccInfo, std::vector<ObjectAccInfo*>* objList, std::vector<ObjectAccInfo*>* newObjList, AccArena* arena) {
     unsigned int currIdx = 0;
     if(srcMethAccInfo->globalClazz != NULL) {
         currIdx += srcMethAccInfo->globalClazz->size();
         dstMethAccInfo->globalClazz = new std::vector<ClazzAccInfo*>();
         for(unsigned int i = 0; i < srcMethAccInfo->globalClazz->size(); i++) {
-            ClazzAccInfo* clzAccInfo = new ClazzAccInfo();
-            newObjList.push_back(clzAccInfo);
+            ClazzAccInfo* clzAccInfo = newClazzAccInfo(arena);
+            newObjList->push_back(clzAccInfo);
             clzAccInfo->clazz = srcMethAccInfo->globalClazz->at(i)->clazz;
             dstMethAccInfo->globalClazz->push_back(clzAccInfo);
         }
@@ -2405,23 +2624,23 @@ static void copyParseInfo(ParseInfo* src, ParseInfo* dst) {
         currIdx += srcMethAccInfo->args->size();
         dstMethAccInfo->args = new std::vector<ObjectAccInfo*>();
         for(unsigned int i = 0; i < srcMethAccInfo->args->size(); i++) {
-            ObjectAccInfo* objAccInfo = new ObjectAccInfo();
-            newObjList.push_back(objAccInfo);
+            ObjectAccInfo* objAccInfo = newObjectAccInfo(arena);
+            newObjList->push_back(objAccInfo);
             dstMethAccInfo->args->push_back(objAccInfo);
         }
     }
-    for(unsigned int i = currIdx; i < objList.size(); i++) {
-        newObjList.push_back(new ObjectAccInfo());
+    for(unsigned int i = currIdx; i < objList->size(); i++) {
+        newObjList->push_back(newObjectAccInfo(arena));
     }
 
     // fill the structure infomation into the new objects list
-    for(unsigned int i = 0; i < objList.size(); i++) {
-        ObjectAccInfo* srcAccInfo = objList.at(i);
-        ObjectAccInfo* dstAccInfo = newObjList.at(i);
+    for(unsigned int i = 0; i < objList->size(); i++) {
+        ObjectAccInfo* srcAccInfo = objList->at(i);
+        ObjectAccInfo* dstAccInfo = newObjList->at(i);
         dstAccInfo->allFlag = srcAccInfo->allFlag;
         dstAccInfo->inArray = srcAccInfo->inArray;
         if(srcAccInfo->belonging != NULL) {
-            dstAccInfo->belonging = newObjList[srcAccInfo->belonging->idx];
+            dstAccInfo->belonging = (*newObjList)[srcAccInfo->belonging->idx];
         }
         dstAccInfo->nullBranchFlags.resize(srcAccInfo->fieldSet.size());
         dstAccInfo->fieldSet.resize(srcAccInfo->fieldSet.size());
@@ -2429,16 +2648,33 @@ static void copyParseInfo(ParseInfo* src, ParseInfo* dst) {
         for(unsigned int j = 0; j < srcAccInfo->fieldSet.size(); j++) {
             dstAccInfo->nullBranchFlags[j] = srcAccInfo->nullBranchFlags[j];
             if(srcAccInfo->fieldSet[j] != NULL) {
-                dstAccInfo->fieldSet[j] = newObjList[srcAccInfo->fieldSet[j]->idx];
+                dstAccInfo->fieldSet[j] = (*newObjList)[srcAccInfo->fieldSet[j]->idx];
             }
             if(srcAccInfo->trackSet[j] != NULL) {
                 dstAccInfo->trackSet[j] = new std::set<ObjectAccInfo*>();
                 for(std::set<ObjectAccInfo*>::iterator it = srcAccInfo->trackSet[j]->begin(); it != srcAccInfo->trackSet[j]->end(); ++it) {
-                    dstAccInfo->trackSet[j]->insert(newObjList[(*it)->idx]);
+                    dstAccInfo->trackSet[j]->insert((*newObjList)[(*it)->idx]);
                 }
             }
         }
     }
+}
+
+static void copyParseInfo(ParseInfo* src, ParseInfo* dst) {
+    dst->insoff = src->insoff;
+    dst->lastop = src->lastop;
+    dst->insOffsets = new std::set<int>(src->insOffsets->begin(), src->insOffsets->end());
+
+    // copy MethodAccInfo
+    MethodAccInfo* srcMethAccInfo = src->methodAccInfo;
+    MethodAccInfo* dstMethAccInfo = new MethodAccInfo();
+    dst->methodAccInfo = dstMethAccInfo;
+    dstMethAccInfo->method = srcMethAccInfo->method;
+    std::vector<ObjectAccInfo*> objList;
+    indexMethodAccInfo(srcMethAccInfo, &objList);
+    indexRegObj(src->interestRegObjMap, &objList);
+    std::vector<ObjectAccInfo*> newObjList;
+    copyIndexedObjs(srcMethAccInfo, dstMethAccInfo, &objList, &newObjList, currentAccArena());
 
     // copy interesting register maps
     dst->interestRegObjMap = new std::map<u2, std::set<ObjectAccInfo*> >();
@@ -2451,6 +2687,131 @@ static void copyParseInfo(ParseInfo* src, ParseInfo* dst) {
     clearIndex(&objList);
 }
 
+/* deep copy the summary of src into dst, whose method is already set */
+static void copyMethodSummary(MethodAccInfo* src, MethodAccInfo* dst, AccArena* arena) {
+    std::vector<ObjectAccInfo*> objList;
+    indexMethodAccInfo(src, &objList);
+    if(src->returnObjs != NULL) {
+        std::queue<ObjectAccInfo*> frontier;
+        for(std::set<ObjectAccInfo*>::iterator it = src->returnObjs->begin(); it != src->returnObjs->end(); ++it) {
+            if(*it != NULL && (*it)->idx == -1) {
+                frontier.push(*it);
+            }
+        }
+        indexObjList(&frontier, &objList);
+    }
+    std::vector<ObjectAccInfo*> newObjList;
+    copyIndexedObjs(src, dst, &objList, &newObjList, arena);
+    if(src->returnObjs != NULL) {
+        dst->returnObjs = new std::set<ObjectAccInfo*>();
+        for(std::set<ObjectAccInfo*>::iterator it = src->returnObjs->begin(); it != src->returnObjs->end(); ++it) {
+            if(*it != NULL) {
+                dst->returnObjs->insert(newObjList[(*it)->idx]);
+            }
+        }
+    }
+    clearIndex(&objList);
+}
+
+/* keep a copy of the summary of the method for later invocations of it */
+static void cacheMethodSummary(MethodAccInfo* methodAccInfo) {
+    MethodAccInfo* summary = new MethodAccInfo();
+    summary->method = methodAccInfo->method;
+    pthread_once(&parseStateOnce, initParseState);
+    pthread_mutex_lock(&summaryLock);
+    copyMethodSummary(methodAccInfo, summary, &summaryArena);
+    std::map<Method*, MethodAccInfo*>::iterator it = summaryCache.find(summary->method);
+    if(it != summaryCache.end()) {
+        // the summary flagged for an invocation cycle is replaced by the complete one
+        freeMethodAccInfo(it->second);
+        it->second = summary;
+    } else {
+        summaryCache[summary->method] = summary;
+    }
+    pthread_mutex_unlock(&summaryLock);
+}
+
+/* true if waiting for owner would close a cycle of analysis threads waiting for each other */
+static bool summaryWaitCycles(pthread_t owner) {
+    pthread_t self = pthread_self();
+    while(!pthread_equal(owner, self)) {
+        std::map<pthread_t, Method*>::iterator wait = summaryWaits.find(owner);
+        if(wait == summaryWaits.end()) {
+            return false;
+        }
+        std::map<Method*, pthread_t>::iterator next = summaryOwners.find(wait->second);
+        if(next == summaryOwners.end()) {
+            return false;
+        }
+        owner = next->second;
+    }
+    return true;
+}
+
+/*
+ * make the calling thread the only one to parse the method and store its summary.  Returns false once the summary is
+ * cached by another thread, or with *cycle set if waiting for the thread parsing it would deadlock.
+ */
+static bool claimMethodSummary(Method* method, bool* cycle) {
+    pthread_t self = pthread_self();
+    bool owned = false;
+    pthread_once(&parseStateOnce, initParseState);
+    pthread_mutex_lock(&summaryLock);
+    while(summaryCache.find(method) == summaryCache.end()) {
+        std::map<Method*, pthread_t>::iterator owner = summaryOwners.find(method);
+        if(owner == summaryOwners.end()) {
+            summaryOwners[method] = self;
+            owned = true;
+            break;
+        }
+        if(summaryWaitCycles(owner->second)) {
+            *cycle = true;
+            break;
+        }
+        summaryWaits[self] = method;
+        pthread_cond_wait(&summaryCond, &summaryLock);
+        summaryWaits.erase(self);
+    }
+    pthread_mutex_unlock(&summaryLock);
+    return owned;
+}
+
+/* let the threads waiting for the summary of the method claimed by the calling thread go on */
+static void releaseMethodSummary(Method* method) {
+    pthread_mutex_lock(&summaryLock);
+    summaryOwners.erase(method);
+    pthread_cond_broadcast(&summaryCond);
+    pthread_mutex_unlock(&summaryLock);
+}
+
+/* fill in the summary of the method if it has been parsed, in this run or a previous one */
+static bool loadMethodSummary(MethodAccInfo* methodAccInfo) {
+    Method* method = methodAccInfo->method;
+    bool found = false;
+    AccArena* arena = currentAccArena();
+    pthread_mutex_lock(&summaryLock);
+    std::map<Method*, MethodAccInfo*>::iterator it = summaryCache.find(method);
+    if(it != summaryCache.end()) {
+        copyMethodSummary(it->second, methodAccInfo, arena);
+        found = true;
+    }
+    pthread_mutex_unlock(&summaryLock);
+    if(found) {
+        return true;
+    }
+    pthread_mutex_lock(&parseFileLock);
+    std::map<Method*, ParsedMethoOffInfo*>::iterator offit = parsedMethodOffMap->find(method);
+    if(offit != parsedMethodOffMap->end()) {
+        loadStructureInFile(methodAccInfo, offit->second->offStart, offit->second->length);
+        found = true;
+    }
+    pthread_mutex_unlock(&parseFileLock);
+    if(found) {
+        cacheMethodSummary(methodAccInfo);
+    }
+    return found;
+}
+
 /* save ObjectAccInfo with structure */
 static void saveStructureToFile(MethodAccInfo* methodAccInfo, std::vector<ObjectAccInfo*>* objList) {
     // output method identification
@@ -2564,6 +2925,14 @@ static void saveStructureToBFile(MethodAccInfo* methodAccInfo, std::vector<Objec
     poffFile.write(reinterpret_cast<char*>(&(methodAccInfo->method->idx)), sizeof(methodAccInfo->method->idx));
     poffFile.write(reinterpret_cast<char*>(&offStart), sizeof(offStart));
     poffFile.write(reinterpret_cast<char*>(&length), sizeof(length));
+    std::map<Method*, u8>::iterator hash = parsedMethodHashes.find(methodAccInfo->method);
+    if(hash != parsedMethodHashes.end()) {
+        phashFile.seekp(0, std::ios::end);
+        phashFile.write(reinterpret_cast<char*>(&clzNameIdx), sizeof(clzNameIdx));
+        phashFile.write(reinterpret_cast<char*>(&methNameIdx), sizeof(methNameIdx));
+        phashFile.write(reinterpret_cast<char*>(&(methodAccInfo->method->idx)), sizeof(methodAccInfo->method->idx));
+        phashFile.write(reinterpret_cast<char*>(&(hash->second)), sizeof(hash->second));
+    }
     ParsedMethoOffInfo* offInfo = new ParsedMethoOffInfo();
     offInfo->offStart = offStart;
     offInfo->length = length;
@@ -2573,8 +2942,13 @@ static void saveStructureToBFile(MethodAccInfo* methodAccInfo, std::vector<Objec
 void persistMethodAllInfo(MethodAccInfo* methodAccInfo) {
     std::vector<ObjectAccInfo*> objList;
     indexMethodAccInfo(methodAccInfo, &objList);
+    pthread_once(&parseStateOnce, initParseState);
+    pthread_mutex_lock(&parseFileLock);
     saveStructureToFile(methodAccInfo, &objList);
     saveStructureToBFile(methodAccInfo, &objList);
+    pthread_mutex_unlock(&parseFileLock);
+    clearIndex(&objList);
+    cacheMethodSummary(methodAccInfo);
 }
 
 void createStringDict() {
@@ -2658,6 +3032,90 @@ void loadStringDict() {
     }
 }
 
+static Method* findParsedMethod(ClassObject* clazz, const char* methodName, unsigned int methodIdx) {
+    if(clazz == NULL || methodName == NULL) { // the class has gone since the method was parsed
+        return NULL;
+    }
+    Method* vmethods = clazz->virtualMethods;
+    size_t vmethodCount = clazz->virtualMethodCount;
+    for(size_t j = 0; j < vmethodCount; j++) {
+        Method* method = &vmethods[j];
+        if(strcmp(method->name, methodName) == 0 && method->idx == methodIdx) {
+            return method;
+        }
+    }
+    Method* dmethods = clazz->directMethods;
+    size_t dmethodCount = clazz->directMethodCount;
+    for(size_t j = 0; j < dmethodCount; j++) {
+        Method* method = &dmethods[j];
+        if(strcmp(method->name, methodName) == 0 && method->idx == methodIdx) {
+            return method;
+        }
+    }
+    return NULL;
+}
+
+static void collectParseCallees(Method* method, std::vector<Method*>* callees) {
+    collectCallees(method, javaLangObject, callees);
+}
+
+/* drop the parsed results of methods which changed, or which call into something that changed, since they were parsed */
+static void dropChangedMethods() {
+    std::vector<Method*> methods;
+    offCollectDexMethods(&loadedDex, &methods);
+    offMethodDeepHashes(&methods, collectParseCallees, &parsedMethodHashes);
+
+    std::map<Method*, u8> savedHashes;
+    std::streampos begin, end;
+    phashFile.seekg(0, std::ios::end);
+    end = phashFile.tellg();
+    phashFile.seekg(0, std::ios::beg);
+    begin = phashFile.tellg();
+    unsigned int total = end - begin;
+    std::vector<char> readbuffer(total);
+    if(total != 0) {
+        phashFile.read(&readbuffer[0], total);
+    }
+    phashFile.clear();
+    int recordSize = sizeof(int) * 2 + sizeof(unsigned int) + sizeof(u8);
+    for(unsigned int pos = 0; pos + recordSize <= total; pos += recordSize) {
+        char* buffer = &readbuffer[pos];
+        int clzNameIdx;
+        memcpy(&clzNameIdx, buffer, sizeof(clzNameIdx));
+        buffer += sizeof(clzNameIdx);
+        int methNameIdx;
+        memcpy(&methNameIdx, buffer, sizeof(methNameIdx));
+        buffer += sizeof(methNameIdx);
+        unsigned int methodIdx;
+        memcpy(&methodIdx, buffer, sizeof(methodIdx));
+        buffer += sizeof(methodIdx);
+        u8 hash;
+        memcpy(&hash, buffer, sizeof(hash));
+        const char* clazzName = (*offStrMap)[clzNameIdx];
+        ClassObject* clazz = clazzName == NULL ? NULL : dvmLookupClass(clazzName, NULL, false);
+        Method* method = findParsedMethod(clazz, (*offStrMap)[methNameIdx], methodIdx);
+        if(method != NULL) {
+            savedHashes[method] = hash;
+        }
+    }
+
+    unsigned int kept = 0;
+    unsigned int dropped = 0;
+    for(std::map<Method*, ParsedMethoOffInfo*>::iterator it = parsedMethodOffMap->begin(); it != parsedMethodOffMap->end(); ) {
+        std::map<Method*, u8>::iterator saved = savedHashes.find(it->first);
+        std::map<Method*, u8>::iterator current = parsedMethodHashes.find(it->first);
+        if(saved != savedHashes.end() && current != parsedMethodHashes.end() && saved->second == current->second) {
+            kept++;
+            ++it;
+        } else {
+            dropped++;
+            delete it->second;
+            parsedMethodOffMap->erase(it++);
+        }
+    }
+    ALOGE("methodParser reuses %u parsed methods, %u changed", kept, dropped);
+}
+
 void loadParsedMethodOffInfo() {
     std::streampos begin, end;
     poffFile.seekg(0, std::ios::end);
@@ -2674,7 +3132,8 @@ void loadParsedMethodOffInfo() {
         memcpy(&clzNameIdx, buffer, sizeof(clzNameIdx));
         buffer += sizeof(clzNameIdx);
         leftbytes -= sizeof(clzNameIdx);
-        ClassObject* clazz = dvmLookupClass((*offStrMap)[clzNameIdx], NULL, false);
+        const char* clazzName = (*offStrMap)[clzNameIdx];
+        ClassObject* clazz = clazzName == NULL ? NULL : dvmLookupClass(clazzName, NULL, false);
         int methNameIdx;
         memcpy(&methNameIdx, buffer, sizeof(methNameIdx));
         buffer += sizeof(methNameIdx);
@@ -2685,29 +3144,7 @@ void loadParsedMethodOffInfo() {
         buffer += sizeof(methodIdx);
         leftbytes -= sizeof(methodIdx);
         // find the specified method reference
-        Method* offmethod;
-        bool found = false;
-        Method* vmethods = clazz->virtualMethods;
-        size_t vmethodCount = clazz->virtualMethodCount;
-        for(size_t j = 0; j < vmethodCount; j++) {
-            Method* method = &vmethods[j];
-            if(strcmp(method->name, methodName) == 0 && method->idx == methodIdx) {
-                offmethod = method;
-                found = true;
-                break;
-            }
-        }
-        if(!found) {
-            Method* dmethods = clazz->directMethods;
-            size_t dmethodCount = clazz->directMethodCount;
-            for(size_t j = 0; j < dmethodCount; j++) {
-                Method* method = &dmethods[j];
-                if(strcmp(method->name, methodName) == 0 && method->idx == methodIdx) {
-                    offmethod = method;
-                    break;
-                }
-            }
-        }
+        Method* offmethod = findParsedMethod(clazz, methodName, methodIdx);
 
         int offStart;
         memcpy(&offStart, buffer, sizeof(offStart));
@@ -2717,25 +3154,34 @@ void loadParsedMethodOffInfo() {
         memcpy(&length, buffer, sizeof(length));
         buffer += sizeof(length);
         leftbytes -= sizeof(length);
+        if(offmethod == NULL) {
+            continue;
+        }
 
         ParsedMethoOffInfo* offInfo = new ParsedMethoOffInfo();
         offInfo->offStart = offStart;
         offInfo->length = length;
+        std::map<Method*, ParsedMethoOffInfo*>::iterator old = parsedMethodOffMap->find(offmethod);
+        if(old != parsedMethodOffMap->end()) {
+            delete old->second;
+        }
         (*parsedMethodOffMap)[offmethod] = offInfo;
     }
+    dropChangedMethods();
 }
 
 static void loadStructureInFile(MethodAccInfo* methodAccInfo, int offStart, int length) {
     std::map<int, ObjectAccInfo*> idObjMap;
     presultFile.seekg(offStart, std::ios::beg);
-    char readbuffer[length];
+    // summaries can be large, keep them off the analysis thread's stack
+    std::vector<char> readbuffer(length);
     if(offStart == 159789083 && length == 28005383) {
         char* newreadbuffer = (char*) malloc(length + 1);
         presultFile.read(newreadbuffer, length);
         ALOGE("read for the problem size is: %d, length is: %d", presultFile.gcount(), length);
     }
-    presultFile.read(readbuffer, length);
-    char* buffer = readbuffer;
+    presultFile.read(&readbuffer[0], length);
+    char* buffer = &readbuffer[0];
 	int clzNameIdx;
 	memcpy(&clzNameIdx, buffer, sizeof(clzNameIdx));
     buffer += sizeof(clzNameIdx);
@@ -2782,11 +3228,11 @@ static void loadStructureInFile(MethodAccInfo* methodAccInfo, int offStart, int
     memcpy(&objSize, buffer, sizeof(objSize));
     buffer += sizeof(objSize);
     for(unsigned int i = 0; i < globalClzSize; i++) {
-        ClazzAccInfo* clzAccInfo = new ClazzAccInfo();
+        ClazzAccInfo* clzAccInfo = newClazzAccInfo();
         idObjMap[i] = clzAccInfo;
     }
     for(unsigned int i = globalClzSize; i < objSize; i++) {
-        ObjectAccInfo* objAccInfo = new ObjectAccInfo();
+        ObjectAccInfo* objAccInfo = newObjectAccInfo();
         idObjMap[i] = objAccInfo;
     }
     for(unsigned int i = 0; i < globalClzSize + argSize; i++) {
@@ -2825,10 +3271,10 @@ static void loadStructureInFile(MethodAccInfo* methodAccInfo, int offStart, int
             if(fieldIdx != -1) {
                 if(idObjMap.find(fieldIdx) == idObjMap.end()) {
                     if((unsigned int) fieldIdx < globalClzSize) {
-                        ClazzAccInfo* fclzAccInfo = new ClazzAccInfo();
+                        ClazzAccInfo* fclzAccInfo = newClazzAccInfo();
                         idObjMap[fieldIdx] = fclzAccInfo;
                     } else {
-                        ObjectAccInfo* fobjAccInfo = new ObjectAccInfo();
+                        ObjectAccInfo* fobjAccInfo = newObjectAccInfo();
                         idObjMap[fieldIdx] = fobjAccInfo;
                     }
                 }
@@ -2850,10 +3296,10 @@ static void loadStructureInFile(MethodAccInfo* methodAccInfo, int offStart, int
                 if(trackIdx != -1) {
                     if(idObjMap.find(trackIdx) == idObjMap.end()) {
                         if((unsigned int) trackIdx < globalClzSize) {
-                            ClazzAccInfo* tclzAccInfo = new ClazzAccInfo();
+                            ClazzAccInfo* tclzAccInfo = newClazzAccInfo();
                             idObjMap[trackIdx] = tclzAccInfo;
                         } else {
-                            ObjectAccInfo* tobjAccInfo = new ObjectAccInfo();
+                            ObjectAccInfo* tobjAccInfo = newObjectAccInfo();
                             idObjMap[trackIdx] = tobjAccInfo;
                         }
                     }
@@ -2899,10 +3345,10 @@ static void loadStructureInFile(MethodAccInfo* methodAccInfo, int offStart, int
             if(fieldIdx != -1) {
                 if(idObjMap.find(fieldIdx) == idObjMap.end()) {
                     if((unsigned int) fieldIdx < globalClzSize) {
-                        ClazzAccInfo* fclzAccInfo = new ClazzAccInfo();
+                        ClazzAccInfo* fclzAccInfo = newClazzAccInfo();
                         idObjMap[fieldIdx] = fclzAccInfo;
                     } else {
-                        ObjectAccInfo* fobjAccInfo = new ObjectAccInfo();
+                        ObjectAccInfo* fobjAccInfo = newObjectAccInfo();
                         idObjMap[fieldIdx] = fobjAccInfo;
                     }
                 }
@@ -2924,10 +3370,10 @@ static void loadStructureInFile(MethodAccInfo* methodAccInfo, int offStart, int
                 if(trackIdx != -1) {
                     if(idObjMap.find(trackIdx) == idObjMap.end()) {
                         if((unsigned int)trackIdx < globalClzSize) {
-                            ClazzAccInfo* tclzAccInfo = new ClazzAccInfo();
+                            ClazzAccInfo* tclzAccInfo = newClazzAccInfo();
                             idObjMap[trackIdx] = tclzAccInfo;
                         } else {
-                            ObjectAccInfo* tobjAccInfo = new ObjectAccInfo();
+                            ObjectAccInfo* tobjAccInfo = newObjectAccInfo();
                             idObjMap[trackIdx] = tobjAccInfo;
                         }
                     }
@@ -2942,13 +3388,7 @@ void freeMethodAccInfo(MethodAccInfo* methodAccInfo) {
     std::vector<ObjectAccInfo*> objList;
     indexMethodAccInfo(methodAccInfo, &objList);
     for(unsigned int i = 0; i < objList.size(); i++) {
-        ObjectAccInfo* objAccInfo = objList.at(i);
-        for(unsigned int j = 0; j < objAccInfo->trackSet.size(); j++) {
-            if(objAccInfo->trackSet[j] != NULL) {
-                delete objAccInfo->trackSet[j];
-            }
-        }
-        delete objAccInfo;
+        freeObjectAccInfo(objList.at(i));
     }
     if(methodAccInfo->args) {
         delete methodAccInfo->args;
@@ -3107,6 +3547,284 @@ void retrieveMethodInfo(std::map<char*, MethodAccResult*, charscomp>* methodAccM
     srcfile.close();
 }
 
+/* the methods an invocation in method may dispatch to, resolved the way parseInsns resolves them; calls to methods of objectClass are skipped */
+void collectCallees(Method* method, ClassObject* objectClass, std::vector<Method*>* callees) {
+    if(dvmIsNativeMethod(method) || dvmIsAbstractMethod(method)) {
+        return;
+    }
+    DvmDex* methodClassDex = method->clazz->pDvmDex;
+    u4 insnsSize = dvmGetMethodInsnsSize(method);
+    u4 offset = 0;
+    while(offset < insnsSize) {
+        const u2* insns = method->insns + offset;
+        Opcode opcode = dexOpcodeFromCodeUnit(*insns);
+        offset += dexGetWidthFromInstruction(insns);
+        u4 ref = insns[1];
+        if(opcode == OP_INVOKE_VIRTUAL || opcode == OP_INVOKE_VIRTUAL_RANGE) {
+            Method* baseMethod = dvmDexGetResolvedMethod(methodClassDex, ref);
+            if(baseMethod == NULL) {
+                baseMethod = resolveMethod(method->clazz, ref, METHOD_VIRTUAL);
+            }
+            if(baseMethod == NULL || baseMethod->clazz == objectClass) {
+                continue;
+            }
+            std::vector<ClassObject*>* subclasses = findSubClass(baseMethod->clazz);
+            if(subclasses->size() > MaxSubCount) {
+                continue;
+            }
+            for(unsigned int idx = 0; idx < subclasses->size(); idx++) {
+                callees->push_back(subclasses->at(idx)->vtable[baseMethod->methodIndex]);
+            }
+        } else if(opcode == OP_INVOKE_INTERFACE || opcode == OP_INVOKE_INTERFACE_RANGE) {
+            Method* absMethod = dvmDexGetResolvedMethod(methodClassDex, ref);
+            if(absMethod == NULL) {
+                absMethod = resolveInterfaceMethod(method->clazz, ref);
+            }
+            if(absMethod == NULL) {
+                continue;
+            }
+            std::vector<ClassObject*>* implclasses = findImplementClass(absMethod->clazz);
+            if(implclasses->size() > MaxSubCount) {
+                continue;
+            }
+            for(unsigned int idx = 0; idx < implclasses->size(); idx++) {
+                ClassObject* implClazz = implclasses->at(idx);
+                for(int ifIdx = 0; ifIdx < implClazz->iftableCount; ifIdx++) {
+                    if(implClazz->iftable[ifIdx].clazz == absMethod->clazz) {
+                        int vtableIndex = implClazz->iftable[ifIdx].methodIndexArray[absMethod->methodIndex];
+                        callees->push_back(implClazz->vtable[vtableIndex]);
+                        break;
+                    }
+                }
+            }
+        } else if(opcode == OP_INVOKE_SUPER || opcode == OP_INVOKE_SUPER_RANGE) {
+            Method* baseMethod = dvmDexGetResolvedMethod(methodClassDex, ref);
+            if(baseMethod == NULL) {
+                baseMethod = resolveMethod(method->clazz, ref, METHOD_VIRTUAL);
+            }
+            ClassObject* super = method->clazz->super;
+            if(baseMethod != NULL && super != NULL && baseMethod->methodIndex < super->vtableCount) {
+                callees->push_back(super->vtable[baseMethod->methodIndex]);
+            }
+        } else if(opcode == OP_INVOKE_DIRECT || opcode == OP_INVOKE_DIRECT_RANGE
+            || opcode == OP_INVOKE_STATIC || opcode == OP_INVOKE_STATIC_RANGE) {
+            Method* methodToCall = dvmDexGetResolvedMethod(methodClassDex, ref);
+            if(methodToCall == NULL) {
+                bool isDirect = opcode == OP_INVOKE_DIRECT || opcode == OP_INVOKE_DIRECT_RANGE;
+                methodToCall = resolveMethod(method->clazz, ref, isDirect ? METHOD_DIRECT : METHOD_STATIC);
+            }
+            if(methodToCall != NULL) {
+                callees->push_back(methodToCall);
+            }
+        }
+    }
+}
+
+/* resolve the field references of method the way parseInsns does, so the analysis threads find them resolved */
+static void resolveFieldRefs(Method* method) {
+    if(dvmIsNativeMethod(method) || dvmIsAbstractMethod(method)) {
+        return;
+    }
+    DvmDex* methodClassDex = method->clazz->pDvmDex;
+    u4 insnsSize = dvmGetMethodInsnsSize(method);
+    u4 offset = 0;
+    while(offset < insnsSize) {
+        const u2* insns = method->insns + offset;
+        Opcode opcode = dexOpcodeFromCodeUnit(*insns);
+        offset += dexGetWidthFromInstruction(insns);
+        if(dexGetIndexTypeFromOpcode(opcode) != kIndexFieldRef) {
+            continue;
+        }
+        u4 ref = insns[1];
+        if(dvmDexGetResolvedField(methodClassDex, ref) != NULL) {
+            continue;
+        }
+        // the static field instructions take a register and the field, the instance ones an object register too
+        InstructionFormat format = dexGetFormatFromOpcode(opcode);
+        if(format == kFmt21c) {
+            resolveStaticField(method->clazz, ref);
+        } else if(format == kFmt22c) {
+            resolveInstField(method->clazz, ref);
+        }
+    }
+}
+
+/* components of the call graph handed out to the analysis threads once their callees are done */
+struct ParsePool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    std::vector<std::vector<Method*> > members;
+    std::vector<std::vector<int> > callers;
+    std::vector<int> pending;
+    std::queue<int> ready;
+    unsigned int done;
+};
+
+static void parseTopMethod(Method* method) {
+    ALOGE("start parse method: %s:%s, %u", method->clazz->descriptor, method->name, method->idx);
+    std::vector<Method*> chain;
+    MethodAccInfo* methodAccInfo = new MethodAccInfo();
+    methodAccInfo->method = method;
+    parseMethod(methodAccInfo, &chain);
+    assert(chain.empty());
+    freeMethodAccInfo(methodAccInfo);
+}
+
+static void* parseWorker(void* arg) {
+    ParsePool* pool = (ParsePool*) arg;
+    AccArena* arena = currentAccArena();
+    pthread_mutex_lock(&pool->lock);
+    while(true) {
+        while(pool->ready.empty() && pool->done < pool->members.size()) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if(pool->ready.empty()) {
+            break;
+        }
+        int scc = pool->ready.front();
+        pool->ready.pop();
+        pthread_mutex_unlock(&pool->lock);
+
+        // methods of one cycle are parsed together, the first one parses the rest through the invocation chain
+        for(unsigned int i = 0; i < pool->members[scc].size(); i++) {
+            parseTopMethod(pool->members[scc][i]);
+        }
+        resetAccArena(arena);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->done++;
+        for(unsigned int i = 0; i < pool->callers[scc].size(); i++) {
+            int caller = pool->callers[scc][i];
+            if(--pool->pending[caller] == 0) {
+                pool->ready.push(caller);
+            }
+        }
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void freeMethodSummaries() {
+    pthread_mutex_lock(&summaryLock);
+    for(std::map<Method*, MethodAccInfo*>::iterator it = summaryCache.begin(); it != summaryCache.end(); ++it) {
+        freeMethodAccInfo(it->second);
+    }
+    summaryCache.clear();
+    resetAccArena(&summaryArena);
+    pthread_mutex_unlock(&summaryLock);
+}
+
+void parseMethods(std::vector<Method*>* methods) {
+    pthread_once(&parseStateOnce, initParseState);
+    std::map<Method*, int> nodeOf;
+    for(unsigned int i = 0; i < methods->size(); i++) {
+        nodeOf[methods->at(i)] = i;
+    }
+    /*
+     * only invocations between the methods to parse order the work, other callees are parsed on demand.  Everything
+     * the analysis of either can resolve is resolved here, on the calling thread, so the analysis threads never load
+     * classes or look up members and need not be VM threads.
+     */
+    std::vector<std::vector<int> > edges(methods->size());
+    std::set<Method*> outside;
+    std::vector<Method*> outsideWork;
+    for(unsigned int i = 0; i < methods->size(); i++) {
+        std::vector<Method*> callees;
+        resolveFieldRefs(methods->at(i));
+        collectCallees(methods->at(i), javaLangObject, &callees);
+        for(unsigned int j = 0; j < callees.size(); j++) {
+            std::map<Method*, int>::iterator it = nodeOf.find(callees[j]);
+            if(it != nodeOf.end()) {
+                edges[i].push_back(it->second);
+            } else if(outside.insert(callees[j]).second) {
+                outsideWork.push_back(callees[j]);
+            }
+        }
+    }
+    while(!outsideWork.empty()) {
+        Method* method = outsideWork.back();
+        outsideWork.pop_back();
+        std::vector<Method*> callees;
+        resolveFieldRefs(method);
+        collectCallees(method, javaLangObject, &callees);
+        for(unsigned int j = 0; j < callees.size(); j++) {
+            if(nodeOf.find(callees[j]) == nodeOf.end() && outside.insert(callees[j]).second) {
+                outsideWork.push_back(callees[j]);
+            }
+        }
+    }
+    std::vector<int> sccOf;
+    int sccCount = offFindCallCycles(&edges, &sccOf);
+
+    ParsePool pool;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    pool.members.resize(sccCount);
+    pool.callers.resize(sccCount);
+    pool.pending.assign(sccCount, 0);
+    pool.done = 0;
+    for(unsigned int i = 0; i < methods->size(); i++) {
+        pool.members[sccOf[i]].push_back(methods->at(i));
+    }
+    std::vector<std::set<int> > calleeSccs(sccCount);
+    for(unsigned int i = 0; i < edges.size(); i++) {
+        for(unsigned int j = 0; j < edges[i].size(); j++) {
+            int callee = sccOf[edges[i][j]];
+            if(callee != sccOf[i] && calleeSccs[sccOf[i]].insert(callee).second) {
+                pool.callers[callee].push_back(sccOf[i]);
+                pool.pending[sccOf[i]]++;
+            }
+        }
+    }
+    for(int scc = 0; scc < sccCount; scc++) {
+        if(pool.pending[scc] == 0) {
+            pool.ready.push(scc);
+        }
+    }
+
+    int threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    const char* threadsEnv = getenv("OFFLOAD_PARSE_THREADS");
+    if(threadsEnv != NULL) {
+        threadCount = atoi(threadsEnv);
+    }
+    ALOGE("parsing %u methods in %d call graph components on %d threads", (unsigned int) methods->size(), sccCount, threadCount);
+    // from here on a reference that did not resolve above is treated as unresolvable
+    resolveFrozen = true;
+    // the calling thread does not touch the heap while the analysis runs, so it need not hold off a collection
+    Thread* self = dvmThreadSelf();
+    ThreadStatus oldStatus = THREAD_VMWAIT;
+    if(self != NULL) {
+        oldStatus = dvmChangeStatus(self, THREAD_VMWAIT);
+    }
+    std::vector<pthread_t> workers;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    // parsing recurses along invocation chains, give the threads the stack it needs
+    pthread_attr_setstacksize(&attr, kParseThreadStackSize);
+    for(int i = 1; i < threadCount; i++) {
+        pthread_t worker;
+        if(pthread_create(&worker, &attr, parseWorker, &pool) != 0) {
+            ALOGE("methodParser failed to start analysis thread %d", i);
+            break;
+        }
+        workers.push_back(worker);
+    }
+    pthread_attr_destroy(&attr);
+    // the calling thread works too, so the analysis goes on if no thread could be started
+    parseWorker(&pool);
+    for(unsigned int i = 0; i < workers.size(); i++) {
+        pthread_join(workers[i], NULL);
+    }
+    resolveFrozen = false;
+    if(self != NULL) {
+        dvmChangeStatus(self, oldStatus);
+    }
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
+    freeMethodSummaries();
+}
+
 void openFiles() {
     char dictFileName[160];
     strcpy(dictFileName, basePath);
@@ -3127,6 +3845,11 @@ void openFiles() {
     strcpy(presultFileNameTxt, basePath);
     strcat(presultFileNameTxt, "/presult.txt");
     presultFileTxt.open(presultFileNameTxt, std::ios::in | std::ios::out | std::ios::app);
+
+    char phashFileName[160];
+    strcpy(phashFileName, basePath);
+    strcat(phashFileName, "/phash.bin");
+    phashFile.open(phashFileName, std::ios::in | std::ios::out | std::ios::app | std::ios::binary);
 }
 
 void closeFiles() {
@@ -3134,5 +3857,7 @@ void closeFiles() {
     poffFile.close();
     presultFile.close();
     presultFileTxt.close();
+    phashFile.close();
+    parsedMethodHashes.clear();
 }
 
@@ -113,6 +113,8 @@ struct MethodAccResult {
 
 void populateMethodAccInfo(MethodAccInfo* methodAccInfo);
 void parseMethod(MethodAccInfo* methodAccInfo, std::vector<Method*>* chain);
+void parseMethods(std::vector<Method*>* methods);
+void collectCallees(Method* method, ClassObject* objectClass, std::vector<Method*>* callees);
 std::vector<ClassObject*>* findSubClass(ClassObject* clazz);
 std::vector<ClassObject*>* findImplementClass(ClassObject* clazz);
 void depthTraverse(ObjectAccInfo* objAccInfo, int depth);
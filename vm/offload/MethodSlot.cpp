@@ -0,0 +1,73 @@
+#include "Dalvik.h"
+
+#include <cutils/atomic.h>
+#include <stdio.h>
+
+volatile int32_t offMethodSlotGen;
+
+/* Fill in what the analysis results say about the method of slot. */
+static void lookupAnalysis(MethodSlot* slot) {
+  if(offAnalysisImageLoaded()) {
+    AnalysisClassIter classes;
+    bool hasClasses = offAnalysisLookupClasses(slot->key, &classes);
+    slot->classes = classes;
+    slot->accResult = offAnalysisLookupMethod(slot->key);
+    slot->hasClasses = hasClasses;
+  } else {
+    if(gDvm.methodClzOffsetMap != NULL) {
+      std::map<char*, u4, charscomp>::iterator it =
+          gDvm.methodClzOffsetMap->find(slot->key);
+      if(it != gDvm.methodClzOffsetMap->end()) {
+        slot->classOffset = it->second;
+        slot->hasClasses = true;
+      }
+    }
+    if(gDvm.methodAccMap != NULL) {
+      std::map<char*, MethodAccResult*, charscomp>::iterator it =
+          gDvm.methodAccMap->find(slot->key);
+      if(it != gDvm.methodAccMap->end()) {
+        slot->accResult = it->second;
+      }
+    }
+  }
+  /* The scheduler's state estimate was based on the old results. */
+  slot->sched.stateBytes = 0;
+}
+
+MethodSlot* offResolveMethodSlot(const Method* method) {
+  int32_t gen = android_atomic_acquire_load(&offMethodSlotGen);
+
+  Method* meth = (Method*)method;
+  MethodSlot* slot = meth->offSlot;
+  if(slot != NULL) {
+    /* Resolved before the analysis was loaded.  The analysis is only ever
+     * loaded once, so the fields go from absent to present and a thread
+     * racing with this sees one or the other. */
+    lookupAnalysis(slot);
+    android_atomic_release_store(gen, &slot->analysisGen);
+    return slot;
+  }
+
+  slot = new MethodSlot();
+  slot->analysisGen = gen;
+
+  size_t len = strlen(method->clazz->descriptor) + strlen(method->name) + 13;
+  slot->key = (char*)malloc(len);
+  snprintf(slot->key, len, "%s %s %u", method->clazz->descriptor,
+           method->name, method->idx);
+  lookupAnalysis(slot);
+
+  /* Methods live in the linear alloc heap and are never freed, so the slot
+   * is never freed either.  If another thread got there first use its slot. */
+  if(android_atomic_release_cas(0, (int32_t)slot,
+                                (volatile int32_t*)&meth->offSlot) != 0) {
+    free(slot->key);
+    delete slot;
+    slot = meth->offSlot;
+  }
+  return slot;
+}
+
+void offMethodSlotsInvalidate() {
+  android_atomic_inc(&offMethodSlotGen);
+}
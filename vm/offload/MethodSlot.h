@@ -0,0 +1,55 @@
+#ifndef OFFLOAD_METHOD_SLOT_H
+#define OFFLOAD_METHOD_SLOT_H
+
+#include <map>
+
+struct Method;
+struct MethodAccResult;
+
+/* Everything the offload paths look up about a method, resolved once from
+ * the "descriptor name idx" key of the analysis results and then reached
+ * through Method::offSlot. */
+struct MethodSlot {
+  /* The analysis key, for logging. */
+  char* key;
+
+  /* Argument access results, NULL if the analysis has none. */
+  MethodAccResult* accResult;
+
+  /* Whether the analysis recorded static class accesses for this method.
+   * They are found in classes if an analysis image is loaded and at
+   * classOffset of static.txt otherwise. */
+  bool hasClasses;
+  AnalysisClassIter classes;
+  u4 classOffset;
+
+  /* Times the method returned from each execution point, see
+   * methodExePointMap. */
+  std::map<u4, u4> exeCounts;
+
+  /* Run time histogram and decisions of the offload scheduler. */
+  SchedProfile sched;
+
+  /* Value of offMethodSlotGen when the analysis fields were looked up. */
+  volatile int32_t analysisGen;
+};
+
+/* Bumped by offMethodSlotsInvalidate.  Slots resolved under an older value
+ * looked up the analysis before it was loaded and are looked up again. */
+extern volatile int32_t offMethodSlotGen;
+
+/* Build the slot of a method, or refresh the analysis fields of its existing
+ * slot.  Use offGetMethodSlot instead. */
+MethodSlot* offResolveMethodSlot(const Method* method);
+
+/* Called once new analysis results are loaded. */
+void offMethodSlotsInvalidate();
+
+/* Get the slot of a method, resolving it on first use. */
+INLINE MethodSlot* offGetMethodSlot(const Method* method) {
+  MethodSlot* slot = method->offSlot;
+  return slot != NULL && slot->analysisGen == offMethodSlotGen ?
+      slot : offResolveMethodSlot(method);
+}
+
+#endif // OFFLOAD_METHOD_SLOT_H
@@ -88,6 +88,9 @@ static int cleanupThread(Thread* thread, void* parg) {
   auxFifoDestroy(&thread->offReadBuffer);
   thread->offWriteBuffer = auxFifoCreate();
   thread->offReadBuffer = auxFifoCreate();
+  thread->offSendDeficit = 0;
+  thread->offSendPending = 0;
+  thread->offSendQueued = false;
   return 0;
 }
 
@@ -103,10 +106,13 @@ static int addStatusUpdate(ClassObject* clazz, void* arg) {
     u4 sz = (clazz->sfieldCount - 1) >> 5;
     memset(clazz->offInfo.bits, 0xFF, sz << 2);
   }
+  free(clazz->offInfo.sendShadow);
+  free(clazz->offInfo.recvShadow);
+  clazz->offInfo.sendShadow = clazz->offInfo.recvShadow = NULL;
   clazz->offInfo.isQueued = false;
   clazz->offInfo.remoteWaitCount = 0;
   clazz->offInfo.isLockOwner = true;
-  clazz->offInfo.isVolatileOwner = true;
+  clazz->offInfo.volatileOwned = OFF_VOLATILE_ALL;
   // Modified by Yong, only add it into write queue for a server
   if(gDvm.isServer) {
     offAddToWriteQueueLocked(clazz);
@@ -154,6 +160,8 @@ ProxyInfo* popProxyInfo(FifoBuffer* fb) {
   return pi;
 }
 
+/* Only reached once a session is given up on.  A dropped link that can be
+ * resumed leaves all of this state in place. */
 static void cleanupOffloadState(Thread* self) {
   u4 i, j;
 
@@ -162,6 +170,9 @@ static void cleanupOffloadState(Thread* self) {
   dvmSuspendAllThreads(SUSPEND_FOR_GC);
   gDvm.offRecoveryHazards = 0;
   gDvm.nextId = 0;
+  auxVectorResize(&gDvm.offFreeIds, 0);
+  gDvm.offFreeIdPos = 0;
+  gDvm.offIdEpoch++;
   auxVectorDestroy(&gDvm.offWriteQueue);
   gDvm.offWriteQueue = auxVectorCreate(10);
   gDvm.offRecvRevision = gDvm.offSendRevision = 0;
@@ -185,6 +196,8 @@ static void cleanupOffloadState(Thread* self) {
       if(info && info->obj) {
         info->obj->objId = COMM_INVALID_ID;
         free(info->bits);
+        free(info->sendShadow);
+        free(info->recvShadow);
       }
     }
     offTableDestroy(&gDvm.objTables[i]);
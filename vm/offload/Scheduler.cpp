@@ -0,0 +1,245 @@
+#include "Dalvik.h"
+
+#include <stdlib.h>
+
+/* How much faster the server runs a method than this device, until the
+ * method's own correction has been learned.  Set with OFF_SCHED_SPEEDUP. */
+#define SCHED_DEFAULT_SPEEDUP 4.0f
+
+/* Link bandwidth to assume before it has been measured. */
+#define SCHED_DEFAULT_BANDWIDTH (1 << 20)
+
+/* Wire cost of an object beyond its fields (id, class, header) and of each
+ * field.  Objects the analysis marks as wholly accessed are charged a flat
+ * SCHED_ALL_BYTES. */
+#define SCHED_OBJECT_BYTES 16
+#define SCHED_FIELD_BYTES 8
+#define SCHED_ALL_BYTES 256
+
+/* State assumed for methods the analysis knows nothing about. */
+#define SCHED_UNKNOWN_BYTES (4 << 10)
+
+/* Only migrate when the offload is predicted to take at most this fraction
+ * of the local time, so noise in the estimates doesn't cause flapping. */
+#define SCHED_MARGIN 0.8f
+
+static inline u4 stackDepth(const Thread* self, const u4* fp) {
+  return (u4)(self->interpStackStart - (const u1*)fp);
+}
+
+static inline u4 histBucket(u8 usec) {
+  u4 bucket = 63 - __builtin_clzll(usec | 1);
+  return bucket < SCHED_HIST_BUCKETS ? bucket : SCHED_HIST_BUCKETS - 1;
+}
+
+/* Expected local run time, taking each bucket at its midpoint. */
+static u8 predictLocal(const SchedProfile* prof) {
+  u8 total = 0;
+  u4 runs = 0;
+  for(u4 i = 0; i < SCHED_HIST_BUCKETS; i++) {
+    total += (u8)prof->hist[i] * (3ULL << i >> 1);
+    runs += prof->hist[i];
+  }
+  return runs ? total / runs : 0;
+}
+
+static u4 objectBytes(const ObjectAccResult* res, u4 depth) {
+  if(res == NULL || depth > 16) return 0;
+  if(res->allFlag) return SCHED_ALL_BYTES;
+  u4 bytes = SCHED_OBJECT_BYTES +
+             __builtin_popcount(res->migrate) * SCHED_FIELD_BYTES;
+  for(size_t i = 0; i < res->fieldSet.size(); i++) {
+    bytes += objectBytes(res->fieldSet[i], depth + 1);
+  }
+  return bytes;
+}
+
+/* Bytes a migration of method has to ship: its frame plus the objects and
+ * statics the analysis says it touches. */
+static u4 stateBytes(const Method* method, MethodSlot* slot) {
+  SchedProfile* prof = &slot->sched;
+  if(prof->stateBytes != 0) return prof->stateBytes;
+
+  u4 bytes = method->registersSize * 4 + sizeof(StackSaveArea);
+  MethodAccResult* acc = slot->accResult;
+  if(acc == NULL) {
+    bytes += SCHED_UNKNOWN_BYTES;
+  } else {
+    if(acc->args != NULL) {
+      for(size_t i = 0; i < acc->args->size(); i++) {
+        bytes += objectBytes((*acc->args)[i], 0);
+      }
+    }
+    if(acc->globalClazz != NULL) {
+      for(size_t i = 0; i < acc->globalClazz->size(); i++) {
+        bytes += objectBytes((*acc->globalClazz)[i], 0);
+      }
+    }
+  }
+  prof->stateBytes = bytes;
+  return bytes;
+}
+
+/* Time spent moving the thread there and back that local execution
+ * doesn't pay: a sync each way, as measured by offSyncPush, plus shipping
+ * the method's state. */
+static u8 predictTransfer(const Method* method, MethodSlot* slot) {
+  u8 bw = gDvm.offNetBandwidth ? gDvm.offNetBandwidth :
+                                 SCHED_DEFAULT_BANDWIDTH;
+  u8 sync = gDvm.offSyncTimeSamples ? gDvm.offSyncTime : gDvm.offNetRTT;
+  return 2 * (sync + (u8)stateBytes(method, slot) * 1000000 / bw);
+}
+
+static void listMethod(const Method* method, SchedProfile* prof) {
+  pthread_mutex_lock(&gDvm.offSchedLock); {
+    if(!prof->listed) {
+      prof->listed = true;
+      gDvm.offSchedMethods->push_back(method);
+    }
+  } pthread_mutex_unlock(&gDvm.offSchedLock);
+}
+
+void offSchedulerDecide(Thread* self, const Method* method,
+                        MethodSlot* slot) {
+  SchedProfile* prof = &slot->sched;
+  u4 depth = stackDepth(self, self->interpSave.curFrame);
+  if(self->offSchedMethod != NULL) {
+    /* Inside a method that was migrated and came back early; the outer
+     * decision still stands. */
+    if(depth > self->offSchedDepth) return;
+
+    /* The migrated frame was unwound by an exception. */
+    self->offSchedMethod = NULL;
+  }
+  if(prof->skip != 0) {
+    prof->skip--;
+    return;
+  }
+  if(!offWellConnected()) return;
+
+  u8 local = predictLocal(prof);
+  u8 transfer = predictTransfer(method, slot);
+  float correction = prof->correction != 0.0f ? prof->correction : 1.0f;
+  u8 predicted = (u8)((local / gDvm.offSchedSpeedup + transfer) * correction);
+
+  if(predicted < local * SCHED_MARGIN) {
+    self->offFlagMigration = true;
+    self->offSchedMethod = method;
+    self->offSchedDepth = depth;
+    self->offSchedCounter = self->migrationCounter;
+    self->offSchedStart = dvmGetRelativeTimeUsec();
+    self->offSchedPredicted = predicted;
+    prof->migrations++;
+    if(gDvm.offSchedVerbose) {
+      ALOGI("Scheduler migrating %s: local %llu us, offloaded %llu us "
+            "(transfer %llu us)", slot->key, local, predicted, transfer);
+    }
+  } else {
+    prof->declined++;
+    prof->skip = SCHED_RECHECK;
+  }
+}
+
+/* A migration the scheduler asked for has finished. */
+static void noteOutcome(Thread* self, const Method* method,
+                        SchedProfile* prof, u8 end) {
+  u8 actual = end - self->offSchedStart;
+  u8 predicted = self->offSchedPredicted ? self->offSchedPredicted : 1;
+  s8 error = (s8)actual - (s8)predicted;
+
+  /* Move the method's correction toward what would have made this
+   * prediction right. */
+  float correction = prof->correction != 0.0f ? prof->correction : 1.0f;
+  float target = correction * actual / predicted;
+  if(target < 0.05f) target = 0.05f;
+  if(target > 20.0f) target = 20.0f;
+  prof->correction = correction + (target - correction) / 4;
+
+  prof->outcomes++;
+  prof->errorSum += error;
+  prof->absErrorSum += error < 0 ? -error : error;
+
+  pthread_mutex_lock(&gDvm.offSchedLock); {
+    gDvm.offSchedOutcomes++;
+    gDvm.offSchedErrorSum += error;
+    gDvm.offSchedAbsErrorSum += error < 0 ? -error : error;
+  } pthread_mutex_unlock(&gDvm.offSchedLock);
+
+  if(gDvm.offSchedVerbose) {
+    ALOGI("Scheduler outcome %s.%s: predicted %llu us, took %llu us",
+          method->clazz->descriptor, method->name, predicted, actual);
+  }
+}
+
+void offSchedulerRecord(Thread* self, const Method* method, const u4* fp,
+                        u8 start, u8 end) {
+  SchedProfile* prof = &offGetMethodSlot(method)->sched;
+  if(self->offSchedMethod == method &&
+     self->offSchedDepth == stackDepth(self, fp)) {
+    self->offSchedMethod = NULL;
+    if(self->migrationCounter != self->offSchedCounter) {
+      noteOutcome(self, method, prof, end);
+      return;
+    }
+    /* The migration didn't happen; this was an ordinary local run. */
+  }
+
+  /* Server frames and frames restamped around native calls don't carry a
+   * usable start time. */
+  if(end <= start) return;
+  if(!prof->listed) listMethod(method, prof);
+
+  prof->hist[histBucket(end - start)]++;
+  if(++prof->samples >= SCHED_HIST_DECAY) {
+    prof->samples = 0;
+    for(u4 i = 0; i < SCHED_HIST_BUCKETS; i++) {
+      prof->hist[i] >>= 1;
+      prof->samples += prof->hist[i];
+    }
+  }
+}
+
+void offSchedulerDumpStats() {
+  if(gDvm.offSchedMethods == NULL) return;
+
+  pthread_mutex_lock(&gDvm.offSchedLock); {
+    u4 outcomes = gDvm.offSchedOutcomes ? gDvm.offSchedOutcomes : 1;
+    ALOGI("Offload scheduler: %u outcomes, mean error %lld us, "
+          "mean abs error %llu us, link %u B/s, sync %u us",
+          gDvm.offSchedOutcomes, gDvm.offSchedErrorSum / outcomes,
+          gDvm.offSchedAbsErrorSum / outcomes, gDvm.offNetBandwidth,
+          gDvm.offSyncTime);
+    for(size_t i = 0; i < gDvm.offSchedMethods->size(); i++) {
+      MethodSlot* slot = (*gDvm.offSchedMethods)[i]->offSlot;
+      SchedProfile* prof = &slot->sched;
+      if(prof->migrations == 0 && prof->declined == 0) continue;
+      u4 n = prof->outcomes ? prof->outcomes : 1;
+      ALOGI("  %s: local %llu us, state %u B, migrated %u, declined %u, "
+            "error %lld us (abs %llu us), correction %.2f",
+            slot->key, predictLocal(prof), prof->stateBytes,
+            prof->migrations, prof->declined, prof->errorSum / n,
+            prof->absErrorSum / n, prof->correction);
+    }
+  } pthread_mutex_unlock(&gDvm.offSchedLock);
+}
+
+bool offSchedulerStartup() {
+  gDvm.offSchedSpeedup = SCHED_DEFAULT_SPEEDUP;
+  const char* speedup = getenv("OFF_SCHED_SPEEDUP");
+  if(speedup != NULL && atof(speedup) > 0) {
+    gDvm.offSchedSpeedup = atof(speedup);
+  }
+  gDvm.offSchedVerbose = getenv("OFF_SCHED_VERBOSE") != NULL;
+  gDvm.offSchedOutcomes = 0;
+  gDvm.offSchedErrorSum = 0;
+  gDvm.offSchedAbsErrorSum = 0;
+  gDvm.offSchedMethods = new std::vector<const Method*>();
+  return pthread_mutex_init(&gDvm.offSchedLock, NULL) == 0;
+}
+
+void offSchedulerShutdown() {
+  offSchedulerDumpStats();
+  delete gDvm.offSchedMethods;
+  gDvm.offSchedMethods = NULL;
+  pthread_mutex_destroy(&gDvm.offSchedLock);
+}
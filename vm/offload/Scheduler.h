@@ -0,0 +1,67 @@
+#ifndef OFFLOAD_SCHEDULER_H
+#define OFFLOAD_SCHEDULER_H
+
+struct Thread;
+struct Method;
+struct MethodSlot;
+
+/* Local run times are counted in power of two buckets of microseconds.
+ * Bucket i holds runs of [2^i, 2^(i+1)) us and the last bucket everything
+ * longer. */
+#define SCHED_HIST_BUCKETS 24
+
+/* Halve the histogram when it holds this many runs so it follows changes in
+ * the method's behaviour. */
+#define SCHED_HIST_DECAY 256
+
+/* Local runs of a method needed before the scheduler considers it. */
+#define SCHED_MIN_SAMPLES 4
+
+/* Entries of a method to let pass after deciding to keep it local. */
+#define SCHED_RECHECK 32
+
+/* Per method scheduler state, kept in the method's slot.  It is updated
+ * without locks by whichever thread runs the method; a lost update only blurs
+ * the statistics. */
+typedef struct SchedProfile {
+  u4 hist[SCHED_HIST_BUCKETS];
+  u4 samples;
+
+  /* Bytes of state the analysis results say a migration ships, 0 until
+   * first needed. */
+  u4 stateBytes;
+
+  /* Observed over predicted offload time, learned from this method's own
+   * migrations.  0 until the first one completes. */
+  float correction;
+
+  u4 skip;
+  bool listed;
+
+  /* Decisions and how the predictions held up, for tuning. */
+  u4 migrations;
+  u4 declined;
+  u4 outcomes;
+  s8 errorSum;
+  u8 absErrorSum;
+} SchedProfile;
+
+/* Predict whether running the method just entered on the server beats
+ * running it locally and flag the thread for migration if it does.  Use
+ * offSchedulerSafePoint instead. */
+void offSchedulerDecide(struct Thread* self, const struct Method* method,
+                        struct MethodSlot* slot);
+
+/* Account for a finished run of a method, either as a local run time sample
+ * or as the outcome of a migration the scheduler asked for.  Use
+ * offSchedulerMethodExit instead. */
+void offSchedulerRecord(struct Thread* self, const struct Method* method,
+                        const u4* fp, u8 start, u8 end);
+
+/* Log the scheduler's decisions and prediction errors. */
+void offSchedulerDumpStats();
+
+bool offSchedulerStartup();
+void offSchedulerShutdown();
+
+#endif // OFFLOAD_SCHEDULER_H
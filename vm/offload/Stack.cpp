@@ -1,12 +1,12 @@
 #include "Dalvik.h"
-#include <sstream> 
 
 //#define SYNC_STACK_ONLY
 
 #define READWRITEFUNC(type, size, ntoh, hton)                                 \
   static void write##size(FifoBuffer* fb, type v) {                           \
     v = hton(v);                                                              \
-    auxFifoPushData(fb, (char*)&v, sizeof(v));                                \
+    memcpy(auxFifoReserve(fb, sizeof(v)), &v, sizeof(v));                    \
+    auxFifoCommit(fb, sizeof(v));                                             \
   }                                                                           \
   static type read##size(FifoBuffer* fb) {                                    \
     type v;                                                                   \
@@ -14,8 +14,6 @@
     return ntoh(v);                                                           \
   }
 
-static std::stringstream converter;
-extern std::ifstream staticfile;
     
 READWRITEFUNC(u1, U1, , );
 //READWRITEFUNC(u2, U2, ntohs, htons);
@@ -130,22 +128,9 @@ void offPushStackLocalMethodStart(FifoBuffer* sfb, FifoBuffer* fb, Thread* threa
  // ALOGE("sync scan time before parsing global: %llu", beforeendtime - beforestarttime);
   
 //ALOGI("SENDING %s %s %d", method->clazz->descriptor, method->name, addr);
-  const char* clazzName = method->clazz->descriptor;
-  const char* methodName = method->name;
-  converter << method->idx;
-  char* idxStr = strdup(converter.str().c_str());
-  converter.str("");
-  converter.clear();
-  char* key = new char[strlen(clazzName) + strlen(methodName) + strlen(idxStr) + 3];
-  strcpy(key, clazzName);
-  strcat(key, " ");
-  strcat(key, methodName);
-  strcat(key, " ");
-  strcat(key, idxStr);
-  pushClazzInfo(method, key, fb);
-  MethodAccResult* methodAccResult = (*gDvm.methodAccMap)[key];
-  free(idxStr);
-  delete[] key;
+  MethodSlot* slot = offGetMethodSlot(method);
+  pushClazzInfo(method, fb);
+  MethodAccResult* methodAccResult = slot->accResult;
   int i;
   int argStart = method->registersSize - method->insSize;
 //          ALOGE("value of i is: %d, regsize is: %d", i, method->registersSize);
@@ -204,6 +189,36 @@ void offPushStackLocalMethodStart(FifoBuffer* sfb, FifoBuffer* fb, Thread* threa
   //    SAVEAREA_FROM_FP(sst->curFrame)->prevFrame : NULL;
 }
 
+static bool isInterpFrame(const u4* fp) {
+  return !dvmIsBreakFrame(fp) &&
+         !dvmIsNativeMethod(SAVEAREA_FROM_FP(fp)->method);
+}
+
+/* Pick where to stop when only the top gDvm.offMigrateFrames interpreted
+ * frames should be sent.  The frames below stay here as stubs; the server
+ * migrates back when it returns into the stop frame, which hands them the
+ * return value without them ever being sent.  The cut is only made between
+ * two interpreted frames so break and native frames stay with their callers.
+ * Returns NULL when the whole stack should be sent. */
+static u4* selectStopFrame(Thread* thread) {
+  u4 limit = gDvm.offMigrateFrames;
+  if(limit == 0) return NULL;
+
+  u4 frames = 0;
+  bool prevInterp = false;
+  u4* fp;
+  for(fp = thread->interpSave.curFrame; fp != NULL;
+      fp = SAVEAREA_FROM_FP(fp)->prevFrame) {
+    bool interp = isInterpFrame(fp);
+    if(interp && prevInterp && frames >= limit) {
+      return fp;
+    }
+    if(interp) frames++;
+    prevInterp = interp;
+  }
+  return NULL;
+}
+
 void offPushStackLocalInMethod(FifoBuffer* sfb, FifoBuffer* fb, Thread* thread) {
   InterpSaveState* sst = &thread->interpSave;
   writeU4(sfb, thread->threadId);
@@ -249,24 +264,23 @@ void offPushStackLocalInMethod(FifoBuffer* sfb, FifoBuffer* fb, Thread* thread)
       const StackSaveArea* saveArea = SAVEAREA_FROM_FP(fp);
       fp = saveArea->prevFrame;
     }
+    if(!stopIsValid) {
+      thread->offStackFpStop = selectStopFrame(thread);
+      if(thread->offStackFpStop != NULL) {
+        /* Only the sent frames will run on the server. */
+        for(fp = sst->curFrame; fp != thread->offStackFpStop;
+            fp = SAVEAREA_FROM_FP(fp)->prevFrame) {
+          if(isInterpFrame(fp)) {
+            pushClazzInfo(SAVEAREA_FROM_FP(fp)->method, fb);
+          }
+        }
+        stopIsValid = true;
+      }
+    }
     fp = sst->curFrame;
     if(stopIsValid) {
       const StackSaveArea* stopSaveArea = SAVEAREA_FROM_FP(thread->offStackFpStop);
-      const char* clazzName = stopSaveArea->method->clazz->descriptor;
-      const char* methodName = stopSaveArea->method->name;
-      converter << stopSaveArea->method->idx;
-      char* idxStr = strdup(converter.str().c_str());
-      converter.str("");
-      converter.clear();
-      char* key = new char[strlen(clazzName) + strlen(methodName) + strlen(idxStr) + 3];
-      strcpy(key, clazzName);
-      strcat(key, " ");
-      strcat(key, methodName);
-      strcat(key, " ");
-      strcat(key, idxStr);
-      pushClazzInfo(stopSaveArea->method, key, fb);
-      free(idxStr);
-      delete[] key;
+      pushClazzInfo(stopSaveArea->method, fb);
       while(fp != thread->offStackFpStop) {
         if(dvmIsBreakFrame(fp)) {
           breakIncluded++;
@@ -2,6 +2,25 @@
 
 #include "Dalvik.h"
 
+#include <cutils/atomic.h>
+
+/* A lock whose ownership changes sides at a rate of this many times per
+ * LOCK_FLIP_WINDOW is ping-ponging.  The side that has it keeps it for a
+ * lease of half an RTT per flip, up to LOCK_LEASE_MAX, so local threads get
+ * some use out of each transfer. */
+#define LOCK_PINGPONG 4
+#define LOCK_FLIP_WINDOW 1000000
+#define LOCK_LEASE_MAX 50000
+
+/* Most extra locks handed over with a requested one. */
+#define LOCK_GROUP_MAX 8
+
+/* Answers to OFF_ACTION_LOCK.  A deferred lock is under lease on the other
+ * side; the reply carries the microseconds left on it. */
+#define LOCK_DENIED   0
+#define LOCK_GRANTED  1
+#define LOCK_DEFERRED 2
+
 void offInsertIntoLockList(Thread* self, Object* obj) {
   u4 i, j;
   Object* lst = obj;
@@ -143,12 +162,39 @@ bool offCheckLockOwnership(Object* obj) {
   return result;
 }
 
+/* Record a change of lock ownership.  lockFlips loses the fraction of itself
+ * that the time since the last change is of LOCK_FLIP_WINDOW, so with
+ * changes every t it settles at LOCK_FLIP_WINDOW / t, the rate per window.
+ * Called with offCommLock held. */
+static void noteOwnershipChange(ObjectInfo* info, bool own) {
+  u8 now = dvmGetRelativeTimeUsec();
+  u8 elapsed = now - info->lockSince;
+  if(elapsed >= LOCK_FLIP_WINDOW) {
+    info->lockFlips = 0;
+  } else {
+    info->lockFlips -= (u4)((u8)info->lockFlips * elapsed / LOCK_FLIP_WINDOW);
+  }
+  info->lockFlips++;
+  info->lockSince = now;
+  info->isLockOwner = own;
+}
+
+/* Time left on the lease of a lock this side owns.  Called with offCommLock
+ * held. */
+static u8 leaseRemaining(ObjectInfo* info) {
+  if(info->lockFlips < LOCK_PINGPONG) return 0;
+  u8 lease = (u8)info->lockFlips * gDvm.offNetRTT / 2;
+  if(lease > LOCK_LEASE_MAX) lease = LOCK_LEASE_MAX;
+  u8 held = dvmGetRelativeTimeUsec() - info->lockSince;
+  return held < lease ? lease - held : 0;
+}
+
 static void setObjectOwnership(Object* obj, bool own) {
   pthread_mutex_lock(&gDvm.offCommLock); {
     ObjectInfo* info = offIdObjectInfo(auxObjectToId(obj));
     assert(info);
     assert(info->isLockOwner != own);
-    info->isLockOwner = own;
+    noteOwnershipChange(info, own);
   } pthread_mutex_unlock(&gDvm.offCommLock);
 }
 
@@ -164,11 +210,55 @@ void offTakeOwnershipSuspend(Object* obj, u4 waiters) {
 typedef struct OwnArgs {
   Object* obj;
   int waiters;
+
+  /* Other locks the remote side handed over along with obj. */
+  u4 groupCount;
+  u4 groupIds[LOCK_GROUP_MAX];
+  u4 groupWaiters[LOCK_GROUP_MAX];
+
+  /* Those of them that have to go back because they are unknown here. */
+  u4 ungrantCount;
+  u4 ungrantIds[LOCK_GROUP_MAX];
 } OwnArgs;
 
 static void setOwnership(OwnArgs* args, FifoBuffer* fb) {
   UNUSED_PARAMETER(fb);
   offTakeOwnershipSuspend(args->obj, args->waiters);
+  args->ungrantCount = 0;
+  for(u4 i = 0; i < args->groupCount; i++) {
+    ObjectInfo* info = offIdObjectInfo(args->groupIds[i]);
+    if(info == NULL || info->obj == NULL) {
+      /* The remote side gave the lock up already, so unless it takes it back
+       * nobody owns it. */
+      args->ungrantIds[args->ungrantCount++] = args->groupIds[i];
+      continue;
+    }
+    if(info->isLockOwner) {
+      ALOGW("Ignoring grant of lock %u", args->groupIds[i]);
+      continue;
+    }
+    offTakeOwnershipSuspend(info->obj, args->groupWaiters[i]);
+  }
+}
+
+/* Wait out the lease the other side has on obj before asking again, unless
+ * the lock comes over meanwhile along with another one. */
+static void waitForLease(Thread* self, Object* obj, u4 wait) {
+  ThreadStatus status = dvmChangeStatus(self, THREAD_VMWAIT);
+  u8 end = dvmGetRelativeTimeUsec() + wait;
+  pthread_mutex_lock(&gDvm.offCommLock);
+  for(;;) {
+    ObjectInfo* info = offIdObjectInfo(auxObjectToId(obj));
+    u8 now = dvmGetRelativeTimeUsec();
+    if(!gDvm.offConnected || (info && info->isLockOwner) || now >= end) {
+      break;
+    }
+    u8 left = end - now;
+    dvmRelativeCondWait(&gDvm.offPullCond, &gDvm.offCommLock,
+                        left / 1000, (left % 1000) * 1000);
+  }
+  pthread_mutex_unlock(&gDvm.offCommLock);
+  dvmChangeStatus(self, status);
 }
 
 /* The contract here is that this endpoint will have lock ownership of the
@@ -185,37 +275,104 @@ retry:
   }
 
   while(!offCheckLockOwnership(obj) && gDvm.offConnected) {
-ALOGI("THREAD %d ASKING FOR OWNERSHIP FOR %d", self->threadId, obj->objId);
+    ALOGV("THREAD %d ASKING FOR OWNERSHIP FOR %d", self->threadId, obj->objId);
 
+    u8 start = dvmGetRelativeTimeUsec();
     sendSyncMessage(self, OFF_ACTION_LOCK, auxObjectToId(obj));
+    offTelemetryCount(self, OFF_STAT_LOCK_ROUND_TRIPS, 1);
     offThreadWaitForResume(self);
     u1 result = offReadU1(self);
 
     if(!gDvm.offConnected) {
-ALOGI("THREAD %d LOST SERVER", self->threadId);
+      ALOGV("THREAD %d LOST SERVER", self->threadId);
       continue;
     }
 
-ALOGI("THREAD %d REQUEST FOR OWNERSHIP FOR %d WAS %s", self->threadId,
-      obj->objId, result ? "GRANTED" : "DENIED");
-    if(result) {
+    ALOGV("THREAD %d REQUEST FOR OWNERSHIP FOR %d WAS %s", self->threadId,
+          obj->objId, result == LOCK_GRANTED ? "GRANTED" :
+                      result == LOCK_DEFERRED ? "DEFERRED" : "DENIED");
+    if(result == LOCK_DEFERRED) {
+      waitForLease(self, obj, offReadU4(self));
+    } else if(result == LOCK_GRANTED) {
       OwnArgs args;
       args.obj = obj;
       args.waiters = offReadU4(self);
+      args.groupCount = 0;
+      for(u4 id = offReadU4(self); id != (u4)-1; id = offReadU4(self)) {
+        u4 waiters = offReadU4(self);
+        if(args.groupCount < LOCK_GROUP_MAX) {
+          args.groupIds[args.groupCount] = id;
+          args.groupWaiters[args.groupCount] = waiters;
+          args.groupCount++;
+        }
+      }
+      args.ungrantCount = 0;
       offSyncPullDo(NULL, NULL,
                     (void(*)(void*, FifoBuffer*))setOwnership, &args);
+      for(u4 i = 0; i < args.ungrantCount; i++) {
+        sendSyncMessage(self, OFF_ACTION_UNGRANT, args.ungrantIds[i]);
+      }
     }
+    offTelemetryRecord(self, OFF_HIST_LOCK_US,
+                       dvmGetRelativeTimeUsec() - start);
   }
   offRecoveryClearHazard(self);
   if(!offCheckLockOwnership(obj)) goto retry;
 }
 
+/* Remember that the remote side of self asked for obj.  Threads tend to
+ * take the same few locks over and over so these are the locks to hand over
+ * together next time. */
+static void noteWanted(Thread* self, Object* obj) {
+  u4 n = sizeof(self->offLockWanted) / sizeof(Object*);
+  for(u4 i = 0; i < n; i++) {
+    if(self->offLockWanted[i] == obj) return;
+  }
+  self->offLockWanted[self->offLockWantedPos] = obj;
+  self->offLockWantedPos = (self->offLockWantedPos + 1) % n;
+}
+
+/* Hand over the locks the remote side of self is likely to ask for next,
+ * skipping any that are held here or still under lease.  Called with the VM
+ * suspended so nothing can lock them meanwhile. */
+static void writeLockGroup(Thread* self, Object* obj) {
+  u4 sent = 0;
+  u4 n = sizeof(self->offLockWanted) / sizeof(Object*);
+  for(u4 i = 0; i < n && sent < LOCK_GROUP_MAX; i++) {
+    Object* peer = self->offLockWanted[i];
+    if(peer == NULL || peer == obj || !dvmIsValidObject(peer) ||
+       noSync(peer) || peer->objId == COMM_INVALID_ID ||
+       dvmGetObjectLockHolder(peer) != NULL) {
+      continue;
+    }
+
+    u4 objId = auxObjectToId(peer);
+    bool grant = false;
+    pthread_mutex_lock(&gDvm.offCommLock); {
+      ObjectInfo* info = offIdObjectInfo(objId);
+      if(info && info->obj == peer && info->isLockOwner &&
+         leaseRemaining(info) == 0) {
+        noteOwnershipChange(info, false);
+        grant = true;
+      }
+    } pthread_mutex_unlock(&gDvm.offCommLock);
+    if(!grant) continue;
+
+    offWriteU4(self, objId);
+    offWriteU4(self, offGetLocalWaiters(peer));
+    sent++;
+  }
+  offWriteU4(self, (u4)-1);
+  offTelemetryCount(self, OFF_STAT_LOCK_GROUP_GRANTS, sent);
+}
+
 static bool clearOwnership(Object* obj) {
   Thread* self = dvmThreadSelf();
   unlockMonitorNoOwn(self, obj);
-  offWriteU1(self, true);
+  offWriteU1(self, LOCK_GRANTED);
   offWriteU4(self, offGetLocalWaiters(obj));
   setObjectOwnership(obj, false);
+  writeLockGroup(self, obj);
   return true;
 }
 
@@ -229,7 +386,23 @@ void offPerformLock(Thread* self) {
      * again. */
     ALOGE("lock failed because of unheard object, id: %d", objId);
     offWriteU1(self, OFF_ACTION_RESUME);
-    offWriteU1(self, false);
+    offWriteU1(self, LOCK_DENIED);
+    return;
+  }
+
+  /* A lock under lease stays here; the other side waits the lease out and
+   * asks again, leaving this thread free meanwhile. */
+  noteWanted(self, obj);
+  u8 lease;
+  pthread_mutex_lock(&gDvm.offCommLock); {
+    ObjectInfo* info = offIdObjectInfo(auxObjectToId(obj));
+    lease = info && info->isLockOwner ? leaseRemaining(info) : 0;
+  } pthread_mutex_unlock(&gDvm.offCommLock);
+  if(lease != 0) {
+    offTelemetryCount(self, OFF_STAT_LOCK_DEFERRED, 1);
+    offWriteU1(self, OFF_ACTION_RESUME);
+    offWriteU1(self, LOCK_DEFERRED);
+    offWriteU4(self, (u4)lease);
     return;
   }
 
@@ -238,7 +411,7 @@ void offPerformLock(Thread* self) {
     ALOGE("lock failed because of lock failed object, id: %d, class is: %s", objId, obj->clazz == gDvm.classJavaLangClass ? ((ClassObject*)obj)->descriptor : obj->clazz->descriptor);
     unlockMonitorNoOwn(self, obj);
     offWriteU1(self, OFF_ACTION_RESUME);
-    offWriteU1(self, false);
+    offWriteU1(self, LOCK_DENIED);
     return;
   }
 
@@ -248,6 +421,18 @@ void offPerformLock(Thread* self) {
   offSyncPushDoIf((bool(*)(void*))clearOwnership, obj, NULL, NULL);
 }
 
+void offPerformUngrant(Thread* self) {
+  u4 objId = offReadU4(self);
+  if(!gDvm.offConnected) return;
+  pthread_mutex_lock(&gDvm.offCommLock); {
+    ObjectInfo* info = offIdObjectInfo(objId);
+    if(info && info->obj && !info->isLockOwner) {
+      noteOwnershipChange(info, true);
+    }
+  } pthread_mutex_unlock(&gDvm.offCommLock);
+  offTelemetryCount(self, OFF_STAT_LOCK_UNGRANTS, 1);
+}
+
 void offObjectNotify(Thread* self, Object* obj) {
   if(noSync(obj)) return;
 
@@ -288,25 +473,41 @@ void offPerformInterrupt(Thread* self) {
   offWriteU1(self, result);
 }
 
+/* Replies to OFF_ACTION_GRABVOL besides a revision to wait for: a full sync
+ * follows, or a handoff of the object's own dirty fields follows. */
+#define VOLATILE_SYNC    0xFFFFFFFFU
+#define VOLATILE_HANDOFF 0xFFFFFFFEU
+
 void offGrabVolatiles(ObjectInfo* info, u4 fieldIndex) {
-  if(info->isVolatileOwner) return;
+  u4 group = OFF_VOLATILE_GROUP(fieldIndex);
+  if(info->volatileOwned & group) return;
 
-ALOGI("grabbing volatiles for %s %u (%s)", info->obj->clazz->descriptor,
-     fieldIndex, (info->obj->clazz == gDvm.classJavaLangClass ?
-                  ((ClassObject*)info->obj)->descriptor : "[n/a]"));
+  ALOGV("grabbing volatiles for %s %u (%s)", info->obj->clazz->descriptor,
+        fieldIndex, (info->obj->clazz == gDvm.classJavaLangClass ?
+                     ((ClassObject*)info->obj)->descriptor : "[n/a]"));
   u4 revision;
   Thread* self = dvmThreadSelf();
+  u8 start = dvmGetRelativeTimeUsec();
 
   offWriteU1(self, OFF_ACTION_GRABVOL);
   offWriteU4(self, info->obj->objId);
+  offWriteU4(self, group);
   revision = offReadU4(self);
   if(!gDvm.offConnected) return;
-  if(revision == 0xFFFFFFFFU) {
+  if(revision == VOLATILE_SYNC) {
     /* We need to pull new data down. */
     offSyncPull();
-    pthread_mutex_lock(&gDvm.offVolatileLock);
-    info->isVolatileOwner = true;
-    pthread_mutex_unlock(&gDvm.offVolatileLock);
+    offTelemetryCount(self, OFF_STAT_VOLATILE_SYNCS, 1);
+  } else if(revision == VOLATILE_HANDOFF) {
+    u4 rev = offReadU4(self);
+    u4 bytes = offReadU4(self);
+    FifoBuffer fb = auxFifoCreate();
+    offReadFifo(self, &fb, bytes);
+    bool applied = gDvm.offConnected &&
+                   offSyncPullObject(self, info, rev, &fb);
+    auxFifoDestroy(&fb);
+    if(!applied) return;
+    offTelemetryCount(self, OFF_STAT_VOLATILE_HANDOFFS, 1);
   } else {
     /* Otherwise just wait until we're at the current revision. */
     if((int)(revision - gDvm.offRecvRevision) > 0) {
@@ -318,29 +519,78 @@ ALOGI("grabbing volatiles for %s %u (%s)", info->obj->clazz->descriptor,
       pthread_mutex_unlock(&gDvm.offCommLock);
       dvmChangeStatus(self, status);
     }
+    return;
+  }
+  pthread_mutex_lock(&gDvm.offVolatileLock);
+  info->volatileOwned |= group;
+  pthread_mutex_unlock(&gDvm.offVolatileLock);
+  offTelemetryRecord(self, OFF_HIST_VOLATILE_US,
+                     dvmGetRelativeTimeUsec() - start);
+}
+
+/* State of a grab answered by offPerformGrabVolatiles. */
+typedef struct VolatileGrab {
+  Thread* self;
+  ObjectInfo* info;
+  u4 group;
+  bool released;
+  bool handoff;
+  u4 rev;
+  FifoBuffer fb;
+} VolatileGrab;
+
+/* Runs with everything stopped at the start of the push that may answer a
+ * grab.  Gives up only the requested group; if the object's own fields are
+ * all the other end is missing they go over by themselves after the VM
+ * resumes.  Returns true, having announced it, only when the full sync has
+ * to follow, so that takes the same suspension. */
+static bool releaseVolatiles(VolatileGrab* grab) {
+  pthread_mutex_lock(&gDvm.offVolatileLock);
+  grab->released = (grab->info->volatileOwned & grab->group) != 0;
+  grab->info->volatileOwned &= ~grab->group;
+  pthread_mutex_unlock(&gDvm.offVolatileLock);
+  if(!grab->released) return false;
+  if(offSyncCaptureObject(grab->info, &grab->fb)) {
+    grab->handoff = true;
+    grab->rev = gDvm.offSendRevision++;
+    return false;
   }
+  offWriteU4(grab->self, VOLATILE_SYNC);
+  return true;
 }
 
 void offPerformGrabVolatiles(Thread* self) {
   u4 objId = offReadU4(self);
+  u4 group = offReadU4(self);
   if(!gDvm.offConnected) return;
   ObjectInfo* info = offIdObjectInfo(objId);
-  if(!info || !info->isVolatileOwner) {
+  if(!info || !(info->volatileOwned & group)) {
     offWriteU4(self, gDvm.offSendRevision);
     return;
   }
 
-  pthread_mutex_lock(&gDvm.offVolatileLock);
-  if(!info->isVolatileOwner) {
+  VolatileGrab grab;
+  grab.self = self;
+  grab.info = info;
+  grab.group = group;
+  grab.released = grab.handoff = false;
+  grab.rev = 0;
+  grab.fb = auxFifoCreate();
+  offSyncPushDoIf((bool(*)(void*))releaseVolatiles, &grab, NULL, NULL);
+
+  if(!grab.released) {
     offWriteU4(self, gDvm.offSendRevision);
-    pthread_mutex_unlock(&gDvm.offVolatileLock);
-    return;
+  } else if(grab.handoff) {
+    offWriteU4(self, VOLATILE_HANDOFF);
+    offWriteU4(self, grab.rev);
+    offWriteU4(self, auxFifoSize(&grab.fb));
+    while(!auxFifoEmpty(&grab.fb)) {
+      u4 bytes = auxFifoGetBufferSize(&grab.fb);
+      offSendMessage(self, auxFifoGetBuffer(&grab.fb), bytes);
+      auxFifoPopBytes(&grab.fb, bytes);
+    }
   }
-  info->isVolatileOwner = false;
-  pthread_mutex_unlock(&gDvm.offVolatileLock);
-
-  offWriteU4(self, 0xFFFFFFFFU);
-  offSyncPush();
+  auxFifoDestroy(&grab.fb);
 }
 
 void offPerformNotify(Thread* self) {
@@ -396,7 +646,8 @@ void offPerformNotifyAll(Thread* self) {
 #define READWRITEFUNC(type, size, ntoh, hton)                                 \
   static void write##size(FifoBuffer* fb, type v) {                           \
     v = hton(v);                                                              \
-    auxFifoPushData(fb, (char*)&v, sizeof(v));                                \
+    memcpy(auxFifoReserve(fb, sizeof(v)), &v, sizeof(v));                    \
+    auxFifoCommit(fb, sizeof(v));                                             \
   }                                                                           \
   static type read##size(FifoBuffer* fb) {                                    \
     type v;                                                                   \
@@ -413,7 +664,8 @@ static void promoteMonitor(Object* obj, int count) {
   assert(LW_MONITOR(obj->lock)->owner == dvmThreadSelf());
   dvmLockMutex(&LW_MONITOR(obj->lock)->lock);
   setObjectOwnership(obj, true);
-ALOGI("THREAD %d: RECEIVE OWNERSHIP OF %d", dvmThreadSelf()->threadId, obj->objId);
+  ALOGV("THREAD %d: RECEIVE OWNERSHIP OF %d", dvmThreadSelf()->threadId,
+        obj->objId);
 }
 
 static void reduceMonitor(Object* obj, int count) {
@@ -422,7 +674,8 @@ static void reduceMonitor(Object* obj, int count) {
   assert(LW_MONITOR(obj->lock)->lockCount == count);
   assert(LW_MONITOR(obj->lock)->owner == dvmThreadSelf());
   setObjectOwnership(obj, false);
-ALOGI("THREAD %d: SEND OWNERSHIP OF %d", dvmThreadSelf()->threadId, obj->objId);
+  ALOGV("THREAD %d: SEND OWNERSHIP OF %d", dvmThreadSelf()->threadId,
+        obj->objId);
   dvmUnlockMutex(&LW_MONITOR(obj->lock)->lock);
 }
 
@@ -26,6 +26,10 @@ void offObjectNotifyAll(struct Thread* self, struct Object* obj);
 
 void offPerformLock(struct Thread* self);
 
+/* Take back a lock handed over along with another that the remote side could
+ * not take because it does not know the object. */
+void offPerformUngrant(struct Thread* self);
+
 void offPerformNotify(struct Thread* self);
 
 void offPerformNotifyAll(struct Thread* self);
@@ -0,0 +1,181 @@
+#include "Dalvik.h"
+
+static const char* const kCounterNames[OFF_STAT_COUNT] = {
+  "syncFieldsSent",
+  "syncFieldsReceived",
+  "lockRoundTrips",
+  "lockGroupGrants",
+  "lockDeferred",
+  "volatileHandoffs",
+  "volatileSyncs",
+  "trimRounds",
+  "trimBytes",
+  "trimmedObjects",
+  "dexFiles",
+  "dexBytes",
+  "lockUngrants",
+};
+
+static const char* const kHistogramNames[OFF_HIST_COUNT] = {
+  "syncPush.us",
+  "syncPause.us",
+  "syncPush.bytes",
+  "syncPull.us",
+  "syncPull.bytes",
+  "migration.us",
+  "lock.us",
+  "volatile.us",
+  "trim.us",
+  "dexPush.us",
+};
+
+/* Counter totals at the last dump, to log rates over the time since.
+ * Guarded by offTelemetryLock. */
+static u8 dumpCounters[OFF_STAT_COUNT];
+static u8 dumpTime;
+
+/* Largest value counted in bucket. */
+static u8 bucketLimit(u4 bucket) {
+  if(bucket < 2 * OFF_HIST_SUB_BUCKETS) return bucket;
+  u4 shift = (bucket >> OFF_HIST_SUB_BITS) - 1;
+  u8 top = (bucket & (OFF_HIST_SUB_BUCKETS - 1)) + OFF_HIST_SUB_BUCKETS;
+  return ((top + 1) << shift) - 1;
+}
+
+OffTelemetry* offTelemetryAttach(Thread* self) {
+  OffTelemetry* tel;
+  pthread_mutex_lock(&gDvm.offTelemetryLock); {
+    for(tel = gDvm.offTelemetryList; tel != NULL; tel = tel->next) {
+      if(tel->owner == NULL) break;
+    }
+    if(tel == NULL) {
+      tel = (OffTelemetry*)calloc(1, sizeof(OffTelemetry));
+      if(tel == NULL) {
+        ALOGE("Failed to allocate offload telemetry");
+        dvmAbort();
+      }
+      tel->next = gDvm.offTelemetryList;
+      /* Readers walk the list without the lock. */
+      ANDROID_MEMBAR_STORE();
+      gDvm.offTelemetryList = tel;
+    }
+    tel->owner = self;
+  } pthread_mutex_unlock(&gDvm.offTelemetryLock);
+  self->offTelemetry = tel;
+  return tel;
+}
+
+void offTelemetryThreadExited(Thread* self) {
+  OffTelemetry* tel = self->offTelemetry;
+  if(tel == NULL) return;
+  self->offTelemetry = NULL;
+  pthread_mutex_lock(&gDvm.offTelemetryLock);
+  tel->owner = NULL;
+  pthread_mutex_unlock(&gDvm.offTelemetryLock);
+}
+
+void offTelemetryReadCounters(u8* counters) {
+  memset(counters, 0, OFF_STAT_COUNT * sizeof(u8));
+  for(OffTelemetry* tel = gDvm.offTelemetryList; tel; tel = tel->next) {
+    for(u4 i = 0; i < OFF_STAT_COUNT; i++) {
+      counters[i] += tel->counters[i];
+    }
+  }
+}
+
+void offTelemetryReadHistogram(OffHistogram hist,
+                               OffHistogramSummary* summary) {
+  u4* buckets = (u4*)calloc(OFF_HIST_BUCKETS, sizeof(u4));
+  memset(summary, 0, sizeof(*summary));
+  if(buckets == NULL) return;
+
+  /* Work from a merged copy so the percentiles agree with the count even if
+   * an owner records meanwhile. */
+  for(OffTelemetry* tel = gDvm.offTelemetryList; tel; tel = tel->next) {
+    const OffHistogramData* data = &tel->hists[hist];
+    summary->sum += data->sum;
+    if(data->max > summary->max) summary->max = data->max;
+    for(u4 i = 0; i < OFF_HIST_BUCKETS; i++) {
+      buckets[i] += data->buckets[i];
+    }
+  }
+  for(u4 i = 0; i < OFF_HIST_BUCKETS; i++) {
+    summary->count += buckets[i];
+  }
+
+  struct { u8* value; u4 permille; } targets[] = {
+    { &summary->p50, 500 },
+    { &summary->p90, 900 },
+    { &summary->p99, 990 },
+    { &summary->p999, 999 },
+  };
+  u4 target = 0;
+  u8 seen = 0;
+  for(u4 i = 0; i < OFF_HIST_BUCKETS && summary->count != 0; i++) {
+    seen += buckets[i];
+    while(target < sizeof(targets) / sizeof(targets[0]) &&
+          seen * 1000 >= summary->count * targets[target].permille) {
+      u8 limit = bucketLimit(i);
+      *targets[target].value = limit < summary->max ? limit : summary->max;
+      target++;
+    }
+  }
+  free(buckets);
+}
+
+const char* offTelemetryCounterName(OffCounter counter) {
+  return kCounterNames[counter];
+}
+
+const char* offTelemetryHistogramName(OffHistogram hist) {
+  return kHistogramNames[hist];
+}
+
+void offTelemetryReset() {
+  pthread_mutex_lock(&gDvm.offTelemetryLock); {
+    for(OffTelemetry* tel = gDvm.offTelemetryList; tel; tel = tel->next) {
+      memset(tel->counters, 0, sizeof(tel->counters));
+      memset(tel->hists, 0, sizeof(tel->hists));
+    }
+    memset(dumpCounters, 0, sizeof(dumpCounters));
+    dumpTime = dvmGetRelativeTimeUsec();
+  } pthread_mutex_unlock(&gDvm.offTelemetryLock);
+}
+
+void offTelemetryDump() {
+  u8 counters[OFF_STAT_COUNT];
+  offTelemetryReadCounters(counters);
+  pthread_mutex_lock(&gDvm.offTelemetryLock); {
+    u8 now = dvmGetRelativeTimeUsec();
+    u8 elapsed = now > dumpTime ? now - dumpTime : 1;
+    for(u4 i = 0; i < OFF_STAT_COUNT; i++) {
+      u8 delta = counters[i] > dumpCounters[i] ?
+                 counters[i] - dumpCounters[i] : 0;
+      ALOGI("Offload telemetry: %s %llu, %llu.%02llu/s over the last %llus",
+            kCounterNames[i], counters[i], delta * 1000000 / elapsed,
+            delta * 100000000 / elapsed % 100, elapsed / 1000000);
+      dumpCounters[i] = counters[i];
+    }
+    dumpTime = now;
+  } pthread_mutex_unlock(&gDvm.offTelemetryLock);
+  for(u4 i = 0; i < OFF_HIST_COUNT; i++) {
+    OffHistogramSummary s;
+    offTelemetryReadHistogram((OffHistogram)i, &s);
+    if(s.count == 0) continue;
+    ALOGI("Offload telemetry: %s count %llu mean %llu p50 %llu p90 %llu "
+          "p99 %llu p999 %llu max %llu", kHistogramNames[i], s.count,
+          s.sum / s.count, s.p50, s.p90, s.p99, s.p999, s.max);
+  }
+}
+
+bool offTelemetryStartup() {
+  gDvm.offTelemetryList = NULL;
+  dumpTime = dvmGetRelativeTimeUsec();
+  return pthread_mutex_init(&gDvm.offTelemetryLock, NULL) == 0;
+}
+
+/* The blocks and their lock are left in place; threads still exit after
+ * the offload engine has shut down. */
+void offTelemetryShutdown() {
+  offTelemetryDump();
+}
@@ -0,0 +1,107 @@
+#ifndef OFFLOAD_TELEMETRY_H
+#define OFFLOAD_TELEMETRY_H
+
+struct Thread;
+
+/* Event counters.  The order is exposed through
+ * dalvik.system.VMDebug.getOffloadCounters so only append to it. */
+typedef enum OffCounter {
+  OFF_STAT_SYNC_FIELDS_SENT,
+  OFF_STAT_SYNC_FIELDS_RECEIVED,
+  OFF_STAT_LOCK_ROUND_TRIPS,
+  OFF_STAT_LOCK_GROUP_GRANTS,
+  OFF_STAT_LOCK_DEFERRED,
+  OFF_STAT_VOLATILE_HANDOFFS,
+  OFF_STAT_VOLATILE_SYNCS,
+  OFF_STAT_TRIM_ROUNDS,
+  OFF_STAT_TRIM_BYTES,
+  OFF_STAT_TRIMMED_OBJECTS,
+  OFF_STAT_DEX_FILES,
+  OFF_STAT_DEX_BYTES,
+  OFF_STAT_LOCK_UNGRANTS,
+  OFF_STAT_COUNT
+} OffCounter;
+
+/* Latency (us) and size (bytes) distributions.  The order is exposed through
+ * dalvik.system.VMDebug.getOffloadHistogram so only append to it. */
+typedef enum OffHistogram {
+  OFF_HIST_SYNC_PUSH_US,        /* whole push, including the remote apply */
+  OFF_HIST_SYNC_PAUSE_US,       /* part of a push with the VM suspended */
+  OFF_HIST_SYNC_PUSH_BYTES,
+  OFF_HIST_SYNC_PULL_US,        /* applying a pull with the VM suspended */
+  OFF_HIST_SYNC_PULL_BYTES,
+  OFF_HIST_MIGRATION_US,        /* from leaving until the thread is back */
+  OFF_HIST_LOCK_US,             /* asking for a lock until it is resolved */
+  OFF_HIST_VOLATILE_US,         /* asking for volatiles until they arrive */
+  OFF_HIST_TRIM_US,             /* exchanging marks in a track trim */
+  OFF_HIST_DEX_PUSH_US,         /* announcing and sending new dex files */
+  OFF_HIST_COUNT
+} OffHistogram;
+
+/* Histograms are HDR style: values below 2 * OFF_HIST_SUB_BUCKETS are counted
+ * exactly, above that each power of two range is split in
+ * OFF_HIST_SUB_BUCKETS linear buckets, so any percentile read back is within
+ * 1 / OFF_HIST_SUB_BUCKETS of the real value.  Values of 2^36 and more land
+ * in the last bucket. */
+#define OFF_HIST_SUB_BITS 3
+#define OFF_HIST_SUB_BUCKETS (1 << OFF_HIST_SUB_BITS)
+#define OFF_HIST_MAX_SHIFT 32
+#define OFF_HIST_BUCKETS ((OFF_HIST_MAX_SHIFT + 2) * OFF_HIST_SUB_BUCKETS)
+
+typedef struct OffHistogramData {
+  u8 count;
+  u8 sum;
+  u8 max;
+  u4 buckets[OFF_HIST_BUCKETS];
+} OffHistogramData;
+
+/* A thread's telemetry.  Only the owning thread writes to its block, without
+ * locks or atomics; readers add up all blocks and may see an update half
+ * done, which only blurs the numbers.  Blocks are never freed: when a thread
+ * exits its block is handed to the next thread that needs one, so totals
+ * survive the thread and readers can walk the list without a lock. */
+typedef struct OffTelemetry {
+  struct OffTelemetry* next;
+  struct Thread* owner;
+  u8 counters[OFF_STAT_COUNT];
+  OffHistogramData hists[OFF_HIST_COUNT];
+} OffTelemetry;
+
+/* Summary of a histogram as read back by offTelemetryReadHistogram.  The
+ * percentiles are bucket upper bounds. */
+typedef struct OffHistogramSummary {
+  u8 count;
+  u8 sum;
+  u8 max;
+  u8 p50;
+  u8 p90;
+  u8 p99;
+  u8 p999;
+} OffHistogramSummary;
+
+/* Give self a telemetry block.  Use offTelemetryCount/offTelemetryRecord
+ * instead. */
+OffTelemetry* offTelemetryAttach(struct Thread* self);
+
+/* Release the exiting thread's block for reuse. */
+void offTelemetryThreadExited(struct Thread* self);
+
+/* Totals over all threads. */
+void offTelemetryReadCounters(u8* counters);
+void offTelemetryReadHistogram(OffHistogram hist,
+                               OffHistogramSummary* summary);
+
+const char* offTelemetryCounterName(OffCounter counter);
+const char* offTelemetryHistogramName(OffHistogram hist);
+
+/* Zero all counters and histograms.  Updates made meanwhile may be lost. */
+void offTelemetryReset();
+
+/* Log the counters, with their rates per second since the last dump, reset
+ * or startup, and the histograms that have samples. */
+void offTelemetryDump();
+
+bool offTelemetryStartup();
+void offTelemetryShutdown();
+
+#endif // OFFLOAD_TELEMETRY_H
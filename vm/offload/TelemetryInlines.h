@@ -0,0 +1,26 @@
+#include "Dalvik.h"
+
+INLINE OffTelemetry* offTelemetryFor(Thread* self) {
+  OffTelemetry* tel = self->offTelemetry;
+  return tel != NULL ? tel : offTelemetryAttach(self);
+}
+
+/* Histogram bucket holding value, see OFF_HIST_SUB_BITS. */
+INLINE u4 offTelemetryBucket(u8 value) {
+  if(value < 2 * OFF_HIST_SUB_BUCKETS) return (u4)value;
+  u4 shift = 63 - __builtin_clzll(value) - OFF_HIST_SUB_BITS;
+  if(shift > OFF_HIST_MAX_SHIFT) return OFF_HIST_BUCKETS - 1;
+  return (shift << OFF_HIST_SUB_BITS) + (u4)(value >> shift);
+}
+
+INLINE void offTelemetryCount(Thread* self, OffCounter counter, u8 n) {
+  offTelemetryFor(self)->counters[counter] += n;
+}
+
+INLINE void offTelemetryRecord(Thread* self, OffHistogram hist, u8 value) {
+  OffHistogramData* data = &offTelemetryFor(self)->hists[hist];
+  data->count++;
+  data->sum += value;
+  if(value > data->max) data->max = value;
+  data->buckets[offTelemetryBucket(value)]++;
+}
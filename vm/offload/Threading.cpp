@@ -39,7 +39,7 @@ static void* thread_daemon(void* pself) {
       ALOGI("THREAD %d LOST CONNECTION", self->threadId);
       return NULL;
     }
-ALOGI("THREAD %d GOT EVENT %d", self->threadId, event);
+    ALOGV("THREAD %d GOT EVENT %d", self->threadId, event);
     switch(event) {
       case OFF_ACTION_RESUME: {
         /* We got a resume message, drop back to our caller. */
@@ -54,6 +54,9 @@ ALOGI("THREAD %d GOT EVENT %d", self->threadId, event);
       case OFF_ACTION_BROADCAST: {
         offPerformNotifyAll(self);
       } break;
+      case OFF_ACTION_UNGRANT: {
+        offPerformUngrant(self);
+      } break;
       case OFF_ACTION_DEX_QUERYDEX: {
         offPerformQueryDex(self);
       } break;
@@ -220,6 +223,7 @@ void offThreadExited(Thread* self) {
     offWriteU1(self, OFF_ACTION_RESUME);
     offFlushStream(self);
   }
+  offTelemetryThreadExited(self);
   ALOGI("THREAD %d LEAVING", threadId);
 }
 
@@ -19,6 +19,7 @@ struct Thread;
 #define OFF_ACTION_MIGRATE       9
 #define OFF_ACTION_CLINIT        10
 #define OFF_ACTION_DEATH         11
+#define OFF_ACTION_UNGRANT       12
 
 /* This component maintains parallel threads between endpoints.  Each VM thread
  * should have no more than one corresponding system thread for the lifetime of
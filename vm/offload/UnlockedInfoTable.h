@@ -3,6 +3,7 @@
 
 #include "Inlines.h"
 #include "offload/Comm.h"
+#include <cutils/atomic.h>
 
 #define CLZ(x) __builtin_clz(x)
 
@@ -31,14 +32,29 @@ INLINE u4 offTableSize(UnlockedInfoTable* v) {
   return v->size;
 }
 
-INLINE ObjectInfo* offTableLockedGet(UnlockedInfoTable* v, u4 ind) {
+/* Get the slot for ind, growing the table if needed.  This does not need any
+ * lock; concurrent callers agree on each segment with a CAS and the loser
+ * frees its copy. */
+INLINE ObjectInfo* offTableAcquire(UnlockedInfoTable* v, u4 ind) {
   u4 id = 28 - CLZ(ind | 0xF);
-  v->size = v->size <= ind ? ind + 1 : v->size;
-  if(v->base[id] == NULL) {
-    v->base[id] = (ObjectInfo*)calloc(1 << (id ? id + 3 : 4),
-                                      sizeof(ObjectInfo));
+  u4 size;
+  while((size = v->size) <= ind &&
+        android_atomic_release_cas((int32_t)size, (int32_t)(ind + 1),
+                                   (volatile int32_t*)&v->size));
+
+  ObjectInfo* seg = v->base[id];
+  if(seg == NULL) {
+    ObjectInfo* fresh = (ObjectInfo*)calloc(1 << (id ? id + 3 : 4),
+                                            sizeof(ObjectInfo));
+    if(android_atomic_release_cas(0, (int32_t)fresh,
+                                  (volatile int32_t*)&v->base[id]) == 0) {
+      seg = fresh;
+    } else {
+      free(fresh);
+      seg = v->base[id];
+    }
   }
-  return v->base[id] + (id ? (ind ^ (8 << id)) : ind);
+  return seg + (id ? (ind ^ (8 << id)) : ind);
 }
 
 INLINE ObjectInfo* offTableGet(UnlockedInfoTable* v, u4 ind) {
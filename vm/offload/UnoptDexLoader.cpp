@@ -522,6 +522,7 @@ void loadApk(char* apkPath) {
     loadStringDict();
     loadParsedMethodOffInfo();
 
+    std::vector<Method*> toParse;
     for(unsigned int idx = 0; idx < loadedDex.size(); idx++) {
     DvmDex* pDvmDex;
     pDvmDex = loadedDex[idx];
@@ -568,15 +569,7 @@ void loadApk(char* apkPath) {
             //if(strcmp(method->clazz->descriptor, "Ljava/util/GregorianCalendar;") == 0 && strcmp(method->name, "computeTime") == 0) {
             //if(strcmp(method->clazz->descriptor, "Ledu/utk/offloadtest/MainActivity;") == 0 && strcmp(method->name, "matrixTest") == 0) {
             //if(strcmp(method->clazz->descriptor, "Lorg/apache/harmony/xnet/provider/jsse/OpenSSLSocketImpl;") == 0 && strcmp(method->name, "startHandshake") == 0) { // long time execution - 5m
-                ALOGE("start parse method: %s:%s, %u", method->clazz->descriptor, method->name, method->idx);
-            std::vector<Method*>* chain = new std::vector<Method*>();
-            MethodAccInfo* methodAccInfo = new MethodAccInfo();
-            methodAccInfo->method = method;
-            parseMethod(methodAccInfo, chain);
-            assert(chain->empty());
-            delete chain;
-            //methodResMap.erase(method);
-            freeMethodAccInfo(methodAccInfo);
+            toParse.push_back(method);
             //}
         }
         Method* dmethods = resClass->directMethods;
@@ -594,19 +587,12 @@ void loadApk(char* apkPath) {
             //if(strcmp(method->clazz->descriptor, "Ljava/util/GregorianCalendar;") == 0 && strcmp(method->name, "computeTime") == 0) {
             //if(strcmp(method->clazz->descriptor, "Ledu/utk/offloadtest/MainActivity;") == 0 && strcmp(method->name, "matrixTest") == 0) {
             //if(strcmp(method->clazz->descriptor, "Lorg/apache/harmony/xnet/provider/jsse/OpenSSLSocketImpl;") == 0 && strcmp(method->name, "startHandshake") == 0) {
-                ALOGE("start parse method: %s:%s, %u", method->clazz->descriptor, method->name, method->idx);
-            std::vector<Method*>* chain = new std::vector<Method*>();
-            MethodAccInfo* methodAccInfo = new MethodAccInfo();
-            methodAccInfo->method = method;
-            parseMethod(methodAccInfo, chain);
-            assert(chain->empty());
-            delete chain;
-            //methodResMap.erase(method);
-            freeMethodAccInfo(methodAccInfo);
+            toParse.push_back(method);
             //}
         }
     }
     }
+    parseMethods(&toParse);
     closeFiles();
     /*gDvm.methodAccMap = new std::map<char*, MethodAccResult*, charscomp>();
     retrieveMethodInfo(gDvm.methodAccMap, outFileName);
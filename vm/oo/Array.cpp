@@ -480,8 +480,9 @@ static ClassObject* createArrayClass(const char* descriptor, Object* loader)
     newClass->offInfo.obj = (Object*)newClass;
     newClass->offInfo.dirty = 0;
     newClass->offInfo.bits = NULL;
-    newClass->offInfo.isVolatileOwner =
-        newClass->offInfo.isLockOwner = !gDvm.isServer;
+    newClass->offInfo.sendShadow = newClass->offInfo.recvShadow = NULL;
+    newClass->offInfo.isLockOwner = !gDvm.isServer;
+    newClass->offInfo.volatileOwned = gDvm.isServer ? 0 : OFF_VOLATILE_ALL;
     newClass->offInfo.isQueued = false;
 #endif
 
@@ -357,8 +357,9 @@ static bool createPrimitiveType(PrimitiveType primitiveType, ClassObject** pClas
     newClass->offInfo.obj = (Object*)newClass;
     newClass->offInfo.dirty = 0;
     newClass->offInfo.bits = NULL;
-    newClass->offInfo.isVolatileOwner =
-        newClass->offInfo.isLockOwner = !gDvm.isServer;
+    newClass->offInfo.sendShadow = newClass->offInfo.recvShadow = NULL;
+    newClass->offInfo.isLockOwner = !gDvm.isServer;
+    newClass->offInfo.volatileOwned = gDvm.isServer ? 0 : OFF_VOLATILE_ALL;
     newClass->offInfo.isQueued = false;
 #endif
 
@@ -2180,6 +2181,10 @@ static void cloneMethod(Method* dst, const Method* src)
         dvmAbort();
     }
     memcpy(dst, src, sizeof(Method));
+#ifdef WITH_OFFLOAD
+    /* The clone gets a class of its own, and with that a different key. */
+    dst->offSlot = NULL;
+#endif
 }
 
 /*
@@ -2905,8 +2910,9 @@ bool dvmLinkClass(ClassObject* clazz)
       } else {
         clazz->offInfo.bits = NULL;
       }
-      clazz->offInfo.isVolatileOwner = clazz->offInfo.isLockOwner =
-          !gDvm.isServer;
+      clazz->offInfo.sendShadow = clazz->offInfo.recvShadow = NULL;
+      clazz->offInfo.isLockOwner = !gDvm.isServer;
+      clazz->offInfo.volatileOwned = gDvm.isServer ? 0 : OFF_VOLATILE_ALL;
       clazz->offInfo.isQueued = false;
     }
 #endif
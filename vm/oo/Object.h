@@ -615,6 +615,11 @@ struct Method {
     /* The index back into the pDvmDex file. */
     u4 idx;
 #endif
+
+#ifdef WITH_OFFLOAD
+    /* Offload analysis results for this method, resolved on first use. */
+    struct MethodSlot* offSlot;
+#endif
 };
 
 
@@ -23,5 +23,7 @@
 bool dvmTestHash(void);
 bool dvmTestAtomicSpeed(void);
 bool dvmTestIndirectRefTable(void);
+bool dvmTestArrayTrackSpeed(void);
+bool dvmTestCodec(void);
 
 #endif  // DALVIK_TEST_TEST_H_
@@ -0,0 +1,118 @@
+/*
+ * Correctness and speed tests for the offload array write tracking.  The speed
+ * test compares the cost of an arraycopy-sized memcpy with tracking off, with
+ * the old per-element marking, and with the word-range marker.
+ */
+#include "Dalvik.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#if defined(WITH_OFFLOAD)
+
+#define kArrayLength    (1024 * 1024)
+#define kIterations     20
+
+static u4 bitmapWords(u4 length)
+{
+    return length > 32 ? (length - 1) >> 5 : 0;
+}
+
+static void resetInfo(ObjectInfo* info, u4 length)
+{
+    info->dirty = 0;
+    memset(info->bits, 0, bitmapWords(length) << 2);
+}
+
+/*
+ * The range marker must leave exactly the same bitmap behind as marking each
+ * element on its own.
+ */
+static bool testRangeMatchesElements(ObjectInfo* a, ObjectInfo* b, u4 length)
+{
+    static const u4 kRanges[][2] = {
+        { 0, 0 }, { 0, 1 }, { 31, 33 }, { 32, 64 }, { 5, 200 },
+        { 63, 64 }, { 64, 65 }, { 100, 1000 }, { 0, 4096 },
+    };
+    for (u4 i = 0; i < NELEM(kRanges); i++) {
+        u4 start = kRanges[i][0], end = kRanges[i][1];
+        resetInfo(a, length);
+        resetInfo(b, length);
+
+        offMarkFieldRange(a, start, end);
+        for (u4 ind = start; ind < end; ind++)
+            offMarkField(b, ind);
+
+        if (a->dirty != b->dirty ||
+            memcmp(a->bits, b->bits, bitmapWords(length) << 2) != 0)
+        {
+            ALOGE("range [%u, %u) marked differently", start, end);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool dvmTestArrayTrackSpeed()
+{
+    u1* src = (u1*) malloc(kArrayLength);
+    u1* dst = (u1*) malloc(kArrayLength);
+    ObjectInfo a, b;
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    a.bits = (u4*) calloc(bitmapWords(kArrayLength), 4);
+    b.bits = (u4*) calloc(bitmapWords(kArrayLength), 4);
+
+    /* Keep offQueueDirtyObject away from the real write queue. */
+    a.isQueued = b.isQueued = true;
+    memset(src, 0x5a, kArrayLength);
+
+    bool result = testRangeMatchesElements(&a, &b, kArrayLength);
+
+    u8 untracked = 0, perElement = 0, ranged = 0;
+    for (int i = 0; i < kIterations; i++) {
+        resetInfo(&a, kArrayLength);
+        u8 start = dvmGetRelativeTimeNsec();
+        memcpy(dst, src, kArrayLength);
+        u8 end = dvmGetRelativeTimeNsec();
+        untracked += end - start;
+
+        start = dvmGetRelativeTimeNsec();
+        memcpy(dst, src, kArrayLength);
+        for (u4 ind = 0; ind < kArrayLength; ind++)
+            offMarkField(&a, ind);
+        end = dvmGetRelativeTimeNsec();
+        perElement += end - start;
+
+        resetInfo(&a, kArrayLength);
+        start = dvmGetRelativeTimeNsec();
+        memcpy(dst, src, kArrayLength);
+        offMarkFieldRange(&a, 0, kArrayLength);
+        end = dvmGetRelativeTimeNsec();
+        ranged += end - start;
+    }
+
+    dvmFprintf(stdout, "arraycopy of %d bytes, average of %d runs:\n",
+        kArrayLength, kIterations);
+    dvmFprintf(stdout, "  untracked:   %.3fms\n",
+        untracked / (double) kIterations / 1000000);
+    dvmFprintf(stdout, "  per-element: %.3fms\n",
+        perElement / (double) kIterations / 1000000);
+    dvmFprintf(stdout, "  word-range:  %.3fms\n",
+        ranged / (double) kIterations / 1000000);
+
+    free(a.bits);
+    free(b.bits);
+    free(src);
+    free(dst);
+    return result;
+}
+
+#else
+
+bool dvmTestArrayTrackSpeed()
+{
+    return true;
+}
+
+#endif
@@ -0,0 +1,149 @@
+/*
+ * Round-trip tests for the offload link codecs.  Every codec must give back
+ * exactly what it was given, stay within offCodecBound, and refuse to
+ * decompress into a buffer that is too small.
+ */
+#include "Dalvik.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#if defined(WITH_OFFLOAD)
+
+static const char* const kCodecNames[OFF_CODEC_COUNT] = {
+    "none", "zlib", "lz"
+};
+
+/*
+ * Compress the n bytes at src, split over pieces iovecs, and check that they
+ * come back unchanged.
+ */
+static bool roundTrip(OffCodecLink* link, int codec, const char* name,
+    const u1* src, u4 n, u4 pieces)
+{
+    u4 cap = offCodecBound(n);
+    char* packed = (char*) malloc(cap);
+    char* unpacked = (char*) malloc(n + 1);
+
+    struct iovec iov[4];
+    u4 cnt = 0, done = 0;
+    for (u4 i = 0; i < pieces; i++) {
+        u4 len = i + 1 == pieces ? n - done : n / pieces;
+        iov[cnt].iov_base = (void*) (src + done);
+        iov[cnt++].iov_len = len;
+        done += len;
+    }
+
+    bool result = true;
+    u4 size = offCodecCompress(link, codec, iov, cnt, packed, cap);
+    int got = offCodecDecompress(link, codec, packed, size, unpacked, n + 1);
+    if (size > cap) {
+        ALOGE("%s %s: %u bytes compressed to %u, over the bound %u",
+            kCodecNames[codec], name, n, size, cap);
+        result = false;
+    } else if (got != (int) n || memcmp(src, unpacked, n) != 0) {
+        ALOGE("%s %s: %u bytes came back as %d different bytes",
+            kCodecNames[codec], name, n, got);
+        result = false;
+    }
+
+    /*
+     * The zlib streams carry state from one message to the next, so only the
+     * stateless codecs can be asked to decompress the same message twice.
+     */
+    if (result && n > 0 && codec != OFF_CODEC_ZLIB &&
+        offCodecDecompress(link, codec, packed, size, unpacked, n - 1) != -1)
+    {
+        ALOGE("%s %s: %u bytes decompressed into %u bytes of room",
+            kCodecNames[codec], name, n, n - 1);
+        result = false;
+    }
+
+    free(packed);
+    free(unpacked);
+    return result;
+}
+
+bool dvmTestCodec()
+{
+    const u4 n = OFF_CODEC_MAX_INPUT;
+    u1* random = (u1*) malloc(n);
+    u1* zeros = (u1*) calloc(n, 1);
+    u1* mixed = (u1*) malloc(n);
+    u1* edges = (u1*) malloc(n);
+
+    srand(1);
+    for (u4 i = 0; i < n; i++)
+        random[i] = (u1) (rand() >> 7);
+
+    /*
+     * Literal runs and matches of every length class: under 15, under
+     * 15 + 255 and longer, at offsets near and far.
+     */
+    u4 pos = 0;
+    for (u4 run = 1; pos < n; run = run * 3 + 1) {
+        u4 len = run < n - pos ? run : n - pos;
+        if ((run & 1) != 0)
+            memcpy(mixed + pos, random + pos, len);
+        else
+            memmove(mixed + pos, mixed + pos / 2, len);
+        pos += len;
+        if (run > 4000)
+            run = 1;
+    }
+
+    /*
+     * Literal runs and matches with lengths around the points where the
+     * length field gains another byte: 15 and 15 + 255 past the minimum.
+     * Matches copy the start of a random block that is never repeated
+     * otherwise, and random bytes stop them again.
+     */
+    const u4 kBlock = 600;
+    memcpy(edges, random + n - kBlock, kBlock);
+    pos = kBlock;
+    u4 tail = 0;
+    for (u4 len = 8; len < 540 && pos + 2 * len + 1 < n; len++) {
+        if (len > 24 && len < 262)
+            len = 262;
+        memcpy(edges + pos, random + tail, len);
+        tail += len;
+        pos += len;
+        memcpy(edges + pos, edges, len);
+        pos += len;
+        edges[pos++] = random[tail++];
+    }
+    u4 edgesLen = pos;
+
+    OffCodecLink* link = (OffCodecLink*) malloc(sizeof(OffCodecLink));
+    offCodecLinkInit(link, OFF_CODEC_ALL);
+
+    bool result = true;
+    for (int codec = 0; codec < OFF_CODEC_COUNT; codec++) {
+        result &= roundTrip(link, codec, "empty", zeros, 0, 1);
+        result &= roundTrip(link, codec, "one byte", random, 1, 1);
+        result &= roundTrip(link, codec, "short", random, 13, 1);
+        result &= roundTrip(link, codec, "incompressible", random, n, 1);
+        result &= roundTrip(link, codec, "long match", zeros, n, 1);
+        result &= roundTrip(link, codec, "mixed", mixed, n, 1);
+        result &= roundTrip(link, codec, "mixed pieces", mixed, n, 3);
+        result &= roundTrip(link, codec, "mixed prefix", mixed, 5000, 2);
+        result &= roundTrip(link, codec, "length edges", edges, edgesLen, 1);
+    }
+
+    offCodecLinkDestroy(link);
+    free(link);
+    free(random);
+    free(zeros);
+    free(mixed);
+    free(edges);
+    return result;
+}
+
+#else
+
+bool dvmTestCodec()
+{
+    return true;
+}
+
+#endif